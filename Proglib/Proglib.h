@@ -6,11 +6,14 @@
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
 
+#include <stddef.h>
+
 /* a few macros for historical reasons */
 #define VOXEL_DATA(vol) ((vol)->array.data)
 
 void  print_error_and_line_num( char format[], char *name, int line, ... );
 void  print_version_info( char *version_string);
+int   transfer_all( int fd, char *buffer, size_t n, int writing );
 
 /*
  *  * Generate a history string consisting of the output of time_stamp(),
@@ -0,0 +1,49 @@
+#include <config.h>
+#include <errno.h>
+#include <stddef.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "Proglib.h"
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : transfer_all
+@INPUT      : fd      - a pipe or file descriptor
+              buffer  - the bytes to write, or room for those to read
+              n       - how many bytes
+              writing - TRUE to write buffer to fd, FALSE to read it
+@OUTPUT     : buffer, when reading
+@RETURNS    : TRUE if all n bytes were transferred, FALSE otherwise
+@DESCRIPTION: write or read all of n bytes, in as many calls as it takes.
+              A call interrupted by a signal before it transferred anything
+              is simply made again.  This is how the worker processes of
+              the -jobs options send their results back to their parent.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : read, write
+@CREATED    : 
+@MODIFIED   : 
+
+---------------------------------------------------------------------------- */
+
+int  transfer_all( int fd, char *buffer, size_t n, int writing )
+{
+#ifdef HAVE_UNISTD_H
+    ssize_t done;
+
+    while (n > 0) {
+        done = writing ? write(fd, buffer, n) : read(fd, buffer, n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return(0);
+        buffer += done;
+        n -= done;
+    }
+    return(1);
+#else
+    return(n == 0);
+#endif
+}
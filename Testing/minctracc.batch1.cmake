@@ -0,0 +1,36 @@
+#! /bin/sh
+set -e
+
+cat > batch1.list <<LIST
+# source            [mask initial]  output
+object1_dxyz.mnc                    output.batch1a.xfm
+object1_dxyz.mnc    -      -        output.batch1b.xfm
+LIST
+
+minctracc -identity -est_center -simplex 10 -lsq6 -step 8 8 8 \
+     -clobber -batch batch1.list object2_dxyz.mnc
+
+# the same jobs, two at a time
+sed -e 's/output\.batch1/output.batch1j/' batch1.list > batch1j.list
+
+minctracc -identity -est_center -simplex 10 -lsq6 -step 8 8 8 \
+     -clobber -batch batch1j.list -batch_jobs 2 object2_dxyz.mnc
+
+param2xfm -rotation -4 7 10 -translation  5 2 -6 -clobber ideal.test1.xfm
+
+for xfm in output.batch1a.xfm output.batch1b.xfm output.batch1ja.xfm output.batch1jb.xfm; do
+  if ! cmpxfm -linear_tolerance 0.05 -translation_tolerance 0.05 $xfm ideal.test1.xfm; then
+    echo >&2 $0 failed: minctracc -batch produced incorrect results for $xfm.
+    exit 1
+  fi
+done
+
+# (the history comments hold the command line, so they are left out)
+for job in a b; do
+  grep -v '^%' output.batch1$job.xfm  > batch1$job.body
+  grep -v '^%' output.batch1j$job.xfm > batch1j$job.body
+  if ! cmp -s batch1$job.body batch1j$job.body; then
+    echo >&2 $0 failed: -batch_jobs 2 changed the result of job $job.
+    exit 1
+  fi
+done
@@ -0,0 +1,34 @@
+#! /bin/sh
+set -e
+
+# two nonlinear fits with -checkpoint and -resume in one -batch run:
+# each job must continue from its own checkpoint, not from the one
+# left by the job before it.
+
+opts="-nonlinear -identity -est_center -step 10 10 10 -iterations 3 -clobber"
+
+cat > batch2.list <<LIST
+object1_dxyz.mnc    output.batch2a.xfm
+ellipse1_dxyz.mnc   output.batch2b.xfm
+LIST
+
+minctracc $opts object1_dxyz.mnc  object2_dxyz.mnc output.batch2_refa.xfm
+minctracc $opts ellipse1_dxyz.mnc object2_dxyz.mnc output.batch2_refb.xfm
+
+rm -f batch2.ckp.*
+
+# the first run writes the checkpoints, the second one resumes from
+# them after the last iteration
+for run in 1 2; do
+  minctracc $opts -checkpoint batch2.ckp -resume \
+       -batch batch2.list object2_dxyz.mnc
+
+  for job in a b; do
+    mincextract -double output.batch2_ref${job}_grid_0.mnc > batch2_ref$job.raw
+    mincextract -double output.batch2${job}_grid_0.mnc     > batch2$job.raw
+    if ! cmp -s batch2_ref$job.raw batch2$job.raw; then
+      echo >&2 $0 failed: run $run of -batch -resume changed the warp of job $job.
+      exit 1
+    fi
+  done
+done
@@ -0,0 +1,26 @@
+#! /bin/sh
+set -e
+
+param2xfm -rotation -4 7 10 -translation  5 2 -6 -clobber ideal.test1.xfm
+
+minctracc -transformation ideal.test1.xfm object1_dxyz.mnc object2_dxyz.mnc \
+     -lsq6 -step 8 8 8 -num_steps 4 -landscape_2d \
+     -matlab landscape1.m -landscape_jobs 1 -clobber
+
+minctracc -transformation ideal.test1.xfm object1_dxyz.mnc object2_dxyz.mnc \
+     -lsq6 -step 8 8 8 -num_steps 4 -landscape_2d \
+     -matlab landscape3.m -landscape_jobs 3 -clobber
+
+if [ ! -s landscape1.m ]; then
+  echo >&2 $0 failed: minctracc -matlab wrote nothing.
+  exit 1
+fi
+
+# the values do not depend on the number of processes computing them
+# (the history comments hold the command line, so they are left out)
+grep -v '^%' landscape1.m > landscape1.body
+grep -v '^%' landscape3.m > landscape3.body
+if ! cmp -s landscape1.body landscape3.body; then
+  echo >&2 $0 failed: -landscape_jobs 3 changed the -matlab output.
+  exit 1
+fi
@@ -0,0 +1,29 @@
+#! /bin/sh
+set -e
+
+# a target cropped in y holds less of the ellipse than the source, so the
+# lattice is in the target and the volumes are measured the other way round
+mincreshape -clobber -dimrange xspace=16,32 -dimrange yspace=16,32 -dimrange zspace=16,32 \
+     object2.mnc object2_crop.mnc
+
+param2xfm -rotation -4 7 10 -translation  5 2 -6 -clobber ideal.test1.xfm
+
+minctracc -transformation ideal.test1.xfm object1.mnc object2_crop.mnc \
+     -lsq6 -step 4 4 4 -debug -measure measure.ideal.txt -clobber > measure.ideal.log
+
+minctracc -identity object1.mnc object2_crop.mnc \
+     -lsq6 -step 4 4 4 -measure measure.identity.txt -clobber
+
+if ! grep -q 'Target volume is smallest' measure.ideal.log; then
+  echo >&2 $0 failed: the lattice was not in the target volume.
+  exit 1
+fi
+
+# the transformation that made object2 fits better than none at all
+ideal=`awk '$3 == "xcorr" { print $1 }' measure.ideal.txt`
+identity=`awk '$3 == "xcorr" { print $1 }' measure.identity.txt`
+
+if ! awk "BEGIN { exit !($ideal < $identity) }"; then
+  echo >&2 $0 failed: -measure xcorr is $ideal for the ideal transformation, $identity for the identity.
+  exit 1
+fi
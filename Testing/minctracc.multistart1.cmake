@@ -0,0 +1,45 @@
+#! /bin/sh
+set -e
+
+# a round body with two small blobs: only the blobs fix the rotation
+# about z, and after a 40 degree turn they are too far from their
+# starting place for a fit from the identity to find them.
+cat > multistart1.obj <<OBJ
+ellipse     0   0   0   70 70 40   100
+ellipse    22   0   0   14 14 14   250
+rectangle   0 -22   0   12 12 12   400
+OBJ
+
+make_phantom -clobber -objects multistart1.obj \
+     -nele 64 64 64 -step 2 2 2 -start -64 -64 -64 multistart1_0.mnc
+
+param2xfm -center 0 0 0 -rotation 0 0 40 -clobber ideal.multistart1.xfm
+
+mincresample -clobber -transformation ideal.multistart1.xfm \
+     -like multistart1_0.mnc multistart1_0.mnc multistart1_1.mnc
+
+mincblur -clobber -gradient -fwhm 6 multistart1_0.mnc multistart1_0
+mincblur -clobber -gradient -fwhm 6 multistart1_1.mnc multistart1_1
+
+# the case must be out of reach of a single start ...
+minctracc -identity multistart1_0_dxyz.mnc multistart1_1_dxyz.mnc \
+     -est_center -debug -simplex 10 -lsq6 -step 8 8 8 \
+     -clobber output.multistart1_single.xfm
+
+if cmpxfm -linear_tolerance 0.05 -translation_tolerance 0.05 output.multistart1_single.xfm ideal.multistart1.xfm; then
+  echo >&2 $0 failed: a single start already finds the rotation, the test does not exercise -multi_start.
+  exit 1
+fi
+
+# ... and recovered by the start 40 degrees about z (the 4th ring of
+# +/-10 degree perturbations: 1 + 6*4 starts for -lsq6), with the
+# coarse fits run two at a time.
+minctracc -identity multistart1_0_dxyz.mnc multistart1_1_dxyz.mnc \
+     -est_center -debug -simplex 10 -lsq6 -step 8 8 8 \
+     -multi_start 25 -simplex_jobs 2 \
+     -clobber output.multistart1.xfm
+
+if ! cmpxfm -linear_tolerance 0.05 -translation_tolerance 0.05 output.multistart1.xfm ideal.multistart1.xfm; then
+  echo >&2 $0 failed: minctracc -multi_start did not recover the rotation.
+  exit 1
+fi
@@ -0,0 +1,26 @@
+#! /bin/sh
+set -e
+
+minctracc -identity object1_dxyz.mnc object2_dxyz.mnc \
+     -est_center -simplex 10 -lsq6 -step 8 8 8 \
+     -simplex_jobs 1 -clobber output.simplexjobs1.xfm
+
+minctracc -identity object1_dxyz.mnc object2_dxyz.mnc \
+     -est_center -simplex 10 -lsq6 -step 8 8 8 \
+     -simplex_jobs 4 -clobber output.simplexjobs4.xfm
+
+param2xfm -rotation -4 7 10 -translation  5 2 -6 -clobber ideal.test1.xfm
+
+if ! cmpxfm -linear_tolerance 0.05 -translation_tolerance 0.05 output.simplexjobs4.xfm ideal.test1.xfm; then
+  echo >&2 $0 failed: minctracc -simplex_jobs 4 produced incorrect results.
+  exit 1
+fi
+
+# the simplex takes the same path whatever the number of jobs
+# (the history comments hold the command line, so they are left out)
+grep -v '^%' output.simplexjobs1.xfm > simplexjobs1.body
+grep -v '^%' output.simplexjobs4.xfm > simplexjobs4.body
+if ! cmp -s simplexjobs1.body simplexjobs4.body; then
+  echo >&2 $0 failed: -simplex_jobs 4 changed the result of the fit.
+  exit 1
+fi
@@ -4,7 +4,9 @@
                  
        usage:   make_phantom [options] outputfile.mnc
    
-   @OUTPUT     : volume data containing either a voxelated ellipse or rectangle.
+   @OUTPUT     : volume data containing either a voxelated ellipse or rectangle,
+                 or, with -objects, -deform or -bias, any number of them
+                 built by phantom.c.
 
    @RETURNS    : TRUE if ok, VIO_ERROR if error.
 
@@ -66,6 +68,7 @@
 #include <volume_io.h>
 #include <Proglib.h>
 #include <ParseArgv.h>
+#include "phantom.h"
 #include "make_phantom.h"
 
 static char *default_dim_names[VIO_N_DIMENSIONS] = { MIxspace, MIyspace, MIzspace };
@@ -199,6 +202,10 @@ int main (int argc, char *argv[] )
   
   VIO_Volume
     data;
+  Phantom
+    phantom;
+  VIO_BOOL
+    use_phantom;
   VIO_Real
     fraction,zero, one,
     edge,
@@ -257,6 +264,50 @@ int main (int argc, char *argv[] )
     partial_flag = FALSE;
   }
 
+  /* the multi-object builder is used for any of its options; the single
+     object from the command line is its only object without -objects */
+  use_phantom = (object_file != NULL || deform[0] != 0.0 || bias != 0.0);
+
+  if (is_labels && bias != 0.0) {
+    fprintf(stderr, "-bias cannot be used with -labels.\n");
+    return VIO_ERROR;
+  }
+  if (fabs(bias) >= 1.0) {     /* 1+b(p) must stay positive */
+    fprintf(stderr, "The -bias fraction must be between -1 and 1.\n");
+    return VIO_ERROR;
+  }
+  if (deform_xfm != NULL && deform[0] == 0.0) {
+    fprintf(stderr, "-deform_xfm needs -deform.\n");
+    return VIO_ERROR;
+  }
+
+  if (use_phantom) {
+    init_phantom(&phantom, background, partial_flag, is_labels);
+
+    if (object_file != NULL) {
+      if (!read_phantom_objects(object_file, &phantom))
+        return VIO_ERROR;
+    }
+    else
+      add_phantom_object(&phantom, object, center, width, fill_value);
+
+    srand48((long) seed);
+    if (deform[0] != 0.0) {
+      if (deform[1] <= 0.0) {
+        fprintf(stderr, "The -deform wavelength must be positive.\n");
+        return VIO_ERROR;
+      }
+      phantom.deform = TRUE;
+      init_phantom_field(&phantom.deformation, 3, deform[0], deform[1]);
+    }
+    if (bias != 0.0) {
+      phantom.bias = TRUE;
+      init_phantom_field(&phantom.bias_field, 1, bias,
+                         2.0*MAX3(fabs(count[X]*step[X]), fabs(count[Y]*step[Y]), 
+                                  fabs(count[Z]*step[Z])));
+    }
+  }
+
   /*TODO: print warnings?*/
   if(is_labels && voxel_range[0]!=real_range[0])
     real_range[0]=voxel_range[0];
@@ -271,7 +322,9 @@ int main (int argc, char *argv[] )
   /*Assume if user set these values, he knows what he is doing*/
   if(voxel_range[0]==voxel_range[1] && voxel_range[0]==-1.0)
   {
-    if(is_labels)
+    if(is_labels && use_phantom)
+      get_phantom_range(&phantom, &voxel_range[0], &voxel_range[1]);
+    else if(is_labels)
     {
       voxel_range[0]=MIN3(background,fill_value,edge_value);
       voxel_range[1]=MAX3(background,fill_value,edge_value);
@@ -283,8 +336,12 @@ int main (int argc, char *argv[] )
   /*Assume if user set these values, he knows what he is doing*/
   if(real_range[0]==real_range[1] && real_range[0]==-1.0)
   {
-    real_range[0]=MIN3(background,fill_value,edge_value);
-    real_range[1]=MAX3(background,fill_value,edge_value);
+    if (use_phantom)
+      get_phantom_range(&phantom, &real_range[0], &real_range[1]);
+    else {
+      real_range[0]=MIN3(background,fill_value,edge_value);
+      real_range[1]=MAX3(background,fill_value,edge_value);
+    }
   }
   
   set_volume_labels(data, is_labels);
@@ -308,6 +365,29 @@ int main (int argc, char *argv[] )
   if (debug) print ("zero: real = %f, voxel = %f\n", background, zero);
   if (debug) print ("one:  real = %f, voxel = %f\n", fill_value, one);
   if (debug) print ("edge: real = %f, voxel = %f\n", edge_value, edge);
+
+  if (use_phantom) {
+    if (verbose)
+      print ("Building %d object(s)\n", phantom.n_objects);
+
+    status = build_phantom(data, &phantom, n_jobs);
+
+    if (status == VIO_OK && deform_xfm != NULL) {
+      status = write_phantom_deformation(deform_xfm, data, &phantom, history);
+      if (status != VIO_OK)
+        print("problems writing the deformation to %s.", deform_xfm);
+    }
+    delete_phantom(&phantom);
+
+    if (status == VIO_OK) {
+      status = output_volume(outfilename, NC_UNSPECIFIED, FALSE, 0.0, 0.0, data, 
+                             history, (minc_output_options *)NULL);  
+      if (status != VIO_OK)
+        print("problems writing volume data for %s.", outfilename);
+    }
+
+    return(status);
+  }
   
   /******************************************************************************/
   /*             write out background value                                     */
@@ -1,6 +1,3 @@
-#define RECTANGLE  0
-#define ELLIPSE    1
-
 #define X         0
 #define Y         1
 #define Z         2
@@ -27,6 +24,13 @@ VIO_Real   fill_value     = 1.0;
 VIO_Real   edge_value     = 1.0;
 VIO_Real   background     = 0.0;
 
+char   *object_file   = NULL;
+VIO_Real   deform[2]      = { 0.0, 0.0 };
+char   *deform_xfm    = NULL;
+VIO_Real   bias           = 0.0;
+int    seed           = 1;
+int    n_jobs         = 1;
+
 static ArgvInfo argTable[] = {
   {NULL, ARGV_HELP, NULL, NULL,
      "Object definition options."},
@@ -70,6 +74,21 @@ static ArgvInfo argTable[] = {
   {"-no_partial", ARGV_CONSTANT, (char *) FALSE, (char *) &partial_flag,
      "Do not account for partial volume effects."},
 
+  {NULL, ARGV_HELP, NULL, NULL,
+     "Multi-object phantom options (any of these uses analytic partial volume)."},
+  {"-objects", ARGV_STRING, (char *) 1, (char *) &object_file,
+     "File of objects, one per line: <ellipse|rectangle> cx cy cz wx wy wz value"},
+  {"-deform", ARGV_FLOAT, (char *) 2, (char *) deform,
+     "Random smooth deformation: <amplitude> <wavelength> (mm)."},
+  {"-deform_xfm", ARGV_STRING, (char *) 1, (char *) &deform_xfm,
+     "Save the -deform deformation as a grid transform."},
+  {"-bias", ARGV_FLOAT, (char *) 1, (char *) &bias,
+     "Random smooth intensity bias, as a fraction below 1 (e.g. 0.2 for +/-20%)."},
+  {"-seed", ARGV_INT, (char *) 1, (char *) &seed,
+     "Seed for -deform and -bias."},
+  {"-jobs", ARGV_INT, (char *) 1, (char *) &n_jobs,
+     "Number of worker processes for -objects, -deform or -bias."},
+
   {NULL, ARGV_HELP, NULL, NULL,
      "Volume definition options."},
   {"-nelements", ARGV_INT, (char *) 3, 
@@ -0,0 +1,624 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : phantom.c
+@DESCRIPTION: multi-object phantoms for make_phantom.
+
+  these include:
+     init_phantom() / add_phantom_object() / read_phantom_objects() -
+                                 the list of objects
+     init_phantom_field() / get_phantom_field() -
+                                 random smooth fields, used for the
+                                 deformation and the intensity bias
+     build_phantom() -           fill a volume, in a pool of worker
+                                 processes
+     write_phantom_deformation() -
+                                 save the deformation as a grid transform
+
+  Every voxel is computed on its own: the voxel centre p is moved to
+  q = p + d(p) when there is a deformation, and each object in turn
+  covers a fraction f of the voxel at q, so that the value v (starting
+  at the background) becomes v + f*(value - v).  f is computed
+  analytically, from the voxel size rather than by sub-sampling the
+  voxel: exactly, as the product of the overlaps along x, y and z, for
+  a rectangle; for an ellipsoid, from the distance of q to the surface
+  (to first order) compared to the width of the voxel across the
+  surface.  Finally v is scaled by 1 + b(p) if there is a bias field.
+  Label phantoms take the value of the last object covering half of
+  the voxel or more, and cannot have a bias field, which would turn
+  the labels into other values.
+
+  The random fields are drawn (with drand48) once, before any worker
+  is started, so a phantom depends only on the seed and not on the
+  number of jobs.  Worker w computes the slices w, w+n_jobs, ... along
+  the first (slowest) volume dimension and sends each one back through
+  a pipe as soon as it is done; slices whose worker could not be
+  started, or failed, are computed by the parent.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <float.h>
+#include <string.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "phantom.h"
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  PHANTOM_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifndef M_PI
+#define M_PI  3.14159265358979323846
+#endif
+
+                                /* what build_phantom() needs to compute
+                                   one slice */
+typedef struct {
+  Phantom   *phantom;
+  int       sizes[3];
+  VIO_Real  origin[3];          /* world position of voxel (0,0,0)      */
+  VIO_Real  axis[3][3];         /* world change per step of each index  */
+  VIO_Real  size[3];            /* extent of a voxel along world x y z  */
+  VIO_Real  (*lo)[3], (*hi)[3]; /* where each object can cover a voxel  */
+} Phantom_Grid;
+
+
+void init_phantom(Phantom *phantom, VIO_Real background,
+                  VIO_BOOL partial, VIO_BOOL labels)
+{
+  phantom->n_objects  = 0;
+  phantom->objects    = NULL;
+  phantom->background = background;
+  phantom->partial    = partial && !labels;
+  phantom->labels     = labels;
+  phantom->deform     = FALSE;
+  phantom->bias       = FALSE;
+  (void) memset(&phantom->deformation, 0, sizeof(phantom->deformation));
+  (void) memset(&phantom->bias_field,  0, sizeof(phantom->bias_field));
+}
+
+void add_phantom_object(Phantom *phantom, int shape,
+                        VIO_Real center[], VIO_Real width[], VIO_Real value)
+{
+  Phantom_Object *object;
+  int m;
+
+  if (phantom->n_objects == 0)
+    ALLOC(phantom->objects, 1);
+  else
+    SET_ARRAY_SIZE(phantom->objects, phantom->n_objects, phantom->n_objects+1, 1);
+
+  object = &phantom->objects[ phantom->n_objects++ ];
+
+  object->shape = shape;
+  for(m=0; m<3; m++) {
+    object->center[m] = center[m];
+    object->width[m]  = fabs(width[m]);
+  }
+  object->value = value;
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : read_phantom_objects
+@INPUT      : filename - text file with one object per line:
+
+                 <ellipse|rectangle>  cx cy cz  wx wy wz  value
+
+              i.e. the shape, its centre and full widths (world mm) and
+              its real value.  Blank lines and lines starting with #
+              are skipped.
+@OUTPUT     : phantom - the objects are added to it
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION:
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_BOOL read_phantom_objects(char *filename, Phantom *phantom)
+{
+  FILE *fp;
+  char line[1024], shape_name[32];
+  VIO_Real center[3], width[3], value;
+  int n, line_num, shape;
+
+  if ((fp = fopen(filename, "r")) == NULL) {
+    (void) fprintf(stderr, "Cannot open object file %s.\n", filename);
+    return(FALSE);
+  }
+
+  line_num = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line_num++;
+
+    n = sscanf(line, "%31s %lf %lf %lf %lf %lf %lf %lf", shape_name,
+               &center[0], &center[1], &center[2],
+               &width[0], &width[1], &width[2], &value);
+
+    if (n <= 0 || shape_name[0] == '#')
+      continue;
+
+    if (strcmp(shape_name, "ellipse") == 0 || strcmp(shape_name, "ellipsoid") == 0)
+      shape = ELLIPSE;
+    else if (strcmp(shape_name, "rectangle") == 0)
+      shape = RECTANGLE;
+    else
+      shape = -1;
+
+    if (shape < 0 || n != 8) {
+      (void) fprintf(stderr, "%s, line %d: expected "
+                     "<ellipse|rectangle> cx cy cz wx wy wz value\n",
+                     filename, line_num);
+      (void) fclose(fp);
+      return(FALSE);
+    }
+
+    add_phantom_object(phantom, shape, center, width, value);
+  }
+
+  (void) fclose(fp);
+
+  if (phantom->n_objects == 0) {
+    (void) fprintf(stderr, "No objects in %s.\n", filename);
+    return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+
+void init_phantom_field(Phantom_Field *field, int n_components,
+                        VIO_Real amplitude, VIO_Real wavelength)
+{
+  VIO_Real z, phi, r, total;
+  int c, t;
+
+  field->n_components = MIN(n_components, 3);
+  field->amplitude    = amplitude;
+  field->wavelength   = wavelength;
+
+  for(c=0; c<field->n_components; c++) {
+    total = 0.0;
+    for(t=0; t<PHANTOM_FIELD_TERMS; t++) {
+                                /* direction uniform on the sphere */
+      z   = 2.0*drand48() - 1.0;
+      phi = 2.0*M_PI*drand48();
+      r   = sqrt(1.0 - z*z);
+
+      field->wave[c][t][0] = 2.0*M_PI * r*cos(phi) / wavelength;
+      field->wave[c][t][1] = 2.0*M_PI * r*sin(phi) / wavelength;
+      field->wave[c][t][2] = 2.0*M_PI * z          / wavelength;
+
+      field->phase[c][t]  = 2.0*M_PI*drand48();
+      field->weight[c][t] = 0.5 + 0.5*drand48();
+      total += field->weight[c][t];
+    }
+    for(t=0; t<PHANTOM_FIELD_TERMS; t++)
+      field->weight[c][t] *= amplitude / total;
+  }
+}
+
+void get_phantom_field(Phantom_Field *field, VIO_Real p[], VIO_Real value[])
+{
+  int c, t;
+
+  for(c=0; c<field->n_components; c++) {
+    value[c] = 0.0;
+    for(t=0; t<PHANTOM_FIELD_TERMS; t++)
+      value[c] += field->weight[c][t] *
+        sin(field->wave[c][t][0]*p[0] + field->wave[c][t][1]*p[1] +
+            field->wave[c][t][2]*p[2] + field->phase[c][t]);
+  }
+}
+
+/* smallest and largest real values the phantom can hold */
+
+void get_phantom_range(Phantom *phantom, VIO_Real *min, VIO_Real *max)
+{
+  VIO_Real scale;
+  int n;
+
+  *min = *max = phantom->background;
+  for(n=0; n<phantom->n_objects; n++) {
+    if (phantom->objects[n].value < *min) *min = phantom->objects[n].value;
+    if (phantom->objects[n].value > *max) *max = phantom->objects[n].value;
+  }
+
+  if (phantom->bias) {
+    scale = fabs(phantom->bias_field.amplitude);
+    *min *= (*min < 0.0) ? 1.0 + scale : 1.0 - scale;
+    *max *= (*max > 0.0) ? 1.0 + scale : 1.0 - scale;
+  }
+}
+
+/* fraction of a voxel of extent size[] centred at q covered by object */
+
+static VIO_Real object_fraction(Phantom_Object *object, VIO_Real q[],
+                                VIO_Real size[], VIO_BOOL partial)
+{
+  VIO_Real
+    frac, lo, hi, r, d, u, quad, grad[3], norm, width,
+    trace, curve;
+  int m;
+
+  if (object->shape == RECTANGLE) {
+    frac = 1.0;
+    for(m=0; m<3; m++) {
+      r = object->width[m]/2.0;
+      if (!partial) {
+        if (fabs(q[m] - object->center[m]) > r)
+          return(0.0);
+      }
+      else {
+        lo = MAX(q[m] - size[m]/2.0, object->center[m] - r);
+        hi = MIN(q[m] + size[m]/2.0, object->center[m] + r);
+        if (hi <= lo)
+          return(0.0);
+        frac *= (size[m] > 0.0) ? (hi - lo)/size[m] : 1.0;
+      }
+    }
+    return(frac);
+  }
+
+                                /* ellipsoid: quad <= 1 inside */
+  quad = norm = trace = curve = 0.0;
+  for(m=0; m<3; m++) {
+    r = object->width[m]/2.0;
+    if (r <= 0.0)
+      return(0.0);
+    u = (q[m] - object->center[m]) / r;
+    quad += u*u;
+    grad[m] = 2.0*u / r;
+    norm += grad[m]*grad[m];
+    trace += 2.0/(r*r);
+    curve += grad[m]*grad[m] * 2.0/(r*r);
+  }
+
+  if (!partial || norm < 1e-24)
+    return( (quad <= 1.0000001) ? 1.0 : 0.0 );
+
+                                /* signed distance to the surface (from
+                                   sqrt(quad), exact for a sphere), and
+                                   the width of the voxel across it */
+  u = sqrt(quad);
+  d = 2.0*u*(u - 1.0) / sqrt(norm);
+  width = 0.0;
+  for(m=0; m<3; m++)
+    width += fabs(grad[m]) * size[m];
+  width /= sqrt(norm);
+
+                                /* a linear ramp of this width across a
+                                   curved surface adds, per unit area,
+                                   (sum of principal curvatures) *
+                                   width^2/24 of volume: move it in by
+                                   as much */
+  d += (trace*norm - curve) / (norm*sqrt(norm)) * width*width / 24.0;
+
+  frac = 0.5 - d/width;
+  if (frac < 0.0) frac = 0.0;
+  if (frac > 1.0) frac = 1.0;
+
+  return(frac);
+}
+
+static void compute_phantom_slice(Phantom_Grid *grid, int i, float values[])
+{
+  Phantom *phantom = grid->phantom;
+  Phantom_Object *object;
+  VIO_Real
+    p[3], q[3], d[3], v, frac;
+  int
+    j, k, m, n;
+
+  for(j=0; j<grid->sizes[1]; j++)
+    for(k=0; k<grid->sizes[2]; k++) {
+
+      for(m=0; m<3; m++) {
+        p[m] = grid->origin[m] + i*grid->axis[0][m] + j*grid->axis[1][m] + k*grid->axis[2][m];
+        q[m] = p[m];
+      }
+
+      if (phantom->deform) {
+        get_phantom_field(&phantom->deformation, p, d);
+        for(m=0; m<3; m++)
+          q[m] += d[m];
+      }
+
+      v = phantom->background;
+
+      for(n=0; n<phantom->n_objects; n++) {
+        if (q[0] < grid->lo[n][0] || q[0] > grid->hi[n][0] ||
+            q[1] < grid->lo[n][1] || q[1] > grid->hi[n][1] ||
+            q[2] < grid->lo[n][2] || q[2] > grid->hi[n][2])
+          continue;
+
+        object = &phantom->objects[n];
+        frac = object_fraction(object, q, grid->size, phantom->partial);
+
+        if (phantom->labels) {
+          if (frac >= 0.5)
+            v = object->value;
+        }
+        else
+          v += frac * (object->value - v);
+      }
+
+      if (phantom->bias) {
+        get_phantom_field(&phantom->bias_field, p, d);
+        v *= 1.0 + d[0];
+      }
+
+      values[ j*grid->sizes[2] + k ] = (float) v;
+    }
+}
+
+
+static void put_phantom_slice(VIO_Volume data, int i, int sizes[], float values[])
+{
+  VIO_Real voxel, voxel_min, voxel_max;
+  int j, k;
+
+  get_volume_voxel_range(data, &voxel_min, &voxel_max);
+
+  for(j=0; j<sizes[1]; j++)
+    for(k=0; k<sizes[2]; k++) {
+      voxel = CONVERT_VALUE_TO_VOXEL(data, (VIO_Real) values[ j*sizes[2] + k ]);
+      if (voxel < voxel_min) voxel = voxel_min;
+      if (voxel > voxel_max) voxel = voxel_max;
+      SET_VOXEL_3D(data, i,j,k, voxel);
+    }
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : build_phantom
+@INPUT      : data    - allocated 3D volume
+              phantom - objects, fields and options
+              n_jobs  - number of worker processes
+@OUTPUT     : data    - filled with the phantom
+@RETURNS    : VIO_OK, or VIO_ERROR for a label phantom with a bias field
+@DESCRIPTION: see the top of this file.
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_Status build_phantom(VIO_Volume data, Phantom *phantom, int n_jobs)
+{
+  Phantom_Grid
+    grid;
+  Phantom_Object
+    *object;
+  VIO_Real
+    w[3];
+  float
+    *values;
+  long
+    slice_size;
+  int
+    i, m, n, v;
+  VIO_BOOL
+    done;
+#ifdef PHANTOM_CAN_FORK
+  int
+    *fd, fds[2];
+  pid_t
+    *pid;
+#endif
+
+  if (phantom->labels && phantom->bias) {
+    (void) fprintf(stderr, "A label phantom cannot have a bias field.\n");
+    return(VIO_ERROR);
+  }
+
+  grid.phantom = phantom;
+  get_volume_sizes(data, grid.sizes);
+  slice_size = (long)grid.sizes[1] * grid.sizes[2];
+
+  convert_3D_voxel_to_world(data, 0.0, 0.0, 0.0,
+                            &grid.origin[0], &grid.origin[1], &grid.origin[2]);
+  for(v=0; v<3; v++) {
+    convert_3D_voxel_to_world(data, (VIO_Real)(v==0), (VIO_Real)(v==1), (VIO_Real)(v==2),
+                              &w[0], &w[1], &w[2]);
+    for(m=0; m<3; m++)
+      grid.axis[v][m] = w[m] - grid.origin[m];
+  }
+  for(m=0; m<3; m++)
+    grid.size[m] = fabs(grid.axis[0][m]) + fabs(grid.axis[1][m]) + fabs(grid.axis[2][m]);
+
+                                /* a voxel centred outside these limits
+                                   cannot overlap the object */
+  ALLOC(grid.lo, MAX(phantom->n_objects, 1));
+  ALLOC(grid.hi, MAX(phantom->n_objects, 1));
+  for(n=0; n<phantom->n_objects; n++) {
+    object = &phantom->objects[n];
+    for(m=0; m<3; m++) {
+      grid.lo[n][m] = object->center[m] - object->width[m]/2.0 - grid.size[m];
+      grid.hi[n][m] = object->center[m] + object->width[m]/2.0 + grid.size[m];
+    }
+  }
+
+  ALLOC(values, slice_size);
+  done = FALSE;
+
+#ifdef PHANTOM_CAN_FORK
+  n_jobs = MIN(n_jobs, grid.sizes[0]);
+
+  if (n_jobs > 1) {
+    ALLOC(pid, n_jobs);
+    ALLOC(fd,  n_jobs);
+
+    (void) fflush( stdout );    /* or the workers print it again */
+    (void) fflush( stderr );
+
+    for(n=0; n<n_jobs; n++) {
+      pid[n] = -1;
+      fd[n]  = -1;
+      if (pipe(fds) != 0)
+        continue;
+
+      pid[n] = fork();
+      if (pid[n] == 0) {
+        (void) close( fds[0] );
+        for(i=n; i<grid.sizes[0]; i+=n_jobs) {
+          compute_phantom_slice(&grid, i, values);
+          if (!transfer_all(fds[1], (char *)values, slice_size*sizeof(float), TRUE))
+            _exit(1);
+        }
+        _exit(0);
+      }
+
+      (void) close( fds[1] );
+      if (pid[n] < 0)
+        (void) close( fds[0] );
+      else
+        fd[n] = fds[0];
+    }
+
+                                /* take the slices in order, each from
+                                   its worker while it is still running */
+    for(i=0; i<grid.sizes[0]; i++) {
+      n = i % n_jobs;
+      if (fd[n] >= 0 &&
+          !transfer_all(fd[n], (char *)values, slice_size*sizeof(float), FALSE)) {
+        (void) close( fd[n] );
+        fd[n] = -1;
+      }
+      if (fd[n] < 0)
+        compute_phantom_slice(&grid, i, values);
+      put_phantom_slice(data, i, grid.sizes, values);
+    }
+
+    for(n=0; n<n_jobs; n++) {
+      if (fd[n] >= 0)
+        (void) close( fd[n] );
+      if (pid[n] > 0)
+        (void) waitpid( pid[n], NULL, 0 );
+    }
+
+    FREE(pid);
+    FREE(fd);
+    done = TRUE;
+  }
+#endif
+
+  if (!done)
+    for(i=0; i<grid.sizes[0]; i++) {
+      compute_phantom_slice(&grid, i, values);
+      put_phantom_slice(data, i, grid.sizes, values);
+    }
+
+  FREE(values);
+  FREE(grid.lo);
+  FREE(grid.hi);
+
+  return(VIO_OK);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : write_phantom_deformation
+@INPUT      : filename - .xfm file to write
+              data     - the phantom volume (for its field of view)
+              phantom  - its deformation
+              history
+@OUTPUT     :
+@RETURNS    : status of output_transform_file()
+@DESCRIPTION: saves d(p) as a grid transform covering the phantom, sampled
+              every eighth of a wavelength (but not more finely than the
+              phantom).  It maps a point of the deformed phantom onto the
+              matching point of the undeformed one.
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_Status write_phantom_deformation(char *filename, VIO_Volume data,
+                                     Phantom *phantom, char *history)
+{
+  static char *dim_names[4] = { MIxspace, MIyspace, MIzspace, MIvector_dimension };
+  VIO_Volume
+    field;
+  VIO_General_transform
+    transform;
+  VIO_Status
+    status;
+  VIO_Real
+    lo[3], hi[3], w[3], p[3], d[3],
+    grid_step, max_step,
+    step[VIO_MAX_DIMENSIONS], start[VIO_MAX_DIMENSIONS], voxel[VIO_MAX_DIMENSIONS];
+  int
+    sizes[3], count[VIO_MAX_DIMENSIONS],
+    c, i, j, k, m;
+
+  get_volume_sizes(data, sizes);
+
+                                /* world extent of the phantom */
+  for(m=0; m<3; m++) {
+    lo[m] = DBL_MAX;
+    hi[m] = -DBL_MAX;
+  }
+  for(c=0; c<8; c++) {
+    convert_3D_voxel_to_world(data,
+                              (VIO_Real)((c & 1) ? sizes[0]-1 : 0),
+                              (VIO_Real)((c & 2) ? sizes[1]-1 : 0),
+                              (VIO_Real)((c & 4) ? sizes[2]-1 : 0),
+                              &w[0], &w[1], &w[2]);
+    for(m=0; m<3; m++) {
+      if (w[m] < lo[m]) lo[m] = w[m];
+      if (w[m] > hi[m]) hi[m] = w[m];
+    }
+  }
+
+  get_volume_separations(data, step);
+  max_step = MAX3(fabs(step[0]), fabs(step[1]), fabs(step[2]));
+  grid_step = MAX(max_step, phantom->deformation.wavelength/8.0);
+
+  field = create_volume(4, dim_names, NC_DOUBLE, TRUE, 0.0, 0.0);
+
+  for(m=0; m<3; m++) {
+    count[m] = (int)ceil((hi[m] - lo[m]) / grid_step) + 1;
+    step[m]  = grid_step;
+    start[m] = lo[m];
+  }
+  count[3] = 3;
+  step[3]  = 0.0;
+
+  set_volume_sizes(       field, count);
+  set_volume_separations( field, step);
+  for(m=0; m<VIO_MAX_DIMENSIONS; m++)
+    voxel[m] = 0.0;
+  set_volume_translation( field, voxel, start);
+  alloc_volume_data(field);
+
+  for(i=0; i<count[0]; i++)
+    for(j=0; j<count[1]; j++)
+      for(k=0; k<count[2]; k++) {
+        p[0] = start[0] + i*grid_step;
+        p[1] = start[1] + j*grid_step;
+        p[2] = start[2] + k*grid_step;
+        get_phantom_field(&phantom->deformation, p, d);
+        for(c=0; c<3; c++)
+          SET_VOXEL(field, i,j,k,c,0, d[c]);
+      }
+
+  create_grid_transform(&transform, field, NULL);
+
+  status = output_transform_file(filename, history, &transform);
+
+  delete_general_transform(&transform);
+  delete_volume(field);
+
+  return(status);
+}
+
+void delete_phantom(Phantom *phantom)
+{
+  if (phantom->n_objects > 0)
+    FREE(phantom->objects);
+  phantom->n_objects = 0;
+}
@@ -0,0 +1,76 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : phantom.h
+@DESCRIPTION: structures and prototypes for phantom.c, the multi-object
+              phantom builder used by make_phantom for -objects, -deform
+              and -bias.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#ifndef MAKE_PHANTOM_PHANTOM_H
+#define MAKE_PHANTOM_PHANTOM_H
+
+#define RECTANGLE  0
+#define ELLIPSE    1
+
+                                /* number of sinusoids summed for each
+                                   component of a random smooth field */
+#define PHANTOM_FIELD_TERMS  4
+
+typedef struct {
+  int       shape;              /* RECTANGLE or ELLIPSE                 */
+  VIO_Real  center[3];          /* world x y z                          */
+  VIO_Real  width[3];           /* full width along x y z (mm)          */
+  VIO_Real  value;              /* real value inside the object         */
+} Phantom_Object;
+
+/* a random smooth field with n_components components, each the sum of
+   PHANTOM_FIELD_TERMS plane waves of the same wavelength, in random
+   directions and with random phases, scaled so that no component
+   exceeds amplitude */
+
+typedef struct {
+  int       n_components;
+  VIO_Real  amplitude;
+  VIO_Real  wavelength;
+  VIO_Real  wave[3][PHANTOM_FIELD_TERMS][3];    /* 2*pi*direction/wavelength */
+  VIO_Real  phase[3][PHANTOM_FIELD_TERMS];
+  VIO_Real  weight[3][PHANTOM_FIELD_TERMS];
+} Phantom_Field;
+
+typedef struct {
+  int             n_objects;
+  Phantom_Object  *objects;     /* painted in order, later over earlier */
+  VIO_Real        background;
+  VIO_BOOL        partial;      /* partial volume at the object edges   */
+  VIO_BOOL        labels;       /* no mixing: each voxel takes a value  */
+  VIO_BOOL        deform;
+  Phantom_Field   deformation;  /* voxel at p shows the objects at p+d(p) */
+  VIO_BOOL        bias;
+  Phantom_Field   bias_field;   /* values are scaled by 1+b(p)          */
+} Phantom;
+
+
+void init_phantom(Phantom *phantom, VIO_Real background,
+                  VIO_BOOL partial, VIO_BOOL labels);
+
+void add_phantom_object(Phantom *phantom, int shape,
+                        VIO_Real center[], VIO_Real width[], VIO_Real value);
+
+VIO_BOOL read_phantom_objects(char *filename, Phantom *phantom);
+
+void init_phantom_field(Phantom_Field *field, int n_components,
+                        VIO_Real amplitude, VIO_Real wavelength);
+
+void get_phantom_field(Phantom_Field *field, VIO_Real p[], VIO_Real value[]);
+
+void get_phantom_range(Phantom *phantom, VIO_Real *min, VIO_Real *max);
+
+VIO_Status build_phantom(VIO_Volume data, Phantom *phantom, int n_jobs);
+
+VIO_Status write_phantom_deformation(char *filename, VIO_Volume data,
+                                     Phantom *phantom, char *history);
+
+void delete_phantom(Phantom *phantom);
+
+#endif
@@ -6,7 +6,8 @@
 @DESCRIPTION: This program will calculate the bounding box of the data in
               the minc volume and return the coordinates of the box in terms
               of startx, starty, startz, widthx, widthy, widthz 
-              all in mm
+              all in mm.  With -crop, the data inside the box (plus -pad
+              voxels on each side) is written to a new volume instead.
 @COPYRIGHT  :
               Copyright 1993 Louis Collins, McConnell Brain Imaging Centre, 
               Montreal Neurological Institute, McGill University.
@@ -55,37 +56,274 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/mincbbox/
 #include <ParseArgv.h>
 #include "mincbbox.h"
 
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  MINCBBOX_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 /*#define  VIO_FLOOR( x )     ((int) floor(x))
 #define  VIO_ROUND( x )     VIO_FLOOR( (double) (x) + 0.5 )*/
 
 static char *default_dim_names[VIO_N_DIMENSIONS] = { MIxspace, MIyspace, MIzspace };
 static char *My_File_order_dimension_names[VIO_MAX_DIMENSIONS] = { "", "", "", "", "" };
 
+/* add to lo..hi the voxels of slice i above the threshold.  Each row
+   is scanned from both ends only until a voxel above the threshold is
+   met, so mostly background is visited. */
+
+static void add_slice_bbox(VIO_Volume data, int i, int sizes[],
+                           int lo[], int hi[])
+{
+  int j,k,first;
+  VIO_Real voxel, value;
+
+  for(j=0; j<sizes[1]; j++) {
+
+    for(first=0; first<sizes[2]; first++) {
+      GET_VOXEL_3D(voxel, data, i,j,first);
+      value = CONVERT_VOXEL_TO_VALUE(data, voxel);
+      if (value>threshold)
+        break;
+    }
+    if (first == sizes[2])
+      continue;
+
+    for(k=sizes[2]-1; k>first; k--) {
+      GET_VOXEL_3D(voxel, data, i,j,k);
+      value = CONVERT_VOXEL_TO_VALUE(data, voxel);
+      if (value>threshold)
+        break;
+    }
+
+    if (i<lo[0]) lo[0] = i;
+    if (i>hi[0]) hi[0] = i;
+    if (j<lo[1]) lo[1] = j;
+    if (j>hi[1]) hi[1] = j;
+    if (first<lo[2]) lo[2] = first;
+    if (k>hi[2])     hi[2] = k;
+  }
+}
+
+static void merge_bbox(int lo[], int hi[], int part_lo[], int part_hi[])
+{
+  int d;
+
+  for(d=0; d<3; d++) {
+    if (part_lo[d]<lo[d]) lo[d] = part_lo[d];
+    if (part_hi[d]>hi[d]) hi[d] = part_hi[d];
+  }
+}
+
+/* voxel bounding box of slices first, first+step, ... */
+
+static void get_slices_bbox(VIO_Volume data, int first, int step, int sizes[],
+                            int lo[], int hi[])
+{
+  int i;
+
+  lo[0] = lo[1] = lo[2] = INT_MAX;
+  hi[0] = hi[1] = hi[2] = -INT_MAX;
+
+  for(i=first; i<sizes[0]; i+=step)
+    add_slice_bbox(data, i, sizes, lo, hi);
+}
+
+/* find the voxel bounding box of the data, the smallest box holding
+   every voxel above the threshold.  With -jobs n > 1 the slices are
+   dealt out to n worker processes, worker w taking slices w, w+n, ...,
+   and each sends back the box of its slices; the boxes of workers that
+   could not be started, or died, are computed here.  Returns FALSE if
+   no voxel is above the threshold. */
+
+static VIO_BOOL get_voxel_bbox(VIO_Volume data, int lo[], int hi[])
+{
+  int
+    sizes[3], part[6], w;
+  VIO_BOOL
+    done;
+#ifdef MINCBBOX_CAN_FORK
+  int
+    *fd, fds[2];
+  pid_t
+    *pid;
+#endif
+
+  get_volume_sizes(data, sizes);
+
+  done = FALSE;
+
+#ifdef MINCBBOX_CAN_FORK
+  if (n_jobs > sizes[0])
+    n_jobs = sizes[0];
+
+  if (n_jobs > 1) {
+    ALLOC(pid, n_jobs);
+    ALLOC(fd,  n_jobs);
+
+    (void) fflush( stdout );    /* or the workers print it again */
+    (void) fflush( stderr );
+
+    for(w=0; w<n_jobs; w++) {
+      pid[w] = -1;
+      fd[w]  = -1;
+      if (pipe(fds) != 0)
+        continue;
+
+      pid[w] = fork();
+      if (pid[w] == 0) {
+        (void) close( fds[0] );
+        get_slices_bbox(data, w, n_jobs, sizes, &part[0], &part[3]);
+        _exit( transfer_all(fds[1], (char *)part, sizeof(part), TRUE) ? 0 : 1 );
+      }
+
+      (void) close( fds[1] );
+      if (pid[w] < 0)
+        (void) close( fds[0] );
+      else
+        fd[w] = fds[0];
+    }
+
+    lo[0] = lo[1] = lo[2] = INT_MAX;
+    hi[0] = hi[1] = hi[2] = -INT_MAX;
+
+    for(w=0; w<n_jobs; w++) {
+      if (fd[w] < 0 ||
+          !transfer_all(fd[w], (char *)part, sizeof(part), FALSE))
+        get_slices_bbox(data, w, n_jobs, sizes, &part[0], &part[3]);
+      merge_bbox(lo, hi, &part[0], &part[3]);
+
+      if (fd[w] >= 0)
+        (void) close( fd[w] );
+      if (pid[w] > 0)
+        (void) waitpid( pid[w], NULL, 0 );
+    }
+
+    FREE(pid);
+    FREE(fd);
+    done = TRUE;
+  }
+#endif
+
+  if (!done)
+    get_slices_bbox(data, 0, 1, sizes, lo, hi);
+
+  return(lo[0] <= hi[0]);
+}
+
+/* world extents of the voxel bounding box, from its eight corners */
+
+static void get_world_bbox(VIO_Volume data, int lo[], int hi[],
+                           VIO_Real min[], VIO_Real max[])
+{
+  int c;
+  VIO_Real w[3];
+
+  for(c=0; c<3; c++) {
+    min[c] = DBL_MAX;
+    max[c] = -DBL_MAX;
+  }
+
+  for(c=0; c<8; c++) {
+    convert_3D_voxel_to_world(data,
+                              (VIO_Real)((c & 1) ? hi[0] : lo[0]),
+                              (VIO_Real)((c & 2) ? hi[1] : lo[1]),
+                              (VIO_Real)((c & 4) ? hi[2] : lo[2]),
+                              &w[0], &w[1], &w[2]);
+    if (w[0]<min[0]) min[0] = w[0];
+    if (w[1]<min[1]) min[1] = w[1];
+    if (w[2]<min[2]) min[2] = w[2];
+
+    if (w[0]>max[0]) max[0] = w[0];
+    if (w[1]>max[1]) max[1] = w[1];
+    if (w[2]>max[2]) max[2] = w[2];
+  }
+}
+
+/* write voxels lo-pad..hi+pad of data to outfile, with the same type,
+   range and orientation.  Voxels outside the input volume are set to
+   zero (or the nearest value in range). */
+
+static VIO_Status write_cropped_volume(VIO_Volume data, int lo[], int hi[],
+                                       char *outfile, char *infile,
+                                       char *history)
+{
+  VIO_Volume
+    crop;
+  VIO_Status
+    status;
+  VIO_Real
+    voxel, fill, voxel_min, voxel_max,
+    origin[VIO_MAX_DIMENSIONS], start[VIO_MAX_DIMENSIONS];
+  int
+    d, i,j,k, sizes[3], count[VIO_MAX_DIMENSIONS], first[3];
+
+  get_volume_sizes(data, sizes);
+
+  for(d=0; d<3; d++) {
+    first[d] = lo[d] - pad;
+    count[d] = hi[d] - lo[d] + 1 + 2*pad;
+  }
+
+  crop = copy_volume_definition_no_alloc(data, NC_UNSPECIFIED, FALSE, 0.0, 0.0);
+  set_volume_sizes(crop, count);
+
+                                /* voxel 0 of the crop is voxel first[]
+                                   of the input */
+  for(d=0; d<VIO_MAX_DIMENSIONS; d++) origin[d] = start[d] = 0.0;
+  convert_3D_voxel_to_world(data,
+                            (VIO_Real)first[0], (VIO_Real)first[1], (VIO_Real)first[2],
+                            &start[VIO_X], &start[VIO_Y], &start[VIO_Z]);
+  set_volume_translation(crop, origin, start);
+
+  alloc_volume_data(crop);
+
+  get_volume_voxel_range(data, &voxel_min, &voxel_max);
+  fill = CONVERT_VALUE_TO_VOXEL(data, 0.0);
+  if (fill < voxel_min) fill = voxel_min;
+  if (fill > voxel_max) fill = voxel_max;
+
+  for(i=0; i<count[0]; i++)
+    for(j=0; j<count[1]; j++)
+      for(k=0; k<count[2]; k++) {
+        if (first[0]+i >= 0 && first[0]+i < sizes[0] &&
+            first[1]+j >= 0 && first[1]+j < sizes[1] &&
+            first[2]+k >= 0 && first[2]+k < sizes[2]) {
+          GET_VOXEL_3D(voxel, data, first[0]+i, first[1]+j, first[2]+k);
+        }
+        else
+          voxel = fill;
+        SET_VOXEL_3D(crop, i,j,k, voxel);
+      }
+
+  status = output_modified_volume(outfile, NC_UNSPECIFIED, FALSE, 0.0, 0.0, crop,
+                                  infile, history, (minc_output_options *)NULL);
+
+  delete_volume(crop);
+
+  return(status);
+}
+
 int main (int argc, char *argv[] )
 {   
   char 
-    *infilename;
+    *infilename,
+    *history;
   VIO_Status 
     status;
   VIO_Volume
     data;
   VIO_Real
-    voxel, value, 
-    x,y,z,
-    minx, miny, minz,
-    maxx, maxy, maxz;
+    min[3], max[3];
   int
-    v_minx, v_miny, v_minz,
-    v_maxx, v_maxy, v_maxz;
-
-  int
-    i,j,k, 
-    sizes[3];
+    lo[3], hi[3];
 
   /* set default values */
   
   prog_name = argv[0];
   infilename =  NULL;
+  history = history_string(argc, argv);
 
   verbose = TRUE;
   debug   = FALSE;
@@ -107,11 +345,24 @@ int main (int argc, char *argv[] )
     print ("thres -> %f\n",threshold);
   }
 
+  if (n_jobs < 1)
+    print_error_and_line_num("-jobs must be at least 1.\n",__FILE__, __LINE__);
+
+  if (cropfilename != NULL) {
+    if (pad < 0)
+      print_error_and_line_num("-pad must not be negative.\n",__FILE__, __LINE__);
+    if (!clobber && file_exists(cropfilename))
+      print_error_and_line_num("File %s exists (use -clobber to overwrite).\n",
+                               __FILE__, __LINE__, cropfilename);
+  }
+
   /******************************************************************************/
   /*             read in input volume data                                      */
   /******************************************************************************/
   
-  if (mincreshape)
+                                /* keep the file's dimension order
+                                   when writing a cropped volume */
+  if (mincreshape || cropfilename != NULL)
       status = input_volume(infilename, 3, My_File_order_dimension_names , 
                             NC_UNSPECIFIED, FALSE, 
                             0.0, 0.0, TRUE, &data, 
@@ -131,66 +382,58 @@ int main (int argc, char *argv[] )
                  __FILE__, __LINE__, infilename, get_volume_n_dimensions(data),0,0,0);
   }
     
-  get_volume_sizes(data, sizes);
-
-  minx = miny = minz = DBL_MAX;
-  maxx = maxy = maxz = -DBL_MAX;
-
-  v_minx = v_miny = v_minz = INT_MAX;
-  v_maxx = v_maxy = v_maxz = -INT_MAX;
-
-  for(i=0; i<sizes[0]; i++) {
-    for(j=0; j<sizes[1]; j++) {
-      for(k=0; k<sizes[2]; k++) {
-        GET_VOXEL_3D(voxel, data, i,j,k);
-        value = CONVERT_VOXEL_TO_VALUE(data, voxel);
-
-        if (value>threshold) {
+  if (get_voxel_bbox(data, lo, hi)) {
+    get_world_bbox(data, lo, hi, min, max);
+  }
+  else {
+    lo[0] = lo[1] = lo[2] = INT_MAX;
+    hi[0] = hi[1] = hi[2] = -INT_MAX;
+    min[0] = min[1] = min[2] = DBL_MAX;
+    max[0] = max[1] = max[2] = -DBL_MAX;
+  }
 
-          convert_3D_voxel_to_world(data,(VIO_Real)i,(VIO_Real)j,(VIO_Real)k, &x,&y,&z);
-          
-          if (x<minx) minx = x;
-          if (y<miny) miny = y;
-          if (z<minz) minz = z;
+  if (debug)
+    print ("voxel bbox: %d %d  %d %d  %d %d\n", lo[0],hi[0], lo[1],hi[1], lo[2],hi[2]);
 
-          if (x>maxx) maxx = x;
-          if (y>maxy) maxy = y;
-          if (z>maxz) maxz = z;
+  if (cropfilename != NULL) {
+    if (lo[0] > hi[0])
+      print_error_and_line_num("No voxel of %s is above %f: nothing to crop.\n",
+                               __FILE__, __LINE__, infilename, threshold);
 
-          if (i<v_minx) v_minx = i;
-          if (j<v_miny) v_miny = j;
-          if (k<v_minz) v_minz = k;
+    if (verbose)
+      print ("Writing %s\n", cropfilename);
 
-          if (i>v_maxx) v_maxx = i;
-          if (j>v_maxy) v_maxy = j;
-          if (k>v_maxz) v_maxz = k;
+    status = write_cropped_volume(data, lo, hi, cropfilename, infilename, history);
+    if ( status != VIO_OK )
+      print_error_and_line_num("problems writing `%s'.\n",__FILE__, __LINE__,cropfilename);
 
-        }
-      }
-    }
+    delete_volume(data);
+    free(history);
+    return(VIO_OK);
   }
 
-  
   if (minccrop) {
     print ("-xlim %d %d -ylim %d %d -zlim %d %d\n",
-           v_minx, v_maxx, v_miny,v_maxy, v_minz,v_maxz);
+           lo[0], hi[0], lo[1],hi[1], lo[2],hi[2]);
   }
   else
   if (mincreshape) {
     print ("-start %d,%d,%d -count %d,%d,%d\n",
-           v_minx,v_miny,v_minz,
-           v_maxx-v_minx+1,v_maxy-v_miny+1,v_maxz-v_minz+1);
+           lo[0],lo[1],lo[2],
+           hi[0]-lo[0]+1,hi[1]-lo[1]+1,hi[2]-lo[2]+1);
   }
   else
   if (mincresample)
     print ("-step 1.0 1.0 1.0 -start %f %f %f -nelements %d %d %d\n",
-           minx, miny, minz, VIO_ROUND(maxx-minx)+1, VIO_ROUND(maxy-miny)+1, VIO_ROUND(maxz-minz)+1);
+           min[0], min[1], min[2], VIO_ROUND(max[0]-min[0])+1, VIO_ROUND(max[1]-min[1])+1, VIO_ROUND(max[2]-min[2])+1);
   else
     if (two_lines)
-      print ("%f %f %f\n%f %f %f\n",minx, miny, minz, maxx-minx+1, maxy-miny+1, maxz-minz+1);
+      print ("%f %f %f\n%f %f %f\n",min[0], min[1], min[2], max[0]-min[0]+1, max[1]-min[1]+1, max[2]-min[2]+1);
     else
-      print ("%f %f %f    %f %f %f\n",minx, miny, minz, maxx-minx+1, maxy-miny+1, maxz-minz+1);
+      print ("%f %f %f    %f %f %f\n",min[0], min[1], min[2], max[0]-min[0]+1, max[1]-min[1]+1, max[2]-min[2]+1);
 
+  delete_volume(data);
+  free(history);
   return(VIO_OK);
 }
 
@@ -6,6 +6,10 @@ int  mincresample = FALSE;
 int  mincreshape  = FALSE;
 int  minccrop     = FALSE;
 int  two_lines    = FALSE; 
+char *cropfilename = NULL;
+int  pad          = 0;
+int  clobber      = FALSE;
+int  n_jobs       = 1;
 
 static ArgvInfo argTable[] = {
   {"-threshold", ARGV_FLOAT, (char *) FALSE, (char *) &threshold,
@@ -20,6 +24,16 @@ static ArgvInfo argTable[] = {
      "Output format for mincreshape: (-start x,y,z -count dx,dy,dz"},
   {"-minccrop", ARGV_CONSTANT, (char *) TRUE, (char *) &minccrop,
      "Output format for minccrop: (-xlim x1 x2 -ylim y1 y2 -zlim z1 z2"},
+  {"-jobs", ARGV_INT, (char *) 1, (char *) &n_jobs,
+     "Number of processes scanning the volume for the bounding box (def=1)."},
+  {NULL, ARGV_HELP, NULL, NULL,
+     "Options for writing the cropped volume."},
+  {"-crop", ARGV_STRING, (char *) 1, (char *) &cropfilename,
+     "Write the data inside the bounding box to <file> instead of printing it."},
+  {"-pad", ARGV_INT, (char *) 1, (char *) &pad,
+     "Number of voxels to add around the bounding box with -crop."},
+  {"-clobber", ARGV_CONSTANT, (char *) TRUE, (char *) &clobber,
+     "Overwrite the -crop output file."},
   {NULL, ARGV_HELP, NULL, NULL,
      "Options for logging progress. Default = -verbose."},
   {"-verbose", ARGV_CONSTANT, (char *) TRUE, (char *) &verbose,
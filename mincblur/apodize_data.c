@@ -149,3 +149,50 @@ void apodize_data(VIO_Volume data, int xyzv[VIO_MAX_DIMENSIONS],
   
 }
 
+
+
+/************************************************************/
+/* return in weights[0..n-1] the scale applied by           */
+/* apodize_data() to each slice along one axis, for use     */
+/* when the volume is not held in memory                    */
+/************************************************************/
+void get_apodize_weights(int n, double step, double ramp1, double ramp2,
+                         float weights[])
+{
+  int
+    i, end, num_steps, slice;
+  float
+    scale1,scale2, scale;
+  double
+    ramp;
+
+  for(i=0; i<n; i++)
+    weights[i] = 1.0;
+
+  for(end=0; end<2; end++) {
+
+    ramp = (end==0) ? ramp1 : ramp2;
+
+    if (ramp > ABS(step)/2) {
+
+      /* number of slices to be apodized */
+      num_steps = ROUND( 1.25*ramp/ABS(step) + 0.5);
+
+      if (num_steps>n) {
+        print_error_and_line_num("FWHM is greater than slice dimension\n",__FILE__, __LINE__);
+      }
+
+      for(slice=0; slice<num_steps; slice++) {
+
+        scale1 = normal_height( ramp*GWID1, 1.25*ramp, (float)slice*ABS(step));
+        scale2 = normal_height( ramp*GWID2, 0.0, (float)(num_steps - 1 - slice)*ABS(step));
+        scale = INTERPOLATE( slice/(num_steps-1.0) , scale1, scale2);
+
+        if (end==0)
+          weights[slice] *= scale;
+        else
+          weights[n-1-slice] *= scale;
+      }
+    }
+  }
+}
@@ -0,0 +1,432 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : blur_slabs.c
+@INPUT      : infile   - name of the MINC file to blur
+              fwhm     - fwhm of the kernel along world x, y and z (mm)
+              apodize  - apodization ramp along world x, y and z (mm),
+                         0 for none
+              kernel_type, history
+              memory_mb - approximate limit on the memory used
+@OUTPUT     : <outfile>_blur.mnc
+@RETURNS    : (nothing)
+@DESCRIPTION: blurs a volume without ever holding it in memory, for
+              volumes too large for blur3D_volume().
+
+              Slices (along the slowest varying dimension of the file)
+              are read a block at a time, apodized and convolved within
+              the slice with the same FFT code as blur3D_volume().  The
+              result goes into a ring of slices that is (2*halo + block)
+              slices deep, and the convolution across slices is done
+              directly from the ring, using the same kernel samples as
+              the FFT convolution (make_kernel()), out to a halo of
+              4*fwhm.  Output slices are written as soon as all of their
+              neighbours have been read.
+
+              Up to rounding, the result is that of blur3D_volume():
+              across slices, the FFT convolution is circular over a
+              zero-padded vector and the kernel beyond 4*fwhm is below
+              float precision.  The output is written with one
+              image-max/min per slice rather than a global range.
+@METHOD     :
+@GLOBALS    : verbose, debug
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+#include <string.h>
+#include <math.h>
+#include <minc.h>
+#include "gradmag_volume.h"
+#include "blur_support.h"
+
+#ifndef MAX
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
+extern int verbose;
+extern int debug;
+
+void fft1(float *signal, int numpoints, int direction);
+
+void get_apodize_weights(int n, double step, double ramp1, double ramp2,
+                         float weights[]);
+
+                                /* FFT convolution of one axis of a slice */
+typedef struct {
+  int   length;                 /* number of samples along the axis     */
+  int   stride;                 /* distance between them in the slice   */
+  int   n_lines;                /* number of lines in the slice         */
+  int   line_stride;            /* distance between the lines           */
+  int   array_size_pow2;
+  int   data_offset;
+  float *kern;                  /* FT of the kernel                     */
+  float *dat_vector, *dat_vecto2;
+} Slab_Axis;
+
+/* get the FFT length and kernel for an axis of n samples, as done for
+   each axis in blur3D_volume() */
+
+static int get_kernel_array(int n, double step, double fwhm, int kernel_type,
+                            float **kern)
+{
+  int kernel_size_data, array_size_pow2;
+
+  kernel_size_data = (int)(((4*fwhm)/fabs(step)) + 0.5);
+
+  if (kernel_size_data > MAX(n,256))
+    kernel_size_data =  MAX(n,256);
+
+  array_size_pow2  = next_power_of_two(n+kernel_size_data+1);
+
+  *kern = MALLOC((2*array_size_pow2+1) * sizeof(float));
+  make_kernel(*kern, (float)fabs(step), fwhm, array_size_pow2, kernel_type);
+
+  return(array_size_pow2);
+}
+
+static void init_slab_axis(Slab_Axis *axis, int length, int stride,
+                           int n_lines, int line_stride,
+                           double step, double fwhm, int kernel_type)
+{
+  axis->length      = length;
+  axis->stride      = stride;
+  axis->n_lines     = n_lines;
+  axis->line_stride = line_stride;
+
+  axis->array_size_pow2 = get_kernel_array(length, step, fwhm, kernel_type,
+                                           &axis->kern);
+  fft1(axis->kern, axis->array_size_pow2, 1);
+
+  axis->data_offset = (axis->array_size_pow2 - length)/2;
+
+  axis->dat_vector = MALLOC((2*axis->array_size_pow2+1) * sizeof(float));
+  axis->dat_vecto2 = MALLOC((2*axis->array_size_pow2+1) * sizeof(float));
+}
+
+static void free_slab_axis(Slab_Axis *axis)
+{
+  FREE(axis->kern);
+  FREE(axis->dat_vector);
+  FREE(axis->dat_vecto2);
+}
+
+/* convolve every line of a slice along one axis */
+
+static void convolve_slice_axis(Slab_Axis *axis, float *slice)
+{
+  int   line, i, pow2;
+  float *f_ptr;
+
+  pow2 = axis->array_size_pow2;
+
+  for (line=0; line < axis->n_lines; line++) {
+
+    f_ptr = slice + line*axis->line_stride;
+    memset(axis->dat_vector,0,(2*pow2+1)*sizeof(float));
+
+    for (i=0; i < axis->length; i++) {          /* extract the line */
+      axis->dat_vector[1 +2*(i+axis->data_offset)] = *f_ptr;
+      f_ptr += axis->stride;
+    }
+
+    fft1(axis->dat_vector,pow2,1);
+    muli_vects(axis->dat_vecto2,axis->dat_vector,axis->kern,pow2);
+    fft1(axis->dat_vecto2,pow2,-1);
+
+    f_ptr = slice + line*axis->line_stride;
+    for (i=0; i < axis->length; i++) {          /* put the line back */
+      *f_ptr = axis->dat_vecto2[1 + 2*(i+axis->data_offset)]/pow2;
+      f_ptr += axis->stride;
+    }
+  }
+}
+
+void blur3D_volume_slabs(char *infile, char *outfile,
+                         double fwhm[], double apodize[],
+                         int kernel_type, char *history,
+                         int memory_mb)
+{
+  MincVolume
+    in_vol_struct, out_vol_struct;
+  MincVolume
+    *in_vol  = &in_vol_struct,
+    *out_vol = &out_vol_struct;
+  File_Info
+    info, *ifp, *ofp;
+  Volume_Definition
+    volume_def;
+  Slab_Axis
+    axis[3];
+  char
+    fulloutfilename[1024];
+  int
+    i, k, idim, index, slice_dim, slice_index,
+    order, world[VOL_NDIMS], size[VOL_NDIMS],
+    n_axes, axis_order[2],
+    halo, pow2;
+  long
+    in_start[MAX_VAR_DIMS], in_count[MAX_VAR_DIMS],
+    out_start[MAX_VAR_DIMS], out_count[MAX_VAR_DIMS],
+    mm_start[MAX_VAR_DIMS],
+    slice_size, block, ring_size, next_in, n_read,
+    z0, z, nb, need, v;
+  float
+    *weights[VOL_NDIMS], *ring, *f_ptr, *kern, *taps, w;
+  double
+    *in_data, *out_data, *d_ptr,
+    step[VOL_NDIMS], sum, minimum, maximum, valid_range[2], bytes;
+
+  /* Get the geometry of the input file: get_file_info() also gives the
+     steps, which build_vol_info() does not return */
+
+  get_file_info(infile, &volume_def, &info);
+  (void) ncclose(info.mincid);
+
+  snprintf(fulloutfilename, sizeof(fulloutfilename), "%s_blur.mnc", outfile);
+
+  build_vol_info(infile, fulloutfilename, in_vol, out_vol, history);
+  make_vol_icv(in_vol);
+
+  ifp = in_vol->file;
+  ofp = out_vol->file;
+
+  /* volume order (0 = slowest) -> world axis, size and step */
+
+  for (k=0; k < WORLD_NDIMS; k++) {
+    order        = info.axes[k];
+    world[order] = k;
+    size[order]  = volume_def.nelements[k];
+    step[order]  = volume_def.step[k];
+  }
+
+  slice_size = (long)size[1] * size[2];
+
+  /* apodization weights for each volume dimension */
+
+  for (order=0; order < VOL_NDIMS; order++) {
+    weights[order] = MALLOC(size[order] * sizeof(float));
+    get_apodize_weights(size[order], step[order],
+                        apodize[ world[order] ], apodize[ world[order] ],
+                        weights[order]);
+  }
+
+  /* in-slice convolutions, in world x, y, z order as in blur3D_volume() */
+
+  n_axes = 0;
+  for (k=0; k < WORLD_NDIMS; k++) {
+    order = info.axes[k];
+    if (order == 0 || fwhm[k] <= 0.0)
+      continue;
+    if (order == 2)
+      init_slab_axis(&axis[n_axes], size[2], 1, size[1], size[2],
+                     step[2], fwhm[k], kernel_type);
+    else
+      init_slab_axis(&axis[n_axes], size[1], size[2], size[2], 1,
+                     step[1], fwhm[k], kernel_type);
+    axis_order[n_axes++] = order;
+  }
+
+  /* taps across slices: the real part of the kernel array used for the
+     FFT convolution in blur3D_volume(), out to the halo */
+
+  halo = 0;
+  if (fwhm[ world[0] ] > 0.0) {
+    pow2 = get_kernel_array(size[0], step[0], fwhm[ world[0] ], kernel_type, &kern);
+    halo = (int)(((4*fwhm[ world[0] ])/fabs(step[0])) + 0.5);
+    if (halo > size[0]-1)  halo = size[0]-1;
+    if (halo > pow2/2 - 1) halo = pow2/2 - 1;
+    taps = MALLOC((2*halo+1) * sizeof(float));
+    for (k=-halo; k <= halo; k++)
+      taps[k+halo] = kern[ ((k + pow2) % pow2)*2 + 1 ];
+    FREE(kern);
+  }
+  else {
+    taps = MALLOC(sizeof(float));
+    taps[0] = 1.0;
+  }
+
+  /* slices per block: the ring holds (block + 2*halo) float slices, and
+     a block of input and of output is kept as doubles */
+
+  bytes = (double)memory_mb * 1024.0 * 1024.0;
+  block = (long)((bytes/(double)slice_size/sizeof(float) - 2*halo) / 5.0);
+  if (block < 1) {
+    (void) fprintf(stderr,
+                   "Blurring in slabs needs at least %.0f MB for this volume.\n",
+                   ceil((double)slice_size*(sizeof(float)*(2*halo+1) +
+                                            2*sizeof(double)) / (1024.0*1024.0)));
+    exit(EXIT_FAILURE);
+  }
+  if (block > size[0]) block = size[0];
+
+  ring_size = block + 2*halo;
+  ring      = MALLOC((size_t) ring_size * slice_size * sizeof(float));
+  in_data   = MALLOC((size_t) block * slice_size * sizeof(double));
+  out_data  = MALLOC((size_t) block * slice_size * sizeof(double));
+
+  if (debug)
+    (void)printf("slab blur: %ld slices per block, halo of %d slices\n",
+                 block, halo);
+
+  /* start and count vectors, as in gradmag_volume.c */
+
+  (void) miset_coords(ifp->ndims, (long) 0, in_start);
+  (void) miset_coords(ifp->ndims, (long) 1, in_count);
+  for (idim=0; idim < VOL_NDIMS; idim++) {
+    index = ifp->indices[idim];
+    in_count[index] = ifp->nelements[index];
+  }
+  slice_dim = ifp->indices[0];
+
+  (void) miset_coords(ifp->ndims, (long) 1, out_count);
+  slice_index = ofp->indices[0];
+  for (idim=1; idim < VOL_NDIMS; idim++) {
+    index = ofp->indices[idim];
+    out_count[index] = ofp->nelements[index];
+  }
+  for (idim=0; idim < ifp->ndims; idim++)
+    out_start[idim] = in_start[idim];
+
+  valid_range[0] =  DBL_MAX;
+  valid_range[1] = -DBL_MAX;
+
+  if (verbose) {
+    (void) fprintf(stderr, "Blurring slices:");
+    (void) fflush(stderr);
+  }
+
+  next_in = 0;
+
+  for (z0=0; z0 < size[0]; z0 += block) {
+
+    nb = size[0] - z0;
+    if (nb > block) nb = block;
+
+    /* read, apodize and blur within the slice everything that the
+       output slices of this block depend on */
+
+    need = z0 + nb + halo;
+    if (need > size[0]) need = size[0];
+
+    while (next_in < need) {
+
+      n_read = need - next_in;
+      if (n_read > block) n_read = block;
+
+      in_start[slice_dim] = next_in;
+      in_count[slice_dim] = n_read;
+      (void) miicv_get(ifp->icvid, in_start, in_count, in_data);
+
+      for (z=next_in; z < next_in+n_read; z++) {
+
+        d_ptr = in_data + (z-next_in)*slice_size;
+        f_ptr = ring + (z % ring_size)*slice_size;
+
+        for (i=0; i < size[1]; i++) {
+          w = weights[0][z] * weights[1][i];
+          for (k=0; k < size[2]; k++)
+            *f_ptr++ = (float)(*d_ptr++ * w * weights[2][k]);
+        }
+
+        f_ptr = ring + (z % ring_size)*slice_size;
+        for (k=0; k < n_axes; k++)
+          convolve_slice_axis(&axis[k], f_ptr);
+      }
+
+      next_in += n_read;
+    }
+
+    /* convolve across slices */
+
+    for (z=z0; z < z0+nb; z++) {
+      d_ptr = out_data + (z-z0)*slice_size;
+      for (v=0; v < slice_size; v++) {
+        sum = 0.0;
+        for (k=-halo; k <= halo; k++)
+          if (z-k >= 0 && z-k < size[0])
+            sum += taps[k+halo] * ring[ ((z-k) % ring_size)*slice_size + v ];
+        d_ptr[v] = sum;
+      }
+    }
+
+    /* write the max and min of each slice, then the block */
+
+    for (z=z0; z < z0+nb; z++) {
+      d_ptr = out_data + (z-z0)*slice_size;
+      minimum =  DBL_MAX;
+      maximum = -DBL_MAX;
+      for (v=0; v < slice_size; v++) {
+        if (d_ptr[v] > maximum) maximum = d_ptr[v];
+        if (d_ptr[v] < minimum) minimum = d_ptr[v];
+      }
+      if (maximum <= minimum) {
+        if (minimum == 0.0)
+          maximum = SMALL_VALUE;
+        else if (minimum < 0.0)
+          maximum = 0.0;
+        else
+          maximum = 2.0 * minimum;
+      }
+
+      if (maximum > valid_range[1]) valid_range[1] = maximum;
+      if (minimum < valid_range[0]) valid_range[0] = minimum;
+
+      out_start[slice_index] = z;
+      (void) mivarput1(ofp->mincid, ofp->maxid,
+                       mitranslate_coords(ofp->mincid,
+                                          ofp->imgid, out_start,
+                                          ofp->maxid, mm_start),
+                       NC_DOUBLE, NULL, &maximum);
+      (void) mivarput1(ofp->mincid, ofp->minid,
+                       mitranslate_coords(ofp->mincid,
+                                          ofp->imgid, out_start,
+                                          ofp->minid, mm_start),
+                       NC_DOUBLE, NULL, &minimum);
+    }
+
+    out_start[slice_index] = z0;
+    out_count[slice_index] = nb;
+    (void) miicv_put(ofp->icvid, out_start, out_count, out_data);
+    out_count[slice_index] = 1;
+
+    if (verbose) {
+      for (z=0; z < nb; z++)
+        (void) fprintf(stderr, ".");
+      (void) fflush(stderr);
+    }
+  }
+
+  if (verbose) {
+    (void) fprintf(stderr, "Done\n");
+    (void) fflush(stderr);
+  }
+
+  if (debug)
+    (void)printf("after  blur min/max = %f %f\n", valid_range[0], valid_range[1]);
+
+  if ((ofp->datatype == NC_FLOAT) || (ofp->datatype == NC_DOUBLE)) {
+    (void) ncattput(ofp->mincid, ofp->imgid, MIvalid_range,
+                    NC_DOUBLE, 2, valid_range);
+  }
+
+  /* Close the files */
+  (void) miattputstr(ofp->mincid, ofp->imgid, MIcomplete, MI_TRUE);
+  (void) ncclose(ofp->mincid);
+  (void) ncclose(ifp->mincid);
+
+  /* Release memory */
+  for (k=0; k < n_axes; k++)
+    free_slab_axis(&axis[k]);
+  for (order=0; order < VOL_NDIMS; order++)
+    FREE(weights[order]);
+  FREE(taps);
+  FREE(ring);
+  FREE(in_data);
+  FREE(out_data);
+  free_vol_info(out_vol);
+  free_vol_info(in_vol);
+}
@@ -96,6 +96,28 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/mincblur/
 extern int verbose;
 extern int debug;
 
+                                /* the derivative volumes are streamed
+                                   through in blocks of slices of about
+                                   this size (per volume) */
+#define STREAM_BLOCK_BYTES  (4*1024*1024)
+#define STREAM_MAX_VOLUMES  6
+
+                                /* computes every output for n voxels
+                                   of the input blocks */
+typedef void (*Slice_Kernel)(long n, double *in[], double *out[], void *data);
+
+static void get_slice_range(double *values, long n,
+                            double *minimum, double *maximum);
+
+static void get_mag_values(long n, 
+                           double *dx, double *dy, double *dz,
+                           double *result);
+
+static void get_curvature_values(long n, 
+                                 double *dx,  double *dy,  double *dz,
+                                 double *dxx, double *dyy, double *dzz,
+                                 double thresh, double *result);
+
 void calc_gradient_magnitude(char *infilename, 
                                     char *output_basename,
                                     char *history, 
@@ -1048,48 +1070,51 @@ void finish_up(MincVolume *in_vol1,
 
 
 /* ----------------------------- MNI Header -----------------------------------
-@NAME       : make_gradmag_volumes
-@INPUT      : in_vol1 - description of input dx volume
-              in_vol2 - description of input dy volume
-              in_vol3 - description of input dz volume
-              out_vol - description of output dxyz volume
-@OUTPUT     : (none)
+@NAME       : stream_slices
+@INPUT      : n_in     - number of input volumes
+              in_vols  - input volumes (all with the same geometry)
+              n_out    - number of output volumes
+              out_vols - output volumes (built from the first input)
+              kernel   - function computing all outputs for a run of voxels
+              data     - passed on to kernel
+@OUTPUT     : valid_range - global [min,max] of each output
 @RETURNS    : (none)
-@DESCRIPTION: dxyz = sqrt(dx*dx + dy*dy + dz*dz), on a voxel by voxel basis.
-                this is calculated one slice at a time.
-@METHOD     : 
-@GLOBALS    : 
+@DESCRIPTION: reads a block of slices from every input, calls the kernel
+              once for the whole block so that all of the outputs are
+              computed from a single read of the inputs, then writes the
+              per-slice max/min and the block of each output.
+@METHOD     : blocks hold up to STREAM_BLOCK_BYTES of doubles per volume,
+              so that most volumes go through in a few dozen
+              miicv_get/miicv_put calls instead of one per slice.
+@GLOBALS    : verbose
 @CALLS      : 
-@CREATED    : Wed Jun 30 09:01:51 EST 1993 Louis Collins
+@CREATED    : 
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
-void make_gradmag_volumes(MincVolume *in_vol1, 
-                                 MincVolume *in_vol2, 
-                                 MincVolume *in_vol3, 
-                                 MincVolume *out_vol,
-                                 double *min_val, double *max_val)
+static void stream_slices(int n_in, MincVolume *in_vols[],
+                          int n_out, MincVolume *out_vols[],
+                          Slice_Kernel kernel, void *data,
+                          double valid_range[][2])
 {
-   long in_start[MAX_VAR_DIMS], in_count[MAX_VAR_DIMS], in_end[MAX_VAR_DIMS];
+   long in_start[MAX_VAR_DIMS], in_count[MAX_VAR_DIMS];
    long out_start[MAX_VAR_DIMS], out_count[MAX_VAR_DIMS];
    long mm_start[MAX_VAR_DIMS];   /* VIO_Vector for min/max variables */
-   long nslice, islice;
-   int idim, slice_dim, index, slice_index;
-   double maximum, minimum, valid_range[2];
+   long nslice, islice, slice_size, nblock, n, i;
+   int idim, slice_dim, index, slice_index, ivol;
+   double maximum, minimum;
+   double *in_data[STREAM_MAX_VOLUMES], *out_data[STREAM_MAX_VOLUMES];
    File_Info *ifp,*ofp;
 
    nslice = slice_index = 0;
 
    /* Set pointers to file information */
-   ifp = in_vol1->file;
-   ofp = out_vol->file;
+   ifp = in_vols[0]->file;
+   ofp = out_vols[0]->file;
 
-   /* Set input file start, count and end vectors for reading a volume
-      at a time */
+   /* Set input file start and count vectors for reading a block of
+      slices */
    (void) miset_coords(ifp->ndims, (long) 0, in_start);
    (void) miset_coords(ifp->ndims, (long) 1, in_count);
-   for (idim=0; idim < ifp->ndims; idim++) {
-      in_end[idim] = ifp->nelements[idim];
-   }
    for (idim=0; idim < VOL_NDIMS; idim++) {
       index = ifp->indices[idim];
       in_count[index] = ifp->nelements[index];
@@ -1098,6 +1123,7 @@ void make_gradmag_volumes(MincVolume *in_vol1,
    /* Set output file count for writing a slice and get the number of 
       output slices */
    (void) miset_coords(ifp->ndims, (long) 1, out_count);
+   slice_size = 1;
    for (idim=0; idim < VOL_NDIMS; idim++) {
       index = ofp->indices[idim];
       if (idim==0) {
@@ -1106,14 +1132,23 @@ void make_gradmag_volumes(MincVolume *in_vol1,
       }
       else {
          out_count[index] = ofp->nelements[index];
+         slice_size *= ofp->nelements[index];
       }
    }
 
    slice_dim = ifp->ndims - 3;
 
-   /* Initialize global max and min */
-   valid_range[0] =  DBL_MAX;
-   valid_range[1] = -DBL_MAX;
+   nblock = STREAM_BLOCK_BYTES / (slice_size * (long)sizeof(double));
+   if (nblock < 1) nblock = 1;
+   if (nblock > nslice) nblock = nslice;
+
+   for (ivol=0; ivol < n_in; ivol++)
+      in_data[ivol]  = MALLOC((size_t) nblock * slice_size * sizeof(double));
+   for (ivol=0; ivol < n_out; ivol++) {
+      out_data[ivol] = MALLOC((size_t) nblock * slice_size * sizeof(double));
+      valid_range[ivol][0] =  DBL_MAX;
+      valid_range[ivol][1] = -DBL_MAX;
+   }
 
    /* Print log message */
    if (verbose) {
@@ -1121,56 +1156,67 @@ void make_gradmag_volumes(MincVolume *in_vol1,
       (void) fflush(stderr);
    }
 
-
    /* Copy the start vector */
    for (idim=0; idim < ifp->ndims; idim++)
      out_start[idim] = in_start[idim];
    
-   /* Loop over slices */
-   for (islice=0; islice < nslice; islice++) {
-     
+   /* Loop over blocks of slices */
+   for (islice=0; islice < nslice; islice += nblock) {
+
+     n = nslice - islice;
+     if (n > nblock) n = nblock;
+
+     /* Read in the block from each volume */
+     in_start[slice_dim] = islice;
+     in_count[slice_dim] = n;
+     for (ivol=0; ivol < n_in; ivol++)
+       (void) miicv_get(in_vols[ivol]->file->icvid, in_start, in_count, 
+                        in_data[ivol]); 
+
+     /* Compute every output */
+     (*kernel)(n * slice_size, in_data, out_data, data);
+
+     for (ivol=0; ivol < n_out; ivol++) {
+       ofp = out_vols[ivol]->file;
+
+       /* Write the max and min of each slice */
+       for (i=0; i<n; i++) {
+
+         get_slice_range(out_data[ivol] + i*slice_size, slice_size,
+                         &minimum, &maximum);
+
+         /* Update global max and min */
+         if (maximum > valid_range[ivol][1]) valid_range[ivol][1] = maximum;
+         if (minimum < valid_range[ivol][0]) valid_range[ivol][0] = minimum;
+
+         out_start[slice_index] = islice + i;
+         (void) mivarput1(ofp->mincid, ofp->maxid, 
+                          mitranslate_coords(ofp->mincid, 
+                                             ofp->imgid, out_start,
+                                             ofp->maxid, mm_start),
+                          NC_DOUBLE, NULL, &maximum);
+         (void) mivarput1(ofp->mincid, ofp->minid, 
+                          mitranslate_coords(ofp->mincid, 
+                                             ofp->imgid, out_start,
+                                             ofp->minid, mm_start),
+                          NC_DOUBLE, NULL, &minimum);
+       }
+
+       /* and the block */
+       out_start[slice_index] = islice;
+       out_count[slice_index] = n;
+       (void) miicv_put(ofp->icvid, out_start, out_count, out_data[ivol]);
+       out_count[slice_index] = 1;
+     }
+
      /* Print log message */
      if (verbose) {
-       (void) fprintf(stderr, ".");
+       for (i=0; i<n; i++)
+         (void) fprintf(stderr, ".");
        (void) fflush(stderr);
      }
-     
-     /* Read in one slice from each volume */
-     in_start[slice_dim] = islice;
-     in_count[slice_dim] = 1;
-     
-     (void) miicv_get(in_vol1->file->icvid, in_start, in_count, in_vol1->slice->data); 
-     (void) miicv_get(in_vol2->file->icvid, in_start, in_count, in_vol2->slice->data); 
-     (void) miicv_get(in_vol3->file->icvid, in_start, in_count, in_vol3->slice->data); 
-     
-     /* Set slice number in out_start */
-     out_start[slice_index] = islice;
-     
-     /* Get the slice */
-     
-     get_mag_slice(out_vol->slice, in_vol1->slice, in_vol2->slice, in_vol3->slice, 
-                   &minimum, &maximum);
 
-     /* Update global max and min */
-     if (maximum > valid_range[1]) valid_range[1] = maximum;
-     if (minimum < valid_range[0]) valid_range[0] = minimum;
-     
-     /* Write the max, min and slice */
-     (void) mivarput1(ofp->mincid, ofp->maxid, 
-                      mitranslate_coords(ofp->mincid, 
-                                         ofp->imgid, out_start,
-                                         ofp->maxid, mm_start),
-                      NC_DOUBLE, NULL, &maximum);
-     (void) mivarput1(ofp->mincid, ofp->minid, 
-                      mitranslate_coords(ofp->mincid, 
-                                         ofp->imgid, out_start,
-                                         ofp->minid, mm_start),
-                      NC_DOUBLE, NULL, &minimum);
-     (void) miicv_put(ofp->icvid, out_start, out_count,
-                      out_vol->slice->data);
-     
-   }    /* End loop over slices */
-   
+   }    /* End loop over blocks */
    
    /* Print end of log message */
    if (verbose) {
@@ -1179,17 +1225,37 @@ void make_gradmag_volumes(MincVolume *in_vol1,
    }
 
    /* If output volume is floating point, write out global max and min */
-   if ((ofp->datatype == NC_FLOAT) || (ofp->datatype == NC_DOUBLE)) {
-      (void) ncattput(ofp->mincid, ofp->imgid, MIvalid_range, 
-                      NC_DOUBLE, 2, valid_range);
+   for (ivol=0; ivol < n_out; ivol++) {
+     ofp = out_vols[ivol]->file;
+     if ((ofp->datatype == NC_FLOAT) || (ofp->datatype == NC_DOUBLE)) {
+       (void) ncattput(ofp->mincid, ofp->imgid, MIvalid_range, 
+                       NC_DOUBLE, 2, valid_range[ivol]);
+     }
    }
 
-   *min_val = valid_range[0]; 
-   *max_val = valid_range[1];
+   for (ivol=0; ivol < n_in; ivol++)  FREE(in_data[ivol]);
+   for (ivol=0; ivol < n_out; ivol++) FREE(out_data[ivol]);
+}
+
+/* kernel data for make_curvature_volumes */
+
+typedef struct {
+  double thresh;
+} Curvature_Data;
 
+static void gradmag_kernel(long n, double *in[], double *out[], void *data)
+{
+  get_mag_values(n, in[0], in[1], in[2], out[0]);
 }
+
+static void curvature_kernel(long n, double *in[], double *out[], void *data)
+{
+  get_curvature_values(n, in[0], in[1], in[2], in[3], in[4], in[5],
+                       ((Curvature_Data *)data)->thresh, out[0]);
+}
+
 /* ----------------------------- MNI Header -----------------------------------
-@NAME       : make_curvature_volumes
+@NAME       : make_gradmag_volumes
 @INPUT      : in_vol1 - description of input dx volume
               in_vol2 - description of input dy volume
               in_vol3 - description of input dz volume
@@ -1197,10 +1263,49 @@ void make_gradmag_volumes(MincVolume *in_vol1,
 @OUTPUT     : (none)
 @RETURNS    : (none)
 @DESCRIPTION: dxyz = sqrt(dx*dx + dy*dy + dz*dz), on a voxel by voxel basis.
-                this is calculated one slice at a time.
+                this is calculated a block of slices at a time.
 @METHOD     : 
 @GLOBALS    : 
-@CALLS      : 
+@CALLS      : stream_slices
+@CREATED    : Wed Jun 30 09:01:51 EST 1993 Louis Collins
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void make_gradmag_volumes(MincVolume *in_vol1, 
+                                 MincVolume *in_vol2, 
+                                 MincVolume *in_vol3, 
+                                 MincVolume *out_vol,
+                                 double *min_val, double *max_val)
+{
+   MincVolume *in_vols[3], *out_vols[1];
+   double valid_range[1][2];
+
+   in_vols[0] = in_vol1;
+   in_vols[1] = in_vol2;
+   in_vols[2] = in_vol3;
+   out_vols[0] = out_vol;
+
+   stream_slices(3, in_vols, 1, out_vols, gradmag_kernel, NULL, valid_range);
+
+   *min_val = valid_range[0][0]; 
+   *max_val = valid_range[0][1];
+
+}
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : make_curvature_volumes
+@INPUT      : in_vol1 - description of input dx volume
+              in_vol2 - description of input dy volume
+              in_vol3 - description of input dz volume
+              in_volxx,in_volyy,in_volzz - input dxx, dyy, dzz volumes
+              out_vol - description of output gcur volume
+              thresh  - gradient magnitude below which gcur = 0
+@OUTPUT     : (none)
+@RETURNS    : (none)
+@DESCRIPTION: gaussian curvature (see get_curvature_slice), on a voxel by
+                voxel basis.  this is calculated a block of slices at a
+                time.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : stream_slices
 @CREATED    : Wed Jun 30 09:01:51 EST 1993 Louis Collins
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
@@ -1213,127 +1318,132 @@ void make_curvature_volumes(MincVolume *in_vol1,
                                    MincVolume *out_vol,
                                    double thresh)
 {
-   long in_start[MAX_VAR_DIMS], in_count[MAX_VAR_DIMS], in_end[MAX_VAR_DIMS];
-   long out_start[MAX_VAR_DIMS], out_count[MAX_VAR_DIMS];
-   long mm_start[MAX_VAR_DIMS];   /* VIO_Vector for min/max variables */
-   long nslice, islice;
-   int idim, slice_dim, index, slice_index;
-   double maximum, minimum, valid_range[2];
-   File_Info *ifp,*ofp;
+   MincVolume *in_vols[6], *out_vols[1];
+   double valid_range[1][2];
+   Curvature_Data curvature;
 
-   nslice = slice_index = 0;
+   in_vols[0] = in_vol1;
+   in_vols[1] = in_vol2;
+   in_vols[2] = in_vol3;
+   in_vols[3] = in_volxx;
+   in_vols[4] = in_volyy;
+   in_vols[5] = in_volzz;
+   out_vols[0] = out_vol;
 
-   /* Set pointers to file information */
-   ifp = in_vol1->file;
-   ofp = out_vol->file;
+   curvature.thresh = thresh;
 
-   /* Set input file start, count and end vectors for reading a volume
-      at a time */
-   (void) miset_coords(ifp->ndims, (long) 0, in_start);
-   (void) miset_coords(ifp->ndims, (long) 1, in_count);
-   for (idim=0; idim < ifp->ndims; idim++) {
-      in_end[idim] = ifp->nelements[idim];
-   }
-   for (idim=0; idim < VOL_NDIMS; idim++) {
-      index = ifp->indices[idim];
-      in_count[index] = ifp->nelements[index];
-   }
+   stream_slices(6, in_vols, 1, out_vols, curvature_kernel, &curvature, 
+                 valid_range);
 
-   /* Set output file count for writing a slice and get the number of 
-      output slices */
-   (void) miset_coords(ifp->ndims, (long) 1, out_count);
-   for (idim=0; idim < VOL_NDIMS; idim++) {
-      index = ofp->indices[idim];
-      if (idim==0) {
-         slice_index = index;
-         nslice = ofp->nelements[index];
-      }
-      else {
-         out_count[index] = ofp->nelements[index];
-      }
-   }
+}
 
-   slice_dim = ifp->ndims - 3;
 
-   /* Initialize global max and min */
-   valid_range[0] =  DBL_MAX;
-   valid_range[1] = -DBL_MAX;
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_slice_range
+@INPUT      : values - data of one slice
+              n      - number of values
+@OUTPUT     : minimum - slice minimum
+              maximum - slice maximum
+@RETURNS    : (none)
+@DESCRIPTION: min and max of a slice, widened so that max > min as
+              needed for the MIimagemax/min of the slice.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void get_slice_range(double *values, long n,
+                            double *minimum, double *maximum)
+{
+   long i;
+   double lo, hi;
+
+   lo =  DBL_MAX;
+   hi = -DBL_MAX;
 
-   /* Print log message */
-   if (verbose) {
-      (void) fprintf(stderr, "Transforming slices:");
-      (void) fflush(stderr);
+   for (i=0; i<n; i++) {
+     if (values[i] > hi) hi = values[i];
+     if (values[i] < lo) lo = values[i];
    }
 
+   *minimum = lo;
+   *maximum = hi;
 
-   /* Copy the start vector */
-   for (idim=0; idim < ifp->ndims; idim++)
-     out_start[idim] = in_start[idim];
-   
-   /* Loop over slices */
-   for (islice=0; islice < nslice; islice++) {
-     
-     /* Print log message */
-     if (verbose) {
-       (void) fprintf(stderr, ".");
-       (void) fflush(stderr);
-     }
-     
-     /* Read in one slice from each volume */
-     in_start[slice_dim] = islice;
-     in_count[slice_dim] = 1;
-     
-     (void) miicv_get(in_vol1->file->icvid, in_start, in_count, in_vol1->slice->data); 
-     (void) miicv_get(in_vol2->file->icvid, in_start, in_count, in_vol2->slice->data); 
-     (void) miicv_get(in_vol3->file->icvid, in_start, in_count, in_vol3->slice->data); 
-     (void) miicv_get(in_volxx->file->icvid, in_start, in_count, in_volxx->slice->data); 
-     (void) miicv_get(in_volyy->file->icvid, in_start, in_count, in_volyy->slice->data); 
-     (void) miicv_get(in_volzz->file->icvid, in_start, in_count, in_volzz->slice->data); 
-     
-     /* Set slice number in out_start */
-     out_start[slice_index] = islice;
-     
-     /* Get the slice */
-     
-     get_curvature_slice(out_vol->slice, in_vol1->slice, in_vol2->slice, in_vol3->slice, 
-                         in_volxx->slice, in_volyy->slice, in_volzz->slice, 
-                         thresh,&minimum, &maximum);
-     
-     /* Update global max and min */
-     if (maximum > valid_range[1]) valid_range[1] = maximum;
-     if (minimum > valid_range[0]) valid_range[0] = minimum;
-     
-     /* Write the max, min and slice */
-     (void) mivarput1(ofp->mincid, ofp->maxid, 
-                      mitranslate_coords(ofp->mincid, 
-                                         ofp->imgid, out_start,
-                                         ofp->maxid, mm_start),
-                      NC_DOUBLE, NULL, &maximum);
-     (void) mivarput1(ofp->mincid, ofp->minid, 
-                      mitranslate_coords(ofp->mincid, 
-                                         ofp->imgid, out_start,
-                                         ofp->minid, mm_start),
-                      NC_DOUBLE, NULL, &minimum);
-     (void) miicv_put(ofp->icvid, out_start, out_count,
-                      out_vol->slice->data);
-     
-   }    /* End loop over slices */
-   
-   
-   /* Print end of log message */
-   if (verbose) {
-      (void) fprintf(stderr, "Done\n");
-      (void) fflush(stderr);
+   if ((*maximum == -DBL_MAX) && (*minimum ==  DBL_MAX)) {
+     *minimum = 0.0;
+     *maximum = SMALL_VALUE;
    }
-
-   /* If output volume is floating point, write out global max and min */
-   if ((ofp->datatype == NC_FLOAT) || (ofp->datatype == NC_DOUBLE)) {
-      (void) ncattput(ofp->mincid, ofp->imgid, MIvalid_range, 
-                      NC_DOUBLE, 2, valid_range);
+   else if (*maximum <= *minimum) {
+     if (*minimum == 0.0) 
+       *maximum = SMALL_VALUE;
+     else if (*minimum < 0.0)
+       *maximum = 0.0;
+     else
+       *maximum = 2.0 * (*minimum);
    }
+}
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_mag_values
+@INPUT      : n - number of voxels
+              dx, dy, dz - partial derivatives
+@OUTPUT     : result
+@RETURNS    : (none)
+@DESCRIPTION: result = sqrt( dx^2 + dy^2 + dz^2) for each voxel.
+@METHOD     : a flat loop with no branches, which the compiler can
+              vectorize.
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void get_mag_values(long n, 
+                           double *dx, double *dy, double *dz,
+                           double *result)
+{
+   long i;
+
+   for (i=0; i<n; i++)
+     result[i] = sqrt( dx[i]*dx[i] + dy[i]*dy[i] + dz[i]*dz[i] );
 }
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_curvature_values
+@INPUT      : n - number of voxels
+              dx, dy, dz    - 1st partial derivatives
+              dxx, dyy, dzz - 2nd partial derivatives
+              thresh        - gradient magnitude threshold
+@OUTPUT     : result
+@RETURNS    : (none)
+@DESCRIPTION: gaussian curvature for each voxel, see get_curvature_slice.
+@METHOD     : the threshold is applied with a select rather than a
+              branch around the division, so the loop can be vectorized.
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void get_curvature_values(long n, 
+                                 double *dx,  double *dy,  double *dz,
+                                 double *dxx, double *dyy, double *dzz,
+                                 double thresh, double *result)
+{
+   long i;
+   double t, numerator, thresh2;
+
+   thresh2 = thresh*thresh;
+
+   for (i=0; i<n; i++) {
+     t = dx[i]*dx[i] + dy[i]*dy[i] + dz[i]*dz[i];
+
+     numerator = (dx[i]*dx[i]) * dyy[i] * dzz[i] + 
+                 (dy[i]*dy[i]) * dxx[i] * dzz[i] +
+                 (dz[i]*dz[i]) * dxx[i] * dyy[i];
+
+     result[i] = (t < thresh2) ? 0.0 : numerator / (t*t);
+   }
+}
 
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : get_mag_slice
@@ -1357,54 +1467,14 @@ void get_mag_slice(Slice_Data *result,
                           Slice_Data *slice_dz,
                           double *minimum, double *maximum)
 {
-   double *dptr;
-   double *dptr1;
-   double *dptr2;
-   double *dptr3;
-   long irow, icol;
-   
-   /* Get slice and volume pointers */
-   
-   dptr  = result->data;
-   dptr1 = slice_dx->data;
-   dptr2 = slice_dy->data;
-   dptr3 = slice_dz->data;
-
-   *maximum = -DBL_MAX;
-   *minimum =  DBL_MAX;
-
-   for (irow=0; irow < result->size[0]; irow++) {   /* Loop over rows of slice */
-     
-     for (icol=0; icol < result->size[1]; icol++) {      /* Loop over columns */
-       
-       *dptr = sqrt( (*dptr1 * *dptr1) + (*dptr2 * *dptr2) + (*dptr3 * *dptr3) );
-
-       if (*dptr > *maximum) *maximum = *dptr;
-       if (*dptr < *minimum) *minimum = *dptr;
+   long n;
 
-       dptr++;
-       dptr1++;
-       dptr2++;
-       dptr3++;
-       
-     }     /* Loop over columns */
-   }        /* Loop over rows */
+   n = result->size[0] * result->size[1];
 
+   get_mag_values(n, slice_dx->data, slice_dy->data, slice_dz->data,
+                  result->data);
 
-
-   if ((*maximum == -DBL_MAX) && (*minimum ==  DBL_MAX)) {
-     *minimum = 0.0;
-     *maximum = SMALL_VALUE;
-   }
-   else if (*maximum <= *minimum) {
-     if (*minimum == 0.0) 
-       *maximum = SMALL_VALUE;
-     else if (*minimum < 0.0)
-       *maximum = 0.0;
-     else
-       *maximum = 2.0 * (*minimum);
-   }
-
+   get_slice_range(result->data, n, minimum, maximum);
 }
 
 /* ----------------------------- MNI Header -----------------------------------
@@ -1439,67 +1509,14 @@ void get_curvature_slice(Slice_Data *result,
                                 double thresh,
                                 double *minimum, double *maximum)
 {
-   double *dptr;
-   double *dptrx;
-   double *dptry;
-   double *dptrz;
-   double *dptrxx;
-   double *dptryy;
-   double *dptrzz;
-   double t,numerator;
-   long irow, icol;
-   
-   /* Get slice and volume pointers */
-   
-   dptr  = result->data;
-   dptrx = slice_dx->data;  dptry =slice_dy->data;  dptrz =slice_dz->data;
-   dptrxx= slice_dxx->data; dptryy=slice_dyy->data; dptrzz=slice_dzz->data;
-
-   *maximum = -DBL_MAX;
-   *minimum =  DBL_MAX;
-
-   for (irow=0; irow < result->size[0]; irow++) {   /* Loop over rows of slice */
-     
-     for (icol=0; icol < result->size[1]; icol++) {      /* Loop over columns */
-       
-       t = (*dptrx * *dptrx) + (*dptry * *dptry) + (*dptrz * *dptrz);
+   long n;
 
-       if (t < thresh*thresh) {
-         *dptr = 0.0;
-       }
-       else {
-
-         numerator = (*dptrx * *dptrx) * *dptryy * *dptrzz + 
-                     (*dptry * *dptry) * *dptrxx * *dptrzz +
-                     (*dptrz * *dptrz) * *dptrxx * *dptryy;
+   n = result->size[0] * result->size[1];
 
-         *dptr = numerator / (t*t);
-
-       }
-
-       if (*dptr > *maximum) *maximum = *dptr;
-       if (*dptr < *minimum) *minimum = *dptr;
-
-       dptr++;
-       dptrx++;  dptry++;  dptrz++;
-       dptrxx++; dptryy++; dptrzz++;
-       
-     }     /* Loop over columns */
-   }        /* Loop over rows */
-   
-
-   if ((*maximum == -DBL_MAX) && (*minimum ==  DBL_MAX)) {
-     *minimum = 0.0;
-     *maximum = SMALL_VALUE;
-   }
-   else if (*maximum <= *minimum) {
-     if (*minimum == 0.0) 
-       *maximum = SMALL_VALUE;
-     else if (*minimum < 0.0)
-       *maximum = 0.0;
-     else
-       *maximum = 2.0 * (*minimum);
-   }
+   get_curvature_values(n, slice_dx->data, slice_dy->data, slice_dz->data,
+                        slice_dxx->data, slice_dyy->data, slice_dzz->data,
+                        thresh, result->data);
 
+   get_slice_range(result->data, n, minimum, maximum);
 }
 
@@ -175,7 +175,8 @@ int main (int argc, char *argv[] )
     data;
   VIO_Real
     min_value, max_value,
-    step[3];
+    step[3],
+    apodize[3];
   int
     n_dimensions,
     i,
@@ -192,6 +193,7 @@ int main (int argc, char *argv[] )
   debug                = FALSE;
   do_gradient_flag     = FALSE;
   do_partials_flag     = FALSE;
+  slab_memory          = 0;
   infilename           = (char *)NULL;
   output_basename      = (char *)NULL;
   temp_basename        = (char *)NULL;
@@ -236,6 +238,11 @@ int main (int argc, char *argv[] )
     for(i=0; i<3; i++) fwhm_3D[i] = fwhm;
   };                                
 
+  if (slab_memory > 0 && (do_partials_flag || do_gradient_flag)) {
+    print_error_and_line_num ("-slab_memory cannot be used with -gradient or -partial.\n", 
+                 __FILE__, __LINE__);
+  }
+
   /******************************************************************************/
   /*                   set up necessary file names                              */
   /******************************************************************************/
@@ -293,10 +300,17 @@ int main (int argc, char *argv[] )
   /*             create blurred volume first                                    */
   /******************************************************************************/
 
-  status = input_volume(infilename, VIO_N_DIMENSIONS, 
-                        get_default_dim_names( VIO_N_DIMENSIONS ),
-                        NC_UNSPECIFIED, FALSE, 0.0, 0.0, TRUE, 
-                        &data, (minc_input_options *)NULL);
+                                /* when blurring in slabs, only the
+                                   header is needed here */
+  if (slab_memory > 0)
+    status = input_volume_header_only(infilename, VIO_N_DIMENSIONS, 
+                                      get_default_dim_names( VIO_N_DIMENSIONS ),
+                                      &data, (minc_input_options *)NULL);
+  else
+    status = input_volume(infilename, VIO_N_DIMENSIONS, 
+                          get_default_dim_names( VIO_N_DIMENSIONS ),
+                          NC_UNSPECIFIED, FALSE, 0.0, 0.0, TRUE, 
+                          &data, (minc_input_options *)NULL);
   if ( status != VIO_OK )
     print_error_and_line_num("problems reading `%s'.\n",__FILE__, __LINE__,infilename);
 
@@ -312,8 +326,10 @@ int main (int argc, char *argv[] )
             sizes[xyzv[VIO_X]], sizes[xyzv[VIO_Y]], sizes[xyzv[VIO_Z]]);
     printf ( "Input voxels are  = %8.3f %8.3f %8.3f\n", 
             step[xyzv[VIO_X]], step[xyzv[VIO_Y]], step[xyzv[VIO_Z]]);
-    get_volume_real_range(data,&min_value, &max_value);
-    printf ( "min/max value     = %8.3f %8.3f\n", min_value, max_value);
+    if (slab_memory <= 0) {
+      get_volume_real_range(data,&min_value, &max_value);
+      printf ( "min/max value     = %8.3f %8.3f\n", min_value, max_value);
+    }
   }
   
   n_dimensions = get_volume_n_dimensions (data);
@@ -323,7 +339,10 @@ int main (int argc, char *argv[] )
   }
   
                                 /* apodize data if needed */
-  if (apodize_data_flg) {
+  for(i=0; i<3; i++)
+    apodize[i] = apodize_data_flg ? fwhm_3D[i] : 0.0;
+
+  if (apodize_data_flg && slab_memory <= 0) {
     if (debug) print ("Apodizing data at (%f,%f) (%f,%f) (%f,%f)\n",
                       fwhm_3D[0], fwhm_3D[0], fwhm_3D[1], fwhm_3D[1], fwhm_3D[2], fwhm_3D[2] );
     apodize_data(data, xyzv, fwhm_3D[0], fwhm_3D[0], fwhm_3D[1], fwhm_3D[1], fwhm_3D[2], fwhm_3D[2] );
@@ -336,12 +355,19 @@ int main (int argc, char *argv[] )
       fwhm_3D[xyzv[0]] = fwhm_3D[xyzv[1]] = 0;
 
                                 /* now _BLUR_ the DATA! */
-  status = blur3D_volume(data, xyzv,
-                         fwhm_3D[0],fwhm_3D[1],fwhm_3D[2],
-                         infilename,
-                         output_basename,
-                         reals_fp,
-                         kernel_type,history);
+  if (slab_memory > 0) {
+    blur3D_volume_slabs(infilename, output_basename,
+                        fwhm_3D, apodize,
+                        kernel_type, history, slab_memory);
+    status = VIO_OK;
+  }
+  else
+    status = blur3D_volume(data, xyzv,
+                           fwhm_3D[0],fwhm_3D[1],fwhm_3D[2],
+                           infilename,
+                           output_basename,
+                           reals_fp,
+                           kernel_type,history);
 
   /******************************************************************************/
   /*             calculate d/dx,  d/dy and d/dz volumes                         */
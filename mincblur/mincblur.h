@@ -51,6 +51,11 @@ VIO_Status blur3D_volume(VIO_Volume data, int *xyzv,
                             FILE *reals_fp,
                             int kernel_type, char *history);
 
+void blur3D_volume_slabs(char *infile, char *outfile,
+                         double fwhm[], double apodize[],
+                         int kernel_type, char *history,
+                         int memory_mb);
+
 VIO_Status gradient3D_volume(FILE *ifd, 
                                 VIO_Volume data, 
                                 int *xyzv,
@@ -88,7 +93,8 @@ int debug,
   kernel_type,
   dimensions,
   do_gradient_flag,
-  do_partials_flag;
+  do_partials_flag,
+  slab_memory;
 
 
 ArgvInfo argTable[] = {
@@ -117,6 +123,8 @@ ArgvInfo argTable[] = {
      "Create the partial derivative and gradient magnitude volumes as well."},
   {"-no_apodize", ARGV_CONSTANT, (char *) FALSE, (char *) &apodize_data_flg, 
      "Do not apodize the data before blurring."},
+  {"-slab_memory", ARGV_INT, (char *) 1, (char *) &slab_memory,
+     "Blur in slabs, using about this many MB (no -gradient or -partial)."},
   
   {NULL, ARGV_HELP, NULL, NULL,
      "Options for logging progress. Default = -verbose."},
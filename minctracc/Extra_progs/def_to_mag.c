@@ -50,7 +50,9 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include <stdio.h>
 #include <string.h>
 #include <volume_io.h>
+#include <ParseArgv.h>
 #include <Proglib.h>
+#include "def_geometry.h"
 
 /* Constants */
 #ifndef TRUE
@@ -59,9 +61,14 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #endif
 
                                 /* type of job to compute */
-#define JOB_UNDEF 0
-#define JOB_SCALE 1
-#define JOB_MAG   2
+#define JOB_UNDEF        0
+#define JOB_SCALE        1
+#define JOB_MAG          2
+#define JOB_JACOBIAN     3
+#define JOB_LOG_JACOBIAN 4
+#define JOB_STRAIN_MAX   5
+#define JOB_STRAIN_MID   6
+#define JOB_STRAIN_MIN   7
 
                                 /* type of neighbourhood to use */
 #define NEIGHBOUR_6     1
@@ -70,6 +77,11 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 
 static char *my_ZYX_dim_names[] = { MIzspace, MIyspace, MIxspace };
 
+                                /* map of def_geometry.c for each job */
+static int job_map[] = { -1, DEF_MAP_SCALE, DEF_MAP_MAGNITUDE,
+                         DEF_MAP_JACOBIAN, DEF_MAP_LOG_JACOBIAN,
+                         DEF_MAP_STRAIN_MAX, DEF_MAP_STRAIN_MID, DEF_MAP_STRAIN_MIN };
+
 void print_usage_and_exit(char *pname);
 
 void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
@@ -79,10 +91,6 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
                                                  int avg_type,
                                                  VIO_Real *scale);
 
-VIO_BOOL get_magnitude(VIO_General_transform *trans,
-                             int voxel[],
-                             VIO_Real *dist);
-
 
 /* Main program */
 char *prog_name;
@@ -91,6 +99,8 @@ VIO_Real real_range[2];
 int
     neighbour_type,
     job_type,
+    grid_only,
+    n_jobs,
     verbose, 
     clobber_flag,
     debug;
@@ -109,6 +119,20 @@ static ArgvInfo argTable[] = {
      "Use the 5x5x5  neighbours."},
 {"-magnitude",  ARGV_CONSTANT, (char *) JOB_MAG, (char *) &job_type,
      "Compute local def magnitude."},
+{"-jacobian",   ARGV_CONSTANT, (char *) JOB_JACOBIAN, (char *) &job_type,
+     "Compute the determinant of the Jacobian."},
+{"-log_jacobian", ARGV_CONSTANT, (char *) JOB_LOG_JACOBIAN, (char *) &job_type,
+     "Compute the log of the determinant of the Jacobian."},
+{"-strain_max", ARGV_CONSTANT, (char *) JOB_STRAIN_MAX, (char *) &job_type,
+     "Compute the largest principal strain."},
+{"-strain_mid", ARGV_CONSTANT, (char *) JOB_STRAIN_MID, (char *) &job_type,
+     "Compute the middle principal strain."},
+{"-strain_min", ARGV_CONSTANT, (char *) JOB_STRAIN_MIN, (char *) &job_type,
+     "Compute the smallest principal strain."},
+{"-grid_only",  ARGV_CONSTANT, (char *) TRUE,  (char *) &grid_only,
+     "Ignore the linear transformations concatenated with the grid."},
+{"-jobs",       ARGV_INT,      (char *) 0,     (char *) &n_jobs,
+     "Number of worker processes sharing the slices (default 1)."},
 {"-no_clobber", ARGV_CONSTANT, (char *) FALSE, (char *) &clobber_flag,
      "Do not overwrite output file (default)."},
 {"-clobber",    ARGV_CONSTANT, (char *) TRUE,  (char *) &clobber_flag,
@@ -130,6 +154,8 @@ int main(int argc, char *argv[])
        def_volume;
    VIO_General_transform 
        *grid_transform_ptr,def_field;
+   Def_Geometry
+       geom;
    
    VIO_Real
        value,
@@ -138,6 +164,9 @@ int main(int argc, char *argv[])
        new_steps[VIO_MAX_DIMENSIONS],
        start[VIO_MAX_DIMENSIONS],
        new_start[VIO_MAX_DIMENSIONS];
+   float
+       *maps[DEF_MAP_TYPES],
+       *map;
    
    int
        parse_flag,
@@ -148,10 +177,11 @@ int main(int argc, char *argv[])
        new_count[VIO_MAX_DIMENSIONS],
        new_xyzv[VIO_MAX_DIMENSIONS],
        xyzv[VIO_MAX_DIMENSIONS];
+   long
+       n, n_nodes;
    
    char *infile,*outfile;
    
-   VIO_Status status;
    VIO_progress_struct
        progress;
 
@@ -159,9 +189,11 @@ int main(int argc, char *argv[])
    verbose       = TRUE;        /* init some variables */
    clobber_flag  = FALSE;
    debug         = FALSE;
+   grid_only     = FALSE;
+   n_jobs        = 1;
    job_type      = JOB_SCALE;
-   real_range[0] =  0.0;
-   real_range[1] =  3.0;
+   real_range[0] =  0.0;        /* no range given: see below */
+   real_range[1] = -1.0;
    neighbour_type= NEIGHBOUR_6;
    prog_name     = argv[0];
 
@@ -193,13 +225,13 @@ int main(int argc, char *argv[])
    }
 
 
-   for(trans_count=0; trans_count<get_n_concated_transforms(&def_field; trans_count++) ) {
-       
-       grid_transform_ptr = get_nth_general_transform(&def_field, trans_count );
+   def_volume         = (VIO_Volume)NULL;
+   grid_transform_ptr = (VIO_General_transform *)NULL;
 
-       def_volume = (VIO_Volume)NULL;
+   for(trans_count=0; trans_count<get_n_concated_transforms(&def_field); trans_count++ ) {
        
-       if (grid_transform_ptr->type == GRID_TRANSFORM) {
+       if (get_nth_general_transform(&def_field, trans_count)->type == GRID_TRANSFORM) {
+           grid_transform_ptr = get_nth_general_transform(&def_field, trans_count );
            def_volume = grid_transform_ptr->displacement_volume;
        }
    }
@@ -215,6 +247,44 @@ int main(int argc, char *argv[])
    get_volume_sizes(       def_volume, count);
    get_volume_separations( def_volume, steps);
    get_volume_XYZV_indices(def_volume, xyzv);
+
+                                /* everything but the larger scale
+                                   neighbourhoods is computed in a
+                                   single pass over the packed field */
+   map = (float *)NULL;
+   if (job_type != JOB_SCALE || neighbour_type == NEIGHBOUR_6) {
+
+       if (!init_def_geometry(&def_field, !grid_only, &geom)) {
+           (void) fprintf(stderr, "%s: Cannot use transform file %s\n", prog_name, infile);
+           exit(EXIT_FAILURE);
+       }
+
+       n_nodes = (long)geom.n[VIO_X] * geom.n[VIO_Y] * geom.n[VIO_Z];
+       for(i=0; i<DEF_MAP_TYPES; i++)
+           maps[i] = (float *)NULL;
+       ALLOC(map, n_nodes);
+       maps[ job_map[job_type] ] = map;
+
+       (void)compute_def_geometry(&geom, maps, n_jobs);
+
+       if (verbose && geom.n_folded > 0)
+           print ("%ld nodes where the transformation folds (Jacobian <= 0)\n",
+                  geom.n_folded);
+
+                                /* use the range of the map itself */
+       if (real_range[1] < real_range[0] &&
+           job_type != JOB_SCALE && job_type != JOB_MAG) {
+           real_range[0] = real_range[1] = map[0];
+           for(n=1; n<n_nodes; n++) {
+               if (map[n] < real_range[0]) real_range[0] = map[n];
+               if (map[n] > real_range[1]) real_range[1] = map[n];
+           }
+       }
+   }
+   if (real_range[1] < real_range[0]) {
+       real_range[0] = 0.0;
+       real_range[1] = 3.0;
+   }
    
    output_vol = create_volume(3, my_ZYX_dim_names, NC_SHORT, TRUE, 0.0, 0.0);
    get_volume_XYZV_indices(output_vol, new_xyzv);
@@ -223,7 +293,7 @@ int main(int argc, char *argv[])
      new_count[ new_xyzv[i] ] = count[ xyzv[i] ];
      new_steps[ new_xyzv[i] ] = steps[ xyzv[i] ];
    }
-   for(i=0; i<MAX_DIMENSIONS; i++) {
+   for(i=0; i<VIO_MAX_DIMENSIONS; i++) {
      start[i] = 0.0;
      voxel[i] = 0.0;
      new_start[i] = 0.0;
@@ -242,78 +312,61 @@ int main(int argc, char *argv[])
    for(i=0; i<VIO_MAX_DIMENSIONS; i++)
        ind[ xyzv[i] ] = 0;
 
+   if (map != (float *)NULL) {
+                                /* copy the map into the volume */
+       for(ind[xyzv[VIO_X]]=0; ind[xyzv[VIO_X]]<count[xyzv[VIO_X]]; ind[xyzv[VIO_X]]++) 
+           for(ind[xyzv[VIO_Y]]=0; ind[xyzv[VIO_Y]]<count[xyzv[VIO_Y]]; ind[xyzv[VIO_Y]]++) 
+               for(ind[xyzv[VIO_Z]]=0; ind[xyzv[VIO_Z]]<count[xyzv[VIO_Z]]; ind[xyzv[VIO_Z]]++) {
+                   n = DEF_GEOMETRY_INDEX(&geom, ind[xyzv[VIO_X]], ind[xyzv[VIO_Y]], ind[xyzv[VIO_Z]]);
+                   set_volume_real_value(output_vol,
+                                         ind[ xyzv[VIO_Z] ], ind[ xyzv[VIO_Y] ], ind[ xyzv[VIO_X] ], 0, 0,
+                                         (VIO_Real)map[n]);
+               }
+       FREE(map);
+       delete_def_geometry(&geom);
+   }
+   else {
                                 /* init the volume to the default value */
-   switch (job_type) 
-   {
-   case JOB_SCALE:
        value = 1.0;
-       break;
-   case JOB_MAG:
-       value = 0.0;
-       break;
-   case JOB_UNDEF:
-   default:
-       (void) fprintf(stderr,"No default value for job_type=%d\n",job_type);
-       exit( EXIT_FAILURE );
-   }
-   
    
-   for(ind[xyzv[VIO_X]]=0; ind[xyzv[VIO_X]]<count[xyzv[VIO_X]]; ind[xyzv[VIO_X]]++) 
-       for(ind[xyzv[VIO_Y]]=0; ind[xyzv[VIO_Y]]<count[xyzv[VIO_Y]]; ind[xyzv[VIO_Y]]++) 
-           for(ind[xyzv[VIO_Z]]=0; ind[xyzv[VIO_Z]]<count[xyzv[VIO_Z]]; ind[xyzv[VIO_Z]]++) {
-               
-               set_volume_real_value(output_vol,
-                                     ind[ xyzv[VIO_Z] ], ind[ xyzv[VIO_Y] ], ind[ xyzv[VIO_X] ], 0, 0,
-                                     value);
-               
-           }
+       for(ind[xyzv[VIO_X]]=0; ind[xyzv[VIO_X]]<count[xyzv[VIO_X]]; ind[xyzv[VIO_X]]++) 
+           for(ind[xyzv[VIO_Y]]=0; ind[xyzv[VIO_Y]]<count[xyzv[VIO_Y]]; ind[xyzv[VIO_Y]]++) 
+               for(ind[xyzv[VIO_Z]]=0; ind[xyzv[VIO_Z]]<count[xyzv[VIO_Z]]; ind[xyzv[VIO_Z]]++) {
+                   
+                   set_volume_real_value(output_vol,
+                                         ind[ xyzv[VIO_Z] ], ind[ xyzv[VIO_Y] ], ind[ xyzv[VIO_X] ], 0, 0,
+                                         value);
+                   
+               }
    
                                 /* now compute the scale factor */
    
-   if (verbose) initialize_progress_report(&progress, FALSE, 
-                                           (count[xyzv[VIO_X]]-2)*(count[xyzv[VIO_Y]]-2)*(count[xyzv[VIO_Z]]-2) + 1,
-                                           "Computing");
+       if (verbose) initialize_progress_report(&progress, FALSE, 
+                                               (count[xyzv[VIO_X]]-2)*(count[xyzv[VIO_Y]]-2)*(count[xyzv[VIO_Z]]-2) + 1,
+                                               "Computing");
 
-   counter = 0;
+       counter = 0;
    
-   for(ind[xyzv[VIO_X]]=1; ind[xyzv[VIO_X]]<count[xyzv[VIO_X]]-1; ind[xyzv[VIO_X]]++) 
-      for(ind[xyzv[VIO_Y]]=1; ind[xyzv[VIO_Y]]<count[xyzv[VIO_Y]]-1; ind[xyzv[VIO_Y]]++) 
-         for(ind[xyzv[VIO_Z]]=1; ind[xyzv[VIO_Z]]<count[xyzv[VIO_Z]]-1; ind[xyzv[VIO_Z]]++) {
+       for(ind[xyzv[VIO_X]]=1; ind[xyzv[VIO_X]]<count[xyzv[VIO_X]]-1; ind[xyzv[VIO_X]]++) 
+          for(ind[xyzv[VIO_Y]]=1; ind[xyzv[VIO_Y]]<count[xyzv[VIO_Y]]-1; ind[xyzv[VIO_Y]]++) 
+             for(ind[xyzv[VIO_Z]]=1; ind[xyzv[VIO_Z]]<count[xyzv[VIO_Z]]-1; ind[xyzv[VIO_Z]]++) {
             
+                if (get_average_scale_from_neighbours(grid_transform_ptr,
+                                                      ind, neighbour_type, 
+                                                      &value)) {
+                   set_volume_real_value(output_vol,
+                                         ind[ xyzv[VIO_Z] ], ind[ xyzv[VIO_Y] ], ind[ xyzv[VIO_X] ], 
+                                         0, 0,
+                                         value);
+                }
+                counter++;
             
-            switch (job_type) {
-               case JOB_SCALE:
-               if (get_average_scale_from_neighbours(grid_transform_ptr,
-                                                     ind, neighbour_type, 
-                                                     &value)) {
-                  set_volume_real_value(output_vol,
-                                        ind[ xyzv[VIO_Z] ], ind[ xyzv[VIO_Y] ], ind[ xyzv[VIO_X] ], 
-                                        0, 0,
-                                        value);
-               }
-               break;
-               case JOB_MAG:
-               if (get_magnitude(grid_transform_ptr,
-                                 ind, &value)) {
-                  set_volume_real_value(output_vol,
-                                        ind[ xyzv[VIO_Z] ], ind[ xyzv[VIO_Y] ], ind[ xyzv[VIO_X] ], 
-                                        0, 0,
-                                        value);
-               }
-               break;
-               case JOB_UNDEF:
-               default:
-               (void) fprintf(stderr,"No default value for job_type=%d\n",job_type);
-               exit( EXIT_FAILURE );
-            }
-            counter++;
-            
-            if (verbose)         update_progress_report( &progress, counter );
+                if (verbose)         update_progress_report( &progress, counter );
             
-         }
-
-   if (verbose) terminate_progress_report(&progress);
+             }
 
+       if (verbose) terminate_progress_report(&progress);
+   }
    
    
    if (output_volume(outfile, NC_UNSPECIFIED, FALSE, 0.0, 0.0,
@@ -351,13 +404,13 @@ void get_volume_XYZV_indices(VIO_Volume data, int xyzv[])
   vol_dims       = get_volume_n_dimensions(data);
   data_dim_names = get_volume_dimension_names(data);
 
-  for(i=0; i<N_DIMENSIONS+1; i++) xyzv[i] = -1;
+  for(i=0; i<VIO_N_DIMENSIONS+1; i++) xyzv[i] = -1;
   for(i=0; i<vol_dims; i++) {
     if (convert_dim_name_to_spatial_axis(data_dim_names[i], &axis )) {
       xyzv[axis] = i; 
     } 
     else {     /* not a spatial axis */
-      xyzv[Z+1] = i;
+      xyzv[VIO_Z+1] = i;
     }
   }
   delete_dimension_names(data,data_dim_names);
@@ -412,7 +465,7 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
     }
   }
   
-  for(i=0; i<MAX_DIMENSIONS; i++) { /* copy the voxel position */
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) { /* copy the voxel position */
     voxel2[i] = voxel[i];
   }
   
@@ -420,8 +473,8 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
   for(i=0; i<VIO_MAX_DIMENSIONS; i++) R_voxel[i] = voxel[i];
   convert_voxel_to_world(volume, R_voxel, &cbx, &cby, &cbz);
 
-  for(voxel2[xyzv[Z+1]]=0; voxel2[xyzv[Z+1]]<sizes[xyzv[Z+1]]; voxel2[xyzv[Z+1]]++) {
-      def_vector[voxel2[ xyzv[Z+1] ]] = 
+  for(voxel2[xyzv[VIO_Z+1]]=0; voxel2[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; voxel2[xyzv[VIO_Z+1]]++) {
+      def_vector[voxel2[ xyzv[VIO_Z+1] ]] = 
           get_volume_real_value(volume,
                                 voxel2[0],voxel2[1],voxel2[2],voxel2[3],voxel2[4]);
   }
@@ -442,8 +495,8 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
               
               voxel2[ xyzv[i] ] = voxel[ xyzv[i] ] + 1;
               
-              for(voxel2[xyzv[Z+1]]=0; voxel2[xyzv[Z+1]]<sizes[xyzv[Z+1]]; voxel2[xyzv[Z+1]]++) {
-                  def_vector[voxel2[ xyzv[Z+1] ]] = 
+              for(voxel2[xyzv[VIO_Z+1]]=0; voxel2[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; voxel2[xyzv[VIO_Z+1]]++) {
+                  def_vector[voxel2[ xyzv[VIO_Z+1] ]] = 
                       get_volume_real_value(volume,
                                             voxel2[0],voxel2[1],voxel2[2],voxel2[3],voxel2[4]);
               }
@@ -473,8 +526,8 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
           if ((voxel[ xyzv[i] ]-1) >= 0) {
               voxel2[ xyzv[i] ] = voxel[ xyzv[i] ] - 1;
               
-              for(voxel2[xyzv[Z+1]]=0; voxel2[xyzv[Z+1]]<sizes[xyzv[Z+1]]; voxel2[xyzv[Z+1]]++) {
-                  def_vector[voxel2[ xyzv[Z+1] ]] = 
+              for(voxel2[xyzv[VIO_Z+1]]=0; voxel2[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; voxel2[xyzv[VIO_Z+1]]++) {
+                  def_vector[voxel2[ xyzv[VIO_Z+1] ]] = 
                       get_volume_real_value(volume,
                                             voxel2[0],voxel2[1],voxel2[2],voxel2[3],voxel2[4]);
               }
@@ -521,8 +574,8 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
           if ((voxel2[ xyzv[VIO_X]] != voxel[ xyzv[VIO_X] ]) ||
               (voxel2[ xyzv[VIO_Y]] != voxel[ xyzv[VIO_Y] ]) ||
               (voxel2[ xyzv[VIO_Z]] != voxel[ xyzv[VIO_Z] ])) {
-            for(voxel2[xyzv[Z+1]]=0; voxel2[xyzv[Z+1]]<sizes[xyzv[Z+1]]; voxel2[xyzv[Z+1]]++) {
-              def_vector[voxel2[ xyzv[Z+1] ]] = 
+            for(voxel2[xyzv[VIO_Z+1]]=0; voxel2[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; voxel2[xyzv[VIO_Z+1]]++) {
+              def_vector[voxel2[ xyzv[VIO_Z+1] ]] = 
                 get_volume_real_value(volume,
                                       voxel2[0],voxel2[1],voxel2[2],voxel2[3],voxel2[4]);
             }
@@ -563,8 +616,8 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
               (voxel2[ xyzv[VIO_Y]] != voxel[ xyzv[VIO_Y] ]) ||
               (voxel2[ xyzv[VIO_Z]] != voxel[ xyzv[VIO_Z] ])) {
 
-            for(voxel2[xyzv[Z+1]]=0; voxel2[xyzv[Z+1]]<sizes[xyzv[Z+1]]; voxel2[xyzv[Z+1]]++) {
-              def_vector[voxel2[ xyzv[Z+1] ]] = 
+            for(voxel2[xyzv[VIO_Z+1]]=0; voxel2[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; voxel2[xyzv[VIO_Z+1]]++) {
+              def_vector[voxel2[ xyzv[VIO_Z+1] ]] = 
                 get_volume_real_value(volume,
                                       voxel2[0],voxel2[1],voxel2[2],voxel2[3],voxel2[4]);
             }
@@ -601,55 +654,3 @@ VIO_BOOL get_average_scale_from_neighbours(VIO_General_transform *trans,
     return(FALSE);
   }
 }
-
-
-VIO_BOOL get_magnitude(VIO_General_transform *trans,
-                             int voxel[],
-                             VIO_Real *dist)
-{
-  int
-    start[VIO_MAX_DIMENSIONS],
-    end[VIO_MAX_DIMENSIONS],
-    count, i, 
-    voxel2[VIO_MAX_DIMENSIONS],
-    xyzv[VIO_MAX_DIMENSIONS],
-    sizes[VIO_MAX_DIMENSIONS];
-  VIO_Real 
-      seps[VIO_MAX_DIMENSIONS],
-      def_vector[VIO_N_DIMENSIONS];
-  VIO_Volume volume;
-  
-  if (trans->type != GRID_TRANSFORM) {
-    print_error_and_line_num("get_magnitude not called with GRID_TRANSFORM",
-                             __FILE__, __LINE__);
-    return (FALSE);
-  }
-
-  volume = trans->displacement_volume;
-  
-  get_volume_sizes(volume, sizes);
-  get_volume_separations(volume, seps);
-  get_volume_XYZV_indices(volume, xyzv);
-  count = 0;
-
-                                /* make sure voxel is in volume */
-  for(i=0; i<3; i++) {
-    if (voxel[ xyzv[i]]<0 || voxel[ xyzv[i] ]>=sizes[ xyzv[i]] ) {
-       return (FALSE);
-    }
-  }
-  
-  
-  for(voxel[xyzv[Z+1]]=0; voxel[xyzv[Z+1]]<sizes[xyzv[Z+1]]; voxel[xyzv[Z+1]]++) {
-     def_vector[voxel[ xyzv[Z+1] ]] = 
-        get_volume_real_value(volume,
-                              voxel[0],voxel[1],voxel[2],voxel[3],voxel[4]);
-  }
-  *dist = sqrt ((def_vector[VIO_X]*def_vector[VIO_X]) + 
-                (def_vector[VIO_Y]*def_vector[VIO_Y]) + 
-                (def_vector[VIO_Z]*def_vector[VIO_Z]));
-  return(TRUE);
-
-}
-
-
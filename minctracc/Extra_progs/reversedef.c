@@ -55,8 +55,17 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <volume_io.h>
 #include <ParseArgv.h>
+#include <Proglib.h>
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  REVERSEDEF_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 /* Constants */
 #ifndef TRUE
@@ -109,6 +118,487 @@ void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]){
     VIO_Real                *z_transformed );
 
 
+/*
+   The inverse is found independently at every voxel of the result,
+   by solving  x + d(x) = w  for x with Newton steps, where d() is the
+   forward displacement.  The steps are taken on a trilinear copy of
+   the forward grid, packed into float arrays, and each voxel starts
+   from the inverse found at its neighbour, so that only a few
+   iterations are needed.  The answer is then polished against the
+   real forward transform (grid_transform_point), and any voxel that
+   still does not meet the tolerance is handed to
+   grid_inverse_transform_point(), as before.
+
+   The slices along X are inverted independently (each one starts
+   from a zero guess), so with -jobs n they are shared among n worker
+   processes: worker w inverts the slices w, w+n, ... and sends each
+   one back through a pipe.  Slices whose worker could not be started,
+   or failed, are inverted by the parent, and the result does not
+   depend on n.
+*/
+
+typedef struct {
+  int      n[VIO_N_DIMENSIONS];        /* sizes along X, Y and Z           */
+  float    *d[VIO_N_DIMENSIONS];       /* displacement components          */
+  VIO_Real A[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS],
+           b[VIO_N_DIMENSIONS];        /* voxel = A * world + b            */
+} Packed_Grid;
+
+#define GRID_INDEX(g,i,j,k) ( ((long)(i)*(g)->n[1] + (j))*(g)->n[2] + (k) )
+
+static VIO_BOOL pack_grid(VIO_Volume vol, Packed_Grid *grid)
+{
+  int
+    xyzv[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS],
+    index[VIO_MAX_DIMENSIONS],
+    i,j,c;
+  VIO_Real
+    voxel0[VIO_MAX_DIMENSIONS],
+    voxel[VIO_MAX_DIMENSIONS],
+    world[VIO_N_DIMENSIONS];
+  long
+    n;
+
+  get_volume_XYZV_indices(vol, xyzv);
+  get_volume_sizes(vol, sizes);
+
+  if (get_volume_n_dimensions(vol) != 4 || xyzv[VIO_Z+1] < 0)
+    return(FALSE);
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    if (xyzv[i] < 0 || sizes[xyzv[i]] < 2)
+      return(FALSE);
+    grid->n[i] = sizes[xyzv[i]];
+  }
+                                /* world to voxel is affine, so three
+                                   columns and an offset are enough */
+  convert_world_to_voxel(vol, 0.0, 0.0, 0.0, voxel0);
+  for(j=VIO_X; j<=VIO_Z; j++) {
+    for(i=VIO_X; i<=VIO_Z; i++) world[i] = (i==j) ? 1.0 : 0.0;
+    convert_world_to_voxel(vol, world[VIO_X], world[VIO_Y], world[VIO_Z], voxel);
+    for(i=VIO_X; i<=VIO_Z; i++)
+      grid->A[i][j] = voxel[xyzv[i]] - voxel0[xyzv[i]];
+  }
+  for(i=VIO_X; i<=VIO_Z; i++)
+    grid->b[i] = voxel0[xyzv[i]];
+
+  n = (long)grid->n[0] * grid->n[1] * grid->n[2];
+  for(c=VIO_X; c<=VIO_Z; c++)
+    ALLOC(grid->d[c], n);
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i] = 0;
+  for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<grid->n[VIO_X]; index[xyzv[VIO_X]]++)
+    for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<grid->n[VIO_Y]; index[xyzv[VIO_Y]]++)
+      for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<grid->n[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        n = GRID_INDEX(grid, index[xyzv[VIO_X]], index[xyzv[VIO_Y]], index[xyzv[VIO_Z]]);
+        for(c=VIO_X; c<=VIO_Z; c++) {
+          index[xyzv[VIO_Z+1]] = c;
+          grid->d[c][n] = (float)get_volume_real_value(vol,
+                                    index[0],index[1],index[2],index[3],index[4]);
+        }
+        index[xyzv[VIO_Z+1]] = 0;
+      }
+
+  return(TRUE);
+}
+
+static void delete_packed_grid(Packed_Grid *grid)
+{
+  int c;
+  for(c=VIO_X; c<=VIO_Z; c++)
+    FREE(grid->d[c]);
+}
+
+/* trilinear displacement at world point w, and its derivatives with
+   respect to the world coordinates, jac[component][axis].  Outside
+   the grid, the displacement is zero. */
+
+static void trilinear_displacement(Packed_Grid *grid, VIO_Real w[],
+                                   VIO_Real d[], VIO_Real jac[][VIO_N_DIMENSIONS])
+{
+  VIO_Real
+    v[VIO_N_DIMENSIONS], f[VIO_N_DIMENSIONS], dv[VIO_N_DIMENSIONS],
+    c000,c001,c010,c011,c100,c101,c110,c111,
+    c00,c01,c10,c11,c0,c1;
+  int
+    i,j,c,
+    p[VIO_N_DIMENSIONS];
+  float
+    *g;
+
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    d[i] = 0.0;
+    for(j=VIO_X; j<=VIO_Z; j++) jac[i][j] = 0.0;
+  }
+
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    v[i] = grid->b[i] + grid->A[i][VIO_X]*w[VIO_X] +
+           grid->A[i][VIO_Y]*w[VIO_Y] + grid->A[i][VIO_Z]*w[VIO_Z];
+    if (v[i] < 0.0 || v[i] > (VIO_Real)(grid->n[i]-1))
+      return;
+    p[i] = (int)v[i];
+    if (p[i] > grid->n[i]-2) p[i] = grid->n[i]-2;
+    f[i] = v[i] - p[i];
+  }
+
+  for(c=VIO_X; c<=VIO_Z; c++) {
+    g = grid->d[c];
+    c000 = g[GRID_INDEX(grid, p[0],  p[1],  p[2]  )];
+    c001 = g[GRID_INDEX(grid, p[0],  p[1],  p[2]+1)];
+    c010 = g[GRID_INDEX(grid, p[0],  p[1]+1,p[2]  )];
+    c011 = g[GRID_INDEX(grid, p[0],  p[1]+1,p[2]+1)];
+    c100 = g[GRID_INDEX(grid, p[0]+1,p[1],  p[2]  )];
+    c101 = g[GRID_INDEX(grid, p[0]+1,p[1],  p[2]+1)];
+    c110 = g[GRID_INDEX(grid, p[0]+1,p[1]+1,p[2]  )];
+    c111 = g[GRID_INDEX(grid, p[0]+1,p[1]+1,p[2]+1)];
+
+    c00 = c000 + f[2]*(c001-c000);
+    c01 = c010 + f[2]*(c011-c010);
+    c10 = c100 + f[2]*(c101-c100);
+    c11 = c110 + f[2]*(c111-c110);
+    c0  = c00  + f[1]*(c01-c00);
+    c1  = c10  + f[1]*(c11-c10);
+
+    d[c]  = c0 + f[0]*(c1-c0);
+
+    dv[0] = c1 - c0;
+    dv[1] = (1.0-f[0])*(c01-c00) + f[0]*(c11-c10);
+    dv[2] = (1.0-f[0])*((1.0-f[1])*(c001-c000) + f[1]*(c011-c010)) +
+                 f[0] *((1.0-f[1])*(c101-c100) + f[1]*(c111-c110));
+
+    for(j=VIO_X; j<=VIO_Z; j++)
+      jac[c][j] = dv[0]*grid->A[0][j] + dv[1]*grid->A[1][j] + dv[2]*grid->A[2][j];
+  }
+}
+
+/* solve (I + jac) step = r.  Where the forward warp folds or nearly
+   so, fall back on a plain fixed-point step (step = r). */
+
+static void newton_step(VIO_Real jac[][VIO_N_DIMENSIONS], VIO_Real r[], VIO_Real step[])
+{
+  VIO_Real
+    m[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS], det;
+  int
+    i,j;
+
+  for(i=VIO_X; i<=VIO_Z; i++)
+    for(j=VIO_X; j<=VIO_Z; j++)
+      m[i][j] = jac[i][j] + ((i==j) ? 1.0 : 0.0);
+
+  det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+      - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+      + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+
+  if (det < 0.1) {
+    for(i=VIO_X; i<=VIO_Z; i++) step[i] = r[i];
+    return;
+  }
+
+  step[0] = ( r[0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+            - m[0][1]*(r[1]*m[2][2] - m[1][2]*r[2])
+            + m[0][2]*(r[1]*m[2][1] - m[1][1]*r[2]) ) / det;
+  step[1] = ( m[0][0]*(r[1]*m[2][2] - m[1][2]*r[2])
+            - r[0]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+            + m[0][2]*(m[1][0]*r[2] - r[1]*m[2][0]) ) / det;
+  step[2] = ( m[0][0]*(m[1][1]*r[2] - r[1]*m[2][1])
+            - m[0][1]*(m[1][0]*r[2] - r[1]*m[2][0])
+            + r[0]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]) ) / det;
+}
+
+/* find x with forward(x) = w, starting from w + guess.  Returns TRUE
+   if the residual |forward(x) - w|, measured on the real forward
+   transform, is below tolerance. */
+
+static VIO_BOOL invert_point(VIO_General_transform *forward, Packed_Grid *grid,
+                             VIO_Real w[], VIO_Real guess[],
+                             VIO_Real tolerance, int max_iterations,
+                             VIO_Real x[], VIO_Real *residual)
+{
+  VIO_Real
+    d[VIO_N_DIMENSIONS], r[VIO_N_DIMENSIONS], step[VIO_N_DIMENSIONS],
+    jac[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS],
+    fx,fy,fz, norm;
+  int
+    i,iters;
+
+  for(i=VIO_X; i<=VIO_Z; i++) x[i] = w[i] + guess[i];
+
+                                /* Newton on the packed trilinear grid */
+  for(iters=0; iters<max_iterations; iters++) {
+    trilinear_displacement(grid, x, d, jac);
+    for(i=VIO_X; i<=VIO_Z; i++) r[i] = x[i] + d[i] - w[i];
+    if (r[0]*r[0] + r[1]*r[1] + r[2]*r[2] < tolerance*tolerance*0.01)
+      break;
+    newton_step(jac, r, step);
+    for(i=VIO_X; i<=VIO_Z; i++) x[i] -= step[i];
+  }
+                                /* polish on the real forward transform */
+  for(iters=0; ; iters++) {
+    grid_transform_point(forward, x[VIO_X], x[VIO_Y], x[VIO_Z], &fx, &fy, &fz);
+    r[VIO_X] = fx - w[VIO_X];
+    r[VIO_Y] = fy - w[VIO_Y];
+    r[VIO_Z] = fz - w[VIO_Z];
+    norm = sqrt(r[0]*r[0] + r[1]*r[1] + r[2]*r[2]);
+    if (norm < tolerance || iters >= max_iterations)
+      break;
+    trilinear_displacement(grid, x, d, jac);
+    newton_step(jac, r, step);
+    for(i=VIO_X; i<=VIO_Z; i++) x[i] -= step[i];
+  }
+
+  *residual = norm;
+  return(norm < tolerance);
+}
+
+
+typedef struct {
+  long     n_solved, n_fallback, n_failed;
+  VIO_Real sum_residual, max_residual;
+} Inverse_Stats;
+
+/* inverse displacement at every voxel of the slice at index x along X
+   of volume, with component c of the voxel at (j,k) along Y and Z in
+   def[3*(j*n_z + k) + c].  grid is NULL to use volume_io's solver. */
+
+static void invert_slice(VIO_General_transform *forward, Packed_Grid *grid,
+                         VIO_Volume volume, int xyzv[], int sizes[], int x,
+                         VIO_Real tolerance, int max_iterations,
+                         VIO_Real def[], Inverse_Stats *stats)
+{
+  VIO_Real
+    voxel[VIO_MAX_DIMENSIONS],
+    wx,wy,wz, inv_x,inv_y,inv_z,
+    world[VIO_N_DIMENSIONS],
+    inverse[VIO_N_DIMENSIONS],
+    guess[VIO_N_DIMENSIONS],
+    row_guess[VIO_N_DIMENSIONS],
+    residual;
+  int
+    index[VIO_MAX_DIMENSIONS],
+    i;
+  long
+    n;
+
+  stats->n_solved = stats->n_fallback = stats->n_failed = 0;
+  stats->sum_residual = stats->max_residual = 0.0;
+  for(i=VIO_X; i<=VIO_Z; i++) guess[i] = row_guess[i] = 0.0;
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i] = 0;
+  index[xyzv[VIO_X]] = x;
+  n = 0;
+
+  for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<sizes[xyzv[VIO_Y]]; index[xyzv[VIO_Y]]++)
+    for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<sizes[xyzv[VIO_Z]]; index[xyzv[VIO_Z]]++) {
+
+      for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i] = (VIO_Real)index[i];
+      convert_voxel_to_world(volume, voxel, &wx, &wy, &wz);
+
+      if (grid != NULL) {
+                                /* start from the neighbour along Z, or
+                                   from the start of the previous row */
+        if (index[xyzv[VIO_Z]] == 0)
+          for(i=VIO_X; i<=VIO_Z; i++) guess[i] = row_guess[i];
+
+        world[VIO_X] = wx; world[VIO_Y] = wy; world[VIO_Z] = wz;
+        if (!invert_point(forward, grid, world, guess,
+                          tolerance, max_iterations, inverse, &residual)) {
+          grid_inverse_transform_point(forward,
+                                       wx, wy, wz,
+                                       &inverse[VIO_X], &inverse[VIO_Y], &inverse[VIO_Z]);
+          grid_transform_point(forward,
+                               inverse[VIO_X], inverse[VIO_Y], inverse[VIO_Z],
+                               &inv_x, &inv_y, &inv_z);
+          residual = sqrt((inv_x-wx)*(inv_x-wx) + (inv_y-wy)*(inv_y-wy) +
+                          (inv_z-wz)*(inv_z-wz));
+          stats->n_fallback++;
+          if (residual >= tolerance) stats->n_failed++;
+        }
+        stats->n_solved++;
+        stats->sum_residual += residual;
+        if (residual > stats->max_residual) stats->max_residual = residual;
+
+        inv_x = inverse[VIO_X];
+        inv_y = inverse[VIO_Y];
+        inv_z = inverse[VIO_Z];
+
+        guess[VIO_X] = inv_x - wx;
+        guess[VIO_Y] = inv_y - wy;
+        guess[VIO_Z] = inv_z - wz;
+        if (index[xyzv[VIO_Z]] == 0)
+          for(i=VIO_X; i<=VIO_Z; i++) row_guess[i] = guess[i];
+      }
+      else if (sizes[ xyzv[VIO_Z] ] ==1)
+        general_inverse_transform_point_in_trans_plane(forward,
+                                                       wx, wy, wz,
+                                                       &inv_x, &inv_y, &inv_z);
+      else
+        grid_inverse_transform_point(forward,
+                                     wx, wy, wz,
+                                     &inv_x, &inv_y, &inv_z);
+
+      def[n++] = inv_x - wx;
+      def[n++] = inv_y - wy;
+      def[n++] = inv_z - wz;
+    }
+}
+
+/* store the slice computed by invert_slice() in volume, and add its
+   statistics to the totals */
+
+static void put_inverse_slice(VIO_Volume volume, int xyzv[], int sizes[], int x,
+                              VIO_Real def[], Inverse_Stats *stats,
+                              Inverse_Stats *total)
+{
+  int
+    index[VIO_MAX_DIMENSIONS],
+    i;
+  long
+    n;
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i] = 0;
+  index[xyzv[VIO_X]] = x;
+  n = 0;
+
+  for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<sizes[xyzv[VIO_Y]]; index[xyzv[VIO_Y]]++)
+    for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<sizes[xyzv[VIO_Z]]; index[xyzv[VIO_Z]]++)
+      for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<3; index[xyzv[VIO_Z+1]]++)
+        set_volume_real_value(volume,
+                              index[0],index[1],index[2],index[3],index[4],
+                              def[n++]);
+
+  total->n_solved     += stats->n_solved;
+  total->n_fallback   += stats->n_fallback;
+  total->n_failed     += stats->n_failed;
+  total->sum_residual += stats->sum_residual;
+  if (stats->max_residual > total->max_residual) 
+    total->max_residual = stats->max_residual;
+}
+
+/* fill volume with the inverse of forward, one slice along X at a
+   time, in n_jobs worker processes */
+
+static void invert_volume(VIO_General_transform *forward, Packed_Grid *grid,
+                          VIO_Volume volume, int n_jobs,
+                          VIO_Real tolerance, int max_iterations,
+                          VIO_BOOL verbose, Inverse_Stats *total)
+{
+  int
+    xyzv[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS],
+    x;
+  long
+    slice_size;
+  VIO_Real
+    *def;
+  Inverse_Stats
+    stats;
+  VIO_BOOL
+    done;
+  VIO_progress_struct
+    progress;
+#ifdef REVERSEDEF_CAN_FORK
+  int
+    w, *fd, fds[2];
+  pid_t
+    *pid;
+#endif
+
+  get_volume_sizes(volume, sizes);
+  get_volume_XYZV_indices(volume, xyzv);
+
+  total->n_solved = total->n_fallback = total->n_failed = 0;
+  total->sum_residual = total->max_residual = 0.0;
+
+  slice_size = 3 * (long)sizes[xyzv[VIO_Y]] * sizes[xyzv[VIO_Z]];
+  ALLOC(def, slice_size);
+
+  if (verbose)
+    initialize_progress_report(&progress, FALSE, sizes[xyzv[VIO_X]],
+                               "Inverting def field");
+  done = FALSE;
+
+#ifdef REVERSEDEF_CAN_FORK
+  n_jobs = MIN(n_jobs, sizes[xyzv[VIO_X]]);
+
+  if (n_jobs > 1) {
+    ALLOC(pid, n_jobs);
+    ALLOC(fd,  n_jobs);
+
+    (void) fflush( stdout );    /* or the workers print it again */
+    (void) fflush( stderr );
+
+    for(w=0; w<n_jobs; w++) {
+      pid[w] = -1;
+      fd[w]  = -1;
+      if (pipe(fds) != 0)
+        continue;
+
+      pid[w] = fork();
+      if (pid[w] == 0) {
+        (void) close( fds[0] );
+        for(x=w; x<sizes[xyzv[VIO_X]]; x+=n_jobs) {
+          invert_slice(forward, grid, volume, xyzv, sizes, x,
+                       tolerance, max_iterations, def, &stats);
+          if (!transfer_all(fds[1], (char *)&stats, sizeof(stats), TRUE) ||
+              !transfer_all(fds[1], (char *)def, slice_size*sizeof(VIO_Real), TRUE))
+            _exit(1);
+        }
+        _exit(0);
+      }
+
+      (void) close( fds[1] );
+      if (pid[w] < 0)
+        (void) close( fds[0] );
+      else
+        fd[w] = fds[0];
+    }
+
+                                /* take the slices in order, each from
+                                   its worker while it is still running */
+    for(x=0; x<sizes[xyzv[VIO_X]]; x++) {
+      w = x % n_jobs;
+      if (fd[w] >= 0 &&
+          (!transfer_all(fd[w], (char *)&stats, sizeof(stats), FALSE) ||
+           !transfer_all(fd[w], (char *)def, slice_size*sizeof(VIO_Real), FALSE))) {
+        (void) close( fd[w] );
+        fd[w] = -1;
+      }
+      if (fd[w] < 0)
+        invert_slice(forward, grid, volume, xyzv, sizes, x,
+                     tolerance, max_iterations, def, &stats);
+      put_inverse_slice(volume, xyzv, sizes, x, def, &stats, total);
+      if (verbose)
+        update_progress_report(&progress, x+1);
+    }
+
+    for(w=0; w<n_jobs; w++) {
+      if (fd[w] >= 0)
+        (void) close( fd[w] );
+      if (pid[w] > 0)
+        (void) waitpid( pid[w], NULL, 0 );
+    }
+
+    FREE(pid);
+    FREE(fd);
+    done = TRUE;
+  }
+#endif
+
+  if (!done)
+    for(x=0; x<sizes[xyzv[VIO_X]]; x++) {
+      invert_slice(forward, grid, volume, xyzv, sizes, x,
+                   tolerance, max_iterations, def, &stats);
+      put_inverse_slice(volume, xyzv, sizes, x, def, &stats, total);
+      if (verbose)
+        update_progress_report(&progress, x+1);
+    }
+
+  if (verbose)
+    terminate_progress_report(&progress);
+
+  FREE(def);
+}
+
 
 /* Main program */
 char *prog_name;
@@ -128,20 +618,28 @@ int main(int argc, char *argv[])
      voxel[VIO_MAX_DIMENSIONS],
      steps[VIO_MAX_DIMENSIONS],
      start[VIO_N_DIMENSIONS],
-     target_steps[VIO_MAX_DIMENSIONS],
-     wx,wy,wz, inv_x, inv_y, inv_z,
-     def_values[VIO_MAX_DIMENSIONS];
+     target_steps[VIO_MAX_DIMENSIONS];
+   Packed_Grid
+     grid;
+   Inverse_Stats
+     stats;
+   VIO_BOOL
+     use_grid;
 
    static int 
      clobber_flag = FALSE,
      verbose      = TRUE,
-     debug        = FALSE;
+     debug        = FALSE,
+     exact        = FALSE,
+     max_iterations = 20,
+     n_jobs       = 1;
+   static double
+     tolerance    = 0.01;
    static char  
      *target_file;
 
    int 
      parse_flag,
-     prog_count,
      sizes[VIO_MAX_DIMENSIONS],
      target_sizes[VIO_MAX_DIMENSIONS],
      xyzv[VIO_MAX_DIMENSIONS],
@@ -149,9 +647,6 @@ int main(int argc, char *argv[])
      index[VIO_MAX_DIMENSIONS],
      i,
      trans_count;
-   VIO_progress_struct
-     progress;
-
 
    static ArgvInfo argTable[] = {
      {"-like",       ARGV_STRING,   (char *) 0,     (char *) &target_file,
@@ -166,6 +661,14 @@ int main(int argc, char *argv[])
         "Do not write log messages"},
      {"-debug",      ARGV_CONSTANT, (char *) TRUE,  (char *) &debug,
         "Print out debug info."},
+     {"-tolerance",  ARGV_FLOAT,    (char *) 0,     (char *) &tolerance,
+        "Largest residual |forward(inverse(x)) - x| accepted, in mm."},
+     {"-max_iterations", ARGV_INT,  (char *) 0,     (char *) &max_iterations,
+        "Newton iterations per voxel before falling back on volume_io."},
+     {"-exact",      ARGV_CONSTANT, (char *) TRUE,  (char *) &exact,
+        "Use volume_io's iterative inverse at every voxel (slow)."},
+     {"-jobs",       ARGV_INT,      (char *) 0,     (char *) &n_jobs,
+        "Number of worker processes sharing the slices (default 1)."},
      {NULL, ARGV_END, NULL, NULL, NULL}
    };
 
@@ -252,50 +755,26 @@ int main(int argc, char *argv[])
        get_volume_sizes(volume, sizes);
        get_volume_XYZV_indices(volume,xyzv);
 
-       for(i=0; i<VIO_MAX_DIMENSIONS; i++){
-         index[i] = 0;
-       }
-
-       if (verbose){
-        initialize_progress_report(&progress, FALSE, 
-                                   sizes[xyzv[VIO_X]]*sizes[xyzv[VIO_Y]]*sizes[xyzv[VIO_Z]]+1,
-                                   "Inverting def field");
+       use_grid = FALSE;
+       if (!exact && sizes[ xyzv[VIO_Z] ] > 1)
+         use_grid = pack_grid(forward_transform.displacement_volume, &grid);
+       if (debug)
+         print ("Inverting %s\n", use_grid ? "with Newton steps on the packed grid" :
+                                              "with grid_inverse_transform_point");
+
+       invert_volume(&forward_transform, use_grid ? &grid : (Packed_Grid *)NULL,
+                     volume, n_jobs, tolerance, max_iterations, verbose, &stats);
+
+       if (use_grid) {
+         delete_packed_grid(&grid);
+         if (verbose && stats.n_solved > 0) {
+           print ("Residual |forward(inverse(x)) - x|: mean %g mm, max %g mm\n",
+                  stats.sum_residual / stats.n_solved, stats.max_residual);
+           print ("%ld of %ld voxels handed to grid_inverse_transform_point, "
+                  "%ld above tolerance (%g mm)\n",
+                  stats.n_fallback, stats.n_solved, stats.n_failed, tolerance);
+         }
        }
-       prog_count = 0;
-
-       for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<sizes[xyzv[VIO_X]]; index[xyzv[VIO_X]]++)
-         for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<sizes[xyzv[VIO_Y]]; index[xyzv[VIO_Y]]++)
-           for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<sizes[xyzv[VIO_Z]]; index[xyzv[VIO_Z]]++) {
-             
-             index[ xyzv[VIO_Z+1] ] = 0;
-             for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i] = (VIO_Real)index[i];
-       
-             convert_voxel_to_world(volume, voxel, &wx, &wy, &wz);
-             
-             if (sizes[ xyzv[VIO_Z] ] ==1)
-                general_inverse_transform_point_in_trans_plane(&forward_transform,
-                                            wx, wy, wz,
-                                            &inv_x, &inv_y, &inv_z);
-             else
-               grid_inverse_transform_point(&forward_transform,
-                                            wx, wy, wz,
-                                            &inv_x, &inv_y, &inv_z);
-             def_values[VIO_X] = inv_x - wx;
-             def_values[VIO_Y] = inv_y - wy;
-             def_values[VIO_Z] = inv_z - wz;
-
-             for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<3; index[xyzv[VIO_Z+1]]++)
-               set_volume_real_value(volume,
-                                     index[0],index[1],index[2],index[3],index[4],
-                                     def_values[ index[ xyzv[VIO_Z+1] ]]);
-
-             prog_count++;
-             if (verbose)
-               update_progress_report(&progress, prog_count);
-           }
-       
-       if (verbose)
-         terminate_progress_report(&progress);
 
        delete_general_transform(&forward_transform);
 
@@ -320,7 +799,9 @@ int main(int argc, char *argv[])
 void print_usage_and_exit(char *pname) {
 
   (void) fprintf(stderr, "This program is used to invert the internal representation\n");
-  (void) fprintf(stderr, "of a GRID_TRANSFORM in order to speed up resampling.\n\n");
+  (void) fprintf(stderr, "of a GRID_TRANSFORM in order to speed up resampling.\n");
+  (void) fprintf(stderr, "The inverse is found by Newton steps from each voxel's\n");
+  (void) fprintf(stderr, "neighbour; use -exact for volume_io's solver everywhere.\n\n");
   (void) fprintf(stderr, "Usage: %s [options] <input.xfm> <result.xfm>\n",
                  pname);
   exit(EXIT_FAILURE);
@@ -15,6 +15,7 @@ typedef  struct
     VIO_Real          tolerance;
     VIO_Real          *sum;
     int               n_steps_no_improvement;
+    int               n_jobs;
 } amoeba_struct;
 
 #endif
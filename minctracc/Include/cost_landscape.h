@@ -0,0 +1,64 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : cost_landscape.h
+@DESCRIPTION: structures and prototypes for Optimize/cost_landscape.c,
+              sweeps of the objective function around a transformation
+              (-matlab), evaluated by a pool of worker processes.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_COST_LANDSCAPE_H
+#define MINCTRACC_COST_LANDSCAPE_H
+
+#define LANDSCAPE_MAX_PARAMS  13        /* tx..tz, 3 rots or 4 quats,
+                                           sx..sz, shx..shz              */
+
+#define LANDSCAPE_MATLAB      0         /* output formats                */
+#define LANDSCAPE_CSV         1
+#define LANDSCAPE_BINARY      2
+
+#define LANDSCAPE_MAGIC       "MNILAND1"
+
+                                /* cost of one set of parameters */
+typedef float (*Landscape_Function)(VIO_Real params[], void *data);
+
+typedef struct {
+  char      name[32];
+  int       n_axes;                         /* 1 or 2                      */
+  int       param[2];                       /* parameter moved along each
+                                               axis, -1 for a direction   */
+  VIO_Real  delta[2][LANDSCAPE_MAX_PARAMS]; /* parameter change per step   */
+  long      first;                          /* of its costs in values[]    */
+} Landscape_Sweep;
+
+typedef struct {
+  int             n_params;
+  int             n_steps;                  /* each axis goes from -n_steps
+                                               to +n_steps                 */
+  VIO_Real        origin[LANDSCAPE_MAX_PARAMS];
+  int             n_sweeps;
+  Landscape_Sweep *sweeps;
+  long            n_points;
+  float           *values;                  /* costs, sweep by sweep, the
+                                               first axis varying fastest */
+} Landscape;
+
+
+void init_landscape(Landscape *landscape, int n_params,
+                    VIO_Real origin[], int n_steps);
+
+void add_landscape_sweep(Landscape *landscape, char *name, int n_axes,
+                         int param[], VIO_Real *delta[]);
+
+long get_landscape_sweep_size(Landscape *landscape, int n_axes);
+
+VIO_BOOL evaluate_landscape(Landscape *landscape,
+                            Landscape_Function function, void *data,
+                            int n_jobs);
+
+VIO_BOOL write_landscape(Landscape *landscape, char *filename,
+                         int format, char *comments);
+
+void delete_landscape(Landscape *landscape);
+
+#endif
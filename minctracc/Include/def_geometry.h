@@ -0,0 +1,52 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : def_geometry.h
+@DESCRIPTION: structures and prototypes for Volume/def_geometry.c, which
+              computes local geometric measures of a deformation field
+              (magnitude, Jacobian, principal strains, local scale) at
+              every node of its GRID_TRANSFORM in a single pass.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_DEF_GEOMETRY_H
+#define MINCTRACC_DEF_GEOMETRY_H
+
+                                /* maps that compute_def_geometry() can fill */
+#define DEF_MAP_MAGNITUDE     0   /* |T(x) - x|                              */
+#define DEF_MAP_JACOBIAN      1   /* det of the Jacobian of T                */
+#define DEF_MAP_LOG_JACOBIAN  2   /* its log, clamped where T folds          */
+#define DEF_MAP_STRAIN_MAX    3   /* principal Green-Lagrange strains,       */
+#define DEF_MAP_STRAIN_MID    4   /*   largest to smallest                   */
+#define DEF_MAP_STRAIN_MIN    5
+#define DEF_MAP_SCALE         6   /* mean length ratio to the 6 neighbours   */
+#define DEF_MAP_TYPES         7
+
+                                /* smallest determinant used for the log */
+#define DEF_GEOMETRY_MIN_JACOBIAN  1.0e-6
+
+#define DEF_GEOMETRY_INDEX(g,i,j,k) ( ((long)(i)*(g)->n[1] + (j))*(g)->n[2] + (k) )
+
+typedef struct {
+  int        n[VIO_N_DIMENSIONS];   /* nodes along X, Y and Z                 */
+  float      *d[VIO_N_DIMENSIONS];  /* displacement components, packed with
+                                       DEF_GEOMETRY_INDEX()                  */
+  VIO_Real   voxel_to_world[VIO_N_DIMENSIONS][4];
+  VIO_Real   world_to_voxel[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS];
+  VIO_Real   pre[VIO_N_DIMENSIONS][4];          /* linear part applied
+                                                   before the grid,        */
+  VIO_Real   pre_inverse[VIO_N_DIMENSIONS][4];  /* its inverse,            */
+  VIO_Real   post[VIO_N_DIMENSIONS][4];         /* and the one after       */
+  long       n_folded;              /* nodes with a Jacobian <= 0, set by
+                                       compute_def_geometry()                */
+} Def_Geometry;
+
+
+VIO_BOOL init_def_geometry(VIO_General_transform *trans,
+                           VIO_BOOL include_linear,
+                           Def_Geometry *geom);
+
+VIO_BOOL compute_def_geometry(Def_Geometry *geom, float *maps[], int n_jobs);
+
+void delete_def_geometry(Def_Geometry *geom);
+
+#endif
@@ -0,0 +1,61 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : flat_transform.h
+@DESCRIPTION: structures and prototypes for Optimize/flat_transform.c, a
+              compiled form of the (linear + grid) transformation that is
+              evaluated for every node and sub-lattice point in
+              do_nonlinear.c.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_FLAT_TRANSFORM_H
+#define MINCTRACC_FLAT_TRANSFORM_H
+
+                                /* largest difference (mm) allowed between
+                                   the packed grid lookup and
+                                   general_transform_point() at the probe
+                                   points checked by update_flat_transform() */
+#define FLAT_TRANSFORM_TOLERANCE  1.0e-3
+
+typedef struct {
+  VIO_General_transform *transform; /* the transformation that was compiled   */
+  VIO_General_transform *grid;      /* its GRID_TRANSFORM, or NULL            */
+  VIO_BOOL   compiled;              /* FALSE: always use general_transform_point */
+  VIO_BOOL   grid_ok;               /* packed lookup agrees with volume_io    */
+  VIO_Real   pre_to_voxel[3][4];    /* source world -> grid voxel (XYZ)       */
+  VIO_Real   pre_post[3][4];        /* source world -> world, without warp    */
+  VIO_Real   post[3][3];            /* linear part applied to displacements   */
+  int        xyzv[VIO_MAX_DIMENSIONS];
+  int        count[3];              /* grid node counts, XYZ order            */
+  float      *disp;                 /* packed displacements, x fastest,
+                                       xyz interleaved                        */
+  VIO_BOOL   has_target;
+  VIO_Real   target_to_voxel[3][4]; /* target world -> target voxel, in the
+                                       volume's dimension order               */
+  long       n_fast;                /* stats since the last update            */
+  long       n_generic;
+} Flat_Transform;
+
+
+VIO_BOOL init_flat_transform(Flat_Transform *flat,
+                             VIO_General_transform *transform,
+                             VIO_Volume target);
+
+void update_flat_transform(Flat_Transform *flat);
+
+void flat_transform_point(Flat_Transform *flat,
+                          VIO_Real x, VIO_Real y, VIO_Real z,
+                          VIO_Real *tx, VIO_Real *ty, VIO_Real *tz);
+
+void flat_transform_map_points(Flat_Transform *flat,
+                               float px[], float py[], float pz[],
+                               float tx[], float ty[], float tz[],
+                               int len);
+
+void flat_transform_to_target_voxel(Flat_Transform *flat,
+                                    float x[], float y[], float z[],
+                                    int len);
+
+void delete_flat_transform(Flat_Transform *flat);
+
+#endif
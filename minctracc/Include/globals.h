@@ -15,6 +15,7 @@ extern char  *prog_name;
 
 extern VIO_Volume  mask_data;
 extern VIO_Volume  mask_model;
+extern VIO_Volume  sample_weights;
 extern VIO_Volume  model;
 extern VIO_Volume  model_dx;
 extern VIO_Volume  model_dy;
@@ -28,13 +29,21 @@ extern VIO_Volume  data_dxyz;
 
 extern double  ftol;
 extern double  simplex_size;
+extern int     simplex_jobs;
+extern int     batch_jobs;
 extern int     iteration_limit;
 extern double  iteration_weight;
 extern double  smoothing_weight;
 extern double  similarity_cost_ratio;
 extern int     number_dimensions;
 extern int     Matlab_num_steps;
+extern int     Landscape_2d;
+extern int     Landscape_random;
+extern int     Landscape_format;
+extern int     Landscape_jobs;
 extern int     Diameter_of_local_lattice;
+extern int     sample_budget;
+extern int     node_budget;
 
 extern int     invert_mapping_flag;
 extern int     clobber_flag;
@@ -7,6 +7,10 @@
 int trilinear_interpolant(VIO_Volume volume, 
                                  PointR *coord, double *result);
 
+int trilinear_interpolant_gradient(VIO_Volume volume, 
+                                   PointR *coord, double *result,
+                                   double deriv[]);
+
 int tricubic_interpolant(VIO_Volume volume, 
                                 PointR *coord, double *result);
 
@@ -17,6 +21,15 @@ void do_Ncubic_interpolation(VIO_Volume volume,
 int nearest_neighbour_interpolant(VIO_Volume volume, 
                                          PointR *coord, double *result);
 
+int bspline_interpolant(VIO_Volume volume, 
+                        PointR *coord, double *result);
+
+int bspline_interpolant_gradient(VIO_Volume volume, 
+                                 PointR *coord, double *result,
+                                 double deriv[]);
+
+void delete_bspline_coefficients(void);
+
 /* A point is not masked if it is a point we should consider.
    If the mask volume is NULL, we consider all points.
    Otherwise, consider a point if the mask volume value is > 0.
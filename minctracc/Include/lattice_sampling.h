@@ -0,0 +1,40 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : lattice_sampling.h
+@DESCRIPTION: structures and prototypes for Optimize/lattice_sampling.c,
+              importance sampling of the linear fit lattice and of the
+              nodes of the non-linear fit, driven by gradient magnitude.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_LATTICE_SAMPLING_H
+#define MINCTRACC_LATTICE_SAMPLING_H
+
+                                /* share of the sample budget that is
+                                   spread uniformly over the lattice, so
+                                   that flat regions keep some samples  */
+#define LATTICE_SAMPLING_UNIFORM_FRACTION  0.1
+
+typedef struct {
+  VIO_Real   voxel[3];              /* lattice node, in voxel coordinates
+                                       of the first volume                 */
+  VIO_Real   weight;                /* inverse of the probability that the
+                                       node was drawn                      */
+} Lattice_Sample;
+
+
+VIO_Real get_importance_weight(VIO_Volume weights, VIO_Volume data,
+                               VIO_Real voxel[]);
+
+int init_lattice_samples(Arg_Data *globals,
+                         VIO_Volume d1, VIO_Volume d2, VIO_Volume m1,
+                         VIO_Volume weights, int budget);
+
+void clear_lattice_samples(void);
+
+int get_lattice_samples(Lattice_Sample **samples);
+
+long select_nodes_by_weight(float weight[], long n_nodes, long budget,
+                            unsigned char selected[]);
+
+#endif
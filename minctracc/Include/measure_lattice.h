@@ -0,0 +1,29 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : measure_lattice.h
+@DESCRIPTION: structures and prototypes for Optimize/measure_lattice.c,
+              all the similarity measures of -measure computed in one
+              pass over the lattice.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_MEASURE_LATTICE_H
+#define MINCTRACC_MEASURE_LATTICE_H
+
+#define MEASURE_MI_BINS  256            /* as forced by -mi and -nmi        */
+
+typedef struct {
+  float      zscore;                    /* as the objective functions of    */
+  float      xcorr;                     /* the same name: smaller is better */
+  float      var_ratio;
+  float      ssc;
+  float      mi;
+  float      nmi;
+} Lattice_Measures;
+
+
+VIO_BOOL measure_lattice(VIO_Volume d1, VIO_Volume d2,
+                         VIO_Volume m1, VIO_Volume m2,
+                         Arg_Data *globals, Lattice_Measures *measures);
+
+#endif
@@ -127,6 +127,8 @@ int get_transformation(char *dst, char *key, char *nextArg);
 
 int get_mask_file(char *dst, char *key, char *nextArg);
 
+int get_sample_weights_file(char *dst, char *key, char *nextArg);
+
 int get_nonlinear_objective(char *dst, char *key, char *nextArg);
 
 int get_feature_volumes(char *dst, char *key, int argc, char **argv);
@@ -196,6 +198,12 @@ float measure_fit(VIO_Volume d1,
                          VIO_Volume m2, 
                          Arg_Data *globals);
 
+float evaluate_fit(VIO_Volume d1,
+                   VIO_Volume d2,
+                   VIO_Volume m1,
+                   VIO_Volume m2, 
+                   Arg_Data *globals);
+
 void make_matlab_data_file(VIO_Volume d1,
                                   VIO_Volume d2,
                                   VIO_Volume m1,
@@ -6,7 +6,7 @@
 typedef struct Arg_Data_struct Arg_Data;
 
 /* enums to define interpolants and objective functions */
-typedef enum { TRILINEAR, TRICUBIC, N_NEIGHBOUR } Interpolating_Type;
+typedef enum { TRILINEAR, TRICUBIC, N_NEIGHBOUR, BSPLINE } Interpolating_Type;
 typedef enum { XCORR, ZSCORE, SSC, VR, MUTUAL_INFORMATION, NORMALIZED_MUTUAL_INFORMATION } Objective_Type;
 
 
@@ -22,6 +22,9 @@ typedef void (*Transform_Function)(PointR *result,
 typedef int (*Interpolating_Function) 
      (VIO_Volume volume, PointR *coord, double *result);
 
+typedef int (*Interpolating_Gradient_Function) 
+     (VIO_Volume volume, PointR *coord, double *result, double deriv[]);
+
 typedef struct {
    int verbose;
    int debug;
@@ -43,6 +46,8 @@ typedef struct {
   char *output_trans;
   char *measure_file;
   char *matlab_file;
+  char *batch_file;             /* list of source/output pairs for -batch */
+  char *checkpoint;             /* base name of non-linear fit checkpoint */
 } Program_Filenames;
 
 typedef struct {
@@ -68,7 +73,12 @@ typedef struct {
   VIO_Real max_def_magnitude;        /* maximum size of deformation in def field */
   int use_simplex;
   int use_bfgs;
+  int multi_start;                  /* number of starting points for linear fit */
   int use_super;
+  int use_warp_cache;              /* packed super-sampled warp, see warp_cache.h */
+  int warp_resample;               /* kernel for an input warp, see warp_resample.h */
+  int use_flat_transform;          /* compiled transformation, see flat_transform.h */
+  int source_cache_mb;             /* memory (MB) for source sub-lattice cache */
   int use_local_smoothing;
   int use_local_isotropic;
   char *file_name;
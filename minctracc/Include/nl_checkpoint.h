@@ -0,0 +1,37 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : nl_checkpoint.h
+@DESCRIPTION: structures and prototypes for Optimize/nl_checkpoint.c,
+              used to save the state of the non-linear fit between
+              iterations and to resume it later.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_NL_CHECKPOINT_H
+#define MINCTRACC_NL_CHECKPOINT_H
+
+typedef struct {
+  int        iterations_done;       /* iterations completed                   */
+  int        iteration_limit;       /* from the run that wrote the checkpoint */
+  VIO_Real   mean_eig_val[3];       /* previous_mean_eig_val                  */
+  VIO_Real   std_eig_val[3];        /* previous_std_eig_val                   */
+  VIO_Real   initial_corr;
+  VIO_Real   previous_mean_warp;    /* convergence test state                 */
+  VIO_Real   previous_corr;
+  VIO_BOOL   converged;             /* the convergence test stopped the fit   */
+  long       n_nodes;               /* size of node_active[]                  */
+  unsigned char *node_active;       /* active set, or NULL                    */
+} Nonlinear_Checkpoint;
+
+
+VIO_BOOL write_nonlinear_checkpoint(char *basename,
+                                    VIO_General_transform *transform,
+                                    Nonlinear_Checkpoint *state);
+
+VIO_BOOL read_nonlinear_checkpoint(char *basename,
+                                   VIO_Volume current_vol,
+                                   Nonlinear_Checkpoint *state);
+
+void delete_nonlinear_checkpoint(Nonlinear_Checkpoint *state);
+
+#endif
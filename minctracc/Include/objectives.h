@@ -4,6 +4,31 @@ float xcorr_objective(VIO_Volume d1,
                              VIO_Volume m2, 
                              Arg_Data *globals);
 
+                                /* objectives that also return the derivative
+                                   of their value with respect to the top 3
+                                   rows of the voxel-to-voxel matrix built
+                                   by get_into_voxel_space() */
+typedef float (*Gradient_Objective_Function) (VIO_Volume d1,
+                                              VIO_Volume d2,
+                                              VIO_Volume m1,
+                                              VIO_Volume m2, 
+                                              Arg_Data *globals,
+                                              VIO_Real gradient[3][4]);
+
+float xcorr_objective_gradient(VIO_Volume d1,
+                               VIO_Volume d2,
+                               VIO_Volume m1,
+                               VIO_Volume m2, 
+                               Arg_Data *globals,
+                               VIO_Real gradient[3][4]);
+
+float zscore_objective_gradient(VIO_Volume d1,
+                                VIO_Volume d2,
+                                VIO_Volume m1,
+                                VIO_Volume m2, 
+                                Arg_Data *globals,
+                                VIO_Real gradient[3][4]);
+
 float zscore_objective(VIO_Volume d1,
                               VIO_Volume d2,
                               VIO_Volume m1,
@@ -0,0 +1,48 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : optical_flow.h
+@DESCRIPTION: structures and prototypes for Optimize/optical_flow.c,
+              packed copies of the source and target volumes used by
+              the optical flow (-nonlinear opticalflow) features of the
+              non-linear fit.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_OPTICAL_FLOW_H
+#define MINCTRACC_OPTICAL_FLOW_H
+
+#define FLOW_INDEX(f,i,j,k) ( ((long)(i)*(f)->sizes[1] + (j))*(f)->sizes[2] + (k) )
+
+typedef struct {
+  int        sizes[3];              /* in volume index order                 */
+  float      *values;               /* real values, packed with FLOW_INDEX() */
+  VIO_Real   A[3][3], b[3];         /* voxel = A * world + b                 */
+} Flow_Volume;
+
+typedef struct {
+  Flow_Volume source;               /* repacked at each iteration, since the
+                                       source is renormalized between them */
+  Flow_Volume target;               /* packed once                           */
+  VIO_Real    min_deriv;            /* smallest target derivative used, a
+                                       fraction of the source real range   */
+  VIO_Real    steps[3];             /* separations of the source             */
+} Optical_Flow;
+
+
+VIO_BOOL init_flow_volume(Flow_Volume *flow, VIO_Volume volume);
+
+void delete_flow_volume(Flow_Volume *flow);
+
+VIO_Real flow_volume_value(Flow_Volume *flow, VIO_Real world[],
+                           VIO_Real gradient[]);
+
+VIO_BOOL init_optical_flow(Optical_Flow *flow,
+                           VIO_Volume data, VIO_Volume model,
+                           VIO_Real min_deriv_fraction);
+
+VIO_BOOL update_optical_flow_source(Optical_Flow *flow, VIO_Volume data,
+                                    VIO_Real min_deriv_fraction);
+
+void delete_optical_flow(Optical_Flow *flow);
+
+#endif
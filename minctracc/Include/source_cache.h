@@ -0,0 +1,50 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : source_cache.h
+@DESCRIPTION: structures and prototypes for Optimize/source_cache.c, a
+              per-node store of the source sub-lattice samples used in
+              the non-linear fit, so that they are interpolated only on
+              the first iteration.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_SOURCE_CACHE_H
+#define MINCTRACC_SOURCE_CACHE_H
+
+                                /* values of Source_Cache.slot[] that are
+                                   not an index into the store */
+#define SOURCE_CACHE_EMPTY   -1L   /* not yet seen, a slot can be given  */
+#define SOURCE_CACHE_NONE    -2L   /* over budget, never cached          */
+
+typedef struct {
+  long       n_nodes;               /* nodes in the deformation grid          */
+  int        n_features;
+  int        max_len;               /* room for samples per feature, per node */
+  int        len;                   /* sub-lattice length (Glen), same for
+                                       all nodes; 0 until the first store    */
+  long       n_slots;               /* number of nodes that fit the budget    */
+  long       used;                  /* slots given out so far                 */
+  long       *slot;                 /* per node: index into the store         */
+  float      *samples;              /* [slot][feature][max_len]               */
+  unsigned char *masked;            /* [slot][feature][max_len]               */
+  float      *sqrt_features;        /* [slot][feature]                        */
+  long       hits;                  /* stats, reset by the caller             */
+  long       misses;
+} Source_Cache;
+
+
+VIO_BOOL init_source_cache(Source_Cache *cache,
+                           long n_nodes, int n_features, int max_len,
+                           int budget_mb);
+
+VIO_BOOL source_cache_fetch(Source_Cache *cache, long node, int len,
+                            float **samples, VIO_BOOL **masked,
+                            float sqrt_features[]);
+
+void source_cache_store(Source_Cache *cache, long node, int len,
+                        float **samples, VIO_BOOL **masked,
+                        float sqrt_features[]);
+
+void delete_source_cache(Source_Cache *cache);
+
+#endif
@@ -31,6 +31,16 @@ go_get_samples_with_offset(VIO_Volume data, VIO_Volume mask,
                            float sqrt_s1, float *a1, VIO_BOOL *m1,
                            VIO_BOOL use_nearest_neighbour);
 
+void 
+go_get_fused_samples_with_offset(VIO_Volume data[], VIO_Volume mask,
+                                 float *x, float *y, float *z,
+                                 VIO_Real  dx, VIO_Real  dy, VIO_Real dz,
+                                 int obj_func[], int n, int len,
+                                 float normalization[],
+                                 float *a1[], VIO_BOOL *m1[],
+                                 VIO_BOOL use_nearest_neighbour,
+                                 float result[]);
+
 void    
 build_target_lattice(float px[], float py[], float pz[],
                      float tx[], float ty[], float tz[],
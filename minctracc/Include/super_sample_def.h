@@ -16,22 +16,6 @@ create_super_sampled_data_volumes(VIO_General_transform *orig_deformation,
                                   int super_step);
 
 
-/*
-   This procedure will use cubic interpolation to resample the deformation
-   field stored in *orig_deformation->displacement_volume onto the voxel
-   lattice defined in *super_sampled.
-
-   The procedure essentially steps though all voxels of 
-   *super_sampled->displacement_volume, figures out the world coordinate for
-   the voxel position, and uses this info to interpolate into *orig_deformation.
-
-   see interpolate_super_sampled_data_by2() (below) for speedy code for the
-   special case when the super sampling rate is euqal to 2.
-*/
-void interpolate_super_sampled_data(VIO_General_transform *orig_deformation,
-                                           VIO_General_transform *super_sampled);
-
-
 /* build the volume structure and allocate the data space to store
    a super-sampled GRID_TRANSFORM.
 
@@ -26,6 +26,10 @@ void build_reorder_matrix_vox2xyz(VIO_General_transform *trans, VIO_Volume volum
 
 void build_reorder_matrix_xyz2vox(VIO_General_transform *trans, VIO_Volume volume);
 
+void init_voxel_space_context(VIO_Volume v1, VIO_Volume v2);
+
+void clear_voxel_space_context(void);
+
 void get_into_voxel_space(Arg_Data *globals,
                                  Voxel_space_struct *vox,
                                  VIO_Volume v1, VIO_Volume v2);
@@ -39,3 +43,12 @@ void  my_homogenous_transform_point(VIO_Transform  *transform,
                                            VIO_Real       *y_trans,
                                            VIO_Real       *z_trans );
 
+
+void init_lattice_clip(VIO_Volume d2, VIO_Volume m2, 
+                       VIO_Real threshold, VIO_BOOL use_threshold);
+
+void clear_lattice_clip(void);
+
+void get_lattice_clip_range(VIO_Transform *trans, 
+                            PointR *row, VectorR *col_step, int count,
+                            int *first, int *last);
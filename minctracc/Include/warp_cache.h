@@ -0,0 +1,66 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : warp_cache.h
+@DESCRIPTION: structures and prototypes for Optimize/warp_cache.c, a
+              packed, incrementally updated copy of the super-sampled
+              deformation field used to build target sub-lattices.
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_WARP_CACHE_H
+#define MINCTRACC_WARP_CACHE_H
+
+                                /* values for trans_info.use_warp_cache */
+#define WARP_CACHE_OFF        0
+#define WARP_CACHE_NEAREST    1
+#define WARP_CACHE_TRILINEAR  2
+
+                                /* edge length (in super-sampled nodes)
+                                   of the tiles that are regenerated
+                                   when coarse nodes change */
+#define WARP_CACHE_TILE_SIZE  8
+
+                                /* coarse displacement changes (mm)
+                                   smaller than this do not dirty a tile */
+#define WARP_CACHE_TOLERANCE  1.0e-4
+
+typedef struct {
+  VIO_Volume coarse_vol;            /* displacement volume being tracked      */
+  int        coarse_xyzv[VIO_MAX_DIMENSIONS];
+  int        coarse_count[3];       /* coarse node counts, XYZ order          */
+  int        count[3];              /* super-sampled node counts, XYZ order   */
+  float      *coarse;               /* packed coarse warp as of last update   */
+  float      *disp;                 /* packed super-sampled warp, x fastest,
+                                       xyz displacement interleaved           */
+  int        *first_tap[3];         /* per axis, per super node: first coarse
+                                       node feeding the 1D interpolation      */
+  int        *n_taps[3];            /* ... number of coarse nodes used (1-4)  */
+  float      *tap_weights[3];       /* ... and their weights (4 per node)     */
+  VIO_Real   world_to_voxel[3][4];  /* world -> super-sampled voxel (XYZ)     */
+  VIO_General_transform *linear_transform;
+  VIO_BOOL   linear_is_affine;      /* TRUE if linear_transform == linear[][] */
+  VIO_Real   linear[3][4];
+  int        tile_count[3];
+  unsigned char *dirty;             /* one flag per tile                      */
+  VIO_BOOL   initialized;           /* FALSE until first update               */
+  int        interpolation;         /* WARP_CACHE_NEAREST or _TRILINEAR       */
+  long       tiles_updated;         /* stats for the last update              */
+  long       total_tiles;
+} Warp_Cache;
+
+
+VIO_BOOL init_warp_cache(Warp_Cache *cache,
+                         VIO_General_transform *warp,
+                         VIO_General_transform *linear_part,
+                         int interpolation);
+
+long update_warp_cache(Warp_Cache *cache);
+
+void warp_cache_map_points(Warp_Cache *cache,
+                           float px[], float py[], float pz[],
+                           float tx[], float ty[], float tz[],
+                           int len);
+
+void delete_warp_cache(Warp_Cache *cache);
+
+#endif
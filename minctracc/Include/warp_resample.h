@@ -0,0 +1,21 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : warp_resample.h
+@DESCRIPTION: prototypes for Volume/warp_resample.c, resampling of the
+              displacement volume of a GRID_TRANSFORM onto another grid
+              (e.g. from the 4mm to the 2mm level of a non-linear fit).
+@CREATED    :
+@MODIFIED   :
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_WARP_RESAMPLE_H
+#define MINCTRACC_WARP_RESAMPLE_H
+
+                                /* values for trans_info.warp_resample */
+#define WARP_RESAMPLE_GENERIC  0        /* grid_transform_point() per node  */
+#define WARP_RESAMPLE_LINEAR   1
+#define WARP_RESAMPLE_CUBIC    2        /* interpolating (Catmull-Rom)      */
+#define WARP_RESAMPLE_BSPLINE  3        /* prefiltered cubic B-spline       */
+
+VIO_BOOL resample_warp_volume(VIO_Volume from, VIO_Volume to, int kernel);
+
+#endif
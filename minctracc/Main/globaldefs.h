@@ -5,6 +5,8 @@
 #include <minctracc.h>
 #include <objectives.h>
 #include "local_macros.h"
+#include "cost_landscape.h"
+#include "warp_resample.h"
 
 
 /* Globals !! :( */
@@ -13,6 +15,7 @@ char  *prog_name                 = NULL;
 
 VIO_Volume  mask_data                = NULL;
 VIO_Volume  mask_model               = NULL;
+VIO_Volume  sample_weights           = NULL;
 VIO_Volume  model                    = NULL;
 VIO_Volume  model_dx                 = NULL;
 VIO_Volume  model_dy                 = NULL;
@@ -26,13 +29,27 @@ VIO_Volume  data_dxyz                = NULL;
 
 double  ftol                     = 0.005;
 double  simplex_size             = 20.0;
+int     simplex_jobs             = 1;
+int     batch_jobs               = 1;
 int     iteration_limit          = 4;
 double  iteration_weight         = 0.6;
 double  smoothing_weight         = 0.5;
+double  active_set_tolerance     = 0.0;
+double  active_set_reactivate    = -1.0;
+double  converge_def_tolerance   = 0.0;
+double  converge_corr_tolerance  = 0.0;
+int     checkpoint_every         = 1;
+int     resume_flag              = FALSE;
 double  similarity_cost_ratio    = 0.5;
 int     number_dimensions        = 3;
 int     Matlab_num_steps         = 15;
+int     Landscape_2d             = FALSE;
+int     Landscape_random         = 0;
+int     Landscape_format         = LANDSCAPE_MATLAB;
+int     Landscape_jobs           = 1;
 int     Diameter_of_local_lattice= 5;
+int     sample_budget            = 0;
+int     node_budget              = 0;
 
 int     invert_mapping_flag      = FALSE;
 int     clobber_flag             = FALSE;
@@ -125,6 +142,9 @@ ArgvInfo argTable[] = {
   {"-nearest_neighbour", ARGV_CONSTANT, (char *) N_NEIGHBOUR,
      (char *) &main_argsX.interpolant_type,
      "Do nearest neighbour interpolation"},
+  {"-bspline", ARGV_CONSTANT, (char *) BSPLINE,
+     (char *) &main_argsX.interpolant_type,
+     "Do prefiltered cubic B-spline interpolation"},
   
   {NULL, ARGV_HELP, NULL, NULL,
      "\nLinear optimization objective functions. (default = -xcorr)"},
@@ -167,6 +187,9 @@ ArgvInfo argTable[] = {
   {"-simplex", ARGV_FLOAT, (char *) 0, 
      (char *) &simplex_size,
      "Radius of simplex volume."},
+  {"-simplex_jobs", ARGV_INT, (char *) 0, 
+     (char *) &simplex_jobs,
+     "Number of simplex values (or -multi_start fits) computed at once (def=1)."},
   {"-w_translations", ARGV_FLOAT, (char *) 3, 
      (char *) &main_argsX.trans_info.weights[0],
      "Optimization weight of translation in x, y, z."},
@@ -181,6 +204,22 @@ ArgvInfo argTable[] = {
      "Optimization weight of shears a,b and c."},
   {"-use_bfgs", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.use_bfgs,
      "use BFGS optimizer instead of amoeba "},
+  {"-multi_start", ARGV_INT, (char *) 0, (char *) &main_argsX.trans_info.multi_start,
+     "Number of perturbed starting points to search on a coarse lattice (def=1)."},
+  {"-sample_budget", ARGV_INT, (char *) 0, (char *) &sample_budget,
+     "Use only <n> lattice nodes, drawn by gradient magnitude (-xcorr, -mi, -nmi)."},
+  {"-sample_weights", ARGV_FUNC, (char *) get_sample_weights_file, 
+     (char *) NULL,
+     "Gradient magnitude volume of the source to draw samples/nodes with."},
+
+  {NULL, ARGV_HELP, NULL, NULL,
+     "\nOptions for batch registration to a single target."},
+  {"-batch", ARGV_STRING, (char *) 0, 
+     (char *) &main_argsX.filenames.batch_file,
+     "File listing <source> [<source_mask>|- <initial_xfm>|-] <output_xfm>, one per line."},
+  {"-batch_jobs", ARGV_INT, (char *) 0, 
+     (char *) &batch_jobs,
+     "Number of -batch registrations run at once (def=1)."},
 
   {NULL, ARGV_HELP, NULL, NULL,
      "\nOptions for measurement comparison."},
@@ -189,6 +228,16 @@ ArgvInfo argTable[] = {
      "Output curves for selected objective function vs parameter."},
   {"-num_steps", ARGV_INT, (char *) 0, (char *) &Matlab_num_steps,
      "Number of steps at which to measure obj fn for matlab output."},
+  {"-landscape_2d", ARGV_CONSTANT, (char *) TRUE, (char *) &Landscape_2d,
+     "Also measure obj fn on a grid for each pair of parameters."},
+  {"-landscape_random", ARGV_INT, (char *) 0, (char *) &Landscape_random,
+     "Also measure obj fn along <n> random directions."},
+  {"-landscape_jobs", ARGV_INT, (char *) 0, (char *) &Landscape_jobs,
+     "Number of processes measuring obj fn for matlab output (def=1)."},
+  {"-landscape_csv", ARGV_CONSTANT, (char *) LANDSCAPE_CSV, (char *) &Landscape_format,
+     "Write the matlab output as CSV."},
+  {"-landscape_binary", ARGV_CONSTANT, (char *) LANDSCAPE_BINARY, (char *) &Landscape_format,
+     "Write the matlab output in binary (see cost_landscape.c)."},
   {"-measure", ARGV_STRING, (char *) 0, 
      (char *) &main_argsX.filenames.measure_file,
      "Output value of each obj. func. for given x-form."},
@@ -248,6 +297,26 @@ ArgvInfo argTable[] = {
      "super sample deformation field during optimization (default)."},
   {"-no_super", ARGV_CONSTANT, (char *) 0, (char *) &main_argsX.trans_info.use_super,
      "do not super sample deformation field during optimization."},
+  {"-warp_cache", ARGV_CONSTANT, (char *) 1, (char *) &main_argsX.trans_info.use_warp_cache,
+     "keep super-sampled deformation in a packed cache, updated only where it changes."},
+  {"-warp_cache_trilinear", ARGV_CONSTANT, (char *) 2, (char *) &main_argsX.trans_info.use_warp_cache,
+     "as -warp_cache, with trilinear (not nearest neighbour) lookup."},
+  {"-no_warp_cache", ARGV_CONSTANT, (char *) 0, (char *) &main_argsX.trans_info.use_warp_cache,
+     "regenerate the full super-sampled deformation each iteration (default)."},
+  {"-warp_resample_linear", ARGV_CONSTANT, (char *) WARP_RESAMPLE_LINEAR, (char *) &main_argsX.trans_info.warp_resample,
+     "resample an input deformation onto the lattice with linear interpolation."},
+  {"-warp_resample_cubic", ARGV_CONSTANT, (char *) WARP_RESAMPLE_CUBIC, (char *) &main_argsX.trans_info.warp_resample,
+     "... with cubic interpolation."},
+  {"-warp_resample_bspline", ARGV_CONSTANT, (char *) WARP_RESAMPLE_BSPLINE, (char *) &main_argsX.trans_info.warp_resample,
+     "... with cubic B-spline interpolation."},
+  {"-warp_resample_generic", ARGV_CONSTANT, (char *) WARP_RESAMPLE_GENERIC, (char *) &main_argsX.trans_info.warp_resample,
+     "... by evaluating the input transform at each node (default)."},
+  {"-flat_transform", ARGV_CONSTANT, (char *) TRUE, (char *) &main_argsX.trans_info.use_flat_transform,
+     "map nodes through a compiled form of the transformation (default)."},
+  {"-no_flat_transform", ARGV_CONSTANT, (char *) FALSE, (char *) &main_argsX.trans_info.use_flat_transform,
+     "map nodes with general_transform_point()."},
+  {"-source_cache", ARGV_INT, (char *) 0, (char *) &main_argsX.trans_info.source_cache_mb,
+     "keep source sub-lattice samples between iterations, using up to <MB> of memory."},
   {"-iterations", ARGV_INT, (char *) 0, 
      (char *) &iteration_limit,
      "Number of iterations for non-linear optimization"},
@@ -257,6 +326,30 @@ ArgvInfo argTable[] = {
   {"-stiffness", ARGV_FLOAT, (char *) 0, 
      (char *) &smoothing_weight,
      "Weighting factor for smoothing between nl iterations"},
+  {"-active_set", ARGV_FLOAT, (char *) 0, 
+     (char *) &active_set_tolerance,
+     "Skip nodes whose last deformation estimate (mm) was below this (default: off)"},
+  {"-active_reactivate", ARGV_FLOAT, (char *) 0, 
+     (char *) &active_set_reactivate,
+     "Re-estimate skipped nodes when the warp nearby moves more (mm) than this"},
+  {"-node_budget", ARGV_INT, (char *) 0, 
+     (char *) &node_budget,
+     "Estimate only the <n> nodes with the largest source gradient (default: all)"},
+  {"-converge_def", ARGV_FLOAT, (char *) 0, 
+     (char *) &converge_def_tolerance,
+     "Stop nl iterations when the mean warp changes by less than this fraction"},
+  {"-converge_corr", ARGV_FLOAT, (char *) 0, 
+     (char *) &converge_corr_tolerance,
+     "Stop nl iterations when the correlation changes by less than this fraction"},
+  {"-checkpoint", ARGV_STRING, (char *) 0, 
+     (char *) &main_argsX.filenames.checkpoint,
+     "Save the state of the nl fit to <base>.state and <base>_[01].xfm"},
+  {"-checkpoint_every", ARGV_INT, (char *) 0, 
+     (char *) &checkpoint_every,
+     "Number of nl iterations between checkpoints (default = 1)"},
+  {"-resume", ARGV_CONSTANT, (char *) TRUE, 
+     (char *) &resume_flag,
+     "Continue the nl fit from the -checkpoint, if there is one"},
   {"-similarity_cost_ratio", ARGV_FLOAT, (char *) 0, 
      (char *) &similarity_cost_ratio,
      "Weighting factor for  r=similarity*w + cost(1*w)"},
@@ -278,7 +371,7 @@ ArgvInfo argTable[] = {
 
 
 Arg_Data main_argsX = {
-  {"","","","","","",""},        /* filenames           */
+  {"","","","","","","","",""},  /* filenames           */
   {1,FALSE},                        /* verbose, debug      */
   {                                /* transformation info */
     FALSE,                        /*   use identity tranformation to start */
@@ -287,7 +380,12 @@ Arg_Data main_argsX = {
     50.0,
     TRUE,                        /*   use_simplex=TRUE ie use 3d simplex by default */
     FALSE,                       /*   use_bfgs=FALSE i.e don't use BFGS*/
+    1,                           /*   multi_start=1 i.e. single starting point */
     2,                                /*   use super sampling of deformation field  */
+    0,                                /*   do not use the packed warp cache         */
+    WARP_RESAMPLE_GENERIC,            /*   resample an input warp node by node     */
+    TRUE,                             /*   use the compiled transformation         */
+    0,                                /*   no source sub-lattice cache              */
     FALSE,                        /* use local smoothing       */
     TRUE,                        /* use isotropic smoothing */
     "",                                /*   filename */
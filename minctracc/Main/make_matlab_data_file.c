@@ -8,7 +8,13 @@
               the current transformation and variants thereof.
 
               each parameter is varied in turn, one at a time, from 
-              -simplex to +simplex around the parameter.
+              -simplex to +simplex around the parameter.  with
+              -landscape_2d, every pair of parameters is also varied
+              on a grid, and -landscape_random <n> adds n sweeps along
+              random directions.  the sweeps are evaluated by
+              -landscape_jobs worker processes (see cost_landscape.c)
+              and written as matlab vectors, CSV (-landscape_csv) or
+              binary (-landscape_binary).
               
 @COPYRIGHT  :
               Copyright 1993 Louis Collins, McConnell Brain Imaging Centre, 
@@ -94,6 +100,7 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 
 
 #include <config.h>
+#include <stdlib.h>
 #include <volume_io.h>
 
 #include "constants.h"
@@ -103,6 +110,9 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "Proglib.h"
 
 #include "local_macros.h"
+#include "vox_space.h"
+#include "interpolation.h"
+#include "cost_landscape.h"
 
 extern Arg_Data *main_args;
 
@@ -116,9 +126,15 @@ extern VIO_Real            *prob_fn1;
 extern VIO_Real            *prob_fn2;         
 
 extern int Matlab_num_steps;
+extern int Landscape_2d;
+extern int Landscape_random;
+extern int Landscape_format;
+extern int Landscape_jobs;
 
-float fit_function(float *params);
-float fit_function_quater(float *params);
+float fit_function(Arg_Data *args, float *params);
+float fit_function_quater(Arg_Data *args, float *params);
+
+VIO_BOOL lattice_clip_uses_threshold(Arg_Data *globals);
 
 void make_zscore_volume(VIO_Volume d1, VIO_Volume m1, 
                                VIO_Real *threshold); 
@@ -143,6 +159,31 @@ void parameters_to_vector_quater(double *trans,
 
 VIO_BOOL replace_volume_data_with_ubyte(VIO_Volume data);
 
+static char *rot_names[]  = { "tx", "ty", "tz", "rx", "ry", "rz",
+                              "sx", "sy", "sz", "shx", "shy", "shz" };
+static char *quat_names[] = { "tx", "ty", "tz", "qx", "qy", "qz", "qw",
+                              "sx", "sy", "sz", "shx", "shy", "shz" };
+
+/* the objective function for a set of parameters in the order of
+   rot_names[] or quat_names[] */
+
+static float landscape_cost(VIO_Real params[], void *data)
+{
+  Arg_Data *globals = (Arg_Data *)data;
+  float p[LANDSCAPE_MAX_PARAMS+1];
+
+  if (globals->trans_info.rotation_type == TRANS_QUAT) {
+    parameters_to_vector_quater(&params[0], &params[3], &params[7], &params[10],
+                                p, globals->trans_info.weights);
+    return( fit_function_quater(globals, p) );
+  }
+  else {
+    parameters_to_vector(&params[0], &params[3], &params[6], &params[9],
+                         p, globals->trans_info.weights);
+    return( fit_function(globals, p) );
+  }
+}
+
 void make_matlab_data_file(VIO_Volume d1,
                                   VIO_Volume d2,
                                   VIO_Volume m1,
@@ -152,22 +193,29 @@ void make_matlab_data_file(VIO_Volume d1,
 {
 
 
-  VIO_Status
-    status;
-  float 
-    *p;
   int 
-    i,j,stat, 
-    ndim;
-  FILE
-    *ofd;
+    i,j,k,r,stat, 
+    ndim, n_params,
+    param[2];
+  char
+    **names,
+    name[32];
   VIO_Real
-    start,step;
-  double trans[3], quats[4], shears[3], scales[3],rots[3];
+    origin[LANDSCAPE_MAX_PARAMS],
+    step[LANDSCAPE_MAX_PARAMS],
+    delta_arrays[2][LANDSCAPE_MAX_PARAMS],
+    *delta[2],
+    length;
+  unsigned short
+    seed[3];
+  Landscape
+    landscape;
   VIO_Data_types
     data_type;
 
-  start = 0.0;
+  delta[0] = delta_arrays[0];
+  delta[1] = delta_arrays[1];
+
   if (globals->obj_function == zscore_objective) { /* replace volume d1 and d2 by zscore volume  */
     make_zscore_volume(d1,m1,&globals->threshold[0]);
     make_zscore_volume(d2,m2,&globals->threshold[1]);
@@ -236,56 +284,109 @@ void make_matlab_data_file(VIO_Volume d1,
     } 
 
 
-if(globals->trans_info.rotation_type == TRANS_ROT)
-  {
   /* ---------------- prepare the weighting array for for the objective function  ---------*/
 
   stat = TRUE;
-  switch (globals->trans_info.transform_type) {
-  case TRANS_LSQ3: 
-    for(i=3; i<12; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.scales[i] = 1.0;
-      globals->trans_info.rotations[i] = 0.0;
-      globals->trans_info.shears[i] = 0.0;
-    }
-    break;
-  case TRANS_LSQ6: 
-    for(i=6; i<12; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.scales[i] = 1.0;
-      globals->trans_info.shears[i] = 0.0;
-    }
-    break;
-  case TRANS_LSQ7: 
-    for(i=7; i<12; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.shears[i] = 0.0;
-    }
-    break;
-  case TRANS_LSQ9: 
-    for(i=9; i<12; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.shears[i] = 0.0;
+  if (globals->trans_info.rotation_type == TRANS_QUAT) {
+    n_params = 13;
+    names    = quat_names;
+    switch (globals->trans_info.transform_type) {
+    case TRANS_LSQ3: 
+      for(i=3; i<13; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.scales[i] = 1.0;
+        globals->trans_info.quaternions[i] = 0.0;
+        globals->trans_info.shears[i] = 0.0;
+      }
+      globals->trans_info.quaternions[3] = 0.1;
+      break;
+    case TRANS_LSQ6: 
+      for(i=7; i<13; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.scales[i] = 1.0;
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ7: 
+      for(i=8; i<13; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ9: 
+      for(i=10; i<13; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ10: 
+      for(i=11; i<13; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=1; i<3; i++) {
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ: 
+                                  /* nothing to be zeroed */
+      break;
+    case TRANS_LSQ12: 
+                                  /* nothing to be zeroed */
+      break;
+    default:
+      (void)fprintf(stderr, "Unknown type of transformation requested (%d)\n",
+                     globals->trans_info.transform_type);
+      (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
+      stat = FALSE;
     }
-    break;
-  case TRANS_LSQ10: 
-    for(i=10; i<12; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=1; i<3; i++) {
-      globals->trans_info.shears[i] = 0.0;
+  }
+  else {
+    n_params = 12;
+    names    = rot_names;
+    switch (globals->trans_info.transform_type) {
+    case TRANS_LSQ3: 
+      for(i=3; i<12; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.scales[i] = 1.0;
+        globals->trans_info.rotations[i] = 0.0;
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ6: 
+      for(i=6; i<12; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.scales[i] = 1.0;
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ7: 
+      for(i=7; i<12; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ9: 
+      for(i=9; i<12; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=0; i<3; i++) {
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ10: 
+      for(i=10; i<12; i++) globals->trans_info.weights[i] = 0.0;
+      for(i=1; i<3; i++) {
+        globals->trans_info.shears[i] = 0.0;
+      }
+      break;
+    case TRANS_LSQ: 
+                                  /* nothing to be zeroed */
+      break;
+    case TRANS_LSQ12: 
+                                  /* nothing to be zeroed */
+      break;
+    default:
+      (void)fprintf(stderr, "Unknown type of transformation requested (%d)\n",
+                     globals->trans_info.transform_type);
+      (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
+      stat = FALSE;
     }
-    break;
-  case TRANS_LSQ: 
-                                /* nothing to be zeroed */
-    break;
-  case TRANS_LSQ12: 
-                                /* nothing to be zeroed */
-    break;
-  default:
-    (void)fprintf(stderr, "Unknown type of transformation requested (%d)\n",
-                   globals->trans_info.transform_type);
-    (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
-    stat = FALSE;
   }
 
   if ( !stat ) 
@@ -295,7 +396,7 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
 
                                 /* find number of dimensions for obj function */
   ndim = 0;
-  for(i=0; i<12; i++)
+  for(i=0; i<n_params; i++)
     if (globals->trans_info.weights[i] != 0.0) ndim++;
 
 
@@ -308,273 +409,116 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
   Gmask2 = m2;
   Ginverse_mapping_flag = FALSE;
 
+                                /* the parameters, in the order of
+                                   rot_names[] or quat_names[]         */
+  for(i=0; i<3; i++) {
+    origin[i]   = globals->trans_info.translations[i];
+    origin[i+3] = (n_params == 13) ? globals->trans_info.quaternions[i] : 
+                                     globals->trans_info.rotations[i];
+    origin[n_params-6+i] = globals->trans_info.scales[i];
+    origin[n_params-3+i] = globals->trans_info.shears[i];
+  }
+  if (n_params == 13)
+    origin[6] = globals->trans_info.quaternions[3];
+
 print ("trans: %10.5f %10.5f %10.5f \n",
        globals->trans_info.translations[0],globals->trans_info.translations[1],globals->trans_info.translations[2]);
-print ("rots : %10.5f %10.5f %10.5f \n",
-       globals->trans_info.rotations[0],globals->trans_info.rotations[1],globals->trans_info.rotations[2]);
+if (n_params == 13)
+  print ("quats : %10.5f %10.5f %10.5f  %10.5f\n",
+         globals->trans_info.quaternions[0],globals->trans_info.quaternions[1],globals->trans_info.quaternions[2],globals->trans_info.quaternions[3]);
+else
+  print ("rots : %10.5f %10.5f %10.5f \n",
+         globals->trans_info.rotations[0],globals->trans_info.rotations[1],globals->trans_info.rotations[2]);
 print ("scale: %10.5f %10.5f %10.5f \n",
        globals->trans_info.scales[0],globals->trans_info.scales[1],globals->trans_info.scales[2]);
 
 
   if (ndim>0) {
 
-    ALLOC(p,ndim+1); /* parameter values */
-    
-    /*  translation +/- simplex_size
+    /*  each parameter is moved by weight*simplex_size/Matlab_num_steps
+        per step, e.g. with the default weights
+        translation +/- simplex_size
         rotation    +/- simplex_size*DEG_TO_RAD
         scale       +/- simplex_size/50
         */
-    
-    
-    
-    status = open_file(  globals->filenames.matlab_file, WRITE_FILE, BINARY_FORMAT,  &ofd );
-    if ( status != VIO_OK ) 
-      print_error_and_line_num ("filename `%s' cannot be opened.", 
-                   __FILE__, __LINE__, globals->filenames.matlab_file);
-    
-    
-    (void)fprintf (ofd,"%% %s\n",comments);
-    
-    /* do translations */
-    for(j=1; j<=12; j++) {
-      if (globals->trans_info.weights[j-1] != 0.0) {
-        switch (j) {
-        case  1: (void)fprintf (ofd,"tx = [\n"); start = globals->trans_info.translations[0]; break;
-        case  2: (void)fprintf (ofd,"ty = [\n"); start = globals->trans_info.translations[1]; break;
-        case  3: (void)fprintf (ofd,"tz = [\n"); start = globals->trans_info.translations[2]; break;
-        case  4: (void)fprintf (ofd,"rx = [\n"); start = globals->trans_info.rotations[0]; break;
-        case  5: (void)fprintf (ofd,"ry = [\n"); start = globals->trans_info.rotations[1]; break;
-        case  6: (void)fprintf (ofd,"rz = [\n"); start = globals->trans_info.rotations[2]; break;
-        case  7: (void)fprintf (ofd,"sx = [\n"); start = globals->trans_info.scales[0]; break;
-        case  8: (void)fprintf (ofd,"sy = [\n"); start = globals->trans_info.scales[1]; break;
-        case  9: (void)fprintf (ofd,"sz = [\n"); start = globals->trans_info.scales[2]; break;
-        case 10: (void)fprintf (ofd,"shx = [\n");start = globals->trans_info.shears[0]; break;
-        case 11: (void)fprintf (ofd,"shy = [\n");start = globals->trans_info.shears[1]; break;
-        case 12: (void)fprintf (ofd,"shz = [\n");start = globals->trans_info.shears[2]; break; 
-        }
-        
-        for(i=0; i<3; i++) {
-          trans[i]  = globals->trans_info.translations[i];
-          scales[i] = globals->trans_info.scales[i];
-          shears[i] = globals->trans_info.shears[i];
-          rots[i]   = globals->trans_info.rotations[i];
-        }
 
-        step =  globals->trans_info.weights[j-1] * simplex_size/ Matlab_num_steps;
-        
-        for(i=-Matlab_num_steps; i<=Matlab_num_steps; i++) {
-          
-          switch (j) {
-          case  1: trans[0] =start + i*step; break;
-          case  2: trans[1] =start + i*step; break;
-          case  3: trans[2] =start + i*step; break;
-          case  4: rots[0]  =start + i*step; break;
-          case  5: rots[1]  =start + i*step; break;
-          case  6: rots[2]  =start + i*step; break;
-          case  7: scales[0]=start + i*step; break;
-          case  8: scales[1]=start + i*step; break;
-          case  9: scales[2]=start + i*step; break;
-          case 10: shears[0]=start + i*step; break;
-          case 11: shears[1]=start + i*step; break;
-          case 12: shears[2]=start + i*step; break; 
-          }
-          
-          parameters_to_vector(trans,
-                               rots,
-                               scales,
-                               shears,
-                               p,
-                               globals->trans_info.weights);
-    
-          (void)fprintf (ofd, "%f %f %f\n",i*step, start+i*step, fit_function(p));
-        }
+    init_landscape(&landscape, n_params, origin, Matlab_num_steps);
 
-        (void)fprintf (ofd,"];\n"); 
-      }
-    }
-    
-    status = close_file(ofd);
-    if ( status != VIO_OK ) 
-      print_error_and_line_num ("filename `%s' cannot be closed.", 
-                   __FILE__, __LINE__, globals->filenames.matlab_file);
-    
-    
-    FREE(p);
-  }
-  }
+    for(j=0; j<n_params; j++)
+      step[j] = globals->trans_info.weights[j] * simplex_size / Matlab_num_steps;
 
+                                /* one parameter at a time */
+    for(j=0; j<n_params; j++)
+      if (step[j] != 0.0) {
+        param[0] = j;
+        for(i=0; i<n_params; i++) delta[0][i] = (i == j) ? step[j] : 0.0;
+        add_landscape_sweep(&landscape, names[j], 1, param, delta);
+      }
 
-    
-if(globals->trans_info.rotation_type == TRANS_QUAT)
-  {
-  /* ---------------- prepare the weighting array for for the objective function  ---------*/
+                                /* every pair of parameters */
+    if (Landscape_2d)
+      for(j=0; j<n_params; j++)
+        for(k=j+1; k<n_params; k++)
+          if (step[j] != 0.0 && step[k] != 0.0) {
+            param[0] = j;
+            param[1] = k;
+            for(i=0; i<n_params; i++) {
+              delta[0][i] = (i == j) ? step[j] : 0.0;
+              delta[1][i] = (i == k) ? step[k] : 0.0;
+            }
+            (void)sprintf(name, "%s_%s", names[j], names[k]);
+            add_landscape_sweep(&landscape, name, 2, param, delta);
+          }
 
-  stat = TRUE;
-  switch (globals->trans_info.transform_type) {
-  case TRANS_LSQ3: 
-    for(i=3; i<13; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.scales[i] = 1.0;
-      globals->trans_info.quaternions[i] = 0.0;
-      globals->trans_info.shears[i] = 0.0;
-    }
-    globals->trans_info.quaternions[3] = 0.1;
-    break;
-  case TRANS_LSQ6: 
-    for(i=7; i<13; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.scales[i] = 1.0;
-      globals->trans_info.shears[i] = 0.0;
-    }
-    break;
-  case TRANS_LSQ7: 
-    for(i=8; i<13; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.shears[i] = 0.0;
-    }
-    break;
-  case TRANS_LSQ9: 
-    for(i=10; i<13; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=0; i<3; i++) {
-      globals->trans_info.shears[i] = 0.0;
-    }
-    break;
-  case TRANS_LSQ10: 
-    for(i=11; i<13; i++) globals->trans_info.weights[i] = 0.0;
-    for(i=1; i<3; i++) {
-      globals->trans_info.shears[i] = 0.0;
+                                /* random directions, drawn uniformly
+                                   on the sphere of the active
+                                   parameters, scaled by their steps   */
+    seed[0] = 0x330e; seed[1] = 0xabcd; seed[2] = 0x1234;
+    for(r=1; r<=Landscape_random; r++) {
+      do {
+        length = 0.0;
+        for(i=0; i<n_params; i++) {
+          if (step[i] != 0.0) 
+            delta[0][i] = sqrt(-2.0*log(1.0-erand48(seed))) * cos(2.0*M_PI*erand48(seed));
+          else
+            delta[0][i] = 0.0;
+          length += delta[0][i]*delta[0][i];
+        }
+      } while (length == 0.0);
+      for(i=0; i<n_params; i++)
+        delta[0][i] *= step[i] / sqrt(length);
+      param[0] = -1;
+      (void)sprintf(name, "dir%d", r);
+      add_landscape_sweep(&landscape, name, 1, param, delta);
     }
-    break;
-  case TRANS_LSQ: 
-                                /* nothing to be zeroed */
-    break;
-  case TRANS_LSQ12: 
-                                /* nothing to be zeroed */
-    break;
-  default:
-    (void)fprintf(stderr, "Unknown type of transformation requested (%d)\n",
-                   globals->trans_info.transform_type);
-    (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
-    stat = FALSE;
-  }
 
-  if ( !stat ) 
-    print_error_and_line_num ("Can't calculate measure (stat is false).", 
-                              __FILE__, __LINE__);
-
-
-                                /* find number of dimensions for obj function */
-  ndim = 0;
-  for(i=0; i<13; i++)
-    if (globals->trans_info.weights[i] != 0.0) ndim++;
+                                /* the lattice clip and the voxel-space
+                                   context are built once, and shared by
+                                   all the workers                     */
+    init_lattice_clip(Gdata2, Gmask2, globals->threshold[1], 
+                      lattice_clip_uses_threshold(globals));
+    init_voxel_space_context(Gdata1, Gdata2);
 
+    if (globals->flags.debug)
+      print ("landscape: %d sweeps, %ld points, %d jobs\n",
+             landscape.n_sweeps, landscape.n_points, Landscape_jobs);
 
-                                /* set GLOBALS to communicate with the
-                                   function to be fitted!              */
-  Gndim = ndim;
-  Gdata1 = d1;
-  Gdata2 = d2;
-  Gmask1 = m1;
-  Gmask2 = m2;
-  Ginverse_mapping_flag = FALSE;
+    if (!evaluate_landscape(&landscape, landscape_cost, globals, Landscape_jobs))
+      print_error_and_line_num ("Can't evaluate the objective function landscape.", 
+                                __FILE__, __LINE__);
 
-print ("trans: %10.5f %10.5f %10.5f \n",
-       globals->trans_info.translations[0],globals->trans_info.translations[1],globals->trans_info.translations[2]);
-print ("quats : %10.5f %10.5f %10.5f  %10.5f\n",
-       globals->trans_info.quaternions[0],globals->trans_info.quaternions[1],globals->trans_info.quaternions[2],globals->trans_info.quaternions[3]);
-print ("scale: %10.5f %10.5f %10.5f \n",
-       globals->trans_info.scales[0],globals->trans_info.scales[1],globals->trans_info.scales[2]);
+    clear_lattice_clip();
+    clear_voxel_space_context();
+    delete_bspline_coefficients();
 
+    if (!write_landscape(&landscape, globals->filenames.matlab_file, 
+                         Landscape_format, comments))
+      print_error_and_line_num ("filename `%s' cannot be written.", 
+                                __FILE__, __LINE__, globals->filenames.matlab_file);
 
-  if (ndim>0) {
-
-    ALLOC(p,ndim+1); /* parameter values */
-    
-    /*  translation +/- simplex_size
-        rotation    +/- simplex_size*DEG_TO_RAD
-        scale       +/- simplex_size/50
-        */
-    
-    
-    
-    status = open_file(  globals->filenames.matlab_file, WRITE_FILE, BINARY_FORMAT,  &ofd );
-    if ( status != VIO_OK ) 
-      print_error_and_line_num ("filename `%s' cannot be opened.", 
-                   __FILE__, __LINE__, globals->filenames.matlab_file);
-    
-    
-    (void)fprintf (ofd,"%% %s\n",comments);
-    
-    /* do translations */
-    for(j=1; j<=13; j++) {
-      if (globals->trans_info.weights[j-1] != 0.0) {
-        switch (j) {
-        case  1: (void)fprintf (ofd,"tx = [\n"); start = globals->trans_info.translations[0]; break;
-        case  2: (void)fprintf (ofd,"ty = [\n"); start = globals->trans_info.translations[1]; break;
-        case  3: (void)fprintf (ofd,"tz = [\n"); start = globals->trans_info.translations[2]; break;
-        case  4: (void)fprintf (ofd,"rx = [\n"); start = globals->trans_info.quaternions[0]; break;
-        case  5: (void)fprintf (ofd,"ry = [\n"); start = globals->trans_info.quaternions[1]; break;
-        case  6: (void)fprintf (ofd,"rz = [\n"); start = globals->trans_info.quaternions[2]; break;
-        case  7: (void)fprintf (ofd,"rz = [\n"); start = globals->trans_info.quaternions[3]; break;
-        case  8: (void)fprintf (ofd,"sx = [\n"); start = globals->trans_info.scales[0]; break;
-        case  9: (void)fprintf (ofd,"sy = [\n"); start = globals->trans_info.scales[1]; break;
-        case 10: (void)fprintf (ofd,"sz = [\n"); start = globals->trans_info.scales[2]; break;
-        case 11: (void)fprintf (ofd,"shx = [\n");start = globals->trans_info.shears[0]; break;
-        case 12: (void)fprintf (ofd,"shy = [\n");start = globals->trans_info.shears[1]; break;
-        case 13: (void)fprintf (ofd,"shz = [\n");start = globals->trans_info.shears[2]; break; 
-        }
-        
-        for(i=0; i<3; i++) {
-          trans[i]  = globals->trans_info.translations[i];
-          scales[i] = globals->trans_info.scales[i];
-          shears[i] = globals->trans_info.shears[i];
-          quats[i]   = globals->trans_info.quaternions[i];
-        }
-        quats[3] = globals->trans_info.quaternions[3];
-
-        step =  globals->trans_info.weights[j-1] * simplex_size/ Matlab_num_steps;
-        
-        for(i=-Matlab_num_steps; i<=Matlab_num_steps; i++) {
-          
-          switch (j) {
-          case  1: trans[0] =start + i*step; break;
-          case  2: trans[1] =start + i*step; break;
-          case  3: trans[2] =start + i*step; break;
-          case  4: quats[0]  =start + i*step; break;
-          case  5: quats[1]  =start + i*step; break;
-          case  6: quats[2]  =start + i*step; break;
-          case  7: quats[3]  =start + i*step; break;
-          case  8: scales[0]=start + i*step; break;
-          case  9: scales[1]=start + i*step; break;
-          case 10: scales[2]=start + i*step; break;
-          case 11: shears[0]=start + i*step; break;
-          case 12: shears[1]=start + i*step; break;
-          case 13: shears[2]=start + i*step; break; 
-          }
-          
-          parameters_to_vector_quater(trans,
-                                      quats,
-                                      scales,
-                                      shears,
-                                      p,
-                                      globals->trans_info.weights);
-    
-          (void)fprintf (ofd, "%f %f %f\n",i*step, start+i*step, fit_function_quater(p));
-        }
-
-        (void)fprintf (ofd,"];\n"); 
-      }
-    }
-    
-    status = close_file(ofd);
-    if ( status != VIO_OK ) 
-      print_error_and_line_num ("filename `%s' cannot be closed.", 
-                   __FILE__, __LINE__, globals->filenames.matlab_file);
-    
-    
-    FREE(p);
-  }
+    delete_landscape(&landscape);
   }
+
   if (globals->obj_function == vr_objective) {
     if (!free_segment_table(segment_table)) {
       (void)fprintf(stderr, "Can't free segment table.\n");
@@ -31,6 +31,8 @@
 ---------------------------------------------------------------------------- */
 
 
+    Lattice_Measures measures;
+
     init_lattice( data, model, mask_data, mask_model, main_args );
 
     if (main_args->smallest_vol == 1) {
@@ -52,58 +54,28 @@
       print_error_and_line_num ("filename `%s' cannot be opened.", 
                    __FILE__, __LINE__, main_args->filenames.measure_file);
 
-                                /* do zscore and reload */
-
-    main_args->obj_function = zscore_objective;
-    obj_func_val = measure_fit( data, model, mask_data, mask_model, main_args );
-    (void)fprintf (ofd, "%f - zscore\n",obj_func_val);
-    (void)fflush(ofd);
-    DEBUG_PRINT1 ( "%f - zscore\n",obj_func_val);
-    
-    delete_volume(data);  
-    delete_volume(model);  
-
-
-    status = input_volume( main_args->filenames.data, 3, default_dim_names, 
-                          NC_UNSPECIFIED, FALSE, 0.0, 0.0,
-                          TRUE, &data, (minc_input_options *)NULL );
-    status = input_volume( main_args->filenames.model, 3, default_dim_names, 
-                          NC_UNSPECIFIED, FALSE, 0.0, 0.0,
-                          TRUE, &model, (minc_input_options *)NULL );
-
-                                /* do xcorr   */
+                                /* all the measures in one pass over
+                                   the lattice; data and model are left
+                                   as they are, so nothing is reloaded  */
 
-    main_args->obj_function = xcorr_objective;
-    obj_func_val = measure_fit( data, model, mask_data, mask_model, main_args );
-    (void)fprintf (ofd, "%f - xcorr\n",obj_func_val);
-    (void)fflush(ofd);
-    DEBUG_PRINT1 ( "%f - xcorr\n",obj_func_val);
-
-                                /* do var_ratio */
+    if (!measure_lattice( data, model, mask_data, mask_model, main_args, &measures ))
+      print_error_and_line_num ("%s", __FILE__, __LINE__,
+                   "Could not compute the similarity measures\n");
 
-    main_args->obj_function = vr_objective;
-    obj_func_val = measure_fit( data, model, mask_data, mask_model, main_args );
-    (void)fprintf (ofd, "%f - var_ratio\n",obj_func_val);
+    (void)fprintf (ofd, "%f - zscore\n",   measures.zscore);
+    (void)fprintf (ofd, "%f - xcorr\n",    measures.xcorr);
+    (void)fprintf (ofd, "%f - var_ratio\n",measures.var_ratio);
+    (void)fprintf (ofd, "%f - ssc\n",      measures.ssc);
+    (void)fprintf (ofd, "%f - mi\n",       measures.mi);
+    (void)fprintf (ofd, "%f - nmi\n",      measures.nmi);
     (void)fflush(ofd);
-    DEBUG_PRINT1 ( "%f - var_ratio\n",obj_func_val);
-
-    delete_volume(data);  
-    delete_volume(model);  
 
-                                /* do ssc / zero-crossings */
-
-    status = input_volume( main_args->filenames.data, 3, default_dim_names, 
-                          NC_UNSPECIFIED, FALSE, 0.0, 0.0,
-                          TRUE, &data, (minc_input_options *)NULL );
-    status = input_volume( main_args->filenames.model, 3, default_dim_names, 
-                          NC_UNSPECIFIED, FALSE, 0.0, 0.0,
-                          TRUE, &model, (minc_input_options *)NULL ); 
-
-    main_args->obj_function = ssc_objective;
-    obj_func_val = measure_fit( data, model, mask_data, mask_model, main_args );
-    (void)fprintf (ofd, "%f - ssc\n",obj_func_val);
-    (void)fflush(ofd);
-    DEBUG_PRINT1 ( "%f - ssc\n",obj_func_val);
+    DEBUG_PRINT1 ( "%f - zscore\n",   measures.zscore);
+    DEBUG_PRINT1 ( "%f - xcorr\n",    measures.xcorr);
+    DEBUG_PRINT1 ( "%f - var_ratio\n",measures.var_ratio);
+    DEBUG_PRINT1 ( "%f - ssc\n",      measures.ssc);
+    DEBUG_PRINT1 ( "%f - mi\n",       measures.mi);
+    DEBUG_PRINT1 ( "%f - nmi\n",      measures.nmi);
 
 
     status = close_file(ofd);
@@ -24,8 +24,16 @@
 #include <minctracc.h>
 #include <objectives.h>
 #include "local_macros.h"
+#include "measure_lattice.h"
 #include "globaldefs.h"
 
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  BATCH_CAN_FORK
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 
 
@@ -37,6 +45,9 @@ static int obj_func0 = -1;
 static char *default_dim_names[VIO_N_DIMENSIONS] = 
     { MIzspace, MIyspace, MIxspace };
 
+/* longest line accepted in a -batch list file */
+#define BATCH_LINE_LENGTH 4096
+
 
 
 VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volume sourceMask, VIO_Volume targetMask, VIO_General_transform *initialXFM, int iterations, float weight, float simplexSize, float stiffness, float similarity, float sub_lattice, Arg_Data *args) {
@@ -91,6 +102,9 @@ VIO_General_transform* minctracc( VIO_Volume source, VIO_Volume target, VIO_Volu
 	case N_NEIGHBOUR:
 		args->interpolant = nearest_neighbour_interpolant;
 		break;
+	case BSPLINE:
+		args->interpolant = bspline_interpolant;
+		break;
 	default:
 		(void) fprintf(stderr, "Error determining interpolation type: %d\n",args->interpolant_type);
 		return NULL;
@@ -227,6 +241,8 @@ void initializeArgs(Arg_Data *args) {
 	args->filenames.output_trans = "";
 	args->filenames.measure_file = "";
 	args->filenames.matlab_file = "";
+	args->filenames.batch_file = "";
+	args->filenames.checkpoint = "";
 	
 	// Program flags
 	args->flags.verbose = 0; args->flags.debug = FALSE;
@@ -238,7 +254,12 @@ void initializeArgs(Arg_Data *args) {
 	args->trans_info.max_def_magnitude = 50.0;
 	args->trans_info.use_simplex = TRUE;
         args->trans_info.use_bfgs = FALSE;
+	args->trans_info.multi_start = 1;
 	args->trans_info.use_super = 2;
+	args->trans_info.use_warp_cache = 0;
+	args->trans_info.warp_resample = WARP_RESAMPLE_GENERIC;
+	args->trans_info.use_flat_transform = TRUE;
+	args->trans_info.source_cache_mb = 0;
 	args->trans_info.use_local_smoothing = FALSE;
 	args->trans_info.use_local_isotropic = TRUE;
 	args->trans_info.file_name = "";
@@ -394,61 +415,738 @@ int allocate_a_new_feature(Feature_volumes *features)
 }
 
 
-void add_a_feature_for_matching(Feature_volumes *features,
-                                VIO_Volume data_vol,
-                                VIO_Volume model_vol,
-                                VIO_Volume data_mask,
-                                VIO_Volume model_mask,
-                                char *data_name,
-                                char *model_name,
-                                char *mask_data_name,
-                                char *mask_model_name,
-                                char obj_func,
-                                VIO_Real weight,
-                                VIO_Real thresh_data,
-                                VIO_Real thresh_model)
-{
+void add_a_feature_for_matching(Feature_volumes *features,
+                                VIO_Volume data_vol,
+                                VIO_Volume model_vol,
+                                VIO_Volume data_mask,
+                                VIO_Volume model_mask,
+                                char *data_name,
+                                char *model_name,
+                                char *mask_data_name,
+                                char *mask_model_name,
+                                char obj_func,
+                                VIO_Real weight,
+                                VIO_Real thresh_data,
+                                VIO_Real thresh_model)
+{
+
+  int i;
+
+  i = allocate_a_new_feature(features);
+
+  features->data[i]            = data_vol; 
+  features->model[i]           = model_vol;
+  features->data_name[i]       = data_name;
+  features->model_name[i]      = model_name;
+  features->data_mask[i]       = data_mask;
+  features->model_mask[i]      = model_mask;
+  features->mask_data_name[i]  = mask_data_name;
+  features->mask_model_name[i] = mask_model_name;
+  features->thresh_data[i]     = thresh_data;
+  features->thresh_model[i]    = thresh_model;
+  features->obj_func[i]        = obj_func;
+  features->weight[i]          = weight;
+
+}
+
+
+
+
+/* MINCTRACCOLDFASHIONED keeps the same interface as the old minctracc main().  The new minctracc
+  main() forwards its argc and argv to this function.  Eventually maybe I'll fix this to feed through
+  the new minctracc function.
+*/
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : insert_main_feature
+@INPUT      : (nothing)
+@OUTPUT     : (nothing)
+@RETURNS    : (nothing)
+@DESCRIPTION: make the current source/target volumes (data, model and their
+              masks) the first entry of main_args->features, shifting any
+              features given with -feature up by one.
+@METHOD     : 
+@GLOBALS    : data, model, mask_data, mask_model, main_args
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void insert_main_feature(void)
+{
+                                /* shift features to be able to
+                                   insert the main source/target
+                                   volumes first. */
+
+  int i, num_features;
+
+  num_features = allocate_a_new_feature(&(main_args->features));
+  for(i=num_features; i>=1; i--) {
+    main_args->features.data[i]            = main_args->features.data[i-1];
+    main_args->features.model[i]           = main_args->features.model[i-1];
+    main_args->features.data_name[i]       = main_args->features.data_name[i-1];
+    main_args->features.model_name[i]      = main_args->features.model_name[i-1];
+    main_args->features.data_mask[i]       = main_args->features.data_mask[i-1];
+    main_args->features.model_mask[i]      = main_args->features.model_mask[i-1];
+    main_args->features.mask_data_name[i]  = main_args->features.mask_data_name[i-1];
+    main_args->features.mask_model_name[i] = main_args->features.mask_model_name[i-1];
+    main_args->features.thresh_data[i]     = main_args->features.thresh_data[i-1];
+    main_args->features.thresh_model[i]    = main_args->features.thresh_model[i-1];
+    main_args->features.obj_func[i]        = main_args->features.obj_func[i-1];
+    main_args->features.weight[i]          = main_args->features.weight[i-1];
+  }
+
+  main_args->features.data[0]            = data; 
+  main_args->features.model[0]           = model;
+  main_args->features.data_name[0]       = main_args->filenames.data;
+  main_args->features.model_name[0]      = main_args->filenames.model;
+  main_args->features.data_mask[0]       = mask_data;
+  main_args->features.model_mask[0]      = mask_model;
+  main_args->features.mask_data_name[0]  = main_args->filenames.mask_data;
+  main_args->features.mask_model_name[0] = main_args->filenames.mask_model;
+  main_args->features.thresh_data[0]     = main_args->threshold[0];
+  main_args->features.thresh_model[0]    = main_args->threshold[1];
+  if (main_args->trans_info.use_magnitude) {
+    main_args->features.obj_func[0]        = obj_func0;
+  } 
+  else {
+    main_args->features.obj_func[0]        = NONLIN_OPTICALFLOW;    
+  }
+  main_args->features.weight[0]          = 1.0;
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_current_source
+@INPUT      : (nothing)
+@OUTPUT     : (nothing)
+@RETURNS    : TRUE if ok, FALSE on error
+@DESCRIPTION: fit the transformation in main_args from the global data
+              volume to the global model volume, once init_params() has been
+              called.  On return, main_args->trans_info.transformation maps
+              source to target (re-inverted if needed) and is ready to save.
+@METHOD     : 
+@GLOBALS    : data, model, mask_data, mask_model, main_args
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL fit_current_source(void)
+{
+  VIO_General_transform
+    tmp_invert;
+  VIO_Transform 
+    *lt;
+  int 
+    i;
+  float quat4;
+
+  DEBUG_PRINT  ("AFTER init_params()\n");
+  if (get_transform_type(main_args->trans_info.transformation)==LINEAR) {
+    lt = get_linear_transform_ptr(main_args->trans_info.transformation);
+    
+    DEBUG_PRINT ( "Transform matrix    = ");
+    for(i=0; i<4; i++) DEBUG_PRINT1 ("%9.4f ",Transform_elem(*lt,0,i));
+    DEBUG_PRINT ( "\n" );
+    DEBUG_PRINT ( "                      ");
+    for(i=0; i<4; i++) DEBUG_PRINT1 ("%9.4f ",Transform_elem(*lt,1,i));
+    DEBUG_PRINT ( "\n" );
+    DEBUG_PRINT ( "                      ");
+    for(i=0; i<4; i++) DEBUG_PRINT1 ("%9.4f ",Transform_elem(*lt,2,i));
+    DEBUG_PRINT ( "\n" );
+  }
+  DEBUG_PRINT ( "\n" );
+  
+  DEBUG_PRINT3 ( "Transform center   = %8.3f %8.3f %8.3f\n", 
+                main_args->trans_info.center[0],
+                main_args->trans_info.center[1],
+                main_args->trans_info.center[2] );
+  if (main_args->trans_info.rotation_type == TRANS_ROT){
+    DEBUG_PRINT3 ( "Transform rotations  = %8.3f %8.3f %8.3f\n", 
+                   main_args->trans_info.rotations[0],
+                   main_args->trans_info.rotations[1],
+                   main_args->trans_info.rotations[2] );
+  }
+  if (main_args->trans_info.rotation_type == TRANS_QUAT)
+    {
+      quat4=sqrt(1-SQR(main_args->trans_info.quaternions[0])-SQR(main_args->trans_info.quaternions[1])-SQR(main_args->trans_info.quaternions[2]));
+      DEBUG_PRINT4 ( "Transform quaternions  = %8.3f %8.3f %8.3f %8.3f\n", 
+                     main_args->trans_info.quaternions[0],
+                     main_args->trans_info.quaternions[1],
+                     main_args->trans_info.quaternions[2],
+                     quat4 );
+    }
+  
+
+  DEBUG_PRINT3 ( "Transform trans    = %8.3f %8.3f %8.3f\n", 
+                main_args->trans_info.translations[0],
+                main_args->trans_info.translations[1],
+                main_args->trans_info.translations[2] );
+  DEBUG_PRINT3 ( "Transform scale    = %8.3f %8.3f %8.3f\n", 
+                main_args->trans_info.scales[0],
+                main_args->trans_info.scales[1],
+                main_args->trans_info.scales[2] );
+  DEBUG_PRINT3 ( "Transform shear    = %8.3f %8.3f %8.3f\n\n", 
+                main_args->trans_info.shears[0],
+                main_args->trans_info.shears[1],
+                main_args->trans_info.shears[2] );
+  
+
+
+                                /* do not do any optimization if the transformation
+                                   requested is the Principal Axes Transformation 
+                                   then:
+                                   =======   do linear fitting =============== */
+  
+  if (main_args->trans_info.transform_type != TRANS_PAT) {
+    
+                                /* initialize the sampling lattice and figure out
+                                   which of the two volumes is smaller.           */
+    
+    init_lattice( data, model, mask_data, mask_model, main_args );
+
+    if (main_args->smallest_vol == 1) {
+      DEBUG_PRINT("Source volume is smallest\n");
+    }
+    else {
+      DEBUG_PRINT("Target volume is smallest\n");
+    }
+    DEBUG_PRINT3 ( "Lattice step size  = %8.3f %8.3f %8.3f\n",
+                  main_args->step[0],main_args->step[1],main_args->step[2]);
+    DEBUG_PRINT3 ( "Lattice start      = %8.3f %8.3f %8.3f\n",
+                  main_args->start[0],main_args->start[1],main_args->start[2]);
+    DEBUG_PRINT3 ( "Lattice count      = %8d %8d %8d\n\n",
+                  main_args->count[0],main_args->count[1],main_args->count[2]);
+
+
+                                /* calculate the actual transformation now. */
+
+    if (main_args->trans_info.transform_type == TRANS_NONLIN) {
+
+      build_default_deformation_field(main_args);
+      
+
+      if ( !optimize_non_linear_transformation( main_args ) ) {
+        print_error_and_line_num("Error in optimization of non-linear transformation\n",
+                                 __FILE__, __LINE__);
+        return(FALSE);
+      }
+      
+    }
+    else {
+      
+      if (main_args->trans_info.rotation_type == TRANS_ROT )
+        {
+          if (!optimize_linear_transformation( data, model, mask_data, mask_model, main_args )) {
+            print_error_and_line_num("Error in optimization of linear transformation\n",
+                                 __FILE__, __LINE__);
+        return(FALSE);
+          }
+        }
+      
+      
+      if (main_args->trans_info.rotation_type == TRANS_QUAT )
+        {
+          if (!optimize_linear_transformation_quater( data, model, mask_data, mask_model, main_args )) {
+            print_error_and_line_num("Error in optimization of linear transformation\n",
+                                 __FILE__, __LINE__);
+        return(FALSE);
+          }
+        }
+      
+      
+    }
+
+    if (number_dimensions==3 && main_args->flags.verbose>0) {
+      print ("Initial objective function val = %0.8f\n",initial_corr); 
+      print ("Final objective function value = %0.8f\n",final_corr);
+    }
+
+  }
+
+
+                        /* if I have internally inverted the transform,
+                           than flip it back forward before the save.   */
+
+  if (main_args->trans_info.invert_mapping_flag) {
+
+    DEBUG_PRINT ("Re-inverting transformation\n");
+    create_inverse_general_transform(main_args->trans_info.transformation,
+                                     &tmp_invert);
+
+    copy_general_transform(&tmp_invert,main_args->trans_info.transformation);
+
+  }
+
+  return(TRUE);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : release_feature_arrays
+@INPUT      : features
+@OUTPUT     : (nothing)
+@RETURNS    : (nothing)
+@DESCRIPTION: free the arrays allocated by allocate_a_new_feature(), but
+              (unlike free_features()) leave the volumes alone, since the
+              batch code shares the target volume between jobs.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void release_feature_arrays(Feature_volumes *features)
+{
+  if (features->number_of_features == 0)
+    return;
+
+  FREE(features->data); 
+  FREE(features->model); 
+  FREE(features->data_mask); 
+  FREE(features->model_mask); 
+  FREE(features->data_name);
+  FREE(features->model_name);
+  FREE(features->mask_data_name);
+  FREE(features->mask_model_name);
+  FREE(features->obj_func);
+  FREE(features->weight);
+  FREE(features->thresh_data);
+  FREE(features->thresh_model);
+  features->number_of_features = 0;
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : run_batch_job
+@INPUT      : source     - source volume filename
+              mask_name  - source mask filename, or NULL to use -source_mask
+              xfm_name   - initial transformation, or NULL to use the one
+                           given on the command line (or the default)
+              output     - output transformation filename
+              start_xfm  - command line initial transformation
+              target     - the shared target volume
+              copy_target- TRUE if the objective function modifies the
+                           target in place, so each job needs its own copy
+              comments   - history string for the output file
+@OUTPUT     : (nothing)
+@RETURNS    : TRUE if the transformation was fitted and saved
+@DESCRIPTION: one source-to-target registration of a -batch run.  main_args
+              must hold a fresh copy of the parsed command line options;
+              everything allocated here is released before returning.
+@METHOD     : 
+@GLOBALS    : data, model, mask_data, main_args
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL run_batch_job(char *source, char *mask_name, 
+                              char *xfm_name, char *output,
+                              VIO_General_transform *start_xfm,
+                              VIO_Volume target, VIO_BOOL copy_target,
+                              char *comments)
+{
+  VIO_General_transform
+    input_xfm;
+  VIO_Volume
+    source_mask;
+  VIO_Status 
+    status;
+  VIO_BOOL
+    stat;
+
+  main_args->filenames.data         = source;
+  main_args->filenames.output_trans = output;
+
+  ALLOC(main_args->trans_info.transformation,1);
+  if (xfm_name != NULL) {
+    if (input_transform_file(xfm_name, &input_xfm) != VIO_OK) {
+      (void)fprintf(stderr, "Error reading transformation file %s.\n", xfm_name);
+      FREE(main_args->trans_info.transformation);
+      return(FALSE);
+    }
+    copy_general_transform(&input_xfm, main_args->trans_info.transformation);
+    delete_general_transform(&input_xfm);
+    main_args->trans_info.file_name  = xfm_name;
+    main_args->trans_info.use_default = FALSE;
+  }
+  else
+    copy_general_transform(start_xfm, main_args->trans_info.transformation);
+
+  ALLOC(main_args->trans_info.orig_transformation,1);
+  copy_general_transform(main_args->trans_info.transformation,
+                         main_args->trans_info.orig_transformation);
+
+  stat = TRUE;
+  data = source_mask = (VIO_Volume)NULL;
+
+  status = input_volume( source, 3, default_dim_names, 
+                         NC_DOUBLE, FALSE, 0.0, 0.0,
+                         TRUE, &data, (minc_input_options *)NULL );
+  if (status != VIO_OK) {
+    (void)fprintf(stderr, "Cannot input volume '%s'\n", source);
+    stat = FALSE;
+  }
+  else if (get_volume_n_dimensions(data)!=3) {
+    (void)fprintf(stderr, "Data file %s has %d dimensions.  Only 3 dims supported.\n",
+                  source, get_volume_n_dimensions(data));
+    stat = FALSE;
+  }
+  data_dxyz = data;
+
+  if (stat && mask_name != NULL) {
+    status = input_volume( mask_name, 3, default_dim_names, 
+                           NC_UNSPECIFIED, FALSE, 0.0, 0.0,
+                           TRUE, &source_mask, (minc_input_options *)NULL );
+    if (status != VIO_OK) {
+      (void)fprintf(stderr, "Cannot input mask file %s.\n", mask_name);
+      source_mask = (VIO_Volume)NULL;
+      stat = FALSE;
+    }
+    else {
+      mask_data = source_mask;
+      main_args->filenames.mask_data = mask_name;
+    }
+  }
+
+  if (stat) {
+    model = copy_target ? copy_volume(target) : target;
+    model_dxyz = model;
+
+    insert_main_feature();
+
+    if (!init_params( data, model, mask_data, mask_model, main_args )) {
+      (void)fprintf(stderr, "Could not initialize transformation parameters\n");
+      stat = FALSE;
+    }
+    else
+      stat = fit_current_source();
+
+    if (stat) {
+      status = output_transform_file(output, comments,
+                                     main_args->trans_info.transformation);
+      if (status != VIO_OK) {
+        (void)fprintf(stderr, "Error saving transformation file %s.\n", output);
+        stat = FALSE;
+      }
+    }
+
+    release_feature_arrays(&(main_args->features));
+    if (copy_target)
+      (void)delete_volume(model);
+    model = model_dxyz = target;
+  }
+
+  if (source_mask != (VIO_Volume)NULL)
+    (void)delete_volume(source_mask);
+  if (data != (VIO_Volume)NULL)
+    (void)delete_volume(data);
+  data = data_dxyz = (VIO_Volume)NULL;
+
+  delete_general_transform(main_args->trans_info.transformation);
+  FREE(main_args->trans_info.transformation);
+  delete_general_transform(main_args->trans_info.orig_transformation);
+  FREE(main_args->trans_info.orig_transformation);
+
+  return(stat);
+}
+
+
+#ifdef BATCH_CAN_FORK
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : wait_for_batch_job
+@INPUT      : pid, job - process id and job number of the running jobs
+              n_running- number of running jobs
+@OUTPUT     : pid, job, n_running - the finished job is removed
+@RETURNS    : the number of jobs that failed (0 or 1, or all of them if
+              the children cannot be waited for)
+@DESCRIPTION: wait for any one of the -batch_jobs child processes started
+              by minctracc_batch() and check its exit status.  A wait
+              interrupted by a signal is started again; only having no
+              children left to wait for (ECHILD) loses the jobs.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static int wait_for_batch_job(pid_t pid[], int job[], int *n_running)
+{
+  pid_t
+    done;
+  int
+    k, wstatus, n_failed;
+
+  do {
+    done = waitpid(-1, &wstatus, 0);
+  } while (done == -1 && errno == EINTR);
+
+  for(k=0; k<*n_running && pid[k]!=done; k++);
+
+  if (k == *n_running) {
+    (void)fprintf(stderr, "Lost track of %d batch jobs.\n", *n_running);
+    n_failed = *n_running;
+    *n_running = 0;
+    return(n_failed);
+  }
+
+  n_failed = 0;
+  if (!WIFEXITED(wstatus)) {    /* a job that exits reports its own error */
+    (void)fprintf(stderr, "Batch job %d failed.\n", job[k]);
+    n_failed = 1;
+  }
+  else if (WEXITSTATUS(wstatus) != 0)
+    n_failed = 1;
+
+  (*n_running)--;
+  pid[k] = pid[*n_running];
+  job[k] = job[*n_running];
+
+  return(n_failed);
+}
+#endif
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : minctracc_batch
+@INPUT      : comments - history string for the output files
+@OUTPUT     : (nothing)
+@RETURNS    : VIO_OK if every job succeeded, EXIT_FAILURE otherwise
+@DESCRIPTION: register every source listed in main_args->filenames.batch_file
+              to the target main_args->filenames.model, with the options
+              given on the command line.  Each line of the list holds
+
+                 <source> <output_xfm>
+              or
+                 <source> <source_mask> <initial_xfm> <output_xfm>
+
+              where '-' stands for no mask (or the -source_mask volume) and
+              for the command line initial transformation.  Blank lines and
+              lines starting with '#' are ignored.
+
+              The target volume, its mask and any type conversion done to
+              the target (e.g. bytes for -mi) are done once and shared by all
+              jobs; each output transformation is written as soon as its fit
+              is done.  A failed job is reported and the next one started.
+              With -checkpoint <base>, job n (counting the jobs of the list
+              from 1) saves its state to <base>.n, so -resume continues each
+              job from its own checkpoint.
+@METHOD     : jobs are run one after the other, or, with -batch_jobs n > 1,
+              each in a child process forked from the state reached
+              after the target was read, with at most n of them running
+              at a time.  The objective functions and optimizers keep
+              their state in globals, which each child has its own copy
+              of; the parent only collects the exit statuses.  A job
+              that cannot be forked is run in the parent.
+@GLOBALS    : data, model, mask_data, mask_model, main_args, clobber_flag,
+              batch_jobs
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static int minctracc_batch(char *comments)
+{
+  FILE
+    *fp;
+  char
+    line[BATCH_LINE_LENGTH],
+    *field[4],
+    *token,
+    *checkpoint;
+  int
+    line_num, n_fields, n_jobs, n_failed;
+  Arg_Data
+    saved_args;
+  VIO_General_transform
+    *start_xfm;
+  VIO_Volume
+    target,
+    source_mask;
+  VIO_BOOL
+    copy_target;
+  VIO_Status 
+    status;
+#ifdef BATCH_CAN_FORK
+  VIO_BOOL
+    job_ok;
+  pid_t
+    *pid;
+  int
+    *job, n_running;
+#endif
+
+  if (main_args->features.number_of_features > 0) {
+    (void)fprintf(stderr, "-feature cannot be used with -batch.\n");
+    return(EXIT_FAILURE);
+  }
+
+                                /* the weights are those of one source */
+  if (sample_weights != (VIO_Volume)NULL) {
+    (void)fprintf(stderr, "-sample_weights cannot be used with -batch.\n");
+    return(EXIT_FAILURE);
+  }
+
+  fp = fopen(main_args->filenames.batch_file, "r");
+  if (fp == NULL) {
+    (void)fprintf(stderr, "Cannot open batch file %s.\n", main_args->filenames.batch_file);
+    return(EXIT_FAILURE);
+  }
+
+                                /* the target is read (and converted, if
+                                   needed) only once */
+  status = input_volume( main_args->filenames.model, 3, default_dim_names, 
+                         NC_DOUBLE, FALSE, 0.0, 0.0,
+                         TRUE, &model, (minc_input_options *)NULL );
+  if (status != VIO_OK)
+    print_error_and_line_num("Cannot input volume '%s'",
+                             __FILE__, __LINE__,main_args->filenames.model);
+  if (get_volume_n_dimensions(model)!=3) 
+    print_error_and_line_num ("Model file %s has %d dimensions.  Only 3 dims supported.", 
+                              __FILE__, __LINE__, main_args->filenames.model, 
+                              get_volume_n_dimensions(model));
+  model_dxyz = target = model;
+
+                                /* zscore and ssc replace the target's
+                                   values in place */
+  copy_target = (main_args->obj_function == zscore_objective ||
+                 main_args->obj_function == ssc_objective);
+
+  saved_args  = *main_args;
+  start_xfm   = main_args->trans_info.transformation;
+  source_mask = mask_data;
+
+  line_num = n_jobs = n_failed = 0;
+
+                                /* each job has its own -checkpoint */
+  checkpoint = NULL;
+  if (strlen(main_args->filenames.checkpoint) > 0)
+    ALLOC(checkpoint, strlen(main_args->filenames.checkpoint)+32);
+
+#ifdef BATCH_CAN_FORK
+  n_running = 0;
+  if (batch_jobs > 1) {
+    ALLOC(pid, batch_jobs);
+    ALLOC(job, batch_jobs);
+  }
+#endif
+
+  while (fgets(line, BATCH_LINE_LENGTH, fp) != NULL) {
+    line_num++;
+
+    n_fields = 0;
+    for(token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+      if (n_fields == 0 && token[0] == '#') break;
+      if (n_fields < 4) field[n_fields] = token;
+      n_fields++;
+    }
+
+    if (n_fields == 0) 
+      continue;
+
+    n_jobs++;
 
-  int i;
+    if (n_fields != 2 && n_fields != 4) {
+      (void)fprintf(stderr, "%s, line %d: expected 2 or 4 fields, found %d.\n",
+                    main_args->filenames.batch_file, line_num, n_fields);
+      n_failed++;
+      continue;
+    }
 
-  i = allocate_a_new_feature(features);
+    if (n_fields == 2) {
+      field[3] = field[1];
+      field[1] = field[2] = "-";
+    }
 
-  features->data[i]            = data_vol; 
-  features->model[i]           = model_vol;
-  features->data_name[i]       = data_name;
-  features->model_name[i]      = model_name;
-  features->data_mask[i]       = data_mask;
-  features->model_mask[i]      = model_mask;
-  features->mask_data_name[i]  = mask_data_name;
-  features->mask_model_name[i] = mask_model_name;
-  features->thresh_data[i]     = thresh_data;
-  features->thresh_model[i]    = thresh_model;
-  features->obj_func[i]        = obj_func;
-  features->weight[i]          = weight;
+    if (!clobber_flag && file_exists(field[3])) {
+      (void)fprintf (stderr,"Output file %s exists.  Use -clobber to overwrite.\n", field[3]);
+      n_failed++;
+      continue;
+    }
 
-}
+    if (main_args->flags.verbose>0)
+      print ("\n===== batch job %d: %s -> %s\n", n_jobs, field[0], field[3]);
 
+                                /* start every job from the command line
+                                   options */
+    *main_args = saved_args;
+    mask_data  = source_mask;
 
+    if (checkpoint != NULL) {
+      (void)sprintf(checkpoint, "%s.%d", saved_args.filenames.checkpoint, n_jobs);
+      main_args->filenames.checkpoint = checkpoint;
+    }
 
+#ifdef BATCH_CAN_FORK
+    if (batch_jobs > 1) {
+      if (n_running == batch_jobs)
+        n_failed += wait_for_batch_job(pid, job, &n_running);
+
+      (void)fflush(stdout);     /* or the children print it again */
+      (void)fflush(stderr);
+
+      pid[n_running] = fork();
+      if (pid[n_running] == 0) {
+        job_ok = run_batch_job(field[0], 
+                               strcmp(field[1],"-")==0 ? (char *)NULL : field[1],
+                               strcmp(field[2],"-")==0 ? (char *)NULL : field[2],
+                               field[3], start_xfm, target, copy_target, comments);
+        if (!job_ok)
+          (void)fprintf(stderr, "Batch job %d (%s) failed.\n", n_jobs, field[0]);
+        (void)fflush(stdout);
+        _exit(job_ok ? 0 : 1);
+      }
+      if (pid[n_running] > 0) {
+        job[n_running++] = n_jobs;
+        continue;
+      }
+                                /* no child: run the job here */
+    }
+#endif
+
+    if (!run_batch_job(field[0], 
+                       strcmp(field[1],"-")==0 ? (char *)NULL : field[1],
+                       strcmp(field[2],"-")==0 ? (char *)NULL : field[2],
+                       field[3], start_xfm, target, copy_target, comments)) {
+      (void)fprintf(stderr, "Batch job %d (%s) failed.\n", n_jobs, field[0]);
+      n_failed++;
+    }
+  }
+
+  (void)fclose(fp);
+
+#ifdef BATCH_CAN_FORK
+  while (n_running > 0)
+    n_failed += wait_for_batch_job(pid, job, &n_running);
+  if (batch_jobs > 1) {
+    FREE(pid);
+    FREE(job);
+  }
+#endif
+
+  if (checkpoint != NULL)
+    FREE(checkpoint);
+
+  *main_args = saved_args;
+  mask_data  = source_mask;
+
+  if (main_args->flags.verbose>0)
+    print ("\nBatch done: %d of %d registrations succeeded.\n", n_jobs-n_failed, n_jobs);
+
+  return( n_failed > 0 ? EXIT_FAILURE : VIO_OK );
+}
 
-/* MINCTRACCOLDFASHIONED keeps the same interface as the old minctracc main().  The new minctracc
-  main() forwards its argc and argv to this function.  Eventually maybe I'll fix this to feed through
-  the new minctracc function.
-*/
 
 int minctraccOldFashioned ( int argc, char* argv[] )
 {
   VIO_Status 
     status;
-  VIO_General_transform
-    tmp_invert;
   VIO_Transform 
     *lt, ident_trans;
   int
     parse_flag,
     measure_matlab_flag,
+    batch_flag,
     
-    sizes[3],i,num_features;
+    sizes[3],i;
   VIO_Real
     min_value, max_value, step[3];
   char 
@@ -480,6 +1178,9 @@ int minctraccOldFashioned ( int argc, char* argv[] )
   case N_NEIGHBOUR:
     main_args->interpolant = nearest_neighbour_interpolant;
     break;
+  case BSPLINE:
+    main_args->interpolant = bspline_interpolant;
+    break;
   default:
     (void) fprintf(stderr, "Error determining interpolation type\n");
     exit(EXIT_FAILURE);
@@ -512,9 +1213,12 @@ int minctraccOldFashioned ( int argc, char* argv[] )
   if(main_args->trans_info.use_bfgs)
     main_args->optimize_type=OPT_BFGS;
 
+  batch_flag = (strlen(main_args->filenames.batch_file) != 0);
+
   if (parse_flag || 
-      (measure_matlab_flag && argc!=3) ||
-      (!measure_matlab_flag && argc!=4)) {
+      (batch_flag && (measure_matlab_flag || argc!=2)) ||
+      (!batch_flag && measure_matlab_flag && argc!=3) ||
+      (!batch_flag && !measure_matlab_flag && argc!=4)) {
 
     print ("Parameters left:\n");
     for(i=0; i<argc; i++)
@@ -524,6 +1228,7 @@ int minctraccOldFashioned ( int argc, char* argv[] )
     (void)fprintf(stderr, 
                   "\nUsage: %s [<options>] <sourcefile> <targetfile> <output transfile>\n", 
                   prog_name);
+    (void)fprintf(stderr,"       %s [<options>] -batch <listfile> <targetfile>\n", prog_name);
     (void)fprintf(stderr,"       %s [-help]\n\n", prog_name);
 
 
@@ -538,11 +1243,17 @@ int minctraccOldFashioned ( int argc, char* argv[] )
     exit(EXIT_FAILURE);
   }
 
-  main_args->filenames.data  = argv[1];        /* set up necessary file names */
-  main_args->filenames.model = argv[2];
-  if (strlen(main_args->filenames.measure_file)==0 &&
-      strlen(main_args->filenames.matlab_file)==0) 
-    main_args->filenames.output_trans = argv[3];
+  if (batch_flag) {
+    main_args->filenames.model = argv[1];     /* sources and outputs are
+                                                 listed in the batch file */
+  }
+  else {
+    main_args->filenames.data  = argv[1];        /* set up necessary file names */
+    main_args->filenames.model = argv[2];
+    if (strlen(main_args->filenames.measure_file)==0 &&
+        strlen(main_args->filenames.matlab_file)==0) 
+      main_args->filenames.output_trans = argv[3];
+  }
 
 
                                 /* check to see if they can be overwritten */
@@ -590,6 +1301,13 @@ int minctraccOldFashioned ( int argc, char* argv[] )
   if (main_args->trans_info.use_identity)
     main_args->trans_info.use_default = FALSE;
 
+  if (batch_flag) {
+    status = minctracc_batch(comments);
+    if( comments ) 
+      FREE( comments );
+    return( status );
+  }
+
 
                                 /* make a copy of the original transformation */
 
@@ -802,43 +1520,7 @@ int minctraccOldFashioned ( int argc, char* argv[] )
     }
 
 
-                                /* shift features to be able to
-                                   insert the main source/target
-                                   volumes first. */
-
-  num_features = allocate_a_new_feature(&(main_args->features));
-  for(i=num_features; i>=1; i--) {
-    main_args->features.data[i]            = main_args->features.data[i-1];
-    main_args->features.model[i]           = main_args->features.model[i-1];
-    main_args->features.data_name[i]       = main_args->features.data_name[i-1];
-    main_args->features.model_name[i]      = main_args->features.model_name[i-1];
-    main_args->features.data_mask[i]       = main_args->features.data_mask[i-1];
-    main_args->features.model_mask[i]      = main_args->features.model_mask[i-1];
-    main_args->features.mask_data_name[i]  = main_args->features.mask_data_name[i-1];
-    main_args->features.mask_model_name[i] = main_args->features.mask_model_name[i-1];
-    main_args->features.thresh_data[i]     = main_args->features.thresh_data[i-1];
-    main_args->features.thresh_model[i]    = main_args->features.thresh_model[i-1];
-    main_args->features.obj_func[i]        = main_args->features.obj_func[i-1];
-    main_args->features.weight[i]          = main_args->features.weight[i-1];
-  }
-
-  main_args->features.data[0]            = data; 
-  main_args->features.model[0]           = model;
-  main_args->features.data_name[0]       = main_args->filenames.data;
-  main_args->features.model_name[0]      = main_args->filenames.model;
-  main_args->features.data_mask[0]       = mask_data;
-  main_args->features.model_mask[0]      = mask_model;
-  main_args->features.mask_data_name[0]  = main_args->filenames.mask_data;
-  main_args->features.mask_model_name[0] = main_args->filenames.mask_model;
-  main_args->features.thresh_data[0]     = main_args->threshold[0];
-  main_args->features.thresh_model[0]    = main_args->threshold[1];
-  if (main_args->trans_info.use_magnitude) {
-    main_args->features.obj_func[0]        = obj_func0;
-  } 
-  else {
-    main_args->features.obj_func[0]        = NONLIN_OPTICALFLOW;    
-  }
-  main_args->features.weight[0]          = 1.0;
+  insert_main_feature();
 
   /* ===========================  translate initial transformation matrix into 
                                   transformation parameters */
@@ -866,144 +1548,8 @@ int minctraccOldFashioned ( int argc, char* argv[] )
        exit(status); */
     }
 
-  DEBUG_PRINT  ("AFTER init_params()\n");
-  if (get_transform_type(main_args->trans_info.transformation)==LINEAR) {
-    lt = get_linear_transform_ptr(main_args->trans_info.transformation);
-    
-    DEBUG_PRINT ( "Transform matrix    = ");
-    for(i=0; i<4; i++) DEBUG_PRINT1 ("%9.4f ",Transform_elem(*lt,0,i));
-    DEBUG_PRINT ( "\n" );
-    DEBUG_PRINT ( "                      ");
-    for(i=0; i<4; i++) DEBUG_PRINT1 ("%9.4f ",Transform_elem(*lt,1,i));
-    DEBUG_PRINT ( "\n" );
-    DEBUG_PRINT ( "                      ");
-    for(i=0; i<4; i++) DEBUG_PRINT1 ("%9.4f ",Transform_elem(*lt,2,i));
-    DEBUG_PRINT ( "\n" );
-  }
-  DEBUG_PRINT ( "\n" );
-  
-  DEBUG_PRINT3 ( "Transform center   = %8.3f %8.3f %8.3f\n", 
-                main_args->trans_info.center[0],
-                main_args->trans_info.center[1],
-                main_args->trans_info.center[2] );
-  if (main_args->trans_info.rotation_type == TRANS_ROT){
-    DEBUG_PRINT3 ( "Transform rotations  = %8.3f %8.3f %8.3f\n", 
-                   main_args->trans_info.rotations[0],
-                   main_args->trans_info.rotations[1],
-                   main_args->trans_info.rotations[2] );
-  }
-  if (main_args->trans_info.rotation_type == TRANS_QUAT)
-    {
-      quat4=sqrt(1-SQR(main_args->trans_info.quaternions[0])-SQR(main_args->trans_info.quaternions[1])-SQR(main_args->trans_info.quaternions[2]));
-      DEBUG_PRINT4 ( "Transform quaternions  = %8.3f %8.3f %8.3f %8.3f\n", 
-                     main_args->trans_info.quaternions[0],
-                     main_args->trans_info.quaternions[1],
-                     main_args->trans_info.quaternions[2],
-                     quat4 );
-    }
-  
-
-  DEBUG_PRINT3 ( "Transform trans    = %8.3f %8.3f %8.3f\n", 
-                main_args->trans_info.translations[0],
-                main_args->trans_info.translations[1],
-                main_args->trans_info.translations[2] );
-  DEBUG_PRINT3 ( "Transform scale    = %8.3f %8.3f %8.3f\n", 
-                main_args->trans_info.scales[0],
-                main_args->trans_info.scales[1],
-                main_args->trans_info.scales[2] );
-  DEBUG_PRINT3 ( "Transform shear    = %8.3f %8.3f %8.3f\n\n", 
-                main_args->trans_info.shears[0],
-                main_args->trans_info.shears[1],
-                main_args->trans_info.shears[2] );
-  
-
-
-                                /* do not do any optimization if the transformation
-                                   requested is the Principal Axes Transformation 
-                                   then:
-                                   =======   do linear fitting =============== */
-  
-  if (main_args->trans_info.transform_type != TRANS_PAT) {
-    
-                                /* initialize the sampling lattice and figure out
-                                   which of the two volumes is smaller.           */
-    
-    init_lattice( data, model, mask_data, mask_model, main_args );
-
-    if (main_args->smallest_vol == 1) {
-      DEBUG_PRINT("Source volume is smallest\n");
-    }
-    else {
-      DEBUG_PRINT("Target volume is smallest\n");
-    }
-    DEBUG_PRINT3 ( "Lattice step size  = %8.3f %8.3f %8.3f\n",
-                  main_args->step[0],main_args->step[1],main_args->step[2]);
-    DEBUG_PRINT3 ( "Lattice start      = %8.3f %8.3f %8.3f\n",
-                  main_args->start[0],main_args->start[1],main_args->start[2]);
-    DEBUG_PRINT3 ( "Lattice count      = %8d %8d %8d\n\n",
-                  main_args->count[0],main_args->count[1],main_args->count[2]);
-
-
-                                /* calculate the actual transformation now. */
-
-    if (main_args->trans_info.transform_type == TRANS_NONLIN) {
-
-      build_default_deformation_field(main_args);
-      
-
-      if ( !optimize_non_linear_transformation( main_args ) ) {
-        print_error_and_line_num("Error in optimization of non-linear transformation\n",
-                                 __FILE__, __LINE__);
-        exit(EXIT_FAILURE);
-      }
-      
-    }
-    else {
-      
-      if (main_args->trans_info.rotation_type == TRANS_ROT )
-        {
-          if (!optimize_linear_transformation( data, model, mask_data, mask_model, main_args )) {
-            print_error_and_line_num("Error in optimization of linear transformation\n",
-                                 __FILE__, __LINE__);
-        exit(EXIT_FAILURE);
-          }
-        }
-      
-      
-      if (main_args->trans_info.rotation_type == TRANS_QUAT )
-        {
-          if (!optimize_linear_transformation_quater( data, model, mask_data, mask_model, main_args )) {
-            print_error_and_line_num("Error in optimization of linear transformation\n",
-                                 __FILE__, __LINE__);
-        exit(EXIT_FAILURE);
-          }
-        }
-      
-      
-    }
-
-    if (number_dimensions==3 && main_args->flags.verbose>0) {
-      print ("Initial objective function val = %0.8f\n",initial_corr); 
-      print ("Final objective function value = %0.8f\n",final_corr);
-    }
-
-  }
-
-
-                        /* if I have internally inverted the transform,
-                           than flip it back forward before the save.   */
-
-  if (main_args->trans_info.invert_mapping_flag) {
-
-    DEBUG_PRINT ("Re-inverting transformation\n");
-    create_inverse_general_transform(main_args->trans_info.transformation,
-                                     &tmp_invert);
-
-    copy_general_transform(&tmp_invert,main_args->trans_info.transformation);
-
-  }
-
-
+  if (!fit_current_source())
+    exit(EXIT_FAILURE);
 
 
   /* ===========================   write out transformation =============== */
@@ -1189,6 +1735,42 @@ int get_mask_file(char *dst, char *key, char *nextArg)
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_sample_weights_file
+@INPUT      : dst - Pointer to client data from argument table
+              key - argument key
+              nextArg - argument following key
+@OUTPUT     : (nothing) 
+@RETURNS    : TRUE so that ParseArgv will discard nextArg
+@DESCRIPTION: Routine called by ParseArgv to read in the volume used to
+              weight the importance-sampled lattice (-sample_budget) and
+              nodes (-node_budget), typically the gradient magnitude of
+              the source (mincblur -gradient).
+@METHOD     : 
+@GLOBALS    : sample_weights
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+/* ARGSUSED */
+int get_sample_weights_file(char *dst, char *key, char *nextArg)
+{ 
+  VIO_Status status;
+
+  status = input_volume( nextArg, 3, default_dim_names, 
+                        NC_UNSPECIFIED, FALSE, 0.0, 0.0,
+                        TRUE, &sample_weights, (minc_input_options *)NULL );
+
+  if (status != VIO_OK)
+  {
+    (void)fprintf(stderr, "Cannot input sample weights file %s.",nextArg);
+    return(FALSE);
+  } 
+
+  return TRUE;
+}
+
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : get_feature volumes
 @INPUT      : dst - Pointer to client data from argument table
@@ -117,6 +117,7 @@ static char rcsid[]="";
 #include "minctracc_arg_data.h"
 #include "local_macros.h"
 #include "constants.h"
+#include "warp_resample.h"
 
 #define MY_MAX_VOX 32766.0
 #define MY_MAX_REAL 50.0
@@ -164,6 +165,11 @@ void build_default_deformation_field(Arg_Data *globals)
    equivalent, where the volumetric definition of the new deformation
    field corresponds to the data in *globals, and the values in this
    new structure must be interpolated from the existing deformation field.
+
+   With -warp_resample_linear, -cubic or -bspline, the values are
+   interpolated directly from the existing displacement volume by
+   resample_warp_volume() (see warp_resample.c), instead of evaluating
+   the grid transform at each node.
 */
 
 static void resample_the_deformation_field(Arg_Data *globals)
@@ -304,6 +310,17 @@ static void resample_the_deformation_field(Arg_Data *globals)
   }
 
   alloc_volume_data(new_field);
+
+  if (globals->trans_info.warp_resample != WARP_RESAMPLE_GENERIC) {
+    if (!resample_warp_volume(existing_field, new_field, 
+                              globals->trans_info.warp_resample))
+      print_error_and_line_num("Cannot resample the deformation field",
+                               __FILE__, __LINE__);
+
+    delete_volume(non_lin_part->displacement_volume);
+    non_lin_part->displacement_volume = new_field;
+    return;
+  }
   
   if (globals->flags.verbose>0)
     initialize_progress_report( &progress, FALSE, count[xyzv[VIO_X]],
@@ -102,7 +102,7 @@
    volume_io.h and amoeba.h are needed for inclusion.
 
    there are four  functions that the user has to call (in order):
-   initialize_amoeba(), 
+   initialize_amoeba() (or initialize_parallel_amoeba()), 
    perform_amoeba(),
    get_amoeba_parameters(),
    terminate_amoeba()
@@ -125,6 +125,19 @@
                                                  function
       VIO_Real              tolerance )              the stopping tolerance
     
+   1b: initialize_parallel_amoeba(amoeba, n_jobs, ...) takes the same
+      arguments after n_jobs.  With n_jobs > 1, the function values that
+      do not depend on each other are computed in up to n_jobs child
+      processes at a time: the vertices of the initial simplex, the
+      vertices of a shrink, and, at each step, the reflection together
+      with the expansion and both contractions that may follow it.  The
+      step then takes the branch the serial algorithm would take with
+      those values, so that the simplex follows the same path; only the
+      evaluations the serial algorithm would have made are counted in
+      num_funks.  The function must not depend on state changed by
+      earlier calls, since the calls made in a child are not seen by
+      the parent.
+
    2: perform_amoeba(amoeba) is then called to actually do the optimization.
       The function returns TRUE if the optimization is successful, otherwise
       it returns FALSE.
@@ -152,6 +165,13 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include <volume_io.h>
 #include <amoeba.h>
 
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  AMOEBA_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #define  FLIP_RATIO      1.0
 #define  CONTRACT_RATIO  0.5
 #define  STRETCH_RATIO   2.0
@@ -225,24 +245,116 @@ static  VIO_Real  get_function_value(
 }
 
 /* ----------------------------- MNI Header -----------------------------------
-@NAME       : initialize_amoeba
-@INPUT      : n_parameters
-              initial_parameters
-              parameter_deltas
-              function
-              function_data
-              tolerance
+@NAME       : get_function_values
+@INPUT      : amoeba
+              n_points
+              points
+@OUTPUT     : values
+@RETURNS    : 
+@DESCRIPTION: Evaluates the function at n_points independent points, in
+              up to amoeba->n_jobs child processes at a time.  Each child
+              sends its value back through a pipe; a point that cannot be
+              sent to a child (or whose child fails) is evaluated here.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static  void  get_function_values(
+    amoeba_struct  *amoeba,
+    int            n_points,
+    float          *points[],
+    VIO_Real       values[] )
+{
+    int      i;
+#ifdef AMOEBA_CAN_FORK
+    int      first, n_batch, fds[2], *fd;
+    pid_t    *pid;
+    ssize_t  n_read;
+    VIO_Real value;
+
+    if( amoeba->n_jobs > 1 && n_points > 1 )
+    {
+        ALLOC( pid, amoeba->n_jobs );
+        ALLOC( fd, amoeba->n_jobs );
+
+        for( first = 0; first < n_points; first += n_batch )
+        {
+            n_batch = MIN( amoeba->n_jobs, n_points - first );
+
+            (void) fflush( stdout );     /* or the children print it again */
+            (void) fflush( stderr );
+
+            for(i=0; i<n_batch; i++)
+            {
+                pid[i] = -1;
+                fd[i]  = -1;
+                if( pipe( fds ) != 0 )
+                    continue;
+
+                pid[i] = fork();
+                if( pid[i] == 0 )
+                {
+                    (void) close( fds[0] );
+                    value = get_function_value( amoeba, points[first+i] );
+                    (void) fflush( stdout );
+                    _exit( write( fds[1], &value, sizeof(value) ) ==
+                           (ssize_t) sizeof(value) ? 0 : 1 );
+                }
+
+                (void) close( fds[1] );
+                if( pid[i] < 0 )
+                    (void) close( fds[0] );
+                else
+                    fd[i] = fds[0];
+            }
+
+            for(i=0; i<n_batch; i++)
+            {
+                n_read = 0;
+                if( fd[i] >= 0 )
+                {
+                    n_read = read( fd[i], &values[first+i], sizeof(VIO_Real) );
+                    (void) close( fd[i] );
+                }
+                if( pid[i] > 0 )
+                    (void) waitpid( pid[i], NULL, 0 );
+
+                if( n_read != (ssize_t) sizeof(VIO_Real) )
+                    values[first+i] = get_function_value( amoeba, points[first+i] );
+            }
+        }
+
+        FREE( pid );
+        FREE( fd );
+        return;
+    }
+#endif
+
+    for(i=0; i<n_points; i++)
+        values[i] = get_function_value( amoeba, points[i] );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : initialize_parallel_amoeba
+@INPUT      : n_jobs       - number of function values computed at once
+              (the others as for initialize_amoeba)
 @OUTPUT     : amoeba
 @RETURNS    : 
-@DESCRIPTION: Initializes the amoeba structure to minimize the function.
+@DESCRIPTION: Initializes the amoeba structure to minimize the function,
+              evaluating the vertices of the initial simplex (and, unless
+              MNI_AUTOREG_OLD_AMOEBA_INIT is defined, the forward and
+              backward step along each parameter) n_jobs at a time.
 @METHOD     : 
 @GLOBALS    : 
 @CALLS      : 
 @CREATED    :         1993    David MacDonald
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
- void  initialize_amoeba(
+ void  initialize_parallel_amoeba(
     amoeba_struct     *amoeba,
+    int               n_jobs,
     int               n_parameters,
     VIO_Real              initial_parameters[],
     VIO_Real              parameter_delta,
@@ -250,18 +362,14 @@ static  VIO_Real  get_function_value(
     void              *function_data,
     VIO_Real              tolerance )
 {
-    int    i, j;
-    
-#ifndef MNI_AUTOREG_OLD_AMOEBA_INIT
-    float *parameter_fwd;
-    float *parameter_bwd;
-    VIO_Real cost_fwd;
-    VIO_Real cost_bwd;
-#endif 
+    int      i, j, k, n_points;
+    float    **points;
+    VIO_Real *costs;
 
     amoeba->n_parameters = n_parameters;
     amoeba->function = function;
     amoeba->function_data = function_data;
+    amoeba->n_jobs = n_jobs;
 
     amoeba->tolerance = tolerance;
     amoeba->n_steps_no_improvement = 0;
@@ -269,58 +377,90 @@ static  VIO_Real  get_function_value(
     ALLOC( amoeba->values, n_parameters+1 );
 
     ALLOC( amoeba->sum, n_parameters );
-    
-#ifndef MNI_AUTOREG_OLD_AMOEBA_INIT
-    ALLOC( parameter_fwd, n_parameters);
-    ALLOC( parameter_bwd, n_parameters);
+
+#ifdef MNI_AUTOREG_OLD_AMOEBA_INIT
+    n_points = n_parameters+1;          /* the vertices                    */
+#else
+    n_points = 2*n_parameters+1;        /* the start, and a step forward and
+                                           backward along each parameter   */
 #endif
+    VIO_ALLOC2D( points, n_points, n_parameters );
+    ALLOC( costs, n_points );
+
+    for(i=0; i<n_points; i++)
+        for(j=0; j<n_parameters; j++)
+            points[i][j] = (float) initial_parameters[j];
 
     for(j=0; j<n_parameters; j++)
-        amoeba->sum[j] = 0.0;
-    
-    for(i=0; i<n_parameters+1; i++)
     {
-        for(j=0; j<n_parameters; j++)
-        {
 #ifdef MNI_AUTOREG_OLD_AMOEBA_INIT
-            amoeba->parameters[i][j] = (float) initial_parameters[j];
+        points[j+1][j] += parameter_delta;
 #else
-            parameter_fwd[j] = (float) initial_parameters[j];
-            parameter_bwd[j] = (float) initial_parameters[j];
+        points[2*j+1][j] += parameter_delta;
+        points[2*j+2][j] -= parameter_delta;
 #endif
-            if( i > 0 && j == i - 1 )
-#ifdef MNI_AUTOREG_OLD_AMOEBA_INIT
-                amoeba->parameters[i][j] += parameter_delta;
-            amoeba->sum[j] += amoeba->parameters[i][j];
-#else
-            {
-              parameter_fwd[j] += parameter_delta;
-              parameter_bwd[j] -= parameter_delta;
-            }
-#endif
-        }
+    }
+
+    /* the start is evaluated here, so that whatever the function sets up
+       on its first call is inherited by the children */
+    costs[0] = get_function_value( amoeba, points[0] );
+    get_function_values( amoeba, n_points-1, &points[1], &costs[1] );
 
+    for(j=0; j<n_parameters; j++)
+        amoeba->sum[j] = 0.0;
+
+    for(i=0; i<n_parameters+1; i++)
+    {
 #ifdef MNI_AUTOREG_OLD_AMOEBA_INIT
-      amoeba->values[i] = get_function_value( amoeba, amoeba->parameters[i] );
+        k = i;
 #else
-      // Test the parameters 
-      cost_fwd = get_function_value( amoeba, parameter_fwd);
-      cost_bwd = get_function_value( amoeba, parameter_bwd);
-
-      // Use the one with the lowest value
-      for(j=0; j<n_parameters; j++)
-      {
-          amoeba->parameters[i][j] = ( cost_fwd < cost_bwd ) ? parameter_fwd[j] : parameter_bwd[j];
-          amoeba->sum[j] += amoeba->parameters[i][j];
-      }
-      amoeba->values[i] = ( cost_fwd < cost_bwd ) ? cost_fwd : cost_bwd;
+        // Use the step with the lowest value
+        if( i == 0 )
+            k = 0;
+        else
+            k = ( costs[2*i-1] < costs[2*i] ) ? 2*i-1 : 2*i;
 #endif
+        for(j=0; j<n_parameters; j++)
+        {
+            amoeba->parameters[i][j] = points[k][j];
+            amoeba->sum[j] += amoeba->parameters[i][j];
+        }
+        amoeba->values[i] = costs[k];
     }
-    
-#ifndef MNI_AUTOREG_OLD_AMOEBA_INIT
-    FREE( parameter_fwd );
-    FREE( parameter_bwd );
-#endif    
+
+    VIO_FREE2D( points );
+    FREE( costs );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : initialize_amoeba
+@INPUT      : n_parameters
+              initial_parameters
+              parameter_deltas
+              function
+              function_data
+              tolerance
+@OUTPUT     : amoeba
+@RETURNS    : 
+@DESCRIPTION: Initializes the amoeba structure to minimize the function.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    :         1993    David MacDonald
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+ void  initialize_amoeba(
+    amoeba_struct     *amoeba,
+    int               n_parameters,
+    VIO_Real              initial_parameters[],
+    VIO_Real              parameter_delta,
+    amoeba_function   function,
+    void              *function_data,
+    VIO_Real              tolerance )
+{
+    initialize_parallel_amoeba( amoeba, 1, n_parameters, initial_parameters,
+                                parameter_delta, function, function_data,
+                                tolerance );
 }
 
 /* ----------------------------- MNI Header -----------------------------------
@@ -376,6 +516,76 @@ static  VIO_Real  get_function_value(
     FREE( amoeba->sum );
 }
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_amoeba_point
+@INPUT      : amoeba
+              sum
+              high_parameters
+              fac
+@OUTPUT     : parameters
+@RETURNS    : 
+@DESCRIPTION: Computes the point fac of the way from the centroid of the
+              other vertices to the high vertex (fac < 0 reflects it).
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    :         1993    David MacDonald
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static  void  get_amoeba_point(
+    amoeba_struct  *amoeba,
+    VIO_Real       sum[],
+    float          high_parameters[],
+    VIO_Real       fac,
+    float          parameters[] )
+{
+    int    j;
+    VIO_Real   fac1, fac2;
+
+    fac1 = (1.0 - fac) / amoeba->n_parameters;
+    fac2 = fac - fac1;
+
+    for(j=0; j<amoeba->n_parameters; j++)
+        parameters[j] = sum[j] * fac1 + high_parameters[j] * fac2;
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : accept_amoeba_point
+@INPUT      : amoeba
+              sum
+              high
+              parameters
+              y_try
+@OUTPUT     : 
+@RETURNS    : 
+@DESCRIPTION: Replaces the high vertex of the amoeba by the new point if
+              its value y_try is better (smaller).
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    :         1993    David MacDonald
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static  void  accept_amoeba_point(
+    amoeba_struct  *amoeba,
+    VIO_Real       sum[],
+    int            high,
+    float          parameters[],
+    VIO_Real       y_try )
+{
+    int    j;
+
+    if( y_try < amoeba->values[high] )
+    {
+        amoeba->values[high] = y_try;
+        for(j=0; j<amoeba->n_parameters; j++)
+        {
+            sum[j] += parameters[j] - amoeba->parameters[high][j];
+            amoeba->parameters[high][j] = parameters[j];
+        }
+    }
+}
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : try_amoeba
 @INPUT      : amoeba
@@ -400,34 +610,174 @@ static  VIO_Real  try_amoeba(
     int            high,
     VIO_Real       fac )
 {
-    int    j;
-    VIO_Real   y_try, fac1, fac2;
+    VIO_Real   y_try;
     float  *parameters;
 
     ALLOC( parameters, amoeba->n_parameters );
 
-    fac1 = (1.0 - fac) / amoeba->n_parameters;
-    fac2 = fac - fac1;
+    get_amoeba_point( amoeba, sum, amoeba->parameters[high], fac, parameters );
 
-    for(j=0; j<amoeba->n_parameters; j++)
-        parameters[j] = sum[j] * fac1 + amoeba->parameters[high][j] * fac2;
+    y_try = get_function_value( amoeba, parameters );
 
+    accept_amoeba_point( amoeba, sum, high, parameters, y_try );
 
-    y_try = get_function_value( amoeba, parameters );
+    FREE( parameters );
 
-    if( y_try < amoeba->values[high] )
+    return( y_try );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : shrink_amoeba
+@INPUT      : amoeba
+              low
+@OUTPUT     : num_funks
+@RETURNS    : 
+@DESCRIPTION: Moves every vertex of the amoeba half way to the low vertex.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    :         1993    David MacDonald
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static  void  shrink_amoeba(
+    amoeba_struct  *amoeba,
+    int            low,
+    int            *num_funks )
+{
+    int       i, j, n_points;
+    float     **points;
+    VIO_Real  *values;
+
+    ALLOC( points, amoeba->n_parameters );
+    ALLOC( values, amoeba->n_parameters );
+
+    n_points = 0;
+    for(i=0; i<amoeba->n_parameters+1; i++)
     {
-        amoeba->values[high] = y_try;
-        for(j=0; j<amoeba->n_parameters; j++)
+        if( i != low )
         {
-            sum[j] += parameters[j] - amoeba->parameters[high][j];
-            amoeba->parameters[high][j] = parameters[j];
+            for(j=0; j<amoeba->n_parameters; j++)
+            {
+                amoeba->parameters[i][j] = (amoeba->parameters[i][j] +
+                                    amoeba->parameters[low][j]) / 2.0;
+            }
+            points[n_points++] = amoeba->parameters[i];
         }
     }
 
-    FREE( parameters );
+    get_function_values( amoeba, n_points, points, values );
+    (*num_funks) += n_points;
 
-    return( y_try );
+    n_points = 0;
+    for(i=0; i<amoeba->n_parameters+1; i++)
+        if( i != low )
+            amoeba->values[i] = values[n_points++];
+
+    for(j=0; j<amoeba->n_parameters; j++)
+    {
+        amoeba->sum[j] = 0.0;
+        for(i=0; i<amoeba->n_parameters+1; i++)
+            amoeba->sum[j] += amoeba->parameters[i][j];
+    }
+
+    FREE( points );
+    FREE( values );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : speculative_amoeba_step
+@INPUT      : amoeba
+              low
+              high
+              next_high
+@OUTPUT     : num_funks
+@RETURNS    : 
+@DESCRIPTION: The reflection, expansion and contraction of one step of
+              perform_amoeba(), with the four points that may be needed
+              evaluated together: the reflection, the expansion and the
+              contraction from the reflected vertex (both used if the
+              reflection replaces the high vertex), and the contraction
+              from the high vertex (used if it does not).  The points are
+              computed exactly as try_amoeba() would compute them, so the
+              amoeba ends up where the serial step leaves it; num_funks
+              counts the evaluations the serial step would have made.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+
+#define  SPEC_REFLECT       0
+#define  SPEC_STRETCH       1
+#define  SPEC_CONTRACT_OUT  2           /* from the reflected vertex */
+#define  SPEC_CONTRACT_IN   3           /* from the high vertex      */
+#define  N_SPECULATIVE      4
+
+static  void  speculative_amoeba_step(
+    amoeba_struct  *amoeba,
+    int            low,
+    int            high,
+    int            next_high,
+    int            *num_funks )
+{
+    int       j;
+    float     **points;
+    VIO_Real  *reflected_sum, y_save, values[N_SPECULATIVE];
+    VIO_BOOL  reflected;
+
+    VIO_ALLOC2D( points, N_SPECULATIVE, amoeba->n_parameters );
+    ALLOC( reflected_sum, amoeba->n_parameters );
+
+    get_amoeba_point( amoeba, amoeba->sum, amoeba->parameters[high],
+                      -FLIP_RATIO, points[SPEC_REFLECT] );
+
+                                /* sum if the reflection replaces high */
+    for(j=0; j<amoeba->n_parameters; j++)
+    {
+        reflected_sum[j] = amoeba->sum[j];
+        reflected_sum[j] += points[SPEC_REFLECT][j] - amoeba->parameters[high][j];
+    }
+
+    get_amoeba_point( amoeba, reflected_sum, points[SPEC_REFLECT],
+                      STRETCH_RATIO, points[SPEC_STRETCH] );
+    get_amoeba_point( amoeba, reflected_sum, points[SPEC_REFLECT],
+                      CONTRACT_RATIO, points[SPEC_CONTRACT_OUT] );
+    get_amoeba_point( amoeba, amoeba->sum, amoeba->parameters[high],
+                      CONTRACT_RATIO, points[SPEC_CONTRACT_IN] );
+
+    get_function_values( amoeba, N_SPECULATIVE, points, values );
+
+                                /* now follow perform_amoeba()          */
+    reflected = ( values[SPEC_REFLECT] < amoeba->values[high] );
+
+    accept_amoeba_point( amoeba, amoeba->sum, high,
+                         points[SPEC_REFLECT], values[SPEC_REFLECT] );
+    (*num_funks)++;
+
+    if( values[SPEC_REFLECT] <= amoeba->values[low] )
+    {
+        if( reflected )
+            accept_amoeba_point( amoeba, amoeba->sum, high,
+                                 points[SPEC_STRETCH], values[SPEC_STRETCH] );
+        else                    /* flat simplex: low == high == reflection */
+            (void) try_amoeba( amoeba, amoeba->sum, high, STRETCH_RATIO );
+        (*num_funks)++;
+    }
+    else if( values[SPEC_REFLECT] >= amoeba->values[next_high] )
+    {
+        y_save = amoeba->values[high];
+        j = reflected ? SPEC_CONTRACT_OUT : SPEC_CONTRACT_IN;
+        accept_amoeba_point( amoeba, amoeba->sum, high,
+                             points[j], values[j] );
+        (*num_funks)++;
+
+        if( values[j] >= y_save )
+            shrink_amoeba( amoeba, low, num_funks );
+    }
+
+    VIO_FREE2D( points );
+    FREE( reflected_sum );
 }
 
 #define  N_STEPS_NO_IMPROVEMENT  6
@@ -451,7 +801,7 @@ static  VIO_Real  try_amoeba(
  VIO_BOOL  perform_amoeba(
     amoeba_struct  *amoeba, int *num_funks )
 {
-    int     i, j, low, high, next_high;
+    int     i, low, high, next_high;
     VIO_Real    y_try, y_save;
     VIO_BOOL  improvement_found;
     VIO_Real tol;
@@ -501,6 +851,12 @@ static  VIO_Real  try_amoeba(
     else
         amoeba->n_steps_no_improvement = 0;
 
+    if( amoeba->n_jobs > 1 )
+    {
+        speculative_amoeba_step( amoeba, low, high, next_high, num_funks );
+        return( improvement_found );
+    }
+
     y_try = try_amoeba( amoeba, amoeba->sum, high, -FLIP_RATIO );
     (*num_funks)++;
 
@@ -515,30 +871,7 @@ static  VIO_Real  try_amoeba(
         (*num_funks)++;
         
         if( y_try >= y_save )
-        {
-            for(i=0; i<amoeba->n_parameters+1; i++)
-            {
-                if( i != low )
-                {
-                    for(j=0; j<amoeba->n_parameters; j++)
-                    {
-                        amoeba->parameters[i][j] = (amoeba->parameters[i][j] +
-                                            amoeba->parameters[low][j]) / 2.0;
-                    }
-
-                    amoeba->values[i] = get_function_value( amoeba,
-                                                  amoeba->parameters[i] );
-                    (*num_funks)++;
-                }
-            }
-
-            for(j=0; j<amoeba->n_parameters; j++)
-            {
-                amoeba->sum[j] = 0.0;
-                for(i=0; i<amoeba->n_parameters+1; i++)
-                    amoeba->sum[j] += amoeba->parameters[i][j];
-            }
-        }
+            shrink_amoeba( amoeba, low, num_funks );
     }
 
     return( improvement_found );
@@ -0,0 +1,420 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : cost_landscape.c
+@DESCRIPTION: sweeps of the objective function around a transformation,
+              used by -matlab.
+
+  these include:
+     init_landscape() -          start an empty landscape around a set of
+                                 parameters
+     add_landscape_sweep() -     add a 1D sweep (along one parameter or a
+                                 direction mixing several) or a 2D grid
+     evaluate_landscape() -      compute the cost at every point, in a pool
+                                 of worker processes
+     write_landscape() -         write the costs as matlab vectors, as CSV
+                                 or in a compact binary file
+     delete_landscape() -        free everything
+
+  A sweep has one or two axes; along each, the parameters change by
+  delta[] per step, from -n_steps to +n_steps steps away from the
+  origin.  The points of all sweeps are numbered one after the other,
+  and evaluate_landscape() hands them out round-robin to n_jobs forked
+  workers.  The cost function is called once in the parent first, so
+  that whatever it builds on its first call (the lattice clip, the
+  voxel-space context, B-spline coefficients...) is shared by all the
+  workers rather than rebuilt by each.  Each worker keeps its costs
+  until it is done and then sends them back through a pipe; points
+  whose worker could not be started, or failed, are computed by the
+  parent, so the result does not depend on n_jobs.
+
+  The binary file holds, in native byte order:
+
+     char   magic[8]                    LANDSCAPE_MAGIC
+     int    n_params, n_steps, n_sweeps
+     double origin[n_params]
+     and for each sweep:
+        char   name[32]
+        int    n_axes, param[2]
+        double delta[2][n_params]
+        float  cost[(2*n_steps+1)^n_axes]       first axis fastest
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "cost_landscape.h"
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  LANDSCAPE_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+void init_landscape(Landscape *landscape, int n_params,
+                    VIO_Real origin[], int n_steps)
+{
+  int i;
+
+  landscape->n_params = MIN(n_params, LANDSCAPE_MAX_PARAMS);
+  landscape->n_steps  = MAX(n_steps, 1);
+  for(i=0; i<LANDSCAPE_MAX_PARAMS; i++)
+    landscape->origin[i] = (i < landscape->n_params) ? origin[i] : 0.0;
+
+  landscape->n_sweeps = 0;
+  landscape->sweeps   = NULL;
+  landscape->n_points = 0;
+  landscape->values   = NULL;
+}
+
+long get_landscape_sweep_size(Landscape *landscape, int n_axes)
+{
+  long n;
+
+  n = 2*landscape->n_steps + 1;
+  return( n_axes == 2 ? n*n : n );
+}
+
+void add_landscape_sweep(Landscape *landscape, char *name, int n_axes,
+                         int param[], VIO_Real *delta[])
+{
+  Landscape_Sweep *sweep;
+  int a, i;
+
+  if (landscape->n_sweeps == 0)
+    ALLOC(landscape->sweeps, 1);
+  else
+    SET_ARRAY_SIZE(landscape->sweeps, landscape->n_sweeps, landscape->n_sweeps+1, 1);
+
+  sweep = &landscape->sweeps[ landscape->n_sweeps++ ];
+
+  (void)strncpy(sweep->name, name, sizeof(sweep->name)-1);
+  sweep->name[ sizeof(sweep->name)-1 ] = '\0';
+
+  sweep->n_axes = (n_axes == 2) ? 2 : 1;
+  for(a=0; a<2; a++) {
+    sweep->param[a] = (a < sweep->n_axes) ? param[a] : -1;
+    for(i=0; i<LANDSCAPE_MAX_PARAMS; i++)
+      sweep->delta[a][i] = (a < sweep->n_axes && i < landscape->n_params) ? delta[a][i] : 0.0;
+  }
+
+  sweep->first = landscape->n_points;
+  landscape->n_points += get_landscape_sweep_size(landscape, sweep->n_axes);
+}
+
+/* the steps along each axis of point k of the landscape, and the
+   sweep it belongs to */
+
+static Landscape_Sweep *get_landscape_point(Landscape *landscape, long k,
+                                            int steps[])
+{
+  Landscape_Sweep *sweep;
+  long n, m;
+  int s;
+
+  for(s=landscape->n_sweeps-1; s>0 && landscape->sweeps[s].first > k; s--)
+    ;
+  sweep = &landscape->sweeps[s];
+
+  n = 2*landscape->n_steps + 1;
+  m = k - sweep->first;
+  steps[0] = (int)(m % n) - landscape->n_steps;
+  steps[1] = (sweep->n_axes == 2) ? (int)(m / n) - landscape->n_steps : 0;
+
+  return(sweep);
+}
+
+static float get_landscape_cost(Landscape *landscape, long k,
+                                Landscape_Function function, void *data)
+{
+  Landscape_Sweep *sweep;
+  VIO_Real params[LANDSCAPE_MAX_PARAMS];
+  int i, steps[2];
+
+  sweep = get_landscape_point(landscape, k, steps);
+
+  for(i=0; i<landscape->n_params; i++)
+    params[i] = landscape->origin[i] +
+      steps[0]*sweep->delta[0][i] + steps[1]*sweep->delta[1][i];
+
+  return( (*function)(params, data) );
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : evaluate_landscape
+@INPUT      : landscape - its sweeps
+              function  - cost of a set of parameters, and its data
+              n_jobs    - number of worker processes
+@OUTPUT     : landscape->values
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: worker w computes the points w, w+n_jobs, w+2*n_jobs...
+              see the top of this file.
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_BOOL evaluate_landscape(Landscape *landscape,
+                            Landscape_Function function, void *data,
+                            int n_jobs)
+{
+  unsigned char *done;
+  long k;
+#ifdef LANDSCAPE_CAN_FORK
+  int w, fds[2], *fd;
+  pid_t *pid;
+  long n_mine;
+  float *mine;
+  VIO_BOOL ok;
+#endif
+
+  if (landscape->n_points == 0)
+    return(TRUE);
+
+  if (landscape->values == NULL)
+    ALLOC(landscape->values, landscape->n_points);
+  ALLOC(done, landscape->n_points);
+  for(k=0; k<landscape->n_points; k++)
+    done[k] = FALSE;
+
+#ifdef LANDSCAPE_CAN_FORK
+  n_jobs = (int)MIN((long)n_jobs, landscape->n_points);
+
+  if (n_jobs > 1) {
+                                /* build whatever the cost function
+                                   caches, once, before forking      */
+    (void)(*function)(landscape->origin, data);
+
+    ALLOC(pid, n_jobs);
+    ALLOC(fd,  n_jobs);
+
+    (void) fflush( stdout );    /* or the workers print it again */
+    (void) fflush( stderr );
+
+    for(w=0; w<n_jobs; w++) {
+      pid[w] = -1;
+      fd[w]  = -1;
+      if (pipe(fds) != 0)
+        continue;
+
+      pid[w] = fork();
+      if (pid[w] == 0) {
+        (void) close( fds[0] );
+        n_mine = (landscape->n_points - w + n_jobs - 1) / n_jobs;
+        ALLOC(mine, n_mine);
+        for(k=w; k<landscape->n_points; k+=n_jobs)
+          mine[k/n_jobs] = get_landscape_cost(landscape, k, function, data);
+        (void) fflush( stdout );
+        _exit( transfer_all(fds[1], (char *)mine, n_mine*sizeof(float), TRUE) ? 0 : 1 );
+      }
+
+      (void) close( fds[1] );
+      if (pid[w] < 0)
+        (void) close( fds[0] );
+      else
+        fd[w] = fds[0];
+    }
+
+    for(w=0; w<n_jobs; w++) {
+      if (fd[w] >= 0) {
+        n_mine = (landscape->n_points - w + n_jobs - 1) / n_jobs;
+        ALLOC(mine, n_mine);
+        ok = transfer_all(fd[w], (char *)mine, n_mine*sizeof(float), FALSE);
+        (void) close( fd[w] );
+        if (ok)
+          for(k=w; k<landscape->n_points; k+=n_jobs) {
+            landscape->values[k] = mine[k/n_jobs];
+            done[k] = TRUE;
+          }
+        FREE(mine);
+      }
+      if (pid[w] > 0)
+        (void) waitpid( pid[w], NULL, 0 );
+    }
+
+    FREE(pid);
+    FREE(fd);
+  }
+#endif
+
+  for(k=0; k<landscape->n_points; k++)
+    if (!done[k])
+      landscape->values[k] = get_landscape_cost(landscape, k, function, data);
+
+  FREE(done);
+
+  return(TRUE);
+}
+
+
+/* offset from the origin and value along one axis of a sweep: in
+   parameter units along a parameter, in fractions of the sweep along
+   a direction */
+
+static void get_axis_position(Landscape *landscape, Landscape_Sweep *sweep,
+                              int a, int step, VIO_Real *offset, VIO_Real *value)
+{
+  if (sweep->param[a] >= 0) {
+    *offset = step * sweep->delta[a][ sweep->param[a] ];
+    *value  = landscape->origin[ sweep->param[a] ] + *offset;
+  }
+  else
+    *offset = *value = (VIO_Real)step / landscape->n_steps;
+}
+
+static void write_direction(FILE *ofd, Landscape *landscape,
+                            Landscape_Sweep *sweep, char *prefix)
+{
+  int a, i;
+
+  for(a=0; a<sweep->n_axes; a++)
+    if (sweep->param[a] < 0) {
+      (void)fprintf (ofd, "%s %s step %d = [", prefix, sweep->name, a+1);
+      for(i=0; i<landscape->n_params; i++)
+        (void)fprintf (ofd, " %g", sweep->delta[a][i]);
+      (void)fprintf (ofd, " ]\n");
+    }
+}
+
+static VIO_BOOL write_landscape_binary(FILE *ofd, Landscape *landscape)
+{
+  Landscape_Sweep *sweep;
+  int a, s, header[3];
+  size_t n;
+
+  header[0] = landscape->n_params;
+  header[1] = landscape->n_steps;
+  header[2] = landscape->n_sweeps;
+
+  if (fwrite(LANDSCAPE_MAGIC, 1, 8, ofd) != 8 ||
+      fwrite(header, sizeof(int), 3, ofd) != 3 ||
+      fwrite(landscape->origin, sizeof(VIO_Real), landscape->n_params, ofd) != landscape->n_params)
+    return(FALSE);
+
+  for(s=0; s<landscape->n_sweeps; s++) {
+    sweep = &landscape->sweeps[s];
+    n = get_landscape_sweep_size(landscape, sweep->n_axes);
+
+    if (fwrite(sweep->name, 1, sizeof(sweep->name), ofd) != sizeof(sweep->name) ||
+        fwrite(&sweep->n_axes, sizeof(int), 1, ofd) != 1 ||
+        fwrite(sweep->param, sizeof(int), 2, ofd) != 2)
+      return(FALSE);
+    for(a=0; a<2; a++)
+      if (fwrite(sweep->delta[a], sizeof(VIO_Real), landscape->n_params, ofd) != landscape->n_params)
+        return(FALSE);
+    if (fwrite(&landscape->values[ sweep->first ], sizeof(float), n, ofd) != n)
+      return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : write_landscape
+@INPUT      : landscape - evaluated by evaluate_landscape()
+              filename
+              format    - LANDSCAPE_MATLAB: one matlab matrix per sweep,
+                             with rows of offset and value along each
+                             axis, then the cost
+                          LANDSCAPE_CSV: the same rows, for all sweeps,
+                             in a single table
+                          LANDSCAPE_BINARY: see the top of this file
+              comments  - written on the first line (not in binary)
+@OUTPUT     :
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION:
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_BOOL write_landscape(Landscape *landscape, char *filename,
+                         int format, char *comments)
+{
+  VIO_Status status;
+  FILE *ofd;
+  Landscape_Sweep *sweep;
+  VIO_Real offset[2], value[2];
+  VIO_BOOL ok;
+  long k, n;
+  int s, steps[2];
+
+  status = open_file( filename, WRITE_FILE, BINARY_FORMAT, &ofd );
+  if (status != VIO_OK)
+    return(FALSE);
+
+  if (format == LANDSCAPE_BINARY)
+    ok = write_landscape_binary(ofd, landscape);
+  else {
+
+    if (format == LANDSCAPE_CSV) {
+      (void)fprintf (ofd, "# %s\n", comments);
+      for(s=0; s<landscape->n_sweeps; s++)
+        write_direction(ofd, landscape, &landscape->sweeps[s], "#");
+      (void)fprintf (ofd, "sweep,offset1,value1,offset2,value2,cost\n");
+    }
+    else
+      (void)fprintf (ofd, "%% %s\n", comments);
+
+    for(s=0; s<landscape->n_sweeps; s++) {
+      sweep = &landscape->sweeps[s];
+      n = get_landscape_sweep_size(landscape, sweep->n_axes);
+
+      if (format == LANDSCAPE_MATLAB) {
+        write_direction(ofd, landscape, sweep, "%");
+        (void)fprintf (ofd, "%s = [\n", sweep->name);
+      }
+
+      for(k=sweep->first; k<sweep->first+n; k++) {
+        (void)get_landscape_point(landscape, k, steps);
+        get_axis_position(landscape, sweep, 0, steps[0], &offset[0], &value[0]);
+        get_axis_position(landscape, sweep, 1, steps[1], &offset[1], &value[1]);
+
+        if (format == LANDSCAPE_CSV) {
+          if (sweep->n_axes == 2)
+            (void)fprintf (ofd, "%s,%f,%f,%f,%f,%f\n", sweep->name,
+                           offset[0], value[0], offset[1], value[1], landscape->values[k]);
+          else
+            (void)fprintf (ofd, "%s,%f,%f,,,%f\n", sweep->name,
+                           offset[0], value[0], landscape->values[k]);
+        }
+        else {
+          if (sweep->n_axes == 2)
+            (void)fprintf (ofd, "%f %f %f %f %f\n",
+                           offset[0], value[0], offset[1], value[1], landscape->values[k]);
+          else
+            (void)fprintf (ofd, "%f %f %f\n", offset[0], value[0], landscape->values[k]);
+        }
+      }
+
+      if (format == LANDSCAPE_MATLAB)
+        (void)fprintf (ofd, "];\n");
+    }
+
+    ok = !ferror(ofd);
+  }
+
+  status = close_file(ofd);
+
+  return( ok && status == VIO_OK );
+}
+
+void delete_landscape(Landscape *landscape)
+{
+  if (landscape->sweeps != NULL)
+    FREE(landscape->sweeps);
+  if (landscape->values != NULL)
+    FREE(landscape->values);
+
+  landscape->sweeps   = NULL;
+  landscape->values   = NULL;
+  landscape->n_sweeps = 0;
+  landscape->n_points = 0;
+}
@@ -99,6 +99,15 @@ float go_get_samples_with_offset(VIO_Volume data, VIO_Volume model_mask,
                                         float sqrt_s1, float *a1, VIO_BOOL *m1,
                                         VIO_BOOL use_nearest_neighbour);
 
+void go_get_fused_samples_with_offset(VIO_Volume data[], VIO_Volume mask,
+                                      float *x, float *y, float *z,
+                                      VIO_Real  dx, VIO_Real  dy, VIO_Real dz,
+                                      int obj_func[], int n, int len,
+                                      float normalization[],
+                                      float *a1[], VIO_BOOL *m1[],
+                                      VIO_BOOL use_nearest_neighbour,
+                                      float result[]);
+
 
 /* This is the COST FUNCTION TO BE MINIMIZED.
    so that very large displacements are impossible */
@@ -120,6 +129,91 @@ static VIO_Real cost_fn(float x, float y, float z, VIO_Real max_length)
   return(d);
 }
 
+/* Features that are not optical flow, whose target volume has the
+   same sizes as that of the first such feature and that share its
+   target mask, can be sampled in a single pass over the target
+   sub-lattice (see go_get_fused_samples_with_offset() in
+   sub_lattice.c).  The buffers below hold the arguments and results
+   of that call, and are grown as needed. */
+
+static struct {
+  int        n_alloc;
+  int        *index;            /* feature numbers in the fused group */
+  int        *obj_func;
+  VIO_Volume *data;
+  float      *normalization;
+  float      **a1;
+  VIO_BOOL   **m1;
+  float      *result;
+  VIO_BOOL   *done;             /* per feature: result[] is available */
+  float      *sim;              /* per feature: fused result          */
+} Gfused = {0};
+
+static int get_fused_features(void)
+{
+  int 
+    i, j, n, first,
+    sizes0[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS];
+  VIO_BOOL
+    same;
+
+  if (Gglobals->features.number_of_features > Gfused.n_alloc) {
+    if (Gfused.n_alloc > 0) {
+      FREE(Gfused.index);         FREE(Gfused.obj_func);
+      FREE(Gfused.data);          FREE(Gfused.normalization);
+      FREE(Gfused.a1);            FREE(Gfused.m1);
+      FREE(Gfused.result);        FREE(Gfused.done);
+      FREE(Gfused.sim);
+    }
+    Gfused.n_alloc = Gglobals->features.number_of_features;
+    ALLOC(Gfused.index,         Gfused.n_alloc);
+    ALLOC(Gfused.obj_func,      Gfused.n_alloc);
+    ALLOC(Gfused.data,          Gfused.n_alloc);
+    ALLOC(Gfused.normalization, Gfused.n_alloc);
+    ALLOC(Gfused.a1,            Gfused.n_alloc);
+    ALLOC(Gfused.m1,            Gfused.n_alloc);
+    ALLOC(Gfused.result,        Gfused.n_alloc);
+    ALLOC(Gfused.done,          Gfused.n_alloc);
+    ALLOC(Gfused.sim,           Gfused.n_alloc);
+  }
+
+  n = 0;
+  first = -1;
+  for(i=0; i<Gglobals->features.number_of_features; i++) {
+
+    Gfused.done[i] = FALSE;
+
+    if (Gglobals->features.obj_func[i] == NONLIN_OPTICALFLOW) 
+      continue;
+
+    if (first < 0) {
+      first = i;
+      get_volume_sizes(Gglobals->features.model[i], sizes0);
+    }
+    else {
+      if (Gglobals->features.model_mask[i] != Gglobals->features.model_mask[first])
+        continue;
+      get_volume_sizes(Gglobals->features.model[i], sizes);
+      same = TRUE;
+      for(j=0; j<3; j++)
+        if (sizes[j] != sizes0[j]) same = FALSE;
+      if (!same)
+        continue;
+    }
+
+    Gfused.index[n]         = i;
+    Gfused.obj_func[n]      = Gglobals->features.obj_func[i];
+    Gfused.data[n]          = Gglobals->features.model[i];
+    Gfused.normalization[n] = Gsqrt_features[i];
+    Gfused.a1[n]            = Ga1_features[i];
+    Gfused.m1[n]            = masked_samples_in_source[i];
+    n++;
+  }
+
+  return(n);
+}
+
 /* This is the SIMILARITY FUNCTION TO BE MAXIMIZED.
 
       it is maximum when source and target data are most similar.
@@ -138,7 +232,7 @@ static VIO_Real cost_fn(float x, float y, float z, VIO_Real max_length)
 
 static VIO_Real similarity_fn(float *d)
 {
-  int i;
+  int i, n_fused;
   VIO_Real
     norm,
     s, func_sim;
@@ -152,6 +246,26 @@ static VIO_Real similarity_fn(float *d)
      and d[2] in 2D (d[3] stays const=0). */
   
   s = norm = 0.0;
+
+                                /* sample the features that share the
+                                   same target geometry and mask in one
+                                   pass */
+  n_fused = get_fused_features();
+  if (n_fused > 1) {
+    go_get_fused_samples_with_offset(Gfused.data,
+                                     Gglobals->features.model_mask[Gfused.index[0]],
+                                     TX,TY,TZ,
+                                     d[3], d[2], d[1],
+                                     Gfused.obj_func, n_fused, Glen,
+                                     Gfused.normalization, 
+                                     Gfused.a1, Gfused.m1,
+                                     Gglobals->interpolant==nearest_neighbour_interpolant,
+                                     Gfused.result);
+    for(i=0; i<n_fused; i++) {
+      Gfused.sim[ Gfused.index[i] ]  = Gfused.result[i];
+      Gfused.done[ Gfused.index[i] ] = TRUE;
+    }
+  }
     
   for(i=0; i<Gglobals->features.number_of_features; i++)  {
 
@@ -159,8 +273,11 @@ static VIO_Real similarity_fn(float *d)
                                    computed directly and _not_ optimized */
 
     if (Gglobals->features.obj_func[i] != NONLIN_OPTICALFLOW) {
-      func_sim = 
-        (VIO_Real)go_get_samples_with_offset(Gglobals->features.model[i],
+      if (Gfused.done[i])
+        func_sim = (VIO_Real)Gfused.sim[i];
+      else
+        func_sim = 
+          (VIO_Real)go_get_samples_with_offset(Gglobals->features.model[i],
                 Gglobals->features.model_mask[i],
                                          TX,TY,TZ,
                                          d[3], d[2], d[1],
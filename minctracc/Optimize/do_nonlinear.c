@@ -372,6 +372,12 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "constants.h"                /* internal constant definitions             */
 #include "interpolation.h"
 #include "super_sample_def.h"
+#include "warp_cache.h"
+#include "flat_transform.h"
+#include "source_cache.h"
+#include "nl_checkpoint.h"
+#include "lattice_sampling.h"
+#include "optical_flow.h"
 #include <sys/types.h>                /* for timing the deformations               */
 #include <time.h>
 time_t time(time_t *tloc);
@@ -453,6 +459,11 @@ VIO_Real     Gcost_radius=0.0;        /* constant used in the cost function
 VIO_General_transform *Gsuper_sampled_warp = NULL;
 VIO_General_transform *Glinear_transform = NULL;
 VIO_Volume  Gsuper_sampled_vol;
+Warp_Cache *Gwarp_cache = NULL; /* packed alternative to Gsuper_sampled_vol */
+Flat_Transform *Gflat_transform = NULL; /* compiled form of trans_info.transformation */
+static Source_Cache *Gsource_cache = NULL; /* source sub-lattice samples  */
+static Optical_Flow *Goptical_flow = NULL; /* packed optical flow volumes,
+                                              one per feature            */
 
 
         /* VIO_Volume order definition for super sampled data */
@@ -470,6 +481,16 @@ extern double     iteration_weight;      /* wght given to a singer iteration */
 extern double     similarity_cost_ratio; /* obj fn = sim * s+c+r -
                                                      cost * (1-s_c_r)        */
 extern int        iteration_limit;       /* total number of iterations       */
+extern double     active_set_tolerance;  /* retire nodes with smaller update */
+extern double     active_set_reactivate; /* wake them if a neighbour moves
+                                            more than this                   */
+extern double     converge_def_tolerance;/* stop when the mean warp changes
+                                            by less than this fraction       */
+extern double     converge_corr_tolerance;/* ... or the correlation does     */
+extern int        checkpoint_every;      /* iterations between checkpoints   */
+extern int        node_budget;           /* nodes estimated per iteration    */
+extern VIO_Volume     sample_weights;        /* importance of the source voxels  */
+extern int        resume_flag;           /* restart from the checkpoint      */
 extern int        number_dimensions;     /* ==2 or ==3                       */
 extern double     ftol;                         /* stopping tolerence for simplex   */
 extern VIO_Real       initial_corr, final_corr;
@@ -547,7 +568,8 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing, VIO_Real thres
                                              int iteration, int total_iters,
                                              int *nfunks,
                                              int ndim,
-                                             VIO_BOOL sub_lattice_needed);
+                                             VIO_BOOL sub_lattice_needed,
+                                             long node);
 
 static double return_locally_smoothed_def(int  isotropic_smoothing,
                                          int  ndim,
@@ -600,13 +622,32 @@ int nearest_neighbour_interpolant(VIO_Volume volume,
 static VIO_BOOL is_a_sub_lattice_needed (char obj_func[],
                                          int  number_of_features);
 
+static void get_warp_of_nodes(VIO_Volume current_vol, int xyzv[],
+                              int start[], int end[], float warp[]);
+
+static void get_importance_of_nodes(VIO_Volume current_vol, int xyzv[],
+                                    int start[], int end[], 
+                                    VIO_Volume weights, VIO_Volume data,
+                                    float importance[]);
+
+static VIO_Real get_mean_warp_magnitude(VIO_Volume current_vol, int xyzv[],
+                                        int start[], int end[]);
+
+static long update_active_set(VIO_Volume current_vol, int xyzv[],
+                              int start[], int end[],
+                              float node_update[], float node_warp[],
+                              float new_warp[],
+                              float node_change[], 
+                              unsigned char node_active[]);
+
 static VIO_BOOL build_lattices(VIO_Real spacing, 
                                VIO_Real threshold, 
                                VIO_Real source_coord[],
                                VIO_Real mean_target[],
                                VIO_Real target_coord[],
                                VIO_Real def_vector[],
-                               int ndim);
+                               int ndim,
+                               long node);
 
 void    build_target_lattice(float px[], float py[], float pz[],
                                     float tx[], float ty[], float tz[],
@@ -618,13 +659,15 @@ void    build_target_lattice_using_super_sampled_def(
                                      int len, int dim);
 
 
+#define Min_deriv  0.02          /* smallest optical flow derivative,
+                                   as a fraction of the source range    */
+
 static VIO_Real get_optical_flow_vector(VIO_Real threshold1, 
                                      VIO_Real source_coord[],
                                      VIO_Real mean_target[],
                                      VIO_Real def_vector[],
                                      VIO_Real voxel_displacement[],
-                                     VIO_Volume data,
-                                     VIO_Volume model,
+                                     Optical_Flow *flow,
                                      int ndim);
 
 static VIO_Real get_chamfer_vector(VIO_Real threshold1, 
@@ -740,6 +783,34 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
    VIO_STR filenamestring;
    VIO_BOOL condition;
 
+   long
+      node,                        /* node number, in loop order                   */
+      n_nodes,
+      nodes_active,
+      nodes_skipped;
+   unsigned char
+      *node_active = NULL,        /* active set: node is to be estimated          */
+      *node_selected = NULL;      /* node budget: node is one of the most
+                                     important ones                               */
+   VIO_Real
+      mean_warp, previous_mean_warp, /* for convergence tests                    */
+      iter_corr, previous_corr,
+      def_change, corr_change;
+   VIO_BOOL
+      check_convergence, converged;
+   Nonlinear_Checkpoint
+      checkpoint;                /* state saved with -checkpoint                 */
+   VIO_BOOL
+      resumed;
+   int
+      first_iteration;
+   float
+      *node_importance = NULL,    /* node budget: gradient magnitude at the node  */
+      *node_update = NULL,        /* active set: magnitude of last estimate       */
+      *node_warp   = NULL,        /* active set: warp at start of iteration       */
+      *new_warp    = NULL,        /* active set: warp at end of iteration         */
+      *node_change = NULL;        /* active set: how much the warp moved          */
+
   /*******************************************************************************/
 
            /* set up globals for communication with other routines */
@@ -797,6 +868,32 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                               __FILE__, __LINE__);
    }
 
+                                /* pack the volumes of the optical flow
+                                   features once; the source is repacked
+                                   whenever it is renormalized below.
+                                   This is done before anything else is
+                                   allocated, so that a feature that
+                                   cannot be packed fails the fit here  */
+   for(i=0; i<Gglobals->features.number_of_features; i++)
+     if (Gglobals->features.obj_func[i] == NONLIN_OPTICALFLOW) {
+       if (Goptical_flow == NULL)
+         ALLOC(Goptical_flow, Gglobals->features.number_of_features);
+       if (!init_optical_flow(&Goptical_flow[i],
+                              Gglobals->features.data[i],
+                              Gglobals->features.model[i], Min_deriv)) {
+         print ("Optical flow needs 3D volumes (feature %d)\n", i);
+         for(j=0; j<i; j++)
+           if (Gglobals->features.obj_func[j] == NONLIN_OPTICALFLOW)
+             delete_optical_flow(&Goptical_flow[j]);
+         FREE(Goptical_flow);
+         Goptical_flow = NULL;
+         VIO_FREE2D(Ga1_features);
+         VIO_FREE2D(masked_samples_in_source);
+         FREE(Gsqrt_features);
+         return(VIO_ERROR);
+       }
+     }
+
    ALLOC(SX,MAX_G_LEN+1);        /* and coordinates in source volume  */
    ALLOC(SY,MAX_G_LEN+1);
    ALLOC(SZ,MAX_G_LEN+1);
@@ -913,6 +1010,101 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
   get_voxel_spatial_loop_limits(additional_vol, 
                                 start, end);
 
+                                /* with -resume, continue from the last
+                                   checkpoint, if there is one          */
+  resumed = FALSE;
+  first_iteration = 0;
+  checkpoint.node_active = NULL;
+  checkpoint.n_nodes = 0;
+
+  if (resume_flag && strlen(globals->filenames.checkpoint) > 0) {
+    if (read_nonlinear_checkpoint(globals->filenames.checkpoint, 
+                                  current_vol, &checkpoint)) {
+      resumed = TRUE;
+      first_iteration = checkpoint.iterations_done;
+      for(i=0; i<3; i++) {
+        previous_mean_eig_val[i] = checkpoint.mean_eig_val[i];
+        previous_std_eig_val[i]  = checkpoint.std_eig_val[i];
+      }
+      if (checkpoint.iteration_limit != iteration_limit)
+        print ("Warning: checkpoint was written with -iterations %d\n",
+               checkpoint.iteration_limit);
+      for(i=0; i<globals->features.number_of_features; i++) 
+        if (globals->features.obj_func[i] == NONLIN_OPTICALFLOW) 
+          print ("Warning: optical flow intensity normalization is not restored on resume\n");
+      if (globals->flags.verbose > 0)
+        print ("Resuming non-linear fit after iteration %d of %d%s\n",
+               first_iteration, iteration_limit,
+               checkpoint.converged ? ", where it had converged" : "");
+    }
+    else if (globals->flags.verbose > 0)
+      print ("No usable checkpoint %s, starting from the first iteration\n",
+             globals->filenames.checkpoint);
+  }
+
+                                /* keep the source sub-lattice samples
+                                   of each node from one iteration to
+                                   the next, if requested                */
+
+  n_nodes = (long)(end[VIO_X]-start[VIO_X]) * 
+            (long)(end[VIO_Y]-start[VIO_Y]) *
+            (long)(end[VIO_Z]-start[VIO_Z]);
+
+                                /* with -active_set, nodes whose estimate
+                                   becomes smaller than the tolerance are
+                                   skipped until the warp around them
+                                   moves again                           */
+  if (active_set_tolerance > 0.0) {
+    ALLOC(node_active, n_nodes);
+    ALLOC(node_update, n_nodes);
+    ALLOC(node_change, n_nodes);
+    ALLOC(node_warp,   3*n_nodes);
+    ALLOC(new_warp,    3*n_nodes);
+    for(node=0; node<n_nodes; node++) {
+      node_active[node] = TRUE;
+      node_update[node] = 0.0;
+    }
+    if (resumed && checkpoint.node_active != NULL && checkpoint.n_nodes == n_nodes)
+      for(node=0; node<n_nodes; node++) 
+        node_active[node] = checkpoint.node_active[node];
+    get_warp_of_nodes(current_vol, xyzv, start, end, node_warp);
+  }
+
+                                /* with -node_budget, only the nodes with
+                                   the largest gradient magnitude in the
+                                   source (or the largest -sample_weights)
+                                   are estimated; the smoothing of the
+                                   warp fills in the others              */
+  if (node_budget > 0 && node_budget < n_nodes) {
+    ALLOC(node_selected,   n_nodes);
+    ALLOC(node_importance, n_nodes);
+    get_importance_of_nodes(current_vol, xyzv, start, end, 
+                            sample_weights, Gglobals->features.data[0],
+                            node_importance);
+    (void)select_nodes_by_weight(node_importance, n_nodes, (long)node_budget,
+                                 node_selected);
+    FREE(node_importance);
+    if (globals->flags.verbose > 0)
+      print ("Node budget: estimating the %d of %ld nodes with the largest gradient\n",
+             node_budget, n_nodes);
+  }
+
+  if (globals->trans_info.source_cache_mb > 0 && sub_lattice_needed) {
+    ALLOC(Gsource_cache,1);
+    if (!init_source_cache(Gsource_cache,
+                           n_nodes,
+                           Gglobals->features.number_of_features,
+                           MAX_G_LEN,
+                           globals->trans_info.source_cache_mb)) {
+      FREE(Gsource_cache);
+      Gsource_cache = NULL;
+      print ("Source sub-lattice cache disabled (budget too small)\n");
+    }
+    else if (globals->flags.debug)
+      print ("Source sub-lattice cache: room for %ld of %ld nodes\n",
+             Gsource_cache->n_slots, Gsource_cache->n_nodes);
+  }
+
                                 /* build a super-sampled version of the
                                    current transformation, if needed     */
 
@@ -956,15 +1148,34 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
 
 
-    ALLOC(Gsuper_sampled_warp,1);
-    create_super_sampled_data_volumes(current_warp, 
-                                      Gsuper_sampled_warp,
-                                      globals->trans_info.use_super);
-    Gsuper_sampled_vol = Gsuper_sampled_warp->displacement_volume;
+    if (globals->trans_info.use_warp_cache) {
+      ALLOC(Gwarp_cache,1);
+      if (!init_warp_cache(Gwarp_cache, current_warp, Glinear_transform,
+                           globals->trans_info.use_warp_cache)) {
+        print_error_and_line_num("Cannot build the super-sampled warp cache",
+                                 __FILE__, __LINE__);
+      }
+    }
+    else {
+      ALLOC(Gsuper_sampled_warp,1);
+      create_super_sampled_data_volumes(current_warp, 
+                                        Gsuper_sampled_warp,
+                                        globals->trans_info.use_super);
+      Gsuper_sampled_vol = Gsuper_sampled_warp->displacement_volume;
+    }
 
 
+    if (globals->flags.debug && Gwarp_cache != NULL) {
+      print ("Super sampling into warp cache:\n");
+      print ("super sizes: %7d  %7d  %7d\n",
+             Gwarp_cache->count[VIO_X], Gwarp_cache->count[VIO_Y], Gwarp_cache->count[VIO_Z]);
+      print ("cache tiles: %7ld (%d^3 nodes each)\n",
+             Gwarp_cache->total_tiles, WARP_CACHE_TILE_SIZE);
+      print ("linear part: %s\n",
+             Gwarp_cache->linear_is_affine ? "affine matrix" : "general transform");
+    }
 
-    if (globals->flags.debug) {
+    if (globals->flags.debug && Gwarp_cache == NULL) {
 
 
       for(i=0; i<VIO_MAX_DIMENSIONS; i++) {
@@ -998,6 +1209,20 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
     }
   }
 
+                                /* compile the total transformation
+                                   (linear part, grid and target
+                                   world-to-voxel) for the per node
+                                   mapping.  The displacements are
+                                   re-packed at each iteration. */
+  if (globals->trans_info.use_flat_transform) {
+    ALLOC(Gflat_transform,1);
+    init_flat_transform(Gflat_transform, globals->trans_info.transformation,
+                        Gglobals->features.model[0]);
+    if (globals->flags.debug)
+      print ("flat transform: %s\n", Gflat_transform->compiled ?
+             "compiled" : "not compiled, using general_transform_point()");
+  }
+
                                 /* set up other parameters needed
                                    for non linear fitting */
 
@@ -1020,6 +1245,8 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                           Gglobals->features.data_mask[0], 
                                           Gglobals->features.model_mask[0],
                                           globals );
+  if (resumed)
+    initial_corr = checkpoint.initial_corr;
 
 
 
@@ -1142,7 +1369,28 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
    mean_disp_mag = 0.0;
 
-   for(iters=0; iters<iteration_limit; iters++) 
+                                /* with -converge_def or -converge_corr,
+                                   stop before iteration_limit once the 
+                                   warp (or the correlation) stops
+                                   changing */
+   check_convergence = (converge_def_tolerance > 0.0 || converge_corr_tolerance > 0.0);
+                                /* a fit that had converged when it was
+                                   checkpointed is already finished     */
+   converged = resumed && checkpoint.converged;
+   previous_mean_warp = 0.0;
+   previous_corr = initial_corr;
+   if (check_convergence && resumed) {
+     previous_mean_warp = checkpoint.previous_mean_warp;
+     previous_corr      = checkpoint.previous_corr;
+   }
+   else if (check_convergence) {
+     previous_mean_warp = get_mean_warp_magnitude(current_vol, xyzv, start, end);
+     if (globals->flags.verbose > 0)
+       print ("convergence: iter %2d  mean warp %9.5f  corr %9.6f\n",
+              0, previous_mean_warp, previous_corr);
+   }
+
+   for(iters=first_iteration; iters<iteration_limit && !converged; iters++) 
      {
        
        iteration_start_time = time(NULL);
@@ -1152,14 +1400,28 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            
            temp_start_time = time(NULL);
            
-           interpolate_super_sampled_data_by2(current_warp,
-                                          Gsuper_sampled_warp);
+           if (Gwarp_cache != NULL) {
+             update_warp_cache(Gwarp_cache);
+             if (globals->flags.debug)
+               print("warp cache: regenerated %ld of %ld tiles\n",
+                     Gwarp_cache->tiles_updated, Gwarp_cache->total_tiles);
+           }
+           else
+             interpolate_super_sampled_data_by2(current_warp,
+                                                Gsuper_sampled_warp);
            if (globals->flags.debug){
              report_time(temp_start_time, "TIME:Interpolating super-sampled data");
              }
 
          }  
 
+       if (Gflat_transform != NULL) {
+         update_flat_transform(Gflat_transform);
+         if (globals->flags.debug && Gflat_transform->compiled &&
+             Gflat_transform->grid != NULL && !Gflat_transform->grid_ok)
+           print("flat transform: packed grid does not match volume_io, using general_transform_point()\n");
+       }
+
 	   if (globals->flags.verbose>1) print("Initializing deformation grid to 0...\n");
        init_the_volume_to_zero(estimated_flag_vol);
 
@@ -1179,6 +1441,7 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
        nodes_done      = 0; 
        nodes_tried     = 0; 
        nodes_seen      = 0; 
+       nodes_skipped   = 0;
        over            = 0;        
        nfunk_total     = 0;
        std             = 0.0;
@@ -1201,6 +1464,7 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
        temp_start_time = time(NULL);
        
        for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+       node = -1;
        
        /* step index[] through all the nodes in the deformation field. */
        
@@ -1218,6 +1482,20 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                  {
                
                    nodes_seen++;          
+                   node++;
+
+                   if (node_active != NULL) {
+                     node_update[node] = 0.0;
+                     if (!node_active[node]) {
+                       nodes_skipped++;
+                       continue;
+                     }
+                   }
+
+                   if (node_selected != NULL && !node_selected[node]) {
+                     nodes_skipped++;
+                     continue;
+                   }
                                         /* get the lattice coordinate 
                                            of the current index node  */
                    for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i]=index[i];
@@ -1284,7 +1562,8 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                                                 iters, iteration_limit, 
                                                                 &nfunks,
                                                                 num_of_dims_to_optimize,
-                                                                sub_lattice_needed);
+                                                                sub_lattice_needed,
+                                                                node);
                      
                      
                        if (result < 0.0) 
@@ -1350,6 +1629,8 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                            set_volume_real_value(additional_mag,
                                                  index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
                                                  result);
+                           if (node_update != NULL)
+                             node_update[node] = result;
                                          /* set the 'node estimated' flag */
                            set_volume_real_value(estimated_flag_vol,
                                                  index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
@@ -1528,6 +1809,17 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
        init_the_volume_to_zero(additional_vol);
        init_the_volume_to_zero(additional_mag);
+
+                                /* choose the nodes to estimate at the
+                                   next iteration */
+       if (node_active != NULL) {
+         nodes_active = update_active_set(current_vol, xyzv, start, end,
+                                          node_update, node_warp, new_warp,
+                                          node_change, node_active);
+         if (globals->flags.verbose > 0)
+           print ("Iteration %2d: %ld of %ld nodes estimated, %ld active for next iteration\n",
+                  iters+1, n_nodes - nodes_skipped, n_nodes, nodes_active);
+       }
  
  
        if (globals->flags.debug && 
@@ -1558,6 +1850,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                                   globals->features.thresh_model[i],
                                                   globals);
 
+                   (void)update_optical_flow_source(&Goptical_flow[i],
+                                                    globals->features.data[i],
+                                                    Min_deriv);
 
                  }
              }
@@ -1577,6 +1872,86 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
            
          }
 
+       if (check_convergence) 
+         {
+           mean_warp = get_mean_warp_magnitude(current_vol, xyzv, start, end);
+           def_change = fabs(mean_warp - previous_mean_warp) / 
+             MAX(previous_mean_warp, 1.0e-6);
+
+                                /* the objective costs a pass over the
+                                   lattice, so it is only evaluated for
+                                   -converge_corr                       */
+           if (converge_corr_tolerance > 0.0) {
+             if (globals->flags.debug) 
+               iter_corr = final_corr;
+             else
+               iter_corr = xcorr_objective_with_def(Gglobals->features.data[0], 
+                                                    Gglobals->features.model[0],
+                                                    Gglobals->features.data_mask[0], 
+                                                    Gglobals->features.model_mask[0],
+                                                    globals );
+             corr_change = fabs(iter_corr - previous_corr) / 
+               MAX(fabs(previous_corr), 1.0e-6);
+           }
+           else {
+             iter_corr   = previous_corr;
+             corr_change = 0.0;
+           }
+
+           if (globals->flags.verbose > 0) {
+             if (converge_corr_tolerance > 0.0)
+               print ("convergence: iter %2d  mean warp %9.5f (%8.4f%%)  corr %9.6f (%8.4f%%)\n",
+                      iters+1, 
+                      mean_warp, 100.0*def_change, 
+                      iter_corr, 100.0*corr_change);
+             else
+               print ("convergence: iter %2d  mean warp %9.5f (%8.4f%%)\n",
+                      iters+1, 
+                      mean_warp, 100.0*def_change);
+           }
+
+                                /* the first iteration starts from the
+                                   input warp, so never stop after it */
+           if (iters > 0 &&
+               ((converge_def_tolerance  > 0.0 && def_change  < converge_def_tolerance) ||
+                (converge_corr_tolerance > 0.0 && corr_change < converge_corr_tolerance))) {
+             converged = TRUE;
+             if (globals->flags.verbose > 0)
+               print ("convergence: stopping after %d of %d iterations\n",
+                      iters+1, iteration_limit);
+           }
+
+           previous_mean_warp = mean_warp;
+           previous_corr      = iter_corr;
+         }
+
+                                /* save the state of the fit, so that it
+                                   can be resumed from here; always when
+                                   this is the last iteration          */
+       if (strlen(globals->filenames.checkpoint) > 0 &&
+           (((iters+1) % MAX(checkpoint_every,1)) == 0 || 
+            iters+1 == iteration_limit || converged)) 
+         {
+           checkpoint.iterations_done = iters+1;
+           checkpoint.iteration_limit = iteration_limit;
+           for(i=0; i<3; i++) {
+             checkpoint.mean_eig_val[i] = previous_mean_eig_val[i];
+             checkpoint.std_eig_val[i]  = previous_std_eig_val[i];
+           }
+           checkpoint.initial_corr       = initial_corr;
+           checkpoint.previous_mean_warp = previous_mean_warp;
+           checkpoint.previous_corr      = previous_corr;
+           checkpoint.converged          = converged;
+           delete_nonlinear_checkpoint(&checkpoint);
+           checkpoint.n_nodes            = n_nodes;
+           checkpoint.node_active        = node_active;
+
+           (void)write_nonlinear_checkpoint(globals->filenames.checkpoint,
+                                            globals->trans_info.transformation,
+                                            &checkpoint);
+           checkpoint.node_active = NULL;
+         }
+
 
        terminate_progress_report( &progress );
 
@@ -1603,7 +1978,20 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
  
 
-   if (globals->trans_info.use_super>0) 
+   if (Gflat_transform != NULL)
+     {
+       delete_flat_transform(Gflat_transform);
+       FREE(Gflat_transform);
+       Gflat_transform = NULL;
+     }
+
+   if (Gwarp_cache != NULL) 
+     {
+       delete_warp_cache(Gwarp_cache);
+       FREE(Gwarp_cache);
+       Gwarp_cache = NULL;
+     }
+   else if (globals->trans_info.use_super>0) 
      {
        delete_general_transform(Gsuper_sampled_warp);
        FREE(Gsuper_sampled_warp);
@@ -1616,6 +2004,36 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
    FREE(another_warp); 
 
   
+   delete_nonlinear_checkpoint(&checkpoint);
+
+   if (node_active != NULL) 
+     {
+       FREE(node_active);
+       FREE(node_update);
+       FREE(node_change);
+       FREE(node_warp);
+       FREE(new_warp);
+     }
+
+   if (node_selected != NULL) 
+     FREE(node_selected);
+
+   if (Gsource_cache != NULL) 
+     {
+       delete_source_cache(Gsource_cache);
+       FREE(Gsource_cache);
+       Gsource_cache = NULL;
+     }
+
+   if (Goptical_flow != NULL) 
+     {
+       for(i=0; i<Gglobals->features.number_of_features; i++)
+         if (Gglobals->features.obj_func[i] == NONLIN_OPTICALFLOW)
+           delete_optical_flow(&Goptical_flow[i]);
+       FREE(Goptical_flow);
+       Goptical_flow = NULL;
+     }
+
    if (Gglobals->features.number_of_features>0) 
      {
        VIO_FREE2D(Ga1_features);
@@ -1644,6 +2062,170 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
 
 
+/* store the current warp vector of each node of the deformation
+   field in warp[3*node .. 3*node+2], with nodes in the order of the
+   main loop of do_non_linear_optimization() */
+
+static void get_warp_of_nodes(VIO_Volume current_vol, int xyzv[],
+                              int start[], int end[], float warp[])
+{
+  int 
+    i, index[VIO_MAX_DIMENSIONS];
+  long
+    node;
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+  node = 0;
+
+  for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++) 
+    for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) 
+      for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        warp[3*node] = warp[3*node+1] = warp[3*node+2] = 0.0;
+        for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) 
+          if (index[xyzv[VIO_Z+1]] < 3)
+            warp[3*node + index[xyzv[VIO_Z+1]]] = 
+              get_volume_real_value(current_vol,
+                                    index[0],index[1],index[2],index[3],index[4]);
+        node++;
+      }
+}
+
+/* importance of each node (in the same order as the main loop): the
+   gradient magnitude of data, or the value of weights if not NULL, at
+   the homolog of the node in the source */
+
+static void get_importance_of_nodes(VIO_Volume current_vol, int xyzv[],
+                                    int start[], int end[], 
+                                    VIO_Volume weights, VIO_Volume data,
+                                    float importance[])
+{
+  int 
+    i, index[VIO_MAX_DIMENSIONS];
+  long
+    node;
+  VIO_Real
+    voxel[VIO_MAX_DIMENSIONS],
+    target_node[3], source_node[3], source_voxel[3];
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+  node = 0;
+
+  for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++) 
+    for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) 
+      for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i]=index[i];
+        convert_voxel_to_world(current_vol, voxel,
+                               &(target_node[VIO_X]), &(target_node[VIO_Y]), &(target_node[VIO_Z]));
+        general_inverse_transform_point(Glinear_transform,
+                                        target_node[VIO_X], target_node[VIO_Y], target_node[VIO_Z],
+                                        &(source_node[VIO_X]),&(source_node[VIO_Y]),&(source_node[VIO_Z])); 
+        convert_3D_world_to_voxel(data, 
+                                  source_node[VIO_X], source_node[VIO_Y], source_node[VIO_Z],
+                                  &source_voxel[0], &source_voxel[1], &source_voxel[2]);
+        importance[node] = (float)get_importance_weight(weights, data, source_voxel);
+        node++;
+      }
+}
+
+/* mean magnitude of the warp vectors of all nodes of the deformation
+   field */
+
+static VIO_Real get_mean_warp_magnitude(VIO_Volume current_vol, int xyzv[],
+                                        int start[], int end[])
+{
+  int 
+    i, index[VIO_MAX_DIMENSIONS];
+  long
+    count;
+  VIO_Real
+    v, mag, sum;
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
+  count = 0;
+  sum = 0.0;
+
+  for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++) 
+    for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) 
+      for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        mag = 0.0;
+        for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) {
+          v = get_volume_real_value(current_vol,
+                                    index[0],index[1],index[2],index[3],index[4]);
+          mag += v*v;
+        }
+        sum += sqrt(mag);
+        count++;
+      }
+
+  return( count > 0 ? sum / count : 0.0 );
+}
+
+/* update the active set after an iteration.  A node stays (or
+   becomes) active if its last estimated deformation was at least
+   active_set_tolerance, or if the warp at the node or at one of its
+   26 neighbours moved by more than active_set_reactivate during the
+   iteration (smoothing included).  node_warp[] is updated to the
+   current warp; new_warp[] (3 per node) is scratch space, allocated
+   once per fit.  Returns the number of active nodes. */
+
+static long update_active_set(VIO_Volume current_vol, int xyzv[],
+                              int start[], int end[],
+                              float node_update[], float node_warp[],
+                              float new_warp[],
+                              float node_change[], 
+                              unsigned char node_active[])
+{
+  int 
+    n[3], i,j,k, di,dj,dk;
+  long
+    node, n_nodes, count;
+  float
+    dx,dy,dz;
+  VIO_Real
+    reactivate;
+
+  for(i=0; i<3; i++) 
+    n[i] = end[i] - start[i];
+  n_nodes = (long)n[0] * n[1] * n[2];
+
+  reactivate = (active_set_reactivate >= 0.0) ? 
+    active_set_reactivate : active_set_tolerance;
+
+  get_warp_of_nodes(current_vol, xyzv, start, end, new_warp);
+
+  for(node=0; node<n_nodes; node++) {
+    dx = new_warp[3*node  ] - node_warp[3*node  ];
+    dy = new_warp[3*node+1] - node_warp[3*node+1];
+    dz = new_warp[3*node+2] - node_warp[3*node+2];
+    node_change[node] = sqrt(dx*dx + dy*dy + dz*dz);
+  }
+
+  for(node=0; node<3*n_nodes; node++)
+    node_warp[node] = new_warp[node];
+
+  count = 0;
+  for(i=0; i<n[0]; i++)
+    for(j=0; j<n[1]; j++)
+      for(k=0; k<n[2]; k++) {
+
+        node = ((long)i*n[1] + j)*n[2] + k;
+        node_active[node] = (node_update[node] >= active_set_tolerance);
+
+        for(di=-1; di<=1 && !node_active[node]; di++)
+          for(dj=-1; dj<=1 && !node_active[node]; dj++)
+            for(dk=-1; dk<=1 && !node_active[node]; dk++) 
+              if (i+di>=0 && i+di<n[0] &&
+                  j+dj>=0 && j+dj<n[1] &&
+                  k+dk>=0 && k+dk<n[2] &&
+                  node_change[((long)(i+di)*n[1] + (j+dj))*n[2] + (k+dk)] > reactivate)
+                node_active[node] = TRUE;
+
+        if (node_active[node]) count++;
+      }
+
+  return(count);
+}
+
 /*   look though the list of object functions requested,
      and set is_a_sub_lattice_needed=TRUE if any obj function
      is used other than Optical Flow
@@ -1978,9 +2560,14 @@ static VIO_BOOL get_best_start_from_neighbours(
 
 /* possible problem: does the following work for a 2D grid transformation? 
  */
-    general_transform_point(Gglobals->trans_info.transformation, 
-                            source[VIO_X],source[VIO_Y],source[VIO_Z], 
-                            &(target[VIO_X]),&(target[VIO_Y]),&(target[VIO_Z]));
+    if (Gflat_transform != NULL)
+      flat_transform_point(Gflat_transform,
+                           source[VIO_X],source[VIO_Y],source[VIO_Z], 
+                           &(target[VIO_X]),&(target[VIO_Y]),&(target[VIO_Z]));
+    else
+      general_transform_point(Gglobals->trans_info.transformation, 
+                              source[VIO_X],source[VIO_Y],source[VIO_Z], 
+                              &(target[VIO_X]),&(target[VIO_Y]),&(target[VIO_Z]));
 
 
     /* set mean_target to be equal to target, just in case this is used later. */
@@ -2017,82 +2604,47 @@ outputs:
 Based on Horn and Schunck Artificial Intell 17 (1981) 185-203
 */
 
-#define Min_deriv  0.02
-
 static VIO_Real get_optical_flow_vector(VIO_Real threshold1, 
                                      VIO_Real source_coord[],
                                      VIO_Real mean_target[],
                                      VIO_Real def_vector[],
                                      VIO_Real voxel_displacement[],
-                                     VIO_Volume data,
-                                     VIO_Volume model,
+                                     Optical_Flow *flow,
                                      int ndim)
 { 
   VIO_Real
-    val[VIO_MAX_DIMENSIONS],        /* the interpolated intensity value     */
     result,                        /* the magnitude of the estimated def   */
-    min,max,thresh,             /* volume real min, max and estimate on smallest
-                                   derivative */
-    xp, yp, zp,                        /* temp storage for coordinate position */
-    mag,
-    dx[VIO_MAX_DIMENSIONS],                /* derivative in X (world-coord)        */
-    dy[VIO_MAX_DIMENSIONS],                /*     "         Y                      */
-    dz[VIO_MAX_DIMENSIONS],                /*     "         Z                      */
-    steps[VIO_MAX_DIMENSIONS];
+    thresh,                        /* estimate on smallest derivative      */
+    diff,
+    grad[3];                        /* target derivatives (world-coord)     */
   int
     i;                                /* a counter                            */
 
-    get_volume_separations(data, steps);
-  
-    xp = mean_target[0];        /* get intensity and derivatives        */
-    yp = mean_target[1];        /* in target volume                     */
-    zp = mean_target[2];
-    evaluate_volume_in_world(model,
-                             xp, yp, zp,
-                             0, TRUE, 0.0, val,
-                             dx,dy,dz,
-                             NULL,NULL,NULL,NULL,NULL,NULL);
-    Gproj_d2 = val[0];
+                                /* get intensity and derivatives
+                                   in target volume                     */
+    Gproj_d2 = flow_volume_value(&flow->target, mean_target, grad);
     
-    xp = source_coord[0];        /* get intensity only                   */
-    yp = source_coord[1];        /* in source volume                     */
-    zp = source_coord[2];
-    evaluate_volume_in_world(data,
-                             xp, yp, zp,
-                             0, TRUE, 0.0, val,
-                             NULL,NULL,NULL,
-                             NULL,NULL,NULL,
-                             NULL,NULL,NULL);
-    Gproj_d1 = val[0];
+                                /* get intensity only in source volume  */
+    Gproj_d1 = flow_volume_value(&flow->source, source_coord, NULL);
     
                                 /* compute deformations directly!       */
 
-    thresh = Min_deriv * (get_volume_real_max(data) - get_volume_real_min(data)); 
+    thresh = flow->min_deriv;
 				/* should compute a better
 				   threshold value here, possibly based on a histogram of the
 				   grandient magnitudes across the 3D lattice. */
 
-    mag = sqrt (dx[0]*dx[0] + dy[0]*dy[0] + dz[0]*dz[0]);
-      
+    diff = Gproj_d1 - Gproj_d2;
 
-    if (fabs(dx[0]) > thresh)   /* fastest (X) */
-      def_vector[0] = ((Gproj_d1 - Gproj_d2) /  dx[0]);
-    else
-      def_vector[0] = 0.0;
-    
-    if (fabs(dy[0]) > thresh)
-      def_vector[1] = ((Gproj_d1 - Gproj_d2) /  dy[0]);
-    else
-      def_vector[1] = 0.0;
-    
-    if (fabs(dz[0]) > thresh && ndim==3)  /* slowest  (Z) */
-      def_vector[2] = ((Gproj_d1 - Gproj_d2) /  dz[0]);
-    else
-      def_vector[2] = 0.0;
-    
+    for(i=0; i<3; i++) {        /* X fastest, Z slowest                 */
+      if (fabs(grad[i]) > thresh && (i<2 || ndim==3))
+        def_vector[i] = diff / grad[i];
+      else
+        def_vector[i] = 0.0;
+    }
     
     for(i=0; i<3; i++)            /* build the real-world displacement */
-      voxel_displacement[i] = def_vector[i]  * steps[i];
+      voxel_displacement[i] = def_vector[i]  * flow->steps[i];
     
     result = sqrt (def_vector[0]*def_vector[0] +
                    def_vector[1]*def_vector[1] +
@@ -2216,8 +2768,11 @@ print ("%5.3f: %7.2f %7.2f %7.2f -> %7.2f %7.2f %7.2f [%7.2f %7.2f %7.2f ]",
         /* sx,sy,sz is now on the closest surface in the data volume,
            we now need the equivalent target coord */
 
-        general_transform_point(Gglobals->trans_info.transformation, 
-                              sx,sy,sz,  &tx,&ty,&tz);
+        if (Gflat_transform != NULL)
+          flat_transform_point(Gflat_transform, sx,sy,sz,  &tx,&ty,&tz);
+        else
+          general_transform_point(Gglobals->trans_info.transformation, 
+                                  sx,sy,sz,  &tx,&ty,&tz);
 
 
   evaluate_volume_in_world(data,
@@ -2290,7 +2845,8 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
                                VIO_Real mean_target[],
                                VIO_Real target_coord[],
                                VIO_Real def_vector[],
-                               int ndim)
+                               int ndim,
+                               long node)
 {
 
   VIO_BOOL
@@ -2385,19 +2941,23 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
                 ydim, and TZ the voxel xdim coordinate.  BIZARRE I know,
                 but it works... */
 
-    for(i=1; i<=Glen; i++) {
-      convert_3D_world_to_voxel(Gglobals->features.model[0], 
-                                (VIO_Real)TX[i],(VIO_Real)TY[i],(VIO_Real)TZ[i], 
-                                &pos[0], &pos[1], &pos[2]);
-
-      /*      print ("%3d %8.3f %8.3f %8.3f -> %8.3f %8.3f %8.3f -> %8.3f %8.3f %8.3f \n",
-             i,SX[i],SY[i],SZ[i],
-             TX[i],TY[i],TZ[i],
-             pos[0], pos[1], pos[2]); */
-
-      TX[i] = pos[0];
-      TY[i] = pos[1];
-      TZ[i] = pos[2];
+    if (Gflat_transform != NULL)
+      flat_transform_to_target_voxel(Gflat_transform, TX,TY,TZ, Glen);
+    else {
+      for(i=1; i<=Glen; i++) {
+        convert_3D_world_to_voxel(Gglobals->features.model[0], 
+                                  (VIO_Real)TX[i],(VIO_Real)TY[i],(VIO_Real)TZ[i], 
+                                  &pos[0], &pos[1], &pos[2]);
+
+        /*      print ("%3d %8.3f %8.3f %8.3f -> %8.3f %8.3f %8.3f -> %8.3f %8.3f %8.3f \n",
+               i,SX[i],SY[i],SZ[i],
+               TX[i],TY[i],TZ[i],
+               pos[0], pos[1], pos[2]); */
+
+        TX[i] = pos[0];
+        TY[i] = pos[1];
+        TZ[i] = pos[2];
+      }
     }
 
     /* -------------------------------------------------------------- */
@@ -2412,6 +2972,16 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
       }
     }
 
+    /* -------------------------------------------------------------- */
+    /* the source samples and normalization constants only depend on
+       the node, so they may have been kept from a previous iteration */
+
+    if (Gsource_cache != NULL &&
+        source_cache_fetch(Gsource_cache, node, Glen, 
+                           Ga1_features, masked_samples_in_source, 
+                           Gsqrt_features))
+      return(result);
+
     /* -------------------------------------------------------------- */
     /* GO GET FEATURES IN SOURCE VOLUME actually get the feature data from
        the source volume local neighbourhood and compute the required
@@ -2477,6 +3047,11 @@ static VIO_BOOL build_lattices(VIO_Real spacing,
                                  __FILE__, __LINE__,Gglobals->features.obj_func[i]);
       }
     }
+
+    if (Gsource_cache != NULL)
+      source_cache_store(Gsource_cache, node, Glen, 
+                         Ga1_features, masked_samples_in_source, 
+                         Gsqrt_features);
     
   }
   return(result );
@@ -2529,7 +3104,8 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
                                              int iteration, int total_iters,
                                              int *num_functions,
                                              int ndim,
-                                             VIO_BOOL sub_lattice_needed)
+                                             VIO_BOOL sub_lattice_needed,
+                                             long node)
 {
 
   VIO_Real
@@ -2569,7 +3145,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
 
     if ( ! build_lattices(spacing, threshold1, 
                           source_coord, mean_target, target_coord, def_vector,
-                          ndim) ){
+                          ndim, node) ){
       result = -DBL_MAX;
       
       return(result);                /* return if we don't make the threshold */
@@ -2825,8 +3401,7 @@ static VIO_Real get_deformation_vector_for_node(VIO_Real spacing,
           result =  get_optical_flow_vector(threshold1, 
                                             source_coord, mean_target,
                                             real_def, vox_def,
-                                            Gglobals->features.data[i],
-                                            Gglobals->features.model[i],
+                                            &Goptical_flow[i],
                                             ndim);
 
 	}
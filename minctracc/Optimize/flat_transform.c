@@ -0,0 +1,459 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : flat_transform.c
+@DESCRIPTION: a compiled ("flattened") evaluator for the transformation
+              being optimized in do_nonlinear.c.
+
+  these include:
+     init_flat_transform() -     fold the linear transforms that come
+                                 before and after the grid transform, and
+                                 the grid's world to voxel map, into
+                                 3x4 matrices
+     update_flat_transform() -   re-pack the grid displacements (once per
+                                 iteration) and check the packed lookup
+                                 against general_transform_point()
+     flat_transform_point() -    map one point
+     flat_transform_map_points() - map a list of points
+     flat_transform_to_target_voxel() - world to voxel in the target
+     delete_flat_transform() -   free everything
+
+  The transformation is expected to be a chain of LINEAR transforms
+  with at most one (non-inverted) GRID_TRANSFORM, as built by
+  minctracc.  Anything else is left uncompiled and every point goes
+  through general_transform_point().
+
+  grid_transform_point() interpolates the displacements with an
+  interpolating cubic (Catmull-Rom), and lowers the order of the
+  interpolation near the edge of the grid.  The packed lookup
+  reproduces the cubic case only, so points within one node of the
+  edge of the grid (and grids with fewer than 4 nodes along an axis)
+  are also handed to general_transform_point().
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "flat_transform.h"
+
+                                /* prototypes called: */
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+
+/* the n-th element of the chain */
+
+static VIO_General_transform *get_element(VIO_General_transform *transform,
+                                          int n)
+{
+  if (get_transform_type(transform) == CONCATENATED_TRANSFORM)
+    return(get_nth_general_transform(transform, n));
+  else
+    return(transform);
+}
+
+/* apply elements [first,last) of the chain to a point */
+
+static void transform_range(VIO_General_transform *transform,
+                            int first, int last,
+                            VIO_Real x, VIO_Real y, VIO_Real z,
+                            VIO_Real *tx, VIO_Real *ty, VIO_Real *tz)
+{
+  int i;
+
+  for(i=first; i<last; i++)
+    general_transform_point(get_element(transform, i), x, y, z, &x, &y, &z);
+
+  *tx = x; *ty = y; *tz = z;
+}
+
+/* get the 3x4 matrix of elements [first,last) of the chain (which must
+   all be LINEAR) by probing it at the origin and the unit vectors */
+
+static void get_affine_of_range(VIO_General_transform *transform,
+                                int first, int last, VIO_Real m[3][4])
+{
+  int      j;
+  VIO_Real o[3], p[3];
+
+  transform_range(transform, first, last, 0.0, 0.0, 0.0, &o[0], &o[1], &o[2]);
+
+  for(j=0; j<3; j++) {
+    transform_range(transform, first, last,
+                    (j==0) ? 1.0 : 0.0,
+                    (j==1) ? 1.0 : 0.0,
+                    (j==2) ? 1.0 : 0.0,
+                    &p[0], &p[1], &p[2]);
+    m[0][j] = p[0] - o[0];
+    m[1][j] = p[1] - o[1];
+    m[2][j] = p[2] - o[2];
+  }
+  m[0][3] = o[0];
+  m[1][3] = o[1];
+  m[2][3] = o[2];
+}
+
+/* c = a o b */
+
+static void compose_affine(VIO_Real a[3][4], VIO_Real b[3][4], VIO_Real c[3][4])
+{
+  int      i,j;
+  VIO_Real r[3][4];
+
+  for(i=0; i<3; i++) {
+    for(j=0; j<4; j++)
+      r[i][j] = a[i][0]*b[0][j] + a[i][1]*b[1][j] + a[i][2]*b[2][j];
+    r[i][3] += a[i][3];
+  }
+
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++)
+      c[i][j] = r[i][j];
+}
+
+/* world -> voxel of a volume, by probing convert_world_to_voxel().  The
+   first three rows are in XYZ order if xyzv is given, otherwise in the
+   volume's dimension order */
+
+static void get_world_to_voxel(VIO_Volume volume, int xyzv[], VIO_Real m[3][4])
+{
+  int      i,j,d;
+  VIO_Real v0[VIO_MAX_DIMENSIONS], v[VIO_MAX_DIMENSIONS];
+
+  convert_world_to_voxel(volume, 0.0, 0.0, 0.0, v0);
+
+  for(j=0; j<3; j++) {
+    convert_world_to_voxel(volume,
+                           (j==0) ? 1.0 : 0.0,
+                           (j==1) ? 1.0 : 0.0,
+                           (j==2) ? 1.0 : 0.0,
+                           v);
+    for(i=0; i<3; i++) {
+      d = (xyzv != NULL) ? xyzv[i] : i;
+      m[i][j] = v[d] - v0[d];
+    }
+  }
+
+  for(i=0; i<3; i++)
+    m[i][3] = v0[ (xyzv != NULL) ? xyzv[i] : i ];
+}
+
+VIO_BOOL init_flat_transform(Flat_Transform *flat,
+                             VIO_General_transform *transform,
+                             VIO_Volume target)
+{
+  int
+    i,j,n,g,
+    sizes[VIO_MAX_DIMENSIONS];
+  VIO_General_transform
+    *t;
+  VIO_Real
+    pre[3][4], post[3][4], grid_to_voxel[3][4];
+
+  flat->transform = transform;
+  flat->grid      = NULL;
+  flat->compiled  = FALSE;
+  flat->grid_ok   = FALSE;
+  flat->disp      = NULL;
+  flat->n_fast    = 0;
+  flat->n_generic = 0;
+
+  flat->has_target = (target != NULL);
+  if (target != NULL)
+    get_world_to_voxel(target, NULL, flat->target_to_voxel);
+
+                                /* check the chain: LINEAR transforms
+                                   and at most one forward grid */
+  if (get_transform_type(transform) == CONCATENATED_TRANSFORM) {
+    if (transform->inverse_flag)
+      return(FALSE);
+    n = get_n_concated_transforms(transform);
+  }
+  else
+    n = 1;
+
+  g = -1;
+  for(i=0; i<n; i++) {
+    t = get_element(transform, i);
+    if (get_transform_type(t) == LINEAR)
+      continue;
+    if (get_transform_type(t) == GRID_TRANSFORM && !t->inverse_flag && g < 0)
+      g = i;
+    else
+      return(FALSE);
+  }
+
+  if (g < 0) {                  /* purely linear */
+    get_affine_of_range(transform, 0, n, flat->pre_post);
+    for(i=0; i<3; i++)
+      for(j=0; j<3; j++)
+        flat->post[i][j] = (i==j) ? 1.0 : 0.0;
+    flat->compiled = TRUE;
+    return(TRUE);
+  }
+
+  flat->grid = get_element(transform, g);
+
+  get_volume_sizes(       flat->grid->displacement_volume, sizes);
+  get_volume_XYZV_indices(flat->grid->displacement_volume, flat->xyzv);
+
+  for(i=0; i<3; i++) {
+    if (flat->xyzv[i] < 0)      /* 2D grid, leave it to volume_io */
+      return(FALSE);
+    flat->count[i] = sizes[ flat->xyzv[i] ];
+    if (flat->count[i] < 4)
+      return(FALSE);
+  }
+
+  get_affine_of_range(transform, 0, g, pre);
+  get_affine_of_range(transform, g+1, n, post);
+  get_world_to_voxel(flat->grid->displacement_volume, flat->xyzv, grid_to_voxel);
+
+  compose_affine(grid_to_voxel, pre, flat->pre_to_voxel);
+  compose_affine(post, pre, flat->pre_post);
+  for(i=0; i<3; i++)
+    for(j=0; j<3; j++)
+      flat->post[i][j] = post[i][j];
+
+  ALLOC(flat->disp, 3L * flat->count[0] * flat->count[1] * flat->count[2]);
+
+  flat->compiled = TRUE;
+
+  return(TRUE);
+}
+
+/* Catmull-Rom weights for fraction f in [0,1) */
+
+static void get_cubic_weights(VIO_Real f, VIO_Real w[4])
+{
+  VIO_Real f2, f3;
+
+  f2 = f*f;
+  f3 = f2*f;
+  w[0] = 0.5 * (-f3 + 2.0*f2 - f);
+  w[1] = 0.5 * ( 3.0*f3 - 5.0*f2 + 2.0);
+  w[2] = 0.5 * (-3.0*f3 + 4.0*f2 + f);
+  w[3] = 0.5 * ( f3 - f2);
+}
+
+/* displacement at grid voxel v[] (XYZ).  Returns FALSE if v is not far
+   enough inside the grid for the full cubic */
+
+static VIO_BOOL get_grid_displacement(Flat_Transform *flat,
+                                      VIO_Real v[], VIO_Real d[])
+{
+  int
+    a,b,c, i0[3];
+  VIO_Real
+    wx[4], wy[4], wz[4], w;
+  float
+    *p;
+  long
+    sy, sz, off;
+
+  for(a=0; a<3; a++)
+    if (!(v[a] >= 1.0 && v[a] < flat->count[a]-2))
+      return(FALSE);
+
+  for(a=0; a<3; a++)
+    i0[a] = (int)v[a];
+
+  get_cubic_weights(v[0] - i0[0], wx);
+  get_cubic_weights(v[1] - i0[1], wy);
+  get_cubic_weights(v[2] - i0[2], wz);
+
+  sy = 3L * flat->count[0];
+  sz = sy * flat->count[1];
+
+  d[0] = d[1] = d[2] = 0.0;
+  for(c=0; c<4; c++)
+    for(b=0; b<4; b++) {
+      off = (i0[2]-1+c)*sz + (i0[1]-1+b)*sy + 3L*(i0[0]-1);
+      for(a=0; a<4; a++) {
+        w = wz[c]*wy[b]*wx[a];
+        p = &flat->disp[off + 3*a];
+        d[0] += w*p[0];
+        d[1] += w*p[1];
+        d[2] += w*p[2];
+      }
+    }
+
+  return(TRUE);
+}
+
+/* re-read the grid displacements into the packed array, and check a
+   few interior points against grid_transform_point() */
+
+void update_flat_transform(Flat_Transform *flat)
+{
+  static VIO_Real
+    probe[3][3] = { {0.37, 0.52, 0.61},
+                    {0.13, 0.88, 0.29},
+                    {0.71, 0.24, 0.45} };
+  int
+    i,k,c[3],
+    index[VIO_MAX_DIMENSIONS];
+  VIO_Volume
+    volume;
+  VIO_Real
+    value, grid_to_voxel[3][4],
+    voxel[VIO_MAX_DIMENSIONS], v[3], d[3], w[3], t[3];
+  float
+    *p;
+
+  flat->n_fast    = 0;
+  flat->n_generic = 0;
+
+  if (!flat->compiled || flat->grid == NULL)
+    return;
+
+  volume = flat->grid->displacement_volume;
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i] = 0;
+
+  p = flat->disp;
+  for(c[2]=0; c[2]<flat->count[2]; c[2]++)
+    for(c[1]=0; c[1]<flat->count[1]; c[1]++)
+      for(c[0]=0; c[0]<flat->count[0]; c[0]++) {
+        for(i=0; i<3; i++)
+          index[ flat->xyzv[i] ] = c[i];
+        for(k=0; k<3; k++) {
+          index[ flat->xyzv[VIO_Z+1] ] = k;
+          GET_VALUE_4D(value, volume, index[0], index[1], index[2], index[3]);
+          *p++ = (float)value;
+        }
+      }
+
+  get_world_to_voxel(volume, flat->xyzv, grid_to_voxel);
+
+  flat->grid_ok = TRUE;
+  for(i=0; i<3 && flat->grid_ok; i++) {
+
+    for(k=0; k<VIO_MAX_DIMENSIONS; k++) voxel[k] = 0.0;
+    for(k=0; k<3; k++)
+      voxel[ flat->xyzv[k] ] = 1.0 + probe[i][k] * (flat->count[k] - 3.0);
+
+    convert_voxel_to_world(volume, voxel, &w[0], &w[1], &w[2]);
+    general_transform_point(flat->grid, w[0], w[1], w[2], &t[0], &t[1], &t[2]);
+
+    for(k=0; k<3; k++)
+      v[k] = grid_to_voxel[k][0]*w[0] + grid_to_voxel[k][1]*w[1] +
+             grid_to_voxel[k][2]*w[2] + grid_to_voxel[k][3];
+
+    if (!get_grid_displacement(flat, v, d))
+      flat->grid_ok = FALSE;
+    else
+      for(k=0; k<3; k++)
+        if (fabs(w[k] + d[k] - t[k]) > FLAT_TRANSFORM_TOLERANCE)
+          flat->grid_ok = FALSE;
+  }
+}
+
+/* map a point with the compiled form.  Returns FALSE if it must go
+   through general_transform_point() instead */
+
+static VIO_BOOL fast_transform_point(Flat_Transform *flat,
+                                     VIO_Real x, VIO_Real y, VIO_Real z,
+                                     VIO_Real t[])
+{
+  int      k;
+  VIO_Real v[3], d[3];
+
+  if (!flat->compiled)
+    return(FALSE);
+
+  d[0] = d[1] = d[2] = 0.0;
+
+  if (flat->grid != NULL) {
+    if (!flat->grid_ok)
+      return(FALSE);
+
+    for(k=0; k<3; k++)
+      v[k] = flat->pre_to_voxel[k][0]*x + flat->pre_to_voxel[k][1]*y +
+             flat->pre_to_voxel[k][2]*z + flat->pre_to_voxel[k][3];
+
+    if (!get_grid_displacement(flat, v, d))
+      return(FALSE);
+  }
+
+  for(k=0; k<3; k++)
+    t[k] = flat->pre_post[k][0]*x + flat->pre_post[k][1]*y +
+           flat->pre_post[k][2]*z + flat->pre_post[k][3] +
+           flat->post[k][0]*d[0] + flat->post[k][1]*d[1] + flat->post[k][2]*d[2];
+
+  return(TRUE);
+}
+
+void flat_transform_point(Flat_Transform *flat,
+                          VIO_Real x, VIO_Real y, VIO_Real z,
+                          VIO_Real *tx, VIO_Real *ty, VIO_Real *tz)
+{
+  VIO_Real t[3];
+
+  if (fast_transform_point(flat, x, y, z, t)) {
+    *tx = t[0]; *ty = t[1]; *tz = t[2];
+    flat->n_fast++;
+  }
+  else {
+    general_transform_point(flat->transform, x, y, z, tx, ty, tz);
+    flat->n_generic++;
+  }
+}
+
+/* map the points (px,py,pz)[1..len] into (tx,ty,tz)[1..len], all in
+   world coordinates */
+
+void flat_transform_map_points(Flat_Transform *flat,
+                               float px[], float py[], float pz[],
+                               float tx[], float ty[], float tz[],
+                               int len)
+{
+  int      i;
+  VIO_Real x,y,z;
+
+  for(i=1; i<=len; i++) {
+    flat_transform_point(flat, (VIO_Real)px[i], (VIO_Real)py[i], (VIO_Real)pz[i],
+                         &x, &y, &z);
+    tx[i] = (float)x;
+    ty[i] = (float)y;
+    tz[i] = (float)z;
+  }
+}
+
+/* replace the world coordinates (x,y,z)[1..len] by voxel coordinates
+   of the target volume given to init_flat_transform(), as
+   convert_3D_world_to_voxel() would */
+
+void flat_transform_to_target_voxel(Flat_Transform *flat,
+                                    float x[], float y[], float z[],
+                                    int len)
+{
+  int      i;
+  VIO_Real (*m)[4], wx,wy,wz;
+
+  if (!flat->has_target) {
+    print_error_and_line_num("flat transform was built without a target volume",
+                             __FILE__, __LINE__);
+    return;
+  }
+
+  m = flat->target_to_voxel;
+
+  for(i=1; i<=len; i++) {
+    wx = x[i]; wy = y[i]; wz = z[i];
+    x[i] = (float)(m[0][0]*wx + m[0][1]*wy + m[0][2]*wz + m[0][3]);
+    y[i] = (float)(m[1][0]*wx + m[1][1]*wy + m[1][2]*wz + m[1][3]);
+    z[i] = (float)(m[2][0]*wx + m[2][1]*wy + m[2][2]*wz + m[2][3]);
+  }
+}
+
+void delete_flat_transform(Flat_Transform *flat)
+{
+  if (flat->disp != NULL)
+    FREE(flat->disp);
+  flat->disp     = NULL;
+  flat->compiled = FALSE;
+}
@@ -0,0 +1,343 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : lattice_sampling.c
+@DESCRIPTION: importance sampling of the lattice, driven by gradient
+              magnitude.
+
+  these include:
+     get_importance_weight() -  gradient magnitude at a voxel, taken from
+                                a weight volume (e.g. the _dxyz output of
+                                mincblur -gradient) or, without one, by
+                                central differences in the data volume
+     init_lattice_samples() -   draw, once per linear fit, a budget of
+                                lattice nodes with a probability that
+                                grows with their weight
+     get_lattice_samples() -    the nodes drawn, used by xcorr_objective
+                                and mutual_information_objective in place
+                                of the full lattice
+     clear_lattice_samples() -  go back to the full lattice
+     select_nodes_by_weight() - keep the nodes of the non-linear fit
+                                with the largest weights
+
+  Most of the similarity signal comes from tissue boundaries, where the
+  gradient is large.  Node i of the lattice is drawn with probability
+
+     p_i = min(1, budget * q_i),  q_i = (1-a) g_i/sum(g) + a/n
+
+  where a share a of the budget is spread uniformly, so that no node
+  has a zero probability.  The nodes are drawn by systematic sampling
+  (deterministic, so that the objective function does not change
+  between calls), and each carries a weight 1/p_i: the weighted sums
+  in the objective functions are then unbiased estimates of the sums
+  over the full lattice.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "minctracc_arg_data.h"
+#include "local_macros.h"
+#include "vox_space.h"
+#include "interpolation.h"
+#include "deform_support.h"
+#include "lattice_sampling.h"
+
+static Lattice_Sample *samples   = NULL;
+static int            n_samples = 0;
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_importance_weight
+@INPUT      : weights - weight volume, or NULL
+              data    - volume in which voxel[] is given
+              voxel   - voxel coordinates (in volume order)
+@OUTPUT     :
+@RETURNS    : the importance of the voxel: the value of weights at the
+              same world position, or the gradient magnitude of data
+              (per mm) estimated by central differences at the nearest
+              voxel.  0 outside of the volumes.
+@DESCRIPTION:
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_Real get_importance_weight(VIO_Volume weights, VIO_Volume data,
+                               VIO_Real voxel[])
+{
+  int
+    k, idx[3], lo[3], hi[3], sizes[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    wx, wy, wz, value, diff, sum,
+    steps[VIO_MAX_DIMENSIONS];
+
+  get_volume_sizes(data, sizes);
+  for(k=0; k<3; k++) {
+    idx[k] = VIO_ROUND(voxel[k]);
+    if (idx[k] < 0 || idx[k] >= sizes[k])
+      return(0.0);
+  }
+
+  if (weights != (VIO_Volume)NULL) {
+    convert_3D_voxel_to_world(data, voxel[0], voxel[1], voxel[2], &wx, &wy, &wz);
+    value = get_value_of_point_in_volume(wx, wy, wz, weights);
+    return( (value > 0.0) ? value : 0.0 );
+  }
+
+  get_volume_separations(data, steps);
+
+  sum = 0.0;
+  for(k=0; k<3; k++) {
+    if (sizes[k] < 2) continue;
+    lo[0] = idx[0]; lo[1] = idx[1]; lo[2] = idx[2];
+    hi[0] = idx[0]; hi[1] = idx[1]; hi[2] = idx[2];
+    lo[k] = MAX(idx[k]-1, 0);
+    hi[k] = MIN(idx[k]+1, sizes[k]-1);
+    diff = get_volume_real_value(data, hi[0],hi[1],hi[2],0,0) -
+           get_volume_real_value(data, lo[0],lo[1],lo[2],0,0);
+    diff /= (hi[k] - lo[k]) * fabs(steps[k]);
+    sum += diff * diff;
+  }
+
+  return(sqrt(sum));
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : init_lattice_samples
+@INPUT      : globals - lattice definition (count[], start[], directions[])
+              d1, d2  - volumes of the fit (the lattice is in d1)
+              m1      - mask of d1, or NULL
+              weights - weight volume (in the space of d1), or NULL to
+                 use the gradient magnitude of d1
+              budget  - number of nodes to draw
+@OUTPUT     :
+@RETURNS    : the number of nodes drawn, or 0 if the full lattice is to
+              be used (budget < 1, or not smaller than the lattice)
+@DESCRIPTION: see the top of this file.  The nodes that are masked or
+              outside of d1 in the full lattice can never contribute and
+              are left out before drawing.
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+int init_lattice_samples(Arg_Data *globals,
+                         VIO_Volume d1, VIO_Volume d2, VIO_Volume m1,
+                         VIO_Volume weights, int budget)
+{
+  Voxel_space_struct
+    *vox_space;
+  VectorR
+    vector_step;
+  PointR
+    starting_position, slice, row, col;
+  VIO_Real
+    *node_voxel, *prob,
+    voxel[3], total, uniform, scale, u, acc;
+  int
+    i, k, r, c, s, n_nodes, n_capped, sizes[VIO_MAX_DIMENSIONS];
+  VIO_BOOL
+    changed;
+
+  clear_lattice_samples();
+
+  n_nodes = globals->count[SLICE_IND] * globals->count[ROW_IND] * globals->count[COL_IND];
+  if (budget < 1 || n_nodes <= budget)
+    return(0);
+
+  get_volume_sizes(d1, sizes);
+
+  ALLOC(node_voxel, 3*n_nodes);
+  ALLOC(prob, n_nodes);
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+
+                                /* weights of the nodes that can contribute */
+  n_nodes = 0;
+  total   = 0.0;
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+
+  for(s=0; s<globals->count[SLICE_IND]; s++) {
+    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+
+    for(r=0; r<globals->count[ROW_IND]; r++) {
+      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+      ADD_POINT_VECTOR( row, slice, vector_step );
+      col = row;
+
+      for(c=0; c<globals->count[COL_IND]; c++) {
+        voxel[0] = Point_x(col);
+        voxel[1] = Point_y(col);
+        voxel[2] = Point_z(col);
+
+        for(k=0; k<3; k++)
+          if (VIO_ROUND(voxel[k]) < 0 || VIO_ROUND(voxel[k]) >= sizes[k])
+            break;
+
+        if (k == 3 && voxel_point_not_masked(m1, voxel[0], voxel[1], voxel[2])) {
+          for(k=0; k<3; k++)
+            node_voxel[3*n_nodes+k] = voxel[k];
+          prob[n_nodes] = get_importance_weight(weights, d1, voxel);
+          total += prob[n_nodes];
+          n_nodes++;
+        }
+
+        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+      }
+    }
+  }
+
+  delete_voxel_space_struct(vox_space);
+
+  if (n_nodes <= budget) {
+    FREE(node_voxel);
+    FREE(prob);
+    return(0);
+  }
+                                /* p_i = budget * q_i, capped at 1 with
+                                   the excess given back to the others */
+  uniform = LATTICE_SAMPLING_UNIFORM_FRACTION / n_nodes;
+  for(i=0; i<n_nodes; i++) {
+    if (total > 0.0)
+      prob[i] = (1.0 - LATTICE_SAMPLING_UNIFORM_FRACTION) * prob[i] / total + uniform;
+    else
+      prob[i] = 1.0 / n_nodes;
+  }
+
+  do {
+    changed  = FALSE;
+    total    = 0.0;
+    n_capped = 0;
+    for(i=0; i<n_nodes; i++)
+      if (prob[i] < 1.0)
+        total += prob[i];
+      else
+        n_capped++;
+
+    if (total <= 0.0 || n_capped >= budget)
+      break;
+
+    scale = (budget - n_capped) / total;
+    for(i=0; i<n_nodes; i++)
+      if (prob[i] < 1.0) {
+        prob[i] *= scale;
+        if (prob[i] >= 1.0) {
+          prob[i]  = 1.0;
+          changed = TRUE;
+        }
+      }
+  } while (changed);
+
+                                /* systematic sampling */
+  ALLOC(samples, budget + 1);
+  n_samples = 0;
+  u   = 0.5;
+  acc = 0.0;
+  for(i=0; i<n_nodes && n_samples <= budget; i++) {
+    acc += prob[i];
+    if (acc >= u) {
+      for(k=0; k<3; k++)
+        samples[n_samples].voxel[k] = node_voxel[3*i+k];
+      samples[n_samples].weight = 1.0 / MIN(prob[i], 1.0);
+      n_samples++;
+      while (acc >= u) u += 1.0;
+    }
+  }
+
+  FREE(node_voxel);
+  FREE(prob);
+
+  if (n_samples == 0) {
+    FREE(samples);
+    samples = NULL;
+  }
+
+  return(n_samples);
+}
+
+void clear_lattice_samples(void)
+{
+  if (samples != NULL)
+    FREE(samples);
+  samples   = NULL;
+  n_samples = 0;
+}
+
+int get_lattice_samples(Lattice_Sample **list)
+{
+  *list = samples;
+  return(n_samples);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : select_nodes_by_weight
+@INPUT      : weight   - importance of each node
+              n_nodes  - number of nodes
+              budget   - number of nodes to keep
+@OUTPUT     : selected - TRUE for the budget nodes with the largest
+                 weights (ties broken by node order), FALSE otherwise
+@RETURNS    : the number of nodes selected
+@DESCRIPTION: used by do_nonlinear.c to estimate only the nodes that
+              carry most of the similarity signal; the others are
+              filled in by the smoothing of the warp.
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+static int compare_floats_down(const void *a, const void *b)
+{
+  float fa = *(const float *)a, fb = *(const float *)b;
+
+  return( (fa < fb) ? 1 : ((fa > fb) ? -1 : 0) );
+}
+
+long select_nodes_by_weight(float weight[], long n_nodes, long budget,
+                            unsigned char selected[])
+{
+  float
+    *sorted, cut;
+  long
+    node, count, above;
+
+  if (budget >= n_nodes) {
+    for(node=0; node<n_nodes; node++)
+      selected[node] = TRUE;
+    return(n_nodes);
+  }
+
+  ALLOC(sorted, n_nodes);
+  for(node=0; node<n_nodes; node++)
+    sorted[node] = weight[node];
+  qsort(sorted, n_nodes, sizeof(float), compare_floats_down);
+  cut = sorted[budget-1];
+  FREE(sorted);
+
+  above = 0;
+  for(node=0; node<n_nodes; node++)
+    if (weight[node] > cut) above++;
+
+  count = 0;
+  for(node=0; node<n_nodes; node++) {
+    selected[node] = (weight[node] > cut ||
+                      (weight[node] == cut && above < budget));
+    if (weight[node] == cut && selected[node])
+      above++;
+    if (selected[node])
+      count++;
+  }
+
+  return(count);
+}
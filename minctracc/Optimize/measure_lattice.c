@@ -0,0 +1,496 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : measure_lattice.c
+@DESCRIPTION: the similarity measures written by -measure, computed in a
+              single pass over the lattice.
+
+  these include:
+     measure_lattice() - zscore, xcorr, var_ratio, ssc, mi and nmi of the
+                         current transformation
+
+  The objective functions that these measures come from need their
+  volumes prepared first: -zscore and -ssc replace both volumes by their
+  z-scores (and -ssc adds speckle to one of them), -mi converts them to
+  bytes.  measure_code.c used to run them one after the other, reading
+  both volumes from disk again after each destructive one.  Here the
+  volumes are left untouched and each node of the lattice is visited
+  once, accumulating what each measure needs:
+
+     xcorr      sums of v1*v2, v1*v1 and v2*v2
+     zscore     sum of (z1-z2)^2, with z = (v-mean)/std computed from
+                the statistics make_zscore_volume() would use
+     var_ratio  per-group sums of v1/v2 and (v1/v2)^2
+     ssc        the z-scores of each node, scanned for zero crossings
+                along the three lattice directions at the end
+     mi, nmi    the joint histogram of the byte values of the volumes,
+                by partial volume interpolation
+
+  The pass runs as the objective function of evaluate_fit(), so the
+  transformation is built from the parameters, and the volumes are
+  swapped and mapped with the inverse transformation when the lattice
+  is in the target, exactly as measure_fit() evaluates one objective.
+
+  Since z-scores are computed from interpolated values rather than
+  interpolated from a z-score volume, zscore and ssc can differ slightly
+  from the old values near thresholded or clamped voxels.  The speckle
+  of ssc scales the z-score of the node in the smaller volume rather
+  than its stored voxel.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "minctracc_arg_data.h"
+#include "local_macros.h"
+#include "vox_space.h"
+#include "interpolation.h"
+#include "segment_table.h"
+#include "measure_lattice.h"
+
+extern Arg_Data *main_args;
+
+#define MIN_ZRANGE -5.0                 /* as in make_zscore_volume() */
+#define MAX_ZRANGE  5.0
+
+int voxel_point_not_masked(VIO_Volume volume,
+                           VIO_Real vx, VIO_Real vy, VIO_Real vz);
+
+VIO_BOOL partial_volume_interpolation(VIO_Volume data,
+                                      VIO_Real coord[],
+                                      VIO_Real intensity_vals[],
+                                      VIO_Real fractional_vals[],
+                                      VIO_Real *result);
+
+void get_zscore_stats(VIO_Volume d1, VIO_Volume m1, VIO_Real threshold,
+                      VIO_Real *mean, VIO_Real *std);
+
+void finish_mutual_information(VIO_Real *pdf1, VIO_Real *pdf2, VIO_Real **jpdf,
+                               int groups, int blur_size, VIO_Real total,
+                               float *mi, float *nmi, double entropies[]);
+
+float evaluate_fit(VIO_Volume d1, VIO_Volume d2,
+                   VIO_Volume m1, VIO_Volume m2,
+                   Arg_Data *globals);
+
+
+/* what measure_lattice() hands to the objective function run by
+   evaluate_fit(): mean and std are those of the first and second volume
+   the objective function gets, zthresh those of threshold[0] and [1]  */
+
+static struct {
+  Lattice_Measures *measures;
+  VIO_BOOL          ok;
+  VIO_Real          mean[2], std[2], zthresh[2];
+} Gmeasure;
+
+
+/* the histogram bins of a volume: its voxel values if it is stored as
+   unsigned bytes, otherwise the voxel values it would get from
+   replace_volume_data_with_ubyte() */
+
+typedef struct {
+  VIO_BOOL   is_byte;
+  VIO_Real   min, scale;
+} Byte_Bins;
+
+static void init_byte_bins(Byte_Bins *bins, VIO_Volume volume)
+{
+  VIO_Real max;
+
+  bins->is_byte = (get_volume_data_type(volume) == VIO_UNSIGNED_BYTE);
+  get_volume_minimum_maximum_real_value(volume, &bins->min, &max);
+  bins->scale = (max > bins->min) ? (MEASURE_MI_BINS-1) / (max - bins->min) : 0.0;
+}
+
+static int get_byte_bin(Byte_Bins *bins, VIO_Volume volume, VIO_Real voxel_value)
+{
+  int bin;
+
+  if (bins->is_byte)
+    bin = VIO_ROUND(voxel_value);
+  else
+    bin = VIO_ROUND((CONVERT_VOXEL_TO_VALUE(volume, voxel_value) - bins->min) * bins->scale);
+
+  return( MAX(0, MIN(MEASURE_MI_BINS-1, bin)) );
+}
+
+static VIO_Real zscore_of(VIO_Real value, VIO_Real mean, VIO_Real std)
+{
+  VIO_Real z;
+
+  z = (value - mean) / std;
+  if (z < MIN_ZRANGE) z = MIN_ZRANGE;
+  if (z > MAX_ZRANGE) z = MAX_ZRANGE;
+
+  return(z);
+}
+
+/* one step of the zero-crossing count of ssc_objective() */
+
+static void count_crossing(VIO_Real z1, VIO_Real z2,
+                           VIO_BOOL *greater, unsigned long *zero_crossings)
+{
+  if (!((*greater && z1>z2) || (!*greater && z1<z2))) {
+    *greater = !*greater;
+    (*zero_crossings)++;
+  }
+}
+
+
+/* the single pass over the lattice, in the order of the objective
+   functions: d1 holds the lattice, and is the smaller volume */
+
+static VIO_BOOL measure_nodes(VIO_Volume d1, VIO_Volume d2,
+                              VIO_Volume m1, VIO_Volume m2,
+                              Arg_Data *globals, Lattice_Measures *measures)
+{
+  VectorR
+    vector_step;
+  PointR
+    starting_position, slice, row, col,
+    voxel, pos2, voxel_pos2;
+  VIO_Real
+    value1, value2, voxel_value2, voxel_value1,
+    coord1[3], coord2[3],
+    intensity_vals1[8], intensity_vals2[8],
+    fractional_vals1[8], fractional_vals2[8],
+    mean1, std1, mean2, std2, zthresh1, zthresh2, z1, z2,
+    speckle_factor,
+    s1, s2, s3,                 /* xcorr sums          */
+    z2_sum,                     /* zscore sum          */
+    *rat_sum, *rat2_sum,        /* var_ratio sums      */
+    rat, var, total_variance,
+    *pdf1, *pdf2, **jpdf,       /* mi, nmi histograms  */
+    total2,
+    entropies[3];
+  float
+    *ssc_z1, *ssc_z2;           /* node z-scores for ssc */
+  unsigned char
+    *ssc_valid;
+  unsigned long
+    *count3, total_count,
+    zero_crossings;
+  long
+    node;
+  int
+    i, j, r, c, s, index,
+    xcorr_count, zscore_count,
+    bin1[8], bin2[8],
+    count[3];
+  VIO_BOOL
+    in_d2, greater, flip_flag;
+  Voxel_space_struct
+    *vox_space;
+  VIO_Transform
+    *trans;
+  Segment_Table
+    *table;
+  Byte_Bins
+    bins1, bins2;
+
+  for(i=0; i<3; i++)
+    count[i] = globals->count[i];
+
+  mean1    = Gmeasure.mean[0];
+  std1     = Gmeasure.std[0];
+  mean2    = Gmeasure.mean[1];
+  std2     = Gmeasure.std[1];
+  zthresh1 = Gmeasure.zthresh[0];
+  zthresh2 = Gmeasure.zthresh[1];
+
+  if (!build_segment_table(&table, d1, globals->groups))
+    return(FALSE);
+
+  init_byte_bins(&bins1, d1);
+  init_byte_bins(&bins2, d2);
+
+  ALLOC(rat_sum,  table->groups+1);
+  ALLOC(rat2_sum, table->groups+1);
+  ALLOC(count3,   table->groups+1);
+  for(i=0; i<=table->groups; i++) {
+    rat_sum[i] = rat2_sum[i] = 0.0;
+    count3[i] = 0;
+  }
+
+  ALLOC(pdf1, MEASURE_MI_BINS);
+  ALLOC(pdf2, MEASURE_MI_BINS);
+  VIO_ALLOC2D(jpdf, MEASURE_MI_BINS, MEASURE_MI_BINS);
+  for(i=0; i<MEASURE_MI_BINS; i++) {
+    pdf1[i] = pdf2[i] = 0.0;
+    for(j=0; j<MEASURE_MI_BINS; j++)
+      jpdf[i][j] = 0.0;
+  }
+
+  ALLOC(ssc_z1,    (long)count[SLICE_IND]*count[ROW_IND]*count[COL_IND]);
+  ALLOC(ssc_z2,    (long)count[SLICE_IND]*count[ROW_IND]*count[COL_IND]);
+  ALLOC(ssc_valid, (long)count[SLICE_IND]*count[ROW_IND]*count[COL_IND]);
+
+  s1 = s2 = s3 = z2_sum = total2 = 0.0;
+  xcorr_count = zscore_count = 0;
+  flip_flag = FALSE;
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+
+  node = 0;
+  for(s=0; s<count[SLICE_IND]; s++) {
+
+    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+
+    for(r=0; r<count[ROW_IND]; r++) {
+
+      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+      ADD_POINT_VECTOR( row, slice, vector_step );
+      col = row;
+
+      for(c=0; c<count[COL_IND]; c++, node++) {
+
+        ssc_valid[node] = FALSE;
+        speckle_factor  = flip_flag ? (1 + 0.01*globals->speckle) : (1 - 0.01*globals->speckle);
+        flip_flag       = !flip_flag;
+
+                                /* mi, nmi: partial volume interpolation
+                                   at the node itself                  */
+        coord1[VIO_X] = Point_x(col);
+        coord1[VIO_Y] = Point_y(col);
+        coord1[VIO_Z] = Point_z(col);
+
+        my_homogenous_transform_point(trans,
+                                      Point_x(col), Point_y(col), Point_z(col), 1.0,
+                                      &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+        coord2[VIO_X] = Point_x(pos2);
+        coord2[VIO_Y] = Point_y(pos2);
+        coord2[VIO_Z] = Point_z(pos2);
+
+        if (voxel_point_not_masked(m1, coord1[VIO_X], coord1[VIO_Y], coord1[VIO_Z]) &&
+            partial_volume_interpolation(d1, coord1, intensity_vals1, fractional_vals1, &value1) &&
+            value1 > globals->threshold[0] &&
+            voxel_point_not_masked(m2, coord2[VIO_X], coord2[VIO_Y], coord2[VIO_Z]) &&
+            partial_volume_interpolation(d2, coord2, intensity_vals2, fractional_vals2, &value2) &&
+            value2 > globals->threshold[1]) {
+
+          total2 += 1.0;
+          for(i=0; i<8; i++) {
+            bin1[i] = get_byte_bin(&bins1, d1, intensity_vals1[i]);
+            bin2[i] = get_byte_bin(&bins2, d2, intensity_vals2[i]);
+            pdf1[ bin1[i] ] += fractional_vals1[i];
+            pdf2[ bin2[i] ] += fractional_vals2[i];
+          }
+          for(i=0; i<8; i++)
+            for(j=0; j<8; j++)
+              jpdf[ bin1[i] ][ bin2[j] ] += fractional_vals1[i]*fractional_vals2[j];
+        }
+
+                                /* the others: the voxel nearest to the
+                                   node in d1                           */
+        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) );
+
+        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel)) &&
+            INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+
+                                /* zscore, var_ratio and ssc map the node
+                                   into d2, xcorr maps its voxel        */
+          in_d2 = voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2)) &&
+                  INTERPOLATE_TRUE_VALUE( d2, &pos2, &value2 );
+
+          my_homogenous_transform_point(trans,
+                                        Point_x(voxel), Point_y(voxel), Point_z(voxel), 1.0,
+                                        &Point_x(voxel_pos2), &Point_y(voxel_pos2), &Point_z(voxel_pos2));
+
+          if (voxel_point_not_masked(m2, Point_x(voxel_pos2), Point_y(voxel_pos2), Point_z(voxel_pos2)) &&
+              INTERPOLATE_TRUE_VALUE( d2, &voxel_pos2, &voxel_value2 ) &&
+              value1 > globals->threshold[0] && voxel_value2 > globals->threshold[1]) {
+            xcorr_count++;
+            s1 += value1*voxel_value2;
+            s2 += value1*value1;
+            s3 += voxel_value2*voxel_value2;
+          }
+
+          if (in_d2) {
+
+            z1 = zscore_of(value1, mean1, std1);
+            z2 = zscore_of(value2, mean2, std2);
+
+                                /* zscore_objective() thresholds the
+                                   z-scores, vr_objective() the values */
+            if (fabs(z1) > zthresh1 && fabs(z2) > zthresh2) {
+              zscore_count++;
+              z2_sum += (z1-z2)*(z1-z2);
+            }
+
+            if (value1 > globals->threshold[0] && value2 > globals->threshold[1] &&
+                value2 != 0.0) {
+              voxel_value1 = CONVERT_VALUE_TO_VOXEL(d1, value1);
+              index = (*table->segment)( voxel_value1, table);
+              if (index>0) {
+                count3[index]++;
+                rat = value1 / value2;
+                rat_sum[index]  += rat;
+                rat2_sum[index] += rat*rat;
+              }
+            }
+
+            z1 *= speckle_factor;
+            ssc_z1[node]    = z1;
+            ssc_z2[node]    = z2;
+            ssc_valid[node] = TRUE;
+          }
+        }
+
+        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+      }
+    }
+  }
+
+  delete_voxel_space_struct(vox_space);
+
+                                /* xcorr */
+  if (s2 > 0.0 && s3 > 0.0)
+    measures->xcorr = 1.0 - s1 / (sqrt((double)s2)*sqrt((double)s3));
+  else
+    measures->xcorr = 1.0;
+
+                                /* zscore */
+  if (zscore_count > 0)
+    measures->zscore = sqrt((double)z2_sum) / zscore_count;
+  else
+    measures->zscore = sqrt((double)z2_sum);
+
+                                /* var_ratio */
+  total_variance = 0.0;
+  total_count = 0;
+  for(index=1; index<=table->groups; index++)
+    if (count3[index] > 1)
+      total_count += count3[index];
+
+  if (total_count > 1) {
+    for(index=1; index<=table->groups; index++)
+      if (count3[index] > 1) {
+        var = ((double)count3[index]*rat2_sum[index] - rat_sum[index]*rat_sum[index]) /
+          ((double)count3[index]*((double)count3[index]-1.0));
+        total_variance += ((double)count3[index]/(double)total_count) * var;
+      }
+  }
+  else
+    total_variance = 1e15;
+  measures->var_ratio = total_variance;
+
+                                /* ssc: along cols, then rows, then slices */
+  greater = TRUE;
+  zero_crossings = 0;
+
+#define SSC_NODE(s,r,c) (((long)(s)*count[ROW_IND] + (r))*count[COL_IND] + (c))
+
+  for(s=0; s<count[SLICE_IND]; s++)
+    for(r=0; r<count[ROW_IND]; r++)
+      for(c=0; c<count[COL_IND]; c++)
+        if (ssc_valid[ node = SSC_NODE(s,r,c) ])
+          count_crossing(ssc_z1[node], ssc_z2[node], &greater, &zero_crossings);
+
+  for(s=0; s<count[SLICE_IND]; s++)
+    for(c=0; c<count[COL_IND]; c++)
+      for(r=0; r<count[ROW_IND]; r++)
+        if (ssc_valid[ node = SSC_NODE(s,r,c) ])
+          count_crossing(ssc_z1[node], ssc_z2[node], &greater, &zero_crossings);
+
+  for(c=0; c<count[COL_IND]; c++)
+    for(r=0; r<count[ROW_IND]; r++)
+      for(s=0; s<count[SLICE_IND]; s++)
+        if (ssc_valid[ node = SSC_NODE(s,r,c) ])
+          count_crossing(ssc_z1[node], ssc_z2[node], &greater, &zero_crossings);
+
+  measures->ssc = -1.0 * (float)zero_crossings;
+
+                                /* mi, nmi */
+  finish_mutual_information(pdf1, pdf2, jpdf, MEASURE_MI_BINS, globals->blur_pdf,
+                            total2, &measures->mi, &measures->nmi, entropies);
+
+  if (globals->flags.debug)
+    (void)print ("measure: %d xcorr, %d zscore and %.0f mi nodes\n",
+                 xcorr_count, zscore_count, total2);
+
+  FREE(ssc_z1);
+  FREE(ssc_z2);
+  FREE(ssc_valid);
+  FREE(pdf1);
+  FREE(pdf2);
+  VIO_FREE2D(jpdf);
+  FREE(rat_sum);
+  FREE(rat2_sum);
+  FREE(count3);
+  (void)free_segment_table(table);
+
+  return(TRUE);
+}
+
+
+static float measure_objective(VIO_Volume d1, VIO_Volume d2,
+                               VIO_Volume m1, VIO_Volume m2,
+                               Arg_Data *globals)
+{
+  Gmeasure.ok = measure_nodes(d1, d2, m1, m2, globals, Gmeasure.measures);
+
+  return(Gmeasure.measures->xcorr);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : measure_lattice
+@INPUT      : d1,d2   - the volumes, as read from disk (not modified)
+              m1,m2   - their masks, or NULL
+              globals - lattice, transformation parameters, thresholds,
+                        -groups, -speckle and -blur_pdf
+@OUTPUT     : measures - the value of each measure
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: see the top of this file
+@METHOD     :
+@GLOBALS    : Gmeasure
+@CALLS      : evaluate_fit
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_BOOL measure_lattice(VIO_Volume d1, VIO_Volume d2,
+                         VIO_Volume m1, VIO_Volume m2,
+                         Arg_Data *globals, Lattice_Measures *measures)
+{
+  Objective_Function
+    obj_function;
+  VIO_Real
+    mean1, std1, mean2, std2;
+
+                                /* what the preparation steps of
+                                   measure_fit() would need */
+  get_zscore_stats(d1, m1, globals->threshold[0], &mean1, &std1);
+  get_zscore_stats(d2, m2, globals->threshold[1], &mean2, &std2);
+  Gmeasure.zthresh[0] = (globals->threshold[0] - mean1) / std1;
+  Gmeasure.zthresh[1] = (globals->threshold[1] - mean2) / std2;
+
+  if (globals->smallest_vol == 1) {
+    Gmeasure.mean[0] = mean1;  Gmeasure.std[0] = std1;
+    Gmeasure.mean[1] = mean2;  Gmeasure.std[1] = std2;
+  }
+  else {
+    Gmeasure.mean[0] = mean2;  Gmeasure.std[0] = std2;
+    Gmeasure.mean[1] = mean1;  Gmeasure.std[1] = std1;
+  }
+
+  Gmeasure.measures = measures;
+  Gmeasure.ok       = FALSE;
+
+  obj_function = globals->obj_function;
+  globals->obj_function = measure_objective;
+
+  (void)evaluate_fit(d1, d2, m1, m2, globals);
+
+  globals->obj_function = obj_function;
+
+  return(Gmeasure.ok);
+}
@@ -0,0 +1,275 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : nl_checkpoint.c
+@DESCRIPTION: save and restore the state of the non-linear fit, so that
+              a long run that is killed can be resumed where it stopped.
+
+  these include:
+     write_nonlinear_checkpoint() -  save the current transformation and
+                                     the iteration state
+     read_nonlinear_checkpoint() -   load them back, copying the saved
+                                     warp into the warp being optimized
+     delete_nonlinear_checkpoint() - free the state
+
+  A checkpoint called <base> is made of
+
+     <base>_0.xfm or <base>_1.xfm  (and its _grid_0.mnc) - the transform,
+                                   written alternately so that the
+                                   previous one stays valid while the
+                                   next one is being written
+     <base>.state                - a small text file naming the last
+                                   complete transform, and the iteration
+                                   state.  It is written to a temporary
+                                   file which is then renamed.
+
+  The displacement volume is written with the type it has in memory,
+  so the restored warp is the same as the one that was saved.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <stdio.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "nl_checkpoint.h"
+
+#define CHECKPOINT_MAGIC    "minctracc_nl_checkpoint"
+#define CHECKPOINT_VERSION  1
+
+
+VIO_BOOL write_nonlinear_checkpoint(char *basename,
+                                    VIO_General_transform *transform,
+                                    Nonlinear_Checkpoint *state)
+{
+  VIO_Status
+    status;
+  VIO_STR
+    comments, xfm_name, xfm_base, state_name, tmp_name;
+  FILE
+    *file;
+  int
+    i, count;
+  long
+    node;
+  VIO_BOOL
+    ok;
+
+  ALLOC(comments,   512);
+  ALLOC(xfm_base,   strlen(basename)+32);
+  ALLOC(xfm_name,   strlen(basename)+32);
+  ALLOC(state_name, strlen(basename)+32);
+  ALLOC(tmp_name,   strlen(basename)+32);
+
+  (void)sprintf(xfm_base,  "%s_%d", basename, state->iterations_done % 2);
+  (void)sprintf(xfm_name,  "%s.xfm", xfm_base);
+  (void)sprintf(state_name,"%s.state", basename);
+  (void)sprintf(tmp_name,  "%s.state.tmp", basename);
+  (void)sprintf(comments,  "checkpoint after step %d of %d of the non-linear estimation",
+                state->iterations_done, state->iteration_limit);
+
+                                /* the transform first ... */
+  count = 0;
+  status = open_file(xfm_name, WRITE_FILE, ASCII_FORMAT, &file);
+  if( status == VIO_OK )
+    status = output_transform(file, xfm_base, &count, comments, transform);
+  if( status == VIO_OK )
+    status = close_file( file );
+
+  ok = (status == VIO_OK);
+
+                                /* ... then the state that points to it */
+  if (ok) {
+    file = fopen(tmp_name, "w");
+    if (file == NULL)
+      ok = FALSE;
+    else {
+      (void)fprintf(file, "%s %d\n", CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+      (void)fprintf(file, "transform %s\n", xfm_name);
+      (void)fprintf(file, "iterations_done %d\n", state->iterations_done);
+      (void)fprintf(file, "iteration_limit %d\n", state->iteration_limit);
+      (void)fprintf(file, "mean_eig_val");
+      for(i=0; i<3; i++) (void)fprintf(file, " %.17g", state->mean_eig_val[i]);
+      (void)fprintf(file, "\nstd_eig_val");
+      for(i=0; i<3; i++) (void)fprintf(file, " %.17g", state->std_eig_val[i]);
+      (void)fprintf(file, "\ninitial_corr %.17g\n", state->initial_corr);
+      (void)fprintf(file, "previous_mean_warp %.17g\n", state->previous_mean_warp);
+      (void)fprintf(file, "previous_corr %.17g\n", state->previous_corr);
+      (void)fprintf(file, "converged %d\n", state->converged ? 1 : 0);
+      if (state->node_active != NULL) {
+        (void)fprintf(file, "node_active %ld\n", state->n_nodes);
+        for(node=0; node<state->n_nodes; node++) {
+          (void)fputc(state->node_active[node] ? '1' : '0', file);
+          if ((node+1) % 72 == 0) (void)fputc('\n', file);
+        }
+        (void)fputc('\n', file);
+      }
+      if (fclose(file) != 0)
+        ok = FALSE;
+      if (ok && rename(tmp_name, state_name) != 0)
+        ok = FALSE;
+    }
+  }
+
+  if (!ok)
+    print ("Error writing non-linear checkpoint %s\n", basename);
+
+  FREE(comments);
+  FREE(xfm_base);
+  FREE(xfm_name);
+  FREE(state_name);
+  FREE(tmp_name);
+
+  return(ok);
+}
+
+/* copy the values of the last grid transform of trans into vol, which
+   must have the same sizes */
+
+static VIO_BOOL copy_last_warp(VIO_General_transform *trans, VIO_Volume vol)
+{
+  VIO_General_transform
+    *warp;
+  VIO_Volume
+    saved;
+  int
+    i, n_dims,
+    s[VIO_MAX_DIMENSIONS], sizes[VIO_MAX_DIMENSIONS],
+    v0,v1,v2,v3,v4;
+
+  warp = (VIO_General_transform *)NULL;
+  for(i=0; i<get_n_concated_transforms(trans); i++)
+    if (get_transform_type( get_nth_general_transform(trans,i) ) == GRID_TRANSFORM)
+      warp = get_nth_general_transform(trans,i);
+
+  if (warp == (VIO_General_transform *)NULL)
+    return(FALSE);
+
+  saved = warp->displacement_volume;
+  n_dims = get_volume_n_dimensions(vol);
+  if (get_volume_n_dimensions(saved) != n_dims)
+    return(FALSE);
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++)
+    s[i] = sizes[i] = 1;
+  get_volume_sizes(saved, s);
+  get_volume_sizes(vol, sizes);
+  for(i=0; i<n_dims; i++)
+    if (s[i] != sizes[i])
+      return(FALSE);
+
+  for(v0=0; v0<sizes[0]; v0++)
+    for(v1=0; v1<sizes[1]; v1++)
+      for(v2=0; v2<sizes[2]; v2++)
+        for(v3=0; v3<sizes[3]; v3++)
+          for(v4=0; v4<sizes[4]; v4++)
+            set_volume_real_value(vol, v0,v1,v2,v3,v4,
+                                  get_volume_real_value(saved, v0,v1,v2,v3,v4));
+  return(TRUE);
+}
+
+VIO_BOOL read_nonlinear_checkpoint(char *basename,
+                                   VIO_Volume current_vol,
+                                   Nonlinear_Checkpoint *state)
+{
+  VIO_General_transform
+    saved;
+  VIO_STR
+    state_name;
+  char
+    key[512], xfm_name[4096];
+  FILE
+    *file;
+  int
+    i, c, version;
+  long
+    node;
+  VIO_BOOL
+    ok;
+
+  state->node_active = NULL;
+  state->n_nodes     = 0;
+  state->converged   = FALSE;     /* not written before -converge_* */
+  xfm_name[0]        = '\0';
+
+  ALLOC(state_name, strlen(basename)+32);
+  (void)sprintf(state_name,"%s.state", basename);
+  file = fopen(state_name, "r");
+  FREE(state_name);
+
+  if (file == NULL)
+    return(FALSE);
+
+  ok = (fscanf(file, "%511s %d", key, &version) == 2 &&
+        strcmp(key, CHECKPOINT_MAGIC) == 0 && version == CHECKPOINT_VERSION);
+
+  while (ok && fscanf(file, "%511s", key) == 1) {
+    if (strcmp(key, "transform") == 0)
+      ok = (fscanf(file, "%4095s", xfm_name) == 1);
+    else if (strcmp(key, "iterations_done") == 0)
+      ok = (fscanf(file, "%d", &state->iterations_done) == 1);
+    else if (strcmp(key, "iteration_limit") == 0)
+      ok = (fscanf(file, "%d", &state->iteration_limit) == 1);
+    else if (strcmp(key, "mean_eig_val") == 0) {
+      for(i=0; i<3 && ok; i++)
+        ok = (fscanf(file, "%lf", &state->mean_eig_val[i]) == 1);
+    }
+    else if (strcmp(key, "std_eig_val") == 0) {
+      for(i=0; i<3 && ok; i++)
+        ok = (fscanf(file, "%lf", &state->std_eig_val[i]) == 1);
+    }
+    else if (strcmp(key, "initial_corr") == 0)
+      ok = (fscanf(file, "%lf", &state->initial_corr) == 1);
+    else if (strcmp(key, "previous_mean_warp") == 0)
+      ok = (fscanf(file, "%lf", &state->previous_mean_warp) == 1);
+    else if (strcmp(key, "previous_corr") == 0)
+      ok = (fscanf(file, "%lf", &state->previous_corr) == 1);
+    else if (strcmp(key, "converged") == 0) {
+      ok = (fscanf(file, "%d", &i) == 1);
+      state->converged = (i != 0);
+    }
+    else if (strcmp(key, "node_active") == 0) {
+      ok = (fscanf(file, "%ld", &state->n_nodes) == 1 && state->n_nodes > 0);
+      if (ok) {
+        ALLOC(state->node_active, state->n_nodes);
+        for(node=0; node<state->n_nodes && ok; ) {
+          c = fgetc(file);
+          if (c == '0' || c == '1')
+            state->node_active[node++] = (c == '1');
+          else if (c == EOF)
+            ok = FALSE;
+        }
+      }
+    }
+    else
+      ok = FALSE;
+  }
+  (void)fclose(file);
+
+  if (ok && xfm_name[0] != '\0') {
+    ok = (input_transform_file(xfm_name, &saved) == VIO_OK);
+    if (ok) {
+      ok = copy_last_warp(&saved, current_vol);
+      delete_general_transform(&saved);
+    }
+  }
+  else
+    ok = FALSE;
+
+  if (!ok) {
+    print ("Error reading non-linear checkpoint %s\n", basename);
+    delete_nonlinear_checkpoint(state);
+  }
+
+  return(ok);
+}
+
+void delete_nonlinear_checkpoint(Nonlinear_Checkpoint *state)
+{
+  if (state->node_active != NULL)
+    FREE(state->node_active);
+  state->node_active = NULL;
+  state->n_nodes = 0;
+}
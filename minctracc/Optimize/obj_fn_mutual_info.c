@@ -91,6 +91,7 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "minctracc_arg_data.h"
 #include "vox_space.h"
 #include "objectives.h"
+#include "lattice_sampling.h"
 #include <math.h>
 
 extern Arg_Data *main_args;
@@ -318,6 +319,222 @@ static void blur_jpdf (VIO_Real **hist, int blur_size, int pdf_length) {
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : finish_mutual_information
+@INPUT      : pdf1, pdf2 - marginal histograms, accumulated over the lattice
+              jpdf       - joint histogram
+              groups     - number of bins
+              blur_size  - width of the blurring kernel (-blur_pdf)
+              total      - sum of the node weights (the number of nodes
+                           found in both volumes, on the full lattice)
+@OUTPUT     : mi         - -1 * mutual information (Collignon, -mi)
+              nmi        - -1 * normalized mutual information (-nmi)
+              entropies  - H(X), H(Y) and I(X;Y) (only computed for nmi)
+              either of mi and nmi may be NULL if not wanted.
+@RETURNS    : 
+@DESCRIPTION: blurs and normalizes the histograms (in place) and computes
+              both similarity values from them.  Shared by
+              mutual_information_objective() and measure_lattice().
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void finish_mutual_information(VIO_Real *pdf1, VIO_Real *pdf2, VIO_Real **jpdf,
+                               int groups, int blur_size, VIO_Real total,
+                               float *mi, float *nmi, double entropies[])
+{
+  int
+    i,j;
+  double
+    Hy, Hx, Ixy;		/* entropies */
+  double
+    product;
+  float 
+    mutual_info_result;                        
+
+  /* now that the data for the objective function has been accumulated
+     over the lattice nodes, blur the probability distribution functions
+  */
+
+  blur_pdf (pdf1, blur_size, groups);
+  blur_pdf (pdf2, blur_size, groups);
+  blur_jpdf(jpdf, blur_size, groups);  
+
+  mutual_info_result = 0.0;
+  Hx = 0.0;
+  Hy = 0.0;
+  Ixy = 0.0;
+  if (nmi != NULL) *nmi = 0.0;
+
+  if (total > 0.0) {
+
+                                /* normalize to count2 (the sum of the
+                                   weights, when sampled)  */
+    for(i=0; i<groups; i++) {
+      pdf1[i] /= total;
+      pdf2[i] /= total;
+    }
+    
+    for(i=0; i<groups; i++) 
+      for(j=0; j<groups; j++) 
+        jpdf[i][j] /= total;
+
+      /* mutual information of X and Y is defined as
+	 I(X;Y) = sum_x ( sum_y ( p(x,y) * log[ p(x,y) / ( p1(x)*p2(y) )  ]  )
+	 where p(x,y) is joint pobability distribution of X and Y
+	 and p1(x) and p2(y) are the marginal probability distibutions
+     
+	 note that 
+	 I(X;Y) = I(Y,X) -> symmetic
+	 I(X,Y) >=0      -> non-negative
+     
+	 if X and Y are inpendent, then 
+	    ->  p(x,y) = p(x)*p(z) and 
+	    -> log [ p(x,y) / (p(x)*p(y) ] = log (1) = 0
+	 
+	 normalized MI = nMI = redundancy:
+
+	 R = I(X;Y) / (H(X) + H(Y))
+	 attains a minimum of 0; 
+	 and a max of min( H(X),H(Y) ) /  (H(X) + H(Y))
+
+	 where H(x) = - sum_i p(x_i)*log p(x_i)
+
+	 so here, we compute the normalized symmetric redudancy based on MI
+
+	 so we need 
+	    H(X) and H(Y) (these are variables Hx and Hy below
+	    I(X;Y) (stored in Ixy below)
+      */
+
+    if (nmi != NULL) {
+
+      for(i=0; i<groups; i++) {	/* compute marginal entropies */
+        if (pdf1[i]>0.0) Hx += -1.0 * (double)pdf1[i] * log((double)pdf1[i]);
+        if (pdf2[i]>0.0) Hy += -1.0 * (double)pdf2[i] * log((double)pdf2[i]);	
+      }
+      
+      for(i=0; i<groups; i++) {        /* compute mutual information */
+        for(j=0; j<groups; j++) {
+          product = pdf1[i]*pdf2[j] ;
+          if (jpdf[i][j]>0.0 && product>0.0) 
+            Ixy += (double)jpdf[i][j] *  log( (double)( jpdf[i][j]/product));
+        }
+      }
+	     
+      if (( Hx + Hy) > 0.0)	/* the redundancy is the normalized mutual info */
+        *nmi = -1.0 * (float)(Ixy / (Hx + Hy));
+    }
+
+    if (mi != NULL) {
+                                /* this is the standard MI computation pre
+                                   Oct 2008 (the -mi option for linear reg) */
+      for(i=0; i<groups; i++) 
+        for(j=0; j<groups; j++) {
+          if ( pdf1[i] > 0.0 &&  pdf2[j] > 0.0 && jpdf[i][j]>0.0)
+            /* this is the same as Ixy, just above */
+            mutual_info_result += jpdf[i][j] * 
+              log( jpdf[i][j] / (pdf1[i] * pdf2[j]) );
+        }
+
+      mutual_info_result *= -1.0;
+    }
+  }
+
+  if (mi != NULL) *mi = mutual_info_result;
+
+  entropies[0] = Hx;
+  entropies[1] = Hy;
+  entropies[2] = Ixy;
+}
+
+
+/* add the lattice node at voxel_coord (in d1) to the pdfs, with the
+   given weight (1 for the full lattice, 1/p for an importance-sampled
+   node).  count1 and count2 are the nodes found in d1 and in both
+   volumes, total2 the sum of the weights of the latter. */
+
+static void add_node_to_pdfs(VIO_Volume d1,
+                             VIO_Volume d2,
+                             VIO_Volume m1,
+                             VIO_Volume m2, 
+                             Arg_Data *globals,
+                             VIO_Transform *trans,
+                             VIO_Real voxel_coord[],
+                             VIO_Real weight,
+                             int *count1, int *count2, VIO_Real *total2)
+{
+  PointR
+    pos2;
+  int
+    i,j,
+    index1[8],
+    index2[8];
+  VIO_Real
+    coord2[3],
+    intensity_vals1[8],                /* voxel values to index into histogram */
+    intensity_vals2[8],
+    fractional_vals1[8],        /* fractional values to add to histo */
+    fractional_vals2[8],
+    value1, value2;
+
+                                   /* get the node value in volume 1,
+                                      if it falls within the volume    */
+
+  if (!voxel_point_not_masked(m1, voxel_coord[VIO_X], voxel_coord[VIO_Y], voxel_coord[VIO_Z]) ||
+      !partial_volume_interpolation(d1, 
+                                    voxel_coord, 
+                                    intensity_vals1,
+                                    fractional_vals1,
+                                    &value1 ) ||
+      value1 <= globals->threshold[0]) /* is the voxel in the thresholded region? */
+    return;
+
+  (*count1)++;
+                                /* transform the node coordinate into
+                                   volume 2                             */
+
+  my_homogenous_transform_point(trans,
+                                voxel_coord[VIO_X], voxel_coord[VIO_Y], voxel_coord[VIO_Z], 1.0,
+                                &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+              
+                                /* get the node value in volume 2,
+                                   if it falls within the volume    */
+              
+  if (!voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) ))
+    return;
+                 
+  coord2[VIO_X] = Point_x(pos2);
+  coord2[VIO_Y] = Point_y(pos2);
+  coord2[VIO_Z] = Point_z(pos2);
+                 
+  if (!partial_volume_interpolation(d2, 
+                                    coord2, 
+                                    intensity_vals2,
+                                    fractional_vals2,
+                                    &value2 ) ||
+      value2 <= globals->threshold[1]) /* is the voxel in the thresholded region? */
+    return;
+
+  (*count2)++;
+  *total2 += weight;
+                       
+  for(i=0; i<8; i++) {
+    index1[i] = VIO_ROUND( intensity_vals1[i] );
+    index2[i] = VIO_ROUND( intensity_vals2[i] );
+    prob_fn1[ index1[i] ] += weight*fractional_vals1[i];
+    prob_fn2[ index2[i] ] += weight*fractional_vals2[i];
+  }
+  for(i=0; i<8; i++) 
+    for(j=0; j<8; j++) {
+      prob_hash_table[ index1[i] ][ index2[j] ] += 
+        weight*fractional_vals1[i]*fractional_vals2[j];
+    }
+}
+
+
 /* this function will calculate the mutual information similarity
    value based on the paper by Collignon, IPMI95, p 266 
 
@@ -347,39 +564,33 @@ float mutual_information_objective(VIO_Volume d1,
     starting_position,
     slice,
     row,
-    col,
-    pos2;
+    col;
   VIO_Real
     voxel_coord[3];
   int
     i,j,
     count1,count2,                /* number of nodes in first vol, second vol */
-    index1[8],
-    index2[8],
-    r,c,s;
+    r,c,s,
+    n_slices, n_samples,
+    c_first,c_last;               /* clipped range of cols in a row */
   
   VIO_Real
-    min_range1, max_range1, range1,
-    min_range2, max_range2, range2,
-    intensity_vals1[8],                /* voxel values to index into histogram */
-    intensity_vals2[8],
-    fractional_vals1[8],        /* fractional values to add to histo */
-    fractional_vals2[8],
-    value1, value2;
-  double
-    Hy, Hx, Ixy;		/* entropies */
+    total2;                       /* sum of the weights of the count2 nodes */
   double
-    product, Redundancy;
+    Hy, Hx, Ixy,		/* entropies */
+    entropies[3];
   float 
     mutual_info_result;                        
 
   Voxel_space_struct *vox_space;
   VIO_Transform          *trans;
+  Lattice_Sample         *samples;
 
 
                                 /* init any objective function specific
                                    stuff here                           */
   count1 = count2 = 0;
+  total2 = 0.0;
   mutual_info_result = 0.0;
 
   for(i=0; i<globals->groups; i++) {
@@ -412,13 +623,24 @@ float mutual_information_objective(VIO_Volume d1,
   get_into_voxel_space(globals, vox_space, d1, d2);
   trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
 
-                                /* get ready to step though the 3D lattice
-                                   */
+                                /* with -sample_budget, only the
+                                   importance-sampled nodes are used */
+
+  n_samples = get_lattice_samples(&samples);
+
+  for(i=0; i<n_samples; i++)
+    add_node_to_pdfs(d1, d2, m1, m2, globals, trans, samples[i].voxel, 
+                     samples[i].weight, &count1, &count2, &total2);
+
+                                /* otherwise get ready to step though the
+                                   3D lattice */
+
+  n_slices = (n_samples > 0) ? 0 : globals->count[SLICE_IND];
 
   fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
   /* ---------- step through all slices of lattice ------------- */
-  for(s=0; s<globals->count[SLICE_IND]; s++) {
+  for(s=0; s<n_slices; s++) {
 
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
@@ -429,75 +651,20 @@ float mutual_information_objective(VIO_Volume d1,
       SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
       ADD_POINT_VECTOR( row, slice, vector_step );
       
-      SCALE_POINT( col, row, 1.0); /* init first col position */
+      get_lattice_clip_range(trans, &row, &vox_space->directions[COL_IND], 
+                             globals->count[COL_IND], &c_first, &c_last);
+      SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c_first);
+      ADD_POINT_VECTOR( col, row, vector_step ); /* init first col position */
 
       /* ---------- step through all cols of lattice ------------- */
-      for(c=0; c<globals->count[COL_IND]; c++) {
+      for(c=c_first; c<=c_last; c++) {
         
-                                   /* get the node value in volume 1,
-                                      if it falls within the volume    */
-
-        if (voxel_point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {
-          
-           voxel_coord[VIO_X] = Point_x(col);
-           voxel_coord[VIO_Y] = Point_y(col);
-           voxel_coord[VIO_Z] = Point_z(col);
-           
-
-          if (partial_volume_interpolation(d1, 
-                                           voxel_coord, 
-                                           intensity_vals1,
-                                           fractional_vals1,
-                                           &value1 )) {
+        voxel_coord[VIO_X] = Point_x(col);
+        voxel_coord[VIO_Y] = Point_y(col);
+        voxel_coord[VIO_Z] = Point_z(col);
 
-            if (value1 > globals->threshold[0]) { /* is the voxel in the thresholded region? */
-
-              count1++;
-                                /* transform the node coordinate into
-                                   volume 2                             */
-
-              my_homogenous_transform_point(trans,
-                                            Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                            &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-              
-              /* get the node value in volume 2,
-                 if it falls within the volume    */
-              
-              if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) )) {
-                 
-                 voxel_coord[VIO_X] = Point_x(pos2);
-                 voxel_coord[VIO_Y] = Point_y(pos2);
-                 voxel_coord[VIO_Z] = Point_z(pos2);
-                 
-                 if (partial_volume_interpolation(d2, 
-                                                  voxel_coord, 
-                                                  intensity_vals2,
-                                                  fractional_vals2,
-                                                  &value2 )) {
-                  
-                    if (value2 > globals->threshold[1]) { /* is the voxel in the thresholded region? */
-
-                       count2++;
-                       
-                       for(i=0; i<8; i++) {
-                          index1[i] = VIO_ROUND( intensity_vals1[i] );
-                          index2[i] = VIO_ROUND( intensity_vals2[i] );
-                          prob_fn1[ index1[i] ] += fractional_vals1[i];
-                          prob_fn2[ index2[i] ] += fractional_vals2[i];
-                       }
-                       for(i=0; i<8; i++) 
-                          for(j=0; j<8; j++) {
-                             prob_hash_table[ index1[i] ][ index2[j] ] += 
-                                fractional_vals1[i]*fractional_vals2[j];
-                          }
-                       
-                       
-                    } /* if value2>thres */
-                 } /* if voxel in d2 */
-              } /* if point in mask volume two */
-           } /* if value1>thres */
-         } /* if voxel in d1 */
-        } /* if point in mask volume one */
+        add_node_to_pdfs(d1, d2, m1, m2, globals, trans, voxel_coord, 1.0,
+                         &count1, &count2, &total2);
         
         ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
         
@@ -507,107 +674,21 @@ float mutual_information_objective(VIO_Volume d1,
 
 
 
-  /* now that the data for the objective function has been accumulated
-     over the lattice nodes, blur the probability distribution functions
-  */
-
-  blur_pdf (prob_fn1,        globals->blur_pdf, globals->groups);
-  blur_pdf (prob_fn2,        globals->blur_pdf, globals->groups);
-  blur_jpdf(prob_hash_table, globals->blur_pdf, globals->groups);  
-
   /* now finish the objective function calculation, 
      placing the final objective function value in  'mutual_info_result' */
 
-      
-  mutual_info_result = 0.0;
-  Hx = 0.0;
-  Hy = 0.0;
-  Ixy = 0.0;
-  
-
+  if ( globals->obj_function == normalized_mutual_information_objective ) /* ie, -nmi option */
+    finish_mutual_information(prob_fn1, prob_fn2, prob_hash_table,
+                              globals->groups, globals->blur_pdf, total2,
+                              NULL, &mutual_info_result, entropies);
+  else
+    finish_mutual_information(prob_fn1, prob_fn2, prob_hash_table,
+                              globals->groups, globals->blur_pdf, total2,
+                              &mutual_info_result, NULL, entropies);
 
-  if (count2>0) {
-
-                                /* normalize to count2  */
-    for(i=0; i<globals->groups; i++) {
-      prob_fn1[i] /= count2;
-      prob_fn2[i] /= count2;
-    }
-    
-    for(i=0; i<globals->groups; i++) 
-      for(j=0; j<globals->groups; j++) 
-        prob_hash_table[i][j] /= count2;
-    
-
-
-    if ( globals->obj_function == normalized_mutual_information_objective ) { /* ie, -nmi option */
-
-      /* mutual information of X and Y is defined as
-	 I(X;Y) = sum_x ( sum_y ( p(x,y) * log[ p(x,y) / ( p1(x)*p2(y) )  ]  )
-	 where p(x,y) is joint pobability distribution of X and Y
-	 and p1(x) and p2(y) are the marginal probability distibutions
-	     I(X;Y) is computed for -mi option (below in the else)
-
-	 note that 
-	 I(X;Y) = I(Y,X) -> symmetic
-	 I(X,Y) >=0      -> non-negative
-     
-	 if X and Y are inpendent, then 
-	    ->  p(x,y) = p(x)*p(z) and 
-	    -> log [ p(x,y) / (p(x)*p(y) ] = log (1) = 0
-	 
-	 normalized MI = nMI = redundancy:
-
-	 R = I(X;Y) / (H(X) + H(Y))
-	 attains a minimum of 0; 
-	 and a max of min( H(X),H(Y) ) /  (H(X) + H(Y))
-
-	 where H(x) = - sum_i p(x_i)*log p(x_i)
-
-	 so here, we compute the normalized symmetric redudancy based on MI
-
-	 so we need 
-	    H(X) and H(Y) (these are variables Hx and Hy below
-	    I(X;Y) (stored in Ixy below)
-      */
-
-
-
-      for(i=0; i<globals->groups; i++) {	/* compute marginal entropies */
-	if (prob_fn1[i]>0.0) Hx += -1.0 * (double)prob_fn1[i] * log((double)prob_fn1[i]);
-	if (prob_fn2[i]>0.0) Hy += -1.0 * (double)prob_fn2[i] * log((double)prob_fn2[i]);	
-	
-      }
-      
-      for(i=0; i<globals->groups; i++) {        /* compute mutual information */
-	for(j=0; j<globals->groups; j++) {
-	  product = prob_fn1[i]*prob_fn2[j] ;
-	  if (prob_hash_table[i][j]>0.0 && product>0.0) 
-	    Ixy += (double)prob_hash_table[i][j] *  log( (double)( prob_hash_table[i][j]/product));
-	}
-      }
-	     
-      if (( Hx + Hy) > 0.0) {	/* compute redundancy, and return as the normalized mutual info */
-	Redundancy = Ixy / (Hx + Hy);
-	mutual_info_result = Redundancy;
-      }
-      else {
-	mutual_info_result = 0.0;
-      }
-
-    } else {			/* this is the standard MI computation pre Oct 2008 (the -mi option for linear reg) */
-      for(i=0; i<globals->groups; i++) 
-	for(j=0; j<globals->groups; j++) {
-	  
-	  if ( prob_fn1[i] > 0.0 &&  prob_fn2[j] > 0.0 && prob_hash_table[i][j]>0.0)
-	    /* this is the same as Ixy, just above */
-	    mutual_info_result += prob_hash_table[i][j] * 
-	      log( prob_hash_table[i][j] / (prob_fn1[i] * prob_fn2[j]) );
-	}
-    }
-
-    mutual_info_result *= -1.0;
-  }
+  Hx  = entropies[0];
+  Hy  = entropies[1];
+  Ixy = entropies[2];
 
   if (globals->flags.debug) {
     (void)print ("%7d %7d -> %f ( %f %f %f )\n",count1,count2,mutual_info_result, Hx, Hy, Ixy);
@@ -616,6 +697,8 @@ float mutual_information_objective(VIO_Volume d1,
 
   /* don't forget to free up any variables you declared above */
     
+  delete_voxel_space_struct(vox_space);
+
   return (mutual_info_result);
   
 }
@@ -118,6 +118,7 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include <Proglib.h>
 #include "vox_space.h"
 #include "interpolation.h"
+#include "lattice_sampling.h"
 
 extern Arg_Data *main_args;
 
@@ -228,10 +229,11 @@ float xcorr_objective(VIO_Volume d1,
     voxel;
 
   int
-    r,c,s;
+    i,r,c,s,c_first,c_last,
+    n_slices, n_samples;
 
   VIO_Real
-    value1, value2;
+    value1, value2, weight;
   
   VIO_Real
     s1,s2,s3;                   /* to store the sums for f1,f2,f3 */
@@ -243,6 +245,7 @@ float xcorr_objective(VIO_Volume d1,
 
   Voxel_space_struct *vox_space;
   VIO_Transform          *trans;
+  Lattice_Sample         *samples;
 
 
                                 /* prepare counters for this objective
@@ -261,13 +264,46 @@ float xcorr_objective(VIO_Volume d1,
 
   trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
 
+                                /* with -sample_budget, visit only the
+                                   importance-sampled nodes, each weighted
+                                   by the inverse of its probability */
+
+  n_samples = get_lattice_samples(&samples);
+
+  for(i=0; i<n_samples; i++) {
+
+    fill_Point( voxel, VIO_ROUND(samples[i].voxel[0]), VIO_ROUND(samples[i].voxel[1]), VIO_ROUND(samples[i].voxel[2]) );
+
+    if (nearest_neighbour_interpolant( d1, &voxel, &value1 )) {
+
+      count1++;
+
+      my_homogenous_transform_point(trans,
+                                    Point_x(voxel), Point_y(voxel), Point_z(voxel), 1.0,
+                                    &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+
+      if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2)) &&
+          INTERPOLATE_TRUE_VALUE( d2, &pos2, &value2 ) &&
+          value1 > globals->threshold[0] && value2 > globals->threshold[1] ) {
+
+        count2++;
+
+        weight = samples[i].weight;
+        s1 += weight*value1*value2;
+        s2 += weight*value1*value1;
+        s3 += weight*value2*value2;
+      }
+    }
+  }
+
+                                /* otherwise, loop through all nodes of the lattice */
 
-                                /* loop through all nodes of the lattice */
+  n_slices = (n_samples > 0) ? 0 : globals->count[SLICE_IND];
                                                                                                                               
   fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
   /* ---------- step through all slices of lattice ------------- */
-  for(s=0; s<globals->count[SLICE_IND]; s++) { 
+  for(s=0; s<n_slices; s++) { 
 
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
@@ -278,10 +314,13 @@ float xcorr_objective(VIO_Volume d1,
       SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
       ADD_POINT_VECTOR( row, slice, vector_step );
       
-      SCALE_POINT( col, row, 1.0); /* init first col position */
+      get_lattice_clip_range(trans, &row, &vox_space->directions[COL_IND], 
+                             globals->count[COL_IND], &c_first, &c_last);
+      SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c_first);
+      ADD_POINT_VECTOR( col, row, vector_step ); /* init first col position */
 
       /* ---------- step through all cols of lattice ------------- */
-      for(c=0; c<globals->count[COL_IND]; c++) {
+      for(c=c_first; c<=c_last; c++) {
                 
                                 /* use the voxel center closest to this lattice
                                    node. 
@@ -338,6 +377,173 @@ float xcorr_objective(VIO_Volume d1,
   
 }
 
+/* the interpolant used for the gradient objectives: the B-spline
+   gradient when -bspline was chosen, trilinear otherwise */
+
+static Interpolating_Gradient_Function get_interpolant_gradient(Arg_Data *globals)
+{
+  if (globals->interpolant == bspline_interpolant)
+    return(bspline_interpolant_gradient);
+  else
+    return(trilinear_interpolant_gradient);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : xcorr_objective_gradient
+@INPUT      : same as xcorr_objective
+@OUTPUT     : gradient - d(result)/d(M[i][j]) for the top 3 rows of the
+                 voxel-to-voxel matrix M used to map lattice nodes of d1
+                 into d2.
+@RETURNS    : the same value as xcorr_objective (with trilinear or B-spline
+              interpolation in d2).
+@DESCRIPTION: one pass over the lattice that accumulates, along with
+              f1,f2,f3, the terms needed for the derivative of 
+              1 - f1/sqrt(f2*f3) with respect to each d2 sample:
+
+                 dr/dv2 = -(v1 - v2*f1/f3) / sqrt(f2*f3)
+
+              each sample's derivative is then chained through the
+              spatial gradient of d2 and the homogeneous source voxel
+              coordinate (since d(pos2_i)/d(M[i][j]) = vox_j).
+
+              Nodes that are masked or thresholded do not contribute to
+              the gradient, as the objective is not differentiable there.
+@GLOBALS    : 
+@CALLS      : trilinear_interpolant_gradient, bspline_interpolant_gradient
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+float xcorr_objective_gradient(VIO_Volume d1,
+                               VIO_Volume d2,
+                               VIO_Volume m1,
+                               VIO_Volume m2, 
+                               Arg_Data *globals,
+                               VIO_Real gradient[3][4])
+{
+  VectorR
+    vector_step;
+
+  PointR
+    starting_position,
+    slice,
+    row,
+    col,
+    pos2,
+    voxel;
+
+  int
+    i,j,r,c,s,c_first,c_last;
+
+  VIO_Real
+    value1, value2, deriv[3], vox[4],
+    s1,s2,s3,
+    g1[3][4],                   /* sum( d1 * grad(d2) * vox ) */
+    g3[3][4];                   /* sum( d2 * grad(d2) * vox ) */
+  float 
+    result;
+  int 
+    count1,count2;
+
+  Voxel_space_struct *vox_space;
+  VIO_Transform          *trans;
+  Interpolating_Gradient_Function interpolant_gradient;
+
+  interpolant_gradient = get_interpolant_gradient(globals);
+
+  s1 = s2 = s3 = 0.0;
+  count1 = count2 = 0;
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++) 
+      g1[i][j] = g3[i][j] = gradient[i][j] = 0.0;
+
+  vox_space = new_voxel_space_struct();
+
+  get_into_voxel_space(globals, vox_space, d1, d2);
+
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+
+  for(s=0; s<globals->count[SLICE_IND]; s++) { 
+
+    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+
+    for(r=0; r<globals->count[ROW_IND]; r++) {
+      
+      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+      ADD_POINT_VECTOR( row, slice, vector_step );
+      
+      get_lattice_clip_range(trans, &row, &vox_space->directions[COL_IND], 
+                             globals->count[COL_IND], &c_first, &c_last);
+      SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c_first);
+      ADD_POINT_VECTOR( col, row, vector_step ); /* init first col position */
+
+      for(c=c_first; c<=c_last; c++) {
+                
+        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
+
+        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
+          
+          if (nearest_neighbour_interpolant( d1, &voxel, &value1 )) {
+
+            count1++;
+
+            vox[0] = Point_x(voxel);
+            vox[1] = Point_y(voxel);
+            vox[2] = Point_z(voxel);
+            vox[3] = 1.0;
+
+            my_homogenous_transform_point(trans,
+                                          vox[0], vox[1], vox[2], 1.0,
+                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+        
+            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
+              
+              if ((*interpolant_gradient)( d2, &pos2, &value2, deriv )) {
+
+                if (value1 > globals->threshold[0] && value2 > globals->threshold[1] ) {
+                  
+                  count2++;
+
+                  s1 += value1*value2;
+                  s2 += value1*value1;
+                  s3 += value2*value2;
+
+                  for(i=0; i<3; i++)
+                    for(j=0; j<4; j++) {
+                      g1[i][j] += value1 * deriv[i] * vox[j];
+                      g3[i][j] += value2 * deriv[i] * vox[j];
+                    }
+                } 
+                
+              } /* if voxel in d2 */
+            } /* if point in mask volume two */
+          } /* if voxel in d1 */
+        } /* if point in mask volume one */
+        
+        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+        
+      } /* for c */
+    } /* for r */
+  } /* for s */
+  
+  result = 1.0 - s1 / (sqrt((double)s2)*sqrt((double)s3));
+
+  if (s2 > 0.0 && s3 > 0.0)
+    for(i=0; i<3; i++)
+      for(j=0; j<4; j++)
+        gradient[i][j] = -(g1[i][j] - g3[i][j]*s1/s3) / sqrt(s2*s3);
+  
+  if (globals->flags.debug) dump_iteration_information(count1,count2,result,trans);
+
+  delete_voxel_space_struct(vox_space);
+
+  return (result);
+  
+}
+
 
 float ssc_objective(VIO_Volume d1,
                     VIO_Volume d2,
@@ -463,7 +669,7 @@ float ssc_objective(VIO_Volume d1,
                                 /* use the voxel center closest to this lattice
                                    node. 
                                 */
-        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
+        fill_Point( voxel, VIO_ROUND(Point_x(row)), VIO_ROUND(Point_y(row)), VIO_ROUND(Point_z(row)) ); 
         
         if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
           
@@ -472,7 +678,7 @@ float ssc_objective(VIO_Volume d1,
             count1++;
 
             my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
+                                          Point_x(row), Point_y(row), Point_z(row), 1.0,
                                           &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
             
             fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
@@ -522,7 +728,7 @@ float ssc_objective(VIO_Volume d1,
                                 /* use the voxel center closest to this lattice
                                    node. 
                                 */
-        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
+        fill_Point( voxel, VIO_ROUND(Point_x(slice)), VIO_ROUND(Point_y(slice)), VIO_ROUND(Point_z(slice)) ); 
         
         if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
           
@@ -531,7 +737,7 @@ float ssc_objective(VIO_Volume d1,
             count1++;
 
             my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
+                                          Point_x(slice), Point_y(slice), Point_z(slice), 1.0,
                                           &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
             
             fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
@@ -563,6 +769,8 @@ float ssc_objective(VIO_Volume d1,
 
   if (globals->flags.debug) (void)print ("%7d %7d -> %10.8f\n",count1,count2,result);
 
+  delete_voxel_space_struct(vox_space);
+
   return (result);
   
 }
@@ -585,7 +793,7 @@ float zscore_objective(VIO_Volume d1,
     voxel;
 
   int
-    r,c,s;
+    r,c,s,c_first,c_last;
 
   VIO_Real
     value1, value2;
@@ -625,8 +833,11 @@ float zscore_objective(VIO_Volume d1,
       SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
       ADD_POINT_VECTOR( row, slice, vector_step );
       
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<globals->count[COL_IND]; c++) {
+      get_lattice_clip_range(trans, &row, &vox_space->directions[COL_IND], 
+                             globals->count[COL_IND], &c_first, &c_last);
+      SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c_first);
+      ADD_POINT_VECTOR( col, row, vector_step ); /* init first col position */
+      for(c=c_first; c<=c_last; c++) {
         
                                 /* use the voxel center closest to this lattice
                                    node. 
@@ -675,6 +886,148 @@ float zscore_objective(VIO_Volume d1,
 
   if (globals->flags.debug) (void)print ("%7d %7d %7d -> %10.8f\n",count1,count2,count3,result);
   
+  delete_voxel_space_struct(vox_space);
+
+  return (result);
+  
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : zscore_objective_gradient
+@INPUT      : same as zscore_objective
+@OUTPUT     : gradient - d(result)/d(M[i][j]) for the top 3 rows of the
+                 voxel-to-voxel matrix M (see xcorr_objective_gradient).
+@RETURNS    : the same value as zscore_objective (with trilinear or B-spline
+              interpolation in d2).
+@DESCRIPTION: single lattice pass; for result = sqrt(z2_sum)/count3,
+
+                 dresult/dv2 = -(v1 - v2) / (count3 * sqrt(z2_sum))
+@GLOBALS    : 
+@CALLS      : trilinear_interpolant_gradient, bspline_interpolant_gradient
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+float zscore_objective_gradient(VIO_Volume d1,
+                                VIO_Volume d2,
+                                VIO_Volume m1,
+                                VIO_Volume m2, 
+                                Arg_Data *globals,
+                                VIO_Real gradient[3][4])
+{
+  VectorR
+    vector_step;
+
+  PointR 
+    starting_position,
+    slice,
+    row,
+    col,
+    pos2,
+    voxel;
+
+  int
+    i,j,r,c,s,c_first,c_last;
+
+  VIO_Real
+    value1, value2, deriv[3], vox[4],
+    z2_sum,
+    gz[3][4];                   /* sum( (d1-d2) * grad(d2) * vox ) */
+  float 
+    result;
+  int 
+    count1,count2,count3;
+  Voxel_space_struct *vox_space;
+  VIO_Transform          *trans;
+  Interpolating_Gradient_Function interpolant_gradient;
+
+  interpolant_gradient = get_interpolant_gradient(globals);
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+
+  z2_sum = 0.0;
+  count1 = count2 = count3 = 0;
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++) 
+      gz[i][j] = gradient[i][j] = 0.0;
+
+  for(s=0; s<globals->count[SLICE_IND]; s++) {
+
+    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+
+    for(r=0; r<globals->count[ROW_IND]; r++) {
+      
+      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+      ADD_POINT_VECTOR( row, slice, vector_step );
+      
+      get_lattice_clip_range(trans, &row, &vox_space->directions[COL_IND], 
+                             globals->count[COL_IND], &c_first, &c_last);
+      SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c_first);
+      ADD_POINT_VECTOR( col, row, vector_step ); /* init first col position */
+      for(c=c_first; c<=c_last; c++) {
+        
+        fill_Point( voxel, VIO_ROUND(Point_x(col)), VIO_ROUND(Point_y(col)), VIO_ROUND(Point_z(col)) ); 
+        
+        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
+          
+          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+
+            count1++;
+
+            vox[0] = Point_x(col);
+            vox[1] = Point_y(col);
+            vox[2] = Point_z(col);
+            vox[3] = 1.0;
+
+            my_homogenous_transform_point(trans,
+                                          vox[0], vox[1], vox[2], 1.0,
+                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+            
+            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
+              
+              if ((*interpolant_gradient)( d2, &pos2, &value2, deriv )) {
+
+                count2++;
+
+                if (fabs(value1) > globals->threshold[0] && fabs(value2) > globals->threshold[1] ) {
+                  count3++;
+                  z2_sum +=  (value1-value2)*(value1-value2);
+
+                  for(i=0; i<3; i++)
+                    for(j=0; j<4; j++)
+                      gz[i][j] += (value1-value2) * deriv[i] * vox[j];
+                } 
+                
+              } /* if voxel in d2 */
+            } /* if point in mask volume two */
+          } /* if voxel in d1 */
+        } /* if point in mask volume one */
+        
+        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+        
+      } /* for c */
+    } /* for r */
+  } /* for s */
+
+  if (count3 > 0)
+    result = sqrt((double)z2_sum) / count3;
+  else
+    result = sqrt((double)z2_sum);
+
+  if (z2_sum > 0.0)
+    for(i=0; i<3; i++)
+      for(j=0; j<4; j++)
+        gradient[i][j] = -gz[i][j] / ((count3 > 0 ? count3 : 1) * sqrt(z2_sum));
+
+  if (globals->flags.debug) (void)print ("%7d %7d %7d -> %10.8f\n",count1,count2,count3,result);
+
+  delete_voxel_space_struct(vox_space);
+  
   return (result);
   
 }
@@ -699,7 +1052,7 @@ float vr_objective(VIO_Volume d1,
     voxel;
 
   int
-    r,c,s;
+    r,c,s,c_first,c_last;
 
   VIO_Real
     value1, value2,
@@ -767,8 +1120,11 @@ float vr_objective(VIO_Volume d1,
       SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
       ADD_POINT_VECTOR( row, slice, vector_step );
       
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<globals->count[COL_IND]; c++) {
+      get_lattice_clip_range(trans, &row, &vox_space->directions[COL_IND], 
+                             globals->count[COL_IND], &c_first, &c_last);
+      SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c_first);
+      ADD_POINT_VECTOR( col, row, vector_step ); /* init first col position */
+      for(c=c_first; c<=c_last; c++) {
         
                                 /* use the voxel center closest to this lattice
                                    node. 
@@ -863,6 +1219,8 @@ float vr_objective(VIO_Volume d1,
 
 
 
+  delete_voxel_space_struct(vox_space);
+
   return (result);
   
 }
@@ -998,6 +1356,8 @@ float stub_objective(VIO_Volume d1,
 
   /* don't forget to free up any variables you declared above */
 
+  delete_voxel_space_struct(vox_space);
+
   return (result);
   
 }
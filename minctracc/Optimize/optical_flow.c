@@ -0,0 +1,196 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : optical_flow.c
+@DESCRIPTION: packed copies of the volumes used by the optical flow
+              features of the non-linear fit.
+
+  these include:
+     init_optical_flow() -          pack the source and target volumes of
+                                    one optical flow feature
+     update_optical_flow_source() - repack the source after it has been
+                                    renormalized to match the target
+     flow_volume_value() -          trilinear value, and its gradient in
+                                    world coordinates, at a world point
+     delete_optical_flow() -        free everything
+
+  get_optical_flow_vector() in do_nonlinear.c used to call
+  evaluate_volume_in_world() twice per node, once with derivatives, and
+  to look up the real range of the source at every node.  Here the
+  volumes are copied once into float arrays along with their
+  world-to-voxel transforms, and each lookup is a single trilinear
+  interpolation over 8 voxels.  The value and gradient are those of
+  evaluate_volume_in_world() with degrees_continuity 0 and an outside
+  value of 0: the gradient of the trilinear interpolant in voxel
+  coordinates, mapped to world coordinates.
+
+  This is only the per-node half of a dense optical flow engine: there
+  are no target gradient volumes and no sweep computing the update of
+  all nodes at once.  The optical flow term of a node is evaluated at
+  the node's mean_target, which get_deformation_vector_for_node() finds
+  from the current warp and its sub-lattice, and is summed there with
+  the terms of the other features before smoothing; pulling it out
+  into a separate pass over the lattice would mean splitting that
+  function for every objective, so the nodes are still visited one at
+  a time, serially.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "optical_flow.h"
+
+
+VIO_BOOL init_flow_volume(Flow_Volume *flow, VIO_Volume volume)
+{
+  int
+    i, j, k, sizes[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    voxel0[VIO_MAX_DIMENSIONS], voxel[VIO_MAX_DIMENSIONS], world[3];
+
+  if (get_volume_n_dimensions(volume) != 3)
+    return(FALSE);
+
+  get_volume_sizes(volume, sizes);
+
+  if (flow->values != NULL &&
+      (flow->sizes[0] != sizes[0] || flow->sizes[1] != sizes[1] ||
+       flow->sizes[2] != sizes[2]))
+    delete_flow_volume(flow);
+
+  for(i=0; i<3; i++)
+    flow->sizes[i] = sizes[i];
+
+  if (flow->values == NULL)
+    ALLOC(flow->values, (long)sizes[0]*sizes[1]*sizes[2]);
+
+  for(i=0; i<sizes[0]; i++)
+    for(j=0; j<sizes[1]; j++)
+      for(k=0; k<sizes[2]; k++)
+        flow->values[ FLOW_INDEX(flow,i,j,k) ] =
+          (float)get_volume_real_value(volume, i,j,k,0,0);
+
+                                /* world_to_voxel is affine */
+  convert_world_to_voxel(volume, 0.0, 0.0, 0.0, voxel0);
+  for(j=0; j<3; j++) {
+    world[0] = world[1] = world[2] = 0.0;
+    world[j] = 1.0;
+    convert_world_to_voxel(volume, world[0], world[1], world[2], voxel);
+    for(i=0; i<3; i++)
+      flow->A[i][j] = voxel[i] - voxel0[i];
+  }
+  for(i=0; i<3; i++)
+    flow->b[i] = voxel0[i];
+
+  return(TRUE);
+}
+
+void delete_flow_volume(Flow_Volume *flow)
+{
+  if (flow->values != NULL)
+    FREE(flow->values);
+  flow->values = NULL;
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : flow_volume_value
+@INPUT      : flow  - packed volume
+              world - world coordinate
+@OUTPUT     : gradient - derivatives of the value along world x, y and z
+                 (may be NULL)
+@RETURNS    : the trilinearly interpolated value; voxels beyond the
+              edges count as 0, and points more than half a voxel out
+              of the volume give 0 (and a zero gradient).
+@DESCRIPTION:
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_Real flow_volume_value(Flow_Volume *flow, VIO_Real world[],
+                           VIO_Real gradient[])
+{
+  int
+    a, i, j, k, n[3], ii, jj, kk;
+  VIO_Real
+    v[3], f[3], w[3][2], dw[3][2], c, value, dv[3];
+
+  for(a=0; a<3; a++) {
+    v[a] = flow->A[a][0]*world[0] + flow->A[a][1]*world[1] +
+           flow->A[a][2]*world[2] + flow->b[a];
+    if (v[a] < -0.5 || v[a] > flow->sizes[a]-0.5) {
+      if (gradient != NULL)
+        gradient[0] = gradient[1] = gradient[2] = 0.0;
+      return(0.0);
+    }
+    n[a] = (int)floor(v[a]);
+    f[a] = v[a] - n[a];
+    w[a][0]  = 1.0 - f[a];   w[a][1]  = f[a];
+    dw[a][0] = -1.0;         dw[a][1] = 1.0;
+  }
+
+  value = dv[0] = dv[1] = dv[2] = 0.0;
+
+  for(i=0; i<2; i++) {
+    ii = n[0] + i;
+    if (ii < 0 || ii >= flow->sizes[0]) continue;
+    for(j=0; j<2; j++) {
+      jj = n[1] + j;
+      if (jj < 0 || jj >= flow->sizes[1]) continue;
+      for(k=0; k<2; k++) {
+        kk = n[2] + k;
+        if (kk < 0 || kk >= flow->sizes[2]) continue;
+
+        c = flow->values[ FLOW_INDEX(flow,ii,jj,kk) ];
+        value += c *  w[0][i] *  w[1][j] *  w[2][k];
+        dv[0] += c * dw[0][i] *  w[1][j] *  w[2][k];
+        dv[1] += c *  w[0][i] * dw[1][j] *  w[2][k];
+        dv[2] += c *  w[0][i] *  w[1][j] * dw[2][k];
+      }
+    }
+  }
+                                /* d/dworld = (d/dvoxel) * A */
+  if (gradient != NULL)
+    for(a=0; a<3; a++)
+      gradient[a] = dv[0]*flow->A[0][a] + dv[1]*flow->A[1][a] + dv[2]*flow->A[2][a];
+
+  return(value);
+}
+
+
+VIO_BOOL init_optical_flow(Optical_Flow *flow,
+                           VIO_Volume data, VIO_Volume model,
+                           VIO_Real min_deriv_fraction)
+{
+  flow->source.values = NULL;
+  flow->target.values = NULL;
+
+  if (!init_flow_volume(&flow->target, model) ||
+      !update_optical_flow_source(flow, data, min_deriv_fraction)) {
+    delete_optical_flow(flow);
+    return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+VIO_BOOL update_optical_flow_source(Optical_Flow *flow, VIO_Volume data,
+                                    VIO_Real min_deriv_fraction)
+{
+  get_volume_separations(data, flow->steps);
+
+  flow->min_deriv = min_deriv_fraction *
+    (get_volume_real_max(data) - get_volume_real_min(data));
+
+  return( init_flow_volume(&flow->source, data) );
+}
+
+void delete_optical_flow(Optical_Flow *flow)
+{
+  delete_flow_volume(&flow->source);
+  delete_flow_volume(&flow->target);
+}
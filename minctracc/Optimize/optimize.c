@@ -180,12 +180,23 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #include "make_rots.h"
 #include "segment_table.h"
 #include "quaternion.h"
+#include "vox_space.h"
+#include "interpolation.h"
+#include "lattice_sampling.h"
 
 #include "local_macros.h"
 
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  MULTI_START_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #ifdef HAVE_LIBLBFGS
 #include <lbfgs.h>
 #define BFGSEPSILON 0.00005
+#define BFGS_MATRIX_EPSILON 0.001  /* step for d(matrix)/d(parameter) */
 #endif /*HAVE_LIBLBFGS*/
 
 extern Arg_Data *main_args;
@@ -195,7 +206,10 @@ int      Ginverse_mapping_flag, Gndim;
 
 extern   double   ftol ;        
 extern   double   simplex_size ;
+extern   int      simplex_jobs;        /* simplex values computed at once  */
 extern   VIO_Real     initial_corr, final_corr;
+extern   int      sample_budget;       /* importance-sampled lattice nodes */
+extern   VIO_Volume   sample_weights;      /*   and their weight volume         */
 
          Segment_Table  *segment_table;        /* for variance of ratios */
 
@@ -216,6 +230,16 @@ extern   VIO_Real     initial_corr, final_corr;
     void              *function_data,
     VIO_Real              tolerance );
 
+ void  initialize_parallel_amoeba(
+    amoeba_struct     *amoeba,
+    int               n_jobs,
+    int               n_parameters,
+    VIO_Real              initial_parameters[],
+    VIO_Real              parameter_delta,
+    amoeba_function   function,
+    void              *function_data,
+    VIO_Real              tolerance );
+
  VIO_Real  get_amoeba_parameters(
     amoeba_struct  *amoeba,
     VIO_Real           parameters[] );
@@ -372,12 +396,14 @@ inline static VIO_BOOL in_limits(double x,double lower,double upper)
 }
 
 /* ----------------------------- MNI Header -----------------------------------
-@NAME       : fit_function
-@INPUT      : params - a variable length array of floats
+@NAME       : set_linear_parameters
+@INPUT      : params - a variable length array of floats (1 based)
+              report - print the parameters if they are out of range
 @OUTPUT     :               
-@RETURNS    : a float value of the user requested objective function,
-              measuring the similarity between two data sets.
-@DESCRIPTION: 
+@RETURNS    : FALSE if the parameters are out of range, TRUE otherwise.
+@DESCRIPTION: rebuild the linear part of main_args->trans_info.transformation
+              from the optimizer's parameter vector.  The matrix is left
+              untouched when FALSE is returned.
 @METHOD     : 
 @GLOBALS    : 
 @CALLS      : 
@@ -385,12 +411,11 @@ inline static VIO_BOOL in_limits(double x,double lower,double upper)
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
 
-float fit_function(Arg_Data *args,float *params) 
+static VIO_BOOL set_linear_parameters(float *params, VIO_BOOL report)
 {
 
   VIO_Transform *mat;
   int i;
-  float r;
 
 
   double trans[3];
@@ -430,7 +455,8 @@ float fit_function(Arg_Data *args,float *params)
 
     {
 
- (void)printf("out : %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c \n",
+      if (report)
+        (void)printf("out : %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c \n",
        rots[0], in_limits(rots[0], (double)-3.1415927/2.0, (double)3.1415927/2.0) ? 'T': 'F' , 
        rots[1], in_limits(rots[1], (double)-3.1415927/2.0, (double)3.1415927/2.0) ? 'T': 'F' , 
        rots[2], in_limits(rots[2], (double)-3.1415927/2.0, (double)3.1415927/2.0) ? 'T': 'F' , 
@@ -441,7 +467,7 @@ float fit_function(Arg_Data *args,float *params)
        shear[1],in_limits(shear[1], (double)-2.0, (double)2.0)? 'T': 'F' , 
        shear[2],in_limits(shear[2], (double)-2.0, (double)2.0)? 'T': 'F' );
 
-    r = 1e10;
+    return(FALSE);
   }
   else {
                                 /* get the linear transformation ptr */
@@ -457,12 +483,35 @@ float fit_function(Arg_Data *args,float *params)
       build_inverse_transformation_matrix(mat, cent, trans, scale, shear, rots);
     else
       build_transformation_matrix(mat, cent, trans, scale, shear, rots);
-    
-    /* call the needed objective function */
-    
-    r = (main_args->obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,args);
   }
 
+  return(TRUE);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_function
+@INPUT      : params - a variable length array of floats
+@OUTPUT     :               
+@RETURNS    : a float value of the user requested objective function,
+              measuring the similarity between two data sets.
+@DESCRIPTION: 
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+
+float fit_function(Arg_Data *args,float *params) 
+{
+  float r;
+
+  if (set_linear_parameters(params, TRUE))
+    r = (main_args->obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,args);
+  else
+    r = 1e10;
+
   return(r);
 }
 
@@ -480,17 +529,139 @@ VIO_Real amoeba_obj_function(void *function_data, float d[])
 
 #ifdef HAVE_LIBLBFGS
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : bfgs_gradient_objective
+@INPUT      : globals
+@OUTPUT     : 
+@RETURNS    : the value+gradient version of the selected objective function,
+              or NULL if there is none.
+@DESCRIPTION: analytic gradients are available for -xcorr and -zscore,
+              and only for -trilinear or -bspline interpolation of the
+              target, whose interpolants also return the gradient (of
+              the trilinear patch, or of the spline).
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static Gradient_Objective_Function bfgs_gradient_objective(Arg_Data *globals)
+{
+  Lattice_Sample *samples;
+
+  if (globals->interpolant != trilinear_interpolant &&
+      globals->interpolant != bspline_interpolant)
+    return(NULL);
+                                /* the gradient objectives use the full
+                                   lattice, not the sampled one */
+  if (get_lattice_samples(&samples) > 0)
+    return(NULL);
+
+  if (globals->obj_function == xcorr_objective)
+    return(xcorr_objective_gradient);
+  else if (globals->obj_function == zscore_objective)
+    return(zscore_objective_gradient);
+  else
+    return(NULL);
+}
+
+/* get the top 3 rows of the current voxel-to-voxel matrix */
+static void get_voxel_to_voxel_matrix(Arg_Data *globals, VIO_Real m[3][4])
+{
+  Voxel_space_struct *vox_space;
+  VIO_Transform *lin;
+  int i,j;
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, Gdata1, Gdata2);
+  lin = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++)
+      m[i][j] = Transform_elem(*lin, i, j);
+
+  delete_voxel_space_struct(vox_space);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : bfgs_analytic_gradient
+@INPUT      : globals, grad_fn - see bfgs_gradient_objective
+              p - 1 based parameter vector
+@OUTPUT     : g - 0 based gradient of the objective wrt p
+@RETURNS    : objective value at p
+@DESCRIPTION: the objective is sampled only once: grad_fn returns
+              d(obj)/d(M) for the voxel-to-voxel matrix M, and the
+              chain rule gives d(obj)/d(p) = sum d(obj)/d(M) * d(M)/d(p).
+
+              d(M)/d(p) is found by central differences on the matrix
+              construction alone (no lattice sampling), so a 12 parameter
+              step costs one pass through the lattice instead of 13.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static lbfgsfloatval_t bfgs_analytic_gradient(Arg_Data *globals,
+                                              Gradient_Objective_Function grad_fn,
+                                              float *p,
+                                              lbfgsfloatval_t *g)
+{
+  VIO_Real dfdm[3][4], m_plus[3][4], m_minus[3][4], dot, h;
+  float save, p_plus, p_minus;
+  lbfgsfloatval_t fx;
+  int i,j,k;
+
+  for(k=0; k<Gndim; k++)
+    g[k] = 0.0;
+
+  if (!set_linear_parameters(p, TRUE))
+    return( (lbfgsfloatval_t)1e10 );
+
+  fx = (lbfgsfloatval_t) (*grad_fn)(Gdata1,Gdata2,Gmask1,Gmask2,globals,dfdm);
+
+  for(k=0; k<Gndim; k++) {
+    save    = p[k+1];
+    p_plus  = save + BFGS_MATRIX_EPSILON;
+    p_minus = save - BFGS_MATRIX_EPSILON;
+
+    p[k+1] = p_plus;
+    if (set_linear_parameters(p, FALSE)) {
+      get_voxel_to_voxel_matrix(globals, m_plus);
+
+      p[k+1] = p_minus;
+      if (set_linear_parameters(p, FALSE)) {
+        get_voxel_to_voxel_matrix(globals, m_minus);
+
+        h = (VIO_Real)p_plus - (VIO_Real)p_minus;
+        dot = 0.0;
+        for(i=0; i<3; i++)
+          for(j=0; j<4; j++)
+            dot += dfdm[i][j] * (m_plus[i][j] - m_minus[i][j]);
+        g[k] = (lbfgsfloatval_t) (dot / h);
+      }
+    }
+    p[k+1] = save;
+  }
+                                /* leave the transformation at p */
+  (void)set_linear_parameters(p, FALSE);
+
+  return(fx);
+}
+
 // Objective function for BFGS optimizer
 lbfgsfloatval_t bfgs_obj_function(void *function_data, const lbfgsfloatval_t *x, lbfgsfloatval_t *g, const int n, const lbfgsfloatval_t step) {
 	int i;
 	float p[13];
 	lbfgsfloatval_t fx,fx2;
-	
-//	fprintf(stderr,"ROBB: in BFGS objective function!\n");
-//	fprintf(stderr,"ROBB: Gndim: %d\n",Gndim);
+	Gradient_Objective_Function grad_fn;
 	
 	for(i=0; i<Gndim; i++)
 		p[i+1] = x[i];
+
+	grad_fn = bfgs_gradient_objective((Arg_Data *)function_data);
+	if (grad_fn != NULL)
+		return( bfgs_analytic_gradient((Arg_Data *)function_data, grad_fn, p, g) );
   
 	fx = (lbfgsfloatval_t) fit_function((Arg_Data *)function_data,p);
 	
@@ -710,9 +881,15 @@ VIO_BOOL optimize_simplex(VIO_Volume d1,
     for(i=0; i<ndim+1; i++)                /* copy initial guess into parameter list */
       parameters[i] = (VIO_Real)p[i+1];
 
-    initialize_amoeba(&the_amoeba, ndim, parameters, 
-                      simplex_size, amoeba_obj_function, 
-                      globals, (VIO_Real)local_ftol);
+                                /* build whatever the objective function
+                                   caches (the -bspline coefficients),
+                                   once, before the workers are forked */
+    if (simplex_jobs > 1)
+      (void)fit_function(globals, p);
+
+    initialize_parallel_amoeba(&the_amoeba, simplex_jobs, ndim, parameters, 
+                               simplex_size, amoeba_obj_function, 
+                               globals, (VIO_Real)local_ftol);
 
     max_iters = 400;
     iteration_number = 0;
@@ -882,12 +1059,15 @@ VIO_BOOL optimize_simplex_quater(VIO_Volume d1,
     for(i=0; i<ndim+1; i++)                /* copy initial guess into parameter list */
       parameters[i] = (VIO_Real)p[i+1];
 
+                                /* build whatever the objective function
+                                   caches (the -bspline coefficients),
+                                   once, before the workers are forked */
+    if (simplex_jobs > 1)
+      (void)fit_function_quater(globals, p);
 
-
-
-    initialize_amoeba(&the_amoeba, ndim, parameters, 
-                      simplex_size, amoeba_obj_function_quater, 
-                      globals, (VIO_Real)local_ftol);
+    initialize_parallel_amoeba(&the_amoeba, simplex_jobs, ndim, parameters, 
+                               simplex_size, amoeba_obj_function_quater, 
+                               globals, (VIO_Real)local_ftol);
 
     max_iters = 400;
     iteration_number = 0;
@@ -1042,6 +1222,10 @@ VIO_BOOL optimize_BFGS(VIO_Volume d1,
 	for(i=0; i<ndim+1; i++)                /* copy initial guess into parameter list */
 		parameters[i] = (VIO_Real)p[i+1];
 	
+	if (globals->flags.verbose>1)
+		print("BFGS gradient: %s\n", 
+		      bfgs_gradient_objective(globals) != NULL ? "analytic" : "finite differences");
+
 	lbfgs_parameter_t param;
 	lbfgs_parameter_init(&param);
 	if (globals->flags.debug)
@@ -1174,6 +1358,489 @@ VIO_BOOL replace_volume_data_with_ubyte(VIO_Volume data)
 }
 
 
+/* call the optimization strategy requested on the command line,
+   starting from (and returning the result in) globals->trans_info */
+
+static VIO_BOOL run_linear_optimizer(VIO_Volume d1,
+                                     VIO_Volume d2,
+                                     VIO_Volume m1,
+                                     VIO_Volume m2, 
+                                     Arg_Data *globals)
+{
+  VIO_BOOL stat;
+
+//fprintf(stderr,"ROBB: Optimizer: %d\n",globals->optimize_type);
+  switch (globals->optimize_type) {
+  case OPT_SIMPLEX:
+    stat = optimize_simplex(d1, d2, m1, m2, globals);
+    break;
+#ifdef HAVE_LIBLBFGS
+  case OPT_BFGS:
+    stat = optimize_BFGS(d1,d2,m1,m2,globals);
+    break;
+#else
+  case OPT_BFGS:
+    (void)fprintf(stderr, "BFGS optimizer is not compiled it\n");
+    (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
+    stat = FALSE;
+    break;
+#endif /*HAVE_LIBLBFGS*/
+  default:
+    (void)fprintf(stderr, "Unknown type of optimization requested (%d)\n",
+                  globals->optimize_type);
+    (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
+    stat = FALSE;
+  }
+
+  return(stat);
+}
+
+
+                                /* perturbations used for multi-start:
+                                   rot x, rot y, rot z, scale           */
+#define MULTI_START_ROT_STEP    (10.0*3.1415927/180.0)
+#define MULTI_START_SCALE_STEP  0.10
+#define MULTI_START_COARSE      2      /* lattice subsampling for the search */
+
+static int multi_start_pattern[8][4] = {
+  { 1, 0, 0, 0}, {-1, 0, 0, 0},
+  { 0, 1, 0, 0}, { 0,-1, 0, 0},
+  { 0, 0, 1, 0}, { 0, 0,-1, 0},
+  { 0, 0, 0, 1}, { 0, 0, 0,-1}
+};
+
+typedef struct {
+  double   rotations[3];           /* starting point                 */
+  double   scales[3];
+  double   r_translations[3];      /* result of the coarse fit       */
+  double   r_rotations[3];
+  double   r_scales[3];
+  double   r_shears[3];
+  float    start_value;            /* obj fn at start, coarse lattice */
+  float    coarse_value;           /* obj fn after coarse fit         */
+  VIO_BOOL pruned;
+} Linear_Start;
+
+static float current_linear_fit(Arg_Data *globals)
+{
+  float p[13];
+
+  parameters_to_vector(globals->trans_info.translations,
+                       globals->trans_info.rotations,
+                       globals->trans_info.scales,
+                       globals->trans_info.shears,
+                       p,
+                       globals->trans_info.weights);
+  return( fit_function(globals,p) );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_linear_start
+@INPUT      : d1,d2,m1,m2: data and masks, as for optimize_linear_transformation
+              globals: set up for the coarse lattice
+              start: the starting rotations and scales
+              base_trans, base_shears: the other starting parameters
+@OUTPUT     : start: r_* parameters and coarse_value after the fit
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: runs the linear optimizer from one starting point.  The
+              trans_info parameters in globals are left at the result.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL fit_linear_start(VIO_Volume d1,
+                                 VIO_Volume d2,
+                                 VIO_Volume m1,
+                                 VIO_Volume m2, 
+                                 Arg_Data *globals,
+                                 Linear_Start *start,
+                                 double base_trans[],
+                                 double base_shears[])
+{
+  VIO_BOOL stat;
+  int i;
+
+  for(i=0; i<3; i++) {
+    globals->trans_info.translations[i] = base_trans[i];
+    globals->trans_info.rotations[i]    = start->rotations[i];
+    globals->trans_info.scales[i]       = start->scales[i];
+    globals->trans_info.shears[i]       = base_shears[i];
+  }
+
+  stat = run_linear_optimizer(d1, d2, m1, m2, globals);
+
+  start->coarse_value = current_linear_fit(globals);
+  for(i=0; i<3; i++) {
+    start->r_translations[i] = globals->trans_info.translations[i];
+    start->r_rotations[i]    = globals->trans_info.rotations[i];
+    start->r_scales[i]       = globals->trans_info.scales[i];
+    start->r_shears[i]       = globals->trans_info.shears[i];
+  }
+
+  return(stat);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_linear_starts
+@INPUT      : d1,d2,m1,m2: data and masks, as for optimize_linear_transformation
+              globals: set up for the coarse lattice
+              start, order, n_keep: the starts start[order[0..n_keep-1]]
+                   are fit
+              base_trans, base_shears: the other starting parameters
+@OUTPUT     : start: r_* parameters and coarse_value of each fit
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: With -simplex_jobs n > 1, up to n starts are fit at once,
+              each in a child process that sends its Linear_Start back
+              through a pipe.  A child uses a serial simplex, so that
+              no more than n processes run at a time.  A start that
+              cannot be sent to a child (or whose child fails) is fit
+              here, so the result does not depend on n.
+@METHOD     : 
+@GLOBALS    : simplex_jobs
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL fit_linear_starts(VIO_Volume d1,
+                                  VIO_Volume d2,
+                                  VIO_Volume m1,
+                                  VIO_Volume m2, 
+                                  Arg_Data *globals,
+                                  Linear_Start start[],
+                                  int order[],
+                                  int n_keep,
+                                  double base_trans[],
+                                  double base_shears[])
+{
+  VIO_BOOL stat;
+  int k;
+#ifdef MULTI_START_CAN_FORK
+  int          j, first, n_batch, fds[2], *fd;
+  pid_t        *pid;
+  ssize_t      n_read;
+  Linear_Start result;
+
+  if (simplex_jobs > 1 && n_keep > 1) {
+    stat = TRUE;
+    ALLOC(pid, simplex_jobs);
+    ALLOC(fd, simplex_jobs);
+
+    for(first=0; first<n_keep; first+=n_batch) {
+      n_batch = MIN(simplex_jobs, n_keep - first);
+
+      (void) fflush(stdout);     /* or the children print it again */
+      (void) fflush(stderr);
+
+      for(k=0; k<n_batch; k++) {
+        j = order[first+k];
+        pid[k] = -1;
+        fd[k]  = -1;
+        if (pipe(fds) != 0)
+          continue;
+
+        pid[k] = fork();
+        if (pid[k] == 0) {
+          (void) close(fds[0]);
+          simplex_jobs = 1;
+          result = start[j];
+          stat = fit_linear_start(d1, d2, m1, m2, globals, &result,
+                                  base_trans, base_shears);
+          (void) fflush(stdout);
+          _exit( (stat && write(fds[1], &result, sizeof(result)) ==
+                  (ssize_t) sizeof(result)) ? 0 : 1 );
+        }
+
+        (void) close(fds[1]);
+        if (pid[k] < 0)
+          (void) close(fds[0]);
+        else
+          fd[k] = fds[0];
+      }
+
+      for(k=0; k<n_batch; k++) {
+        j = order[first+k];
+        n_read = 0;
+        if (fd[k] >= 0) {
+          n_read = read(fd[k], &result, sizeof(result));
+          (void) close(fd[k]);
+        }
+        if (pid[k] > 0)
+          (void) waitpid(pid[k], NULL, 0);
+
+        if (n_read == (ssize_t) sizeof(result))
+          start[j] = result;
+        else
+          stat = fit_linear_start(d1, d2, m1, m2, globals, &start[j],
+                                  base_trans, base_shears) && stat;
+      }
+    }
+
+    FREE(pid);
+    FREE(fd);
+    return(stat);
+  }
+#endif
+
+  stat = TRUE;
+  for(k=0; k<n_keep && stat; k++)
+    stat = fit_linear_start(d1, d2, m1, m2, globals, &start[order[k]],
+                            base_trans, base_shears);
+
+  return(stat);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : multi_start_linear_search
+@INPUT      : d1,d2,m1,m2: data and masks, as for optimize_linear_transformation
+              globals: with trans_info.multi_start > 1
+@OUTPUT     : globals->trans_info parameters are replaced by the best of
+              the starting points, after a coarse fit.
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: The input parameters and up to multi_start-1 perturbed
+              copies (rotations of +/-10 deg about each axis, +/-10%
+              scale, repeated at larger amplitude if more starts are
+              requested) are evaluated on a lattice MULTI_START_COARSE
+              times coarser than the one set up by init_lattice().
+              The worst half is pruned on the starting value alone, the
+              rest are fit on the coarse lattice, and the best result
+              is left in globals to be refined by the normal fit on the
+              full lattice.
+@METHOD     : The starting values are single evaluations and are
+              computed here; the coarse fits of the survivors are run
+              by fit_linear_starts(), -simplex_jobs at a time.  The
+              coarse lattice and pruning keep the total cost close to
+              one full fit.
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL multi_start_linear_search(VIO_Volume d1,
+                                          VIO_Volume d2,
+                                          VIO_Volume m1,
+                                          VIO_Volume m2, 
+                                          Arg_Data *globals)
+{
+  VIO_BOOL
+    stat;
+  int
+    i,j,k,n,ring,tries,
+    n_starts, n_keep, best,
+    *order,
+    save_count[3];
+  double
+    save_step[3],
+    base_trans[3], base_rots[3], base_scales[3], base_shears[3];
+  VectorR
+    save_directions[3];
+  Linear_Start
+    *start;
+  int
+    *pat;
+
+  stat = TRUE;
+  n_starts = globals->trans_info.multi_start;
+
+  for(i=0; i<3; i++) {
+    base_trans[i]  = globals->trans_info.translations[i];
+    base_rots[i]   = globals->trans_info.rotations[i];
+    base_scales[i] = globals->trans_info.scales[i];
+    base_shears[i] = globals->trans_info.shears[i];
+  }
+
+                                /* build the list of starting points,
+                                   skipping perturbations of parameters
+                                   that are not being optimized */
+  ALLOC(start, n_starts);
+  ALLOC(order, n_starts);
+
+  for(i=0; i<3; i++) {
+    start[0].rotations[i] = base_rots[i];
+    start[0].scales[i]    = base_scales[i];
+  }
+  n = 1;
+  for(tries=0; n<n_starts && tries<8*8; tries++) {
+    ring = tries/8 + 1;
+    pat  = multi_start_pattern[tries%8];
+
+    if ((pat[0] && globals->trans_info.weights[3]==0.0) ||
+        (pat[1] && globals->trans_info.weights[4]==0.0) ||
+        (pat[2] && globals->trans_info.weights[5]==0.0) ||
+        (pat[3] && globals->trans_info.weights[6]==0.0))
+      continue;
+
+    for(i=0; i<3; i++) {
+      start[n].rotations[i] = base_rots[i] + ring*pat[i]*MULTI_START_ROT_STEP;
+      start[n].scales[i]    = base_scales[i] * (1.0 + ring*pat[3]*MULTI_START_SCALE_STEP);
+    }
+    n++;
+  }
+  n_starts = n;
+
+  if (n_starts < 2) {            /* nothing to perturb for this fit type */
+    FREE(start);
+    FREE(order);
+    return(stat);
+  }
+
+                                /* switch to a coarser lattice */
+  for(i=0; i<3; i++) {
+    save_count[i]      = globals->count[i];
+    save_step[i]       = globals->step[i];
+    save_directions[i] = globals->directions[i];
+    if (globals->count[i] > 1) {
+      globals->count[i] = (globals->count[i] + MULTI_START_COARSE - 1) / MULTI_START_COARSE;
+      globals->step[i] *= MULTI_START_COARSE;
+      for(j=0; j<3; j++)
+        globals->directions[i].coords[j] *= MULTI_START_COARSE;
+    }
+  }
+
+                                /* evaluate each start */
+  for(k=0; k<n_starts; k++) {
+    for(i=0; i<3; i++) {
+      globals->trans_info.translations[i] = base_trans[i];
+      globals->trans_info.rotations[i]    = start[k].rotations[i];
+      globals->trans_info.scales[i]       = start[k].scales[i];
+      globals->trans_info.shears[i]       = base_shears[i];
+    }
+    start[k].start_value  = current_linear_fit(globals);
+    start[k].coarse_value = start[k].start_value;
+    start[k].pruned       = FALSE;
+    order[k] = k;
+  }
+
+                                /* prune the worst half before fitting */
+  for(k=1; k<n_starts; k++)      
+    for(j=k; j>0 && start[order[j]].start_value < start[order[j-1]].start_value; j--) {
+      i = order[j]; order[j] = order[j-1]; order[j-1] = i;
+    }
+  n_keep = (n_starts+1)/2;
+  for(k=n_keep; k<n_starts; k++)
+    start[order[k]].pruned = TRUE;
+
+                                /* coarse fit of the survivors */
+  stat = fit_linear_starts(d1, d2, m1, m2, globals, start, order, n_keep,
+                           base_trans, base_shears);
+
+  best = order[0];
+  for(k=1; k<n_keep; k++)
+    if (start[order[k]].coarse_value < start[best].coarse_value)
+      best = order[k];
+
+                                /* back to the full lattice */
+  for(i=0; i<3; i++) {
+    globals->count[i]      = save_count[i];
+    globals->step[i]       = save_step[i];
+    globals->directions[i] = save_directions[i];
+  }
+
+  for(i=0; i<3; i++) {
+    globals->trans_info.translations[i] = start[best].r_translations[i];
+    globals->trans_info.rotations[i]    = start[best].r_rotations[i];
+    globals->trans_info.scales[i]       = start[best].r_scales[i];
+    globals->trans_info.shears[i]       = start[best].r_shears[i];
+  }
+
+  if (globals->flags.verbose>0) {
+    print("Multi-start linear search (%d starts, %d kept, lattice step x%d):\n",
+          n_starts, n_keep, MULTI_START_COARSE);
+    print("start    rot_x    rot_y    rot_z    scale     initial      coarse\n");
+    for(k=0; k<n_starts; k++) {
+      print("%3d%c %8.3f %8.3f %8.3f %8.4f  %10.6f  ",
+            k, (k==best) ? '*' : ' ',
+            start[k].rotations[0]*180.0/3.1415927,
+            start[k].rotations[1]*180.0/3.1415927,
+            start[k].rotations[2]*180.0/3.1415927,
+            start[k].scales[0], start[k].start_value);
+      if (start[k].pruned)
+        print("    (pruned)\n");
+      else
+        print("%10.6f\n", start[k].coarse_value);
+    }
+  }
+
+  FREE(start);
+  FREE(order);
+
+  return(stat);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : init_importance_sampling
+@INPUT      : globals
+@OUTPUT     : 
+@RETURNS    : 
+@DESCRIPTION: with -sample_budget, draw the lattice nodes used by
+              xcorr_objective and mutual_information_objective (see
+              lattice_sampling.c).  The -sample_weights volume is in the
+              space of the source; when the lattice is in the target
+              (the volumes were swapped), the gradient magnitude of the
+              target is used instead.
+@METHOD     : 
+@GLOBALS    : Gdata1, Gdata2, Gmask1, Ginverse_mapping_flag,
+              sample_budget, sample_weights
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void init_importance_sampling(Arg_Data *globals)
+{
+  int n;
+
+  if (sample_budget < 1 ||
+      (globals->obj_function != xcorr_objective &&
+       globals->obj_function != mutual_information_objective &&
+       globals->obj_function != normalized_mutual_information_objective))
+    return;
+
+  n = init_lattice_samples(globals, Gdata1, Gdata2, Gmask1,
+                           Ginverse_mapping_flag ? (VIO_Volume)NULL : sample_weights,
+                           sample_budget);
+
+  if (globals->flags.verbose > 0) {
+    if (n > 0)
+      print ("Importance sampling: %d of %d lattice nodes\n", n,
+             globals->count[0]*globals->count[1]*globals->count[2]);
+    else
+      print ("Importance sampling: the lattice has no more than %d nodes, using all of them\n",
+             sample_budget);
+  }
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : lattice_clip_uses_threshold
+@INPUT      : globals
+@OUTPUT     : 
+@RETURNS    : TRUE if lattice nodes whose value in the second volume is not
+              above threshold[1] are ignored by the objective function, and
+              the interpolant cannot overshoot the data (so that such nodes
+              are all outside of the bounding box of supra-threshold voxels)
+@DESCRIPTION: see init_lattice_clip() in vox_space.c
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+VIO_BOOL lattice_clip_uses_threshold(Arg_Data *globals)
+{
+                                /* partial volume interpolation */
+  if (globals->obj_function == mutual_information_objective || 
+      globals->obj_function == normalized_mutual_information_objective)
+    return(TRUE);
+
+  if (globals->interpolant == tricubic_interpolant ||
+      globals->interpolant == bspline_interpolant)
+    return(FALSE);
+
+  return(globals->obj_function == xcorr_objective || 
+         globals->obj_function == vr_objective);
+}
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : optimize_linear_transformation
                 get the parameters necessary to map volume 1 to volume 2
@@ -1388,6 +2055,22 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
     Ginverse_mapping_flag = TRUE;
   }
 
+           /* ---------------- skip the lattice nodes that cannot map
+                               into the second volume (or its mask)  ---------*/
+
+  init_lattice_clip(Gdata2, Gmask2, globals->threshold[1], 
+                    lattice_clip_uses_threshold(globals));
+
+           /* ---------------- build the parts of the voxel-to-voxel
+                               transform that stay fixed during the fit --*/
+
+  init_voxel_space_context(Gdata1, Gdata2);
+
+           /* ---------------- with -sample_budget, use importance-
+                               sampled nodes instead of the lattice --*/
+
+  init_importance_sampling(globals);
+
 
            /* ---------------- call the requested obj_function to 
                                establish the initial fitting value  ---------*/
@@ -1404,30 +2087,15 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
 
   initial_corr = fit_function(globals,p);
 
+           /* ---------------- search from several starting points,
+                               if requested, on a coarse lattice  ---------*/
+
+  if (stat && globals->trans_info.multi_start > 1)
+    stat = multi_start_linear_search(d1, d2, m1, m2, globals);
+
            /* ---------------- call requested optimization strategy ---------*/
 
-//fprintf(stderr,"ROBB: Optimizer: %d\n",globals->optimize_type);
-  switch (globals->optimize_type) {
-  case OPT_SIMPLEX:
-    stat = optimize_simplex(d1, d2, m1, m2, globals);
-    break;
-#ifdef HAVE_LIBLBFGS
-  case OPT_BFGS:
-    stat = optimize_BFGS(d1,d2,m1,m2,globals);
-    break;
-#else
-  case OPT_BFGS:
-    (void)fprintf(stderr, "BFGS optimizer is not compiled it\n");
-    (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
-    stat = FALSE;
-    break;
-#endif /*HAVE_LIBLBFGS*/
-  default:
-    (void)fprintf(stderr, "Unknown type of optimization requested (%d)\n",
-                  globals->optimize_type);
-    (void)fprintf(stderr, "Error in line %d, file %s\n",__LINE__, __FILE__);
-    stat = FALSE;
-  }
+  stat = run_linear_optimizer(d1, d2, m1, m2, globals) && stat;
   
   parameters_to_vector(globals->trans_info.translations,
                        globals->trans_info.rotations,
@@ -1438,6 +2106,11 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
 
   final_corr = fit_function(globals,p);
 
+  clear_lattice_clip();
+  clear_voxel_space_context();
+  delete_bspline_coefficients();
+  clear_lattice_samples();
+
   FREE(p);
 
   /*--------- set up final transformation matrix ------------------*/
@@ -1695,6 +2368,22 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
     Ginverse_mapping_flag = TRUE;
   }
 
+           /* ---------------- skip the lattice nodes that cannot map
+                               into the second volume (or its mask)  ---------*/
+
+  init_lattice_clip(Gdata2, Gmask2, globals->threshold[1], 
+                    lattice_clip_uses_threshold(globals));
+
+           /* ---------------- build the parts of the voxel-to-voxel
+                               transform that stay fixed during the fit --*/
+
+  init_voxel_space_context(Gdata1, Gdata2);
+
+           /* ---------------- with -sample_budget, use importance-
+                               sampled nodes instead of the lattice --*/
+
+  init_importance_sampling(globals);
+
 
            /* ---------------- call the requested obj_function to 
                                establish the initial fitting value  ---------*/
@@ -1712,6 +2401,9 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
 
   initial_corr = fit_function_quater(globals,p);
 
+  if (globals->trans_info.multi_start > 1)
+    print ("WARNING: -multi_start is not available with -quaternions, ignored.\n");
+
            /* ---------------- call requested optimization strategy ---------*/
 
   switch (globals->optimize_type) {
@@ -1734,6 +2426,11 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
 
   final_corr = fit_function_quater(globals,p);
 
+  clear_lattice_clip();
+  clear_voxel_space_context();
+  delete_bspline_coefficients();
+  clear_lattice_samples();
+
   FREE(p);
 
   /*--------- set up final transformation matrix ------------------*/
@@ -1777,37 +2474,33 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
 
 
 /* ----------------------------- MNI Header -----------------------------------
-@NAME       : measure_fit
-                evaluate the objective function comparing d1 to d2 a single
-                time.
+@NAME       : evaluate_fit
+                evaluate the objective function once, at the parameters
+                of globals->trans_info.
 @INPUT      : d1,d2:
-                two volumes of data (already in memory).
+                two volumes of data, prepared for the objective function.
               m1,m2:
-                two mask volumes for data (already in memory).
+                two mask volumes for data.
               globals:
-                a global data structure containing info from the command line,
-                including the input parameters, the input matrix,
-                and a plethora of flags!
+                as for measure_fit().
 @OUTPUT     : 
-@RETURNS    : TRUE if ok, FALSE if error.
-@DESCRIPTION: 
+@RETURNS    : the value of globals->obj_function.
+@DESCRIPTION: the parameters that the transformation type does not use
+                are reset, and the transformation is rebuilt from the
+                others.  When the lattice is in the target (smallest_vol
+                is 2), the objective function gets the volumes and masks
+                swapped, and the inverse transformation, as during a fit.
 @METHOD     :
-                1- this routine begins by initializing the volume data structures
-                to be used by the objective functions.
-
-                2- the objective function is evaluated
-                
-                3- its value is returned
-@GLOBALS    : 
-@CALLS      : 
-@CREATED    : Tue Jul 13 11:15:57 EST 1993 LC
+@GLOBALS    : Gndim, Gdata1, Gdata2, Gmask1, Gmask2, Ginverse_mapping_flag
+@CALLS      : fit_function, fit_function_quater
+@CREATED    : 
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
-float measure_fit(VIO_Volume d1,
-                         VIO_Volume d2,
-                         VIO_Volume m1,
-                         VIO_Volume m2, 
-                         Arg_Data *globals)
+float evaluate_fit(VIO_Volume d1,
+                   VIO_Volume d2,
+                   VIO_Volume m1,
+                   VIO_Volume m2, 
+                   Arg_Data *globals)
 {
   VIO_BOOL 
     stat;
@@ -1816,77 +2509,10 @@ float measure_fit(VIO_Volume d1,
   int 
     i, 
     ndim;
-  VIO_Data_types
-    data_type;
-
-
 
-  
   stat = TRUE;
+  y = -1e10; 
 
-             /*----------------- prepare data for objective function evaluation ------------ */
-
-  
-  if (globals->obj_function == zscore_objective) { /* replace volume d1 and d2 by zscore volume  */
-    make_zscore_volume(d1,m1,&globals->threshold[0]);
-    make_zscore_volume(d2,m2,&globals->threshold[1]);
-  } 
-  else  if (globals->obj_function == ssc_objective) {        /* add speckle to the data set */
-
-    make_zscore_volume(d1,m1,&globals->threshold[0]); /* need to make data sets comparable */
-    make_zscore_volume(d2,m2,&globals->threshold[1]); /* in mean and sd...                 */
-
-    if (globals->smallest_vol == 1)
-      add_speckle_to_volume(d1, 
-                            globals->speckle,
-                            globals->start, globals->count, globals->directions);
-    else
-      add_speckle_to_volume(d2, 
-                            globals->speckle,
-                            globals->start, globals->count, globals->directions);    
-  } else if (globals->obj_function == vr_objective) {
-
-    if (globals->smallest_vol == 1) {
-      if (!build_segment_table(&segment_table, d1, globals->groups))
-        print_error_and_line_num("Could not build segment table for source volume\n",__FILE__, __LINE__);
-    }
-    else {
-      if (!build_segment_table(&segment_table, d2, globals->groups))
-        print_error_and_line_num("Could not build segment table for target volume\n",__FILE__, __LINE__);
-    }
-
-  } else if (globals->obj_function == mutual_information_objective || globals->obj_function == normalized_mutual_information_objective )
-                                /* Collignon's mutual information */
-    {
-
-      if ( globals->groups != 256 ) {
-        print ("WARNING: -groups was %d, but will be forced to 256 in this run\n",globals->groups);
-        globals->groups = 256;
-      }
-
-      data_type = get_volume_data_type (d1);
-      if (data_type != VIO_UNSIGNED_BYTE) {
-        print ("WARNING: source volume not UNSIGNED BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d1)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
-      data_type = get_volume_data_type (d2);
-      if (data_type != VIO_UNSIGNED_BYTE) {
-        print ("WARNING: target volume not UNSIGNED BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d2)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
-      ALLOC(   prob_fn1,   globals->groups);
-      ALLOC(   prob_fn2,   globals->groups);
-      VIO_ALLOC2D( prob_hash_table, globals->groups, globals->groups);
-
-    } 
           /* ---------------- prepare the weighting array for obj func evaluation  ---------*/
  
 if(globals->trans_info.rotation_type == TRANS_ROT)
@@ -2076,6 +2702,115 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
   }
   }
   
+
+  return(y);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : measure_fit
+                evaluate the objective function comparing d1 to d2 a single
+                time.
+@INPUT      : d1,d2:
+                two volumes of data (already in memory).
+              m1,m2:
+                two mask volumes for data (already in memory).
+              globals:
+                a global data structure containing info from the command line,
+                including the input parameters, the input matrix,
+                and a plethora of flags!
+@OUTPUT     : 
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: 
+@METHOD     :
+                1- this routine begins by initializing the volume data structures
+                to be used by the objective functions.
+
+                2- the objective function is evaluated
+                
+                3- its value is returned
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : Tue Jul 13 11:15:57 EST 1993 LC
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+float measure_fit(VIO_Volume d1,
+                         VIO_Volume d2,
+                         VIO_Volume m1,
+                         VIO_Volume m2, 
+                         Arg_Data *globals)
+{
+  float 
+    y;
+  VIO_Data_types
+    data_type;
+
+
+             /*----------------- prepare data for objective function evaluation ------------ */
+
+  
+  if (globals->obj_function == zscore_objective) { /* replace volume d1 and d2 by zscore volume  */
+    make_zscore_volume(d1,m1,&globals->threshold[0]);
+    make_zscore_volume(d2,m2,&globals->threshold[1]);
+  } 
+  else  if (globals->obj_function == ssc_objective) {        /* add speckle to the data set */
+
+    make_zscore_volume(d1,m1,&globals->threshold[0]); /* need to make data sets comparable */
+    make_zscore_volume(d2,m2,&globals->threshold[1]); /* in mean and sd...                 */
+
+    if (globals->smallest_vol == 1)
+      add_speckle_to_volume(d1, 
+                            globals->speckle,
+                            globals->start, globals->count, globals->directions);
+    else
+      add_speckle_to_volume(d2, 
+                            globals->speckle,
+                            globals->start, globals->count, globals->directions);    
+  } else if (globals->obj_function == vr_objective) {
+
+    if (globals->smallest_vol == 1) {
+      if (!build_segment_table(&segment_table, d1, globals->groups))
+        print_error_and_line_num("Could not build segment table for source volume\n",__FILE__, __LINE__);
+    }
+    else {
+      if (!build_segment_table(&segment_table, d2, globals->groups))
+        print_error_and_line_num("Could not build segment table for target volume\n",__FILE__, __LINE__);
+    }
+
+  } else if (globals->obj_function == mutual_information_objective || globals->obj_function == normalized_mutual_information_objective )
+                                /* Collignon's mutual information */
+    {
+
+      if ( globals->groups != 256 ) {
+        print ("WARNING: -groups was %d, but will be forced to 256 in this run\n",globals->groups);
+        globals->groups = 256;
+      }
+
+      data_type = get_volume_data_type (d1);
+      if (data_type != VIO_UNSIGNED_BYTE) {
+        print ("WARNING: source volume not UNSIGNED BYTE, will do conversion now.\n");
+        if (!replace_volume_data_with_ubyte(d1)) {
+          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
+                             __FILE__, __LINE__);
+        }
+      }
+
+      data_type = get_volume_data_type (d2);
+      if (data_type != VIO_UNSIGNED_BYTE) {
+        print ("WARNING: target volume not UNSIGNED BYTE, will do conversion now.\n");
+        if (!replace_volume_data_with_ubyte(d2)) {
+          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
+                             __FILE__, __LINE__);
+        }
+      }
+
+      ALLOC(   prob_fn1,   globals->groups);
+      ALLOC(   prob_fn2,   globals->groups);
+      VIO_ALLOC2D( prob_hash_table, globals->groups, globals->groups);
+
+    } 
+  y = evaluate_fit(d1, d2, m1, m2, globals);
+
           /* ----------------finish up parameter/matrix manipulations ------*/
 
   if (globals->obj_function == vr_objective) {
@@ -0,0 +1,158 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : source_cache.c
+@DESCRIPTION: a per-node store of the source side of the sub-lattices
+              built by build_lattices() in do_nonlinear.c.
+
+  these include:
+     init_source_cache() -   size the store for a memory budget
+     source_cache_fetch() -  copy the cached samples of a node back into
+                             Ga1_features, masked_samples_in_source and
+                             Gsqrt_features
+     source_cache_store() -  save them after they have been interpolated
+     delete_source_cache() - free everything
+
+  The source volume and the linear part of the transformation do not
+  change during the non-linear fit, so neither does the position of a
+  node in the source, nor the samples interpolated around it.  Only
+  the target sub-lattice has to be rebuilt at each iteration.
+
+  Slots are handed out in the order in which nodes are first seen.
+  Once the budget is used up, the remaining nodes are marked
+  SOURCE_CACHE_NONE and sampled at every iteration, as before.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "source_cache.h"
+
+
+VIO_BOOL init_source_cache(Source_Cache *cache,
+                           long n_nodes, int n_features, int max_len,
+                           int budget_mb)
+{
+  long
+    i,
+    slot_bytes;
+
+  cache->n_nodes    = n_nodes;
+  cache->n_features = n_features;
+  cache->max_len    = max_len;
+  cache->len        = 0;
+  cache->used       = 0;
+  cache->hits       = 0;
+  cache->misses     = 0;
+
+  if (n_nodes < 1 || n_features < 1 || max_len < 1 || budget_mb < 1)
+    return(FALSE);
+
+  slot_bytes = (long)n_features *
+    ((long)max_len * (sizeof(float) + sizeof(unsigned char)) + sizeof(float));
+
+  cache->n_slots = ((long)budget_mb * 1024L * 1024L) / slot_bytes;
+  if (cache->n_slots > n_nodes)
+    cache->n_slots = n_nodes;
+  if (cache->n_slots < 1)
+    return(FALSE);
+
+  ALLOC(cache->slot, n_nodes);
+  for(i=0; i<n_nodes; i++)
+    cache->slot[i] = SOURCE_CACHE_EMPTY;
+
+  ALLOC(cache->samples,       cache->n_slots * n_features * max_len);
+  ALLOC(cache->masked,        cache->n_slots * n_features * max_len);
+  ALLOC(cache->sqrt_features, cache->n_slots * n_features);
+
+  return(TRUE);
+}
+
+/* the sample arrays are indexed from 1 to len, as in do_nonlinear.c */
+
+VIO_BOOL source_cache_fetch(Source_Cache *cache, long node, int len,
+                            float **samples, VIO_BOOL **masked,
+                            float sqrt_features[])
+{
+  long
+    s;
+  int
+    f,j;
+  float
+    *p;
+  unsigned char
+    *m;
+
+  if (node < 0 || node >= cache->n_nodes || len != cache->len ||
+      cache->slot[node] < 0) {
+    cache->misses++;
+    return(FALSE);
+  }
+
+  s = cache->slot[node];
+  for(f=0; f<cache->n_features; f++) {
+    p = &cache->samples[(s*cache->n_features + f) * cache->max_len];
+    m = &cache->masked [(s*cache->n_features + f) * cache->max_len];
+    for(j=1; j<=len; j++) {
+      samples[f][j] = p[j-1];
+      masked[f][j]  = (VIO_BOOL)m[j-1];
+    }
+    sqrt_features[f] = cache->sqrt_features[s*cache->n_features + f];
+  }
+
+  cache->hits++;
+  return(TRUE);
+}
+
+void source_cache_store(Source_Cache *cache, long node, int len,
+                        float **samples, VIO_BOOL **masked,
+                        float sqrt_features[])
+{
+  long
+    s;
+  int
+    f,j;
+  float
+    *p;
+  unsigned char
+    *m;
+
+  if (node < 0 || node >= cache->n_nodes || len < 1 || len > cache->max_len)
+    return;
+
+  if (cache->len == 0)
+    cache->len = len;
+  else if (len != cache->len)
+    return;
+
+  if (cache->slot[node] == SOURCE_CACHE_EMPTY) {
+    if (cache->used < cache->n_slots)
+      cache->slot[node] = cache->used++;
+    else
+      cache->slot[node] = SOURCE_CACHE_NONE;
+  }
+  if (cache->slot[node] < 0)
+    return;
+
+  s = cache->slot[node];
+  for(f=0; f<cache->n_features; f++) {
+    p = &cache->samples[(s*cache->n_features + f) * cache->max_len];
+    m = &cache->masked [(s*cache->n_features + f) * cache->max_len];
+    for(j=1; j<=len; j++) {
+      p[j-1] = samples[f][j];
+      m[j-1] = (unsigned char)(masked[f][j] != FALSE);
+    }
+    cache->sqrt_features[s*cache->n_features + f] = sqrt_features[f];
+  }
+}
+
+void delete_source_cache(Source_Cache *cache)
+{
+  FREE(cache->slot);
+  FREE(cache->samples);
+  FREE(cache->masked);
+  FREE(cache->sqrt_features);
+}
@@ -84,10 +84,14 @@
 #include "minctracc_arg_data.h"                /* definition of the global data struct      */
 #include "sub_lattice.h"
 #include "init_lattice.h"
+#include "warp_cache.h"
+#include "flat_transform.h"
 
 
 extern Arg_Data *Gglobals;      /* defined in do_nonlinear.c */
 extern VIO_Volume   Gsuper_sampled_vol; /* defined in do_nonlinear.c */
+extern Warp_Cache  *Gwarp_cache;        /* defined in do_nonlinear.c */
+extern Flat_Transform *Gflat_transform; /* defined in do_nonlinear.c */
 extern VIO_General_transform 
                 *Glinear_transform;/* defined in do_nonlinear.c */
 
@@ -269,6 +273,132 @@ void go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
   
 }
 
+/*********************************************************************** 
+   do the last bits of the similarity function calculation, given the
+   accumulators s1..s5 of switch_obj_func.c - normalizing each obj_func
+   where-ever possible.
+*/
+
+static float finish_similarity(int obj_func, float normalization,
+                               double s1, double s2, double s3, 
+                               double s4, double s5,
+                               int number_of_nonzero_samples)
+{
+  double 
+    r;
+  double mean_s = 0.0;		/* init variables for stats */
+  double mean_t = 0.0;
+  double var_s = 0.0;
+  double var_t = 0.0;
+  double covariance = 0.0;
+
+  r = 0.0;
+
+  switch (obj_func) {
+
+  case NONLIN_XCORR:            /* use standard normalized cross-correlation 
+                                   where 0.0 < r < 1.0, where 1.0 is best*/
+    if ( normalization < 0.001 && s3 < 0.00001) {
+      r = 1.0;
+    }
+    else {
+      if ( normalization < 0.001 || s3 < 0.00001) {
+        r = 0.0;
+      }
+      else {
+        r = s1 / ((sqrt((double)s2))*(sqrt((double)s3)));
+      }
+    }
+    /* r = 1.0 - r;                 now, 0 is best                   */
+    break;
+
+  case NONLIN_DIFF:             /* normalization stores the number of samples in
+                                   the sub-lattice 
+                                   s1 stores the sum of the magnitude of
+                                   the differences*/
+
+     r = -s1 /number_of_nonzero_samples;        /* r = average intensity difference ; with
+                                   -max(intensity range) < r < 0,
+                                   where 0 is best                  */
+    break;
+  case NONLIN_LABEL:
+     r = s1 /number_of_nonzero_samples;           /* r = average label agreement,
+                                    s1 stores the number of similar labels
+                                   0 < r < 1.0                      
+                                   where 1.0 is best                */
+    break;
+  case NONLIN_CHAMFER:
+    if (number_of_nonzero_samples>0) {
+       r = 1.0 - (s1 / (20.0*number_of_nonzero_samples));        
+                                /* r = 1- average distance / 20mm 
+                                       0 < r < ~1.0 
+                                   where 1.0 is best     
+                                       and where 2.0cm is an arbitrary value to
+                                       norm the dist, corresponding to a guess
+                                       at the maximum average cortical variability
+
+                                       so the max(r) could be greater than
+                                       1.0, but when it is, shouldn't
+                                       chamfer have larger weight to drive
+                                       the fit? */
+    }
+    else
+       r = 2.0;                 /* this is simply a value > 1.5, used as a
+                                   flag to indicate that there were no
+                                   samples used for the chamfer */
+    break;
+  case NONLIN_CORRCOEFF:
+      {
+          /* Accumulators:
+           * s1 = sum of source image values
+           * s2 = sum of target image values
+           * s3 = sum of squared source image values
+           * s4 = sum of squared target image values
+           * s5 = sum of source*target values
+           *
+           * normalization = #values considered
+           */
+          if (number_of_nonzero_samples>0) {
+            mean_s = s1 / number_of_nonzero_samples;
+            mean_t = s2 / number_of_nonzero_samples;
+            var_s = s3 / number_of_nonzero_samples - mean_s*mean_s;
+            var_t = s4 / number_of_nonzero_samples - mean_t*mean_t;
+            covariance = s5 / number_of_nonzero_samples - mean_s*mean_t;
+          }
+          else {
+            mean_s = 0.0;
+            mean_t = 0.0;
+            var_s = 0.0;
+            var_t = 0.0;
+            covariance = 0.0;
+          }
+
+
+          if ((var_s < 0.00001) || (var_t < 0.00001) ) {
+            r = 0.0;
+          }
+          else {
+            r = covariance / sqrt( var_s*var_t );            
+          }
+      }
+      break;
+          
+  case NONLIN_SQDIFF:           /* normalization stores the number of samples 
+                                   in the sub-lattice.
+                                   s1 stores the sum of the squared intensity
+                                   differences */
+    r = -s1 /number_of_nonzero_samples;
+    break;
+
+  default:
+    print_error_and_line_num("Objective function %d not supported in go_get_samples_with_offset",__FILE__, __LINE__,obj_func);
+  }
+  
+  
+  
+  return(r);
+}
+
 /*********************************************************************** 
    use the list of voxel coordinates stored in x[], y[], z[] and the
    voxel offset stored in dx, dy, dz to interpolate len samples from
@@ -313,7 +443,7 @@ float go_get_samples_with_offset(
 				 VIO_BOOL use_nearest_neighbour)   /* interpolation flag              */
 {
   double
-    sample, r,
+    sample,
     s1,s2,s3,s4,s5,tmp;                   /* accumulators for inner loop */
   int 
     sizes[3],
@@ -330,12 +460,6 @@ float go_get_samples_with_offset(
 
   double ***double_ptr;
   
-  double mean_s = 0.0;		/* init variables for stats */
-  double mean_t = 0.0;
-  double var_s = 0.0;
-  double var_t = 0.0;
-  double covariance = 0.0;
-  
   number_of_nonzero_samples = 0;
 
   get_volume_sizes(data, sizes);  
@@ -500,115 +624,185 @@ float go_get_samples_with_offset(
   
 
 
+  }
+
                                 /* do the last bits of the similarity function
-                                   calculation here - normalizing each obj_func
-                                   where-ever possible: */
-  r = 0.0;
+                                   calculation here */
+  return(finish_similarity(obj_func, normalization, 
+                           s1,s2,s3,s4,s5, number_of_nonzero_samples));
+}
 
-  switch (obj_func) {
 
-  case NONLIN_XCORR:            /* use standard normalized cross-correlation 
-                                   where 0.0 < r < 1.0, where 1.0 is best*/
-    if ( normalization < 0.001 && s3 < 0.00001) {
-      r = 1.0;
-    }
-    else {
-      if ( normalization < 0.001 || s3 < 0.00001) {
-        r = 0.0;
-      }
-      else {
-        r = s1 / ((sqrt((double)s2))*(sqrt((double)s3)));
-      }
-    }
-    /* r = 1.0 - r;                 now, 0 is best                   */
-    break;
 
-  case NONLIN_DIFF:             /* normalization stores the number of samples in
-                                   the sub-lattice 
-                                   s1 stores the sum of the magnitude of
-                                   the differences*/
 
-     r = -s1 /number_of_nonzero_samples;        /* r = average intensity difference ; with
-                                   -max(intensity range) < r < 0,
-                                   where 0 is best                  */
-    break;
-  case NONLIN_LABEL:
-     r = s1 /number_of_nonzero_samples;           /* r = average label agreement,
-                                    s1 stores the number of similar labels
-                                   0 < r < 1.0                      
-                                   where 1.0 is best                */
-    break;
-  case NONLIN_CHAMFER:
-    if (number_of_nonzero_samples>0) {
-       r = 1.0 - (s1 / (20.0*number_of_nonzero_samples));        
-                                /* r = 1- average distance / 20mm 
-                                       0 < r < ~1.0 
-                                   where 1.0 is best     
-                                       and where 2.0cm is an arbitrary value to
-                                       norm the dist, corresponding to a guess
-                                       at the maximum average cortical variability
+/*********************************************************************** 
+   go_get_fused_samples_with_offset() does the work of n calls to 
+   go_get_samples_with_offset(), one per feature, when the n target
+   volumes data[0..n-1] have the same sizes and share the same target
+   mask (as for the usual blurred intensity + gradient magnitude
+   features).  The mask test and the interpolation indices and weights
+   are computed once per sub-lattice node, and the n samples are then
+   read at the same voxel offsets.  The result for feature f is
+   returned in result[f], and is the same as that of the separate call.
+*/
 
-                                       so the max(r) could be greater than
-                                       1.0, but when it is, shouldn't
-                                       chamfer have larger weight to drive
-                                       the fit? */
+typedef struct {
+  double ***voxels;
+  double s1,s2,s3,s4,s5;
+  int    number_of_nonzero_samples;
+} Fused_Feature;
+
+                                /* the per-sample update of
+                                   go_get_samples_with_offset(), from
+                                   switch_obj_func.c, on the
+                                   accumulators of one feature */
+static void accumulate_sample(int obj_func, float *a1, double sample,
+                              Fused_Feature *f)
+{
+  double
+    s1,s2,s3,s4,s5,tmp;
+  int
+    number_of_nonzero_samples;
+
+  s1 = f->s1; s2 = f->s2; s3 = f->s3; s4 = f->s4; s5 = f->s5;
+  number_of_nonzero_samples = f->number_of_nonzero_samples;
+
+#include "switch_obj_func.c"
+
+  f->s1 = s1; f->s2 = s2; f->s3 = s3; f->s4 = s4; f->s5 = s5;
+  f->number_of_nonzero_samples = number_of_nonzero_samples;
+}
+
+void go_get_fused_samples_with_offset(
+     VIO_Volume data[],                /* the n target feature volumes     */
+     VIO_Volume mask,                  /* their (shared) target mask       */
+     float *x, float *y, float *z,     /* the positions of the sub-lattice */
+     VIO_Real  dx, VIO_Real  dy, VIO_Real dz, /* the local displacement   */
+     int obj_func[],                   /* obj function for each feature    */
+     int n,                            /* number of features               */
+     int len,                          /* number of sub-lattice nodes      */
+     float normalization[],            /* normalization for each feature   */
+     float *a1[],                      /* source values, for each feature  */
+     VIO_BOOL *m1[],                   /* source mask flags, per feature   */
+     VIO_BOOL use_nearest_neighbour,   /* interpolation flag               */
+     float result[])                   /* similarity value, per feature    */
+{
+  static Fused_Feature 
+    *feat = NULL;
+  static int
+    n_alloc = 0;
+  Fused_Feature 
+    *ff;
+  double
+    sample,
+    v0, v1, v2, 
+    f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  int 
+    sizes[3],
+    ind0, ind1, ind2, 
+    offset0, offset1, offset2,
+    c, f, in_volume;
+  VIO_BOOL
+    any;
+
+  if (n > n_alloc) {
+    if (n_alloc > 0)
+      FREE(feat);
+    ALLOC(feat, n);
+    n_alloc = n;
+  }
+
+  for(f=0; f<n; f++) {
+    feat[f].voxels = VOXEL_DATA (data[f]);
+    feat[f].s1 = feat[f].s2 = feat[f].s3 = feat[f].s4 = feat[f].s5 = 0.0;
+    feat[f].number_of_nonzero_samples = 0;
+  }
+
+  get_volume_sizes(data[0], sizes);  
+
+  if (use_nearest_neighbour) {
+    offset0 = offset1 = offset2 = 0;
+  }
+  else {
+    offset0 = (Gglobals->count[VIO_Z] > 1) ? 1 : 0;
+    offset1 = (Gglobals->count[VIO_Y] > 1) ? 1 : 0;
+    offset2 = (Gglobals->count[VIO_X] > 1) ? 1 : 0;
+  }
+
+  f0 = f1 = f2 = r0 = r1 = r2 = 0.0;
+  r1r2 = r1f2 = f1r2 = f1f2 = 0.0;
+
+  /* for each sub-lattice node, indexed from 1...len */
+  for(c=1; c<=len; c++) {
+
+    if (!voxel_point_not_masked(mask, (VIO_Real)x[c], (VIO_Real)y[c], (VIO_Real)z[c]))
+      continue;
+
+    any = FALSE;
+    for(f=0; f<n && !any; f++) 
+      if (!m1[f][c] && (obj_func[f]!=NONLIN_CHAMFER || a1[f][c]>0)) 
+        any = TRUE;
+    if (!any)
+      continue;
+
+    v0 = (VIO_Real) ( x[c] + dx );
+    v1 = (VIO_Real) ( y[c] + dy );
+    v2 = (VIO_Real) ( z[c] + dz );
+
+    ind0 = (int)v0;
+    ind1 = (int)v1;
+    ind2 = (int)v2;
+
+    in_volume = (ind0>=0 && ind0<(sizes[0]-offset0) &&
+                 ind1>=0 && ind1<(sizes[1]-offset1) &&
+                 ind2>=0 && ind2<(sizes[2]-offset2));
+
+    if (in_volume && !use_nearest_neighbour) {
+      f0 = v0 - ind0;
+      f1 = v1 - ind1;
+      f2 = v2 - ind2;
+      r0 = 1.0 - f0;
+      r1 = 1.0 - f1;
+      r2 = 1.0 - f2;
+      r1r2 = r1 * r2;
+      r1f2 = r1 * f2;
+      f1r2 = f1 * r2;
+      f1f2 = f1 * f2;
     }
-    else
-       r = 2.0;                 /* this is simply a value > 1.5, used as a
-                                   flag to indicate that there were no
-                                   samples used for the chamfer */
-    break;
-  case NONLIN_CORRCOEFF:
-      {
-          /* Accumulators:
-           * s1 = sum of source image values
-           * s2 = sum of target image values
-           * s3 = sum of squared source image values
-           * s4 = sum of squared target image values
-           * s5 = sum of source*target values
-           *
-           * normalization = #values considered
-           */
-          if (number_of_nonzero_samples>0) {
-            mean_s = s1 / number_of_nonzero_samples;
-            mean_t = s2 / number_of_nonzero_samples;
-            var_s = s3 / number_of_nonzero_samples - mean_s*mean_s;
-            var_t = s4 / number_of_nonzero_samples - mean_t*mean_t;
-            covariance = s5 / number_of_nonzero_samples - mean_s*mean_t;
-          }
-          else {
-            mean_s = 0.0;
-            mean_t = 0.0;
-            var_s = 0.0;
-            var_t = 0.0;
-            covariance = 0.0;
-          }
 
+    for(f=0; f<n; f++) {
 
-          if ((var_s < 0.00001) || (var_t < 0.00001) ) {
-            r = 0.0;
-          }
-          else {
-            r = covariance / sqrt( var_s*var_t );            
-          }
+      if (m1[f][c] || (obj_func[f]==NONLIN_CHAMFER && a1[f][c]<=0))
+        continue;
+
+      ff = &feat[f];
+
+      if (!in_volume) 
+        sample = 0.0;
+      else if (use_nearest_neighbour)
+        sample = ff->voxels[ind0][ind1][ind2];
+      else {
+        sample   = 
+          r0 *  (r1r2 * ff->voxels[ind0        ][ind1        ][ind2        ] +
+                 r1f2 * ff->voxels[ind0        ][ind1        ][ind2+offset2] +
+                 f1r2 * ff->voxels[ind0        ][ind1+offset1][ind2        ] +
+                 f1f2 * ff->voxels[ind0        ][ind1+offset1][ind2+offset2]);
+        sample  +=
+          f0 *  (r1r2 * ff->voxels[ind0+offset0][ind1        ][ind2        ] +
+                 r1f2 * ff->voxels[ind0+offset0][ind1        ][ind2+offset2] +
+                 f1r2 * ff->voxels[ind0+offset0][ind1+offset1][ind2        ] +
+                 f1f2 * ff->voxels[ind0+offset0][ind1+offset1][ind2+offset2]);
       }
-      break;
-          
-  case NONLIN_SQDIFF:           /* normalization stores the number of samples 
-                                   in the sub-lattice.
-                                   s1 stores the sum of the squared intensity
-                                   differences */
-    r = -s1 /number_of_nonzero_samples;
-    break;
 
-  default:
-    print_error_and_line_num("Objective function %d not supported in go_get_samples_with_offset",__FILE__, __LINE__,obj_func);
-  }
-  
-  
-  return(r);
+      accumulate_sample(obj_func[f], &a1[f][c], sample, ff);
+    }
   }
 
+  for(f=0; f<n; f++) 
+    result[f] = finish_similarity(obj_func[f], normalization[f],
+                                  feat[f].s1, feat[f].s2, feat[f].s3, 
+                                  feat[f].s4, feat[f].s5, 
+                                  feat[f].number_of_nonzero_samples);
 }
 
 
@@ -622,6 +816,8 @@ float go_get_samples_with_offset(
    both input (px,py,pz) and output (tx,ty,tz) coordinate lists are in
    WORLD COORDINATES
 
+   with -flat_transform (the default), the compiled form in
+   Gflat_transform is used.
 */
 void    build_target_lattice(float px[], float py[], float pz[],
 			     float tx[], float ty[], float tz[],
@@ -630,6 +826,10 @@ void    build_target_lattice(float px[], float py[], float pz[],
   int i;
   VIO_Real x,y,z;
 
+  if (Gflat_transform != NULL) {
+    flat_transform_map_points(Gflat_transform, px,py,pz, tx,ty,tz, len);
+    return;
+  }
 
   for(i=1; i<=len; i++) {
 
@@ -651,6 +851,8 @@ void    build_target_lattice(float px[], float py[], float pz[],
    both input (px,py,pz) and output (tx,ty,tz) coordinate lists are in
    WORLD COORDINATES
 
+   when -warp_cache is used, the super-sampled deformation lives in
+   Gwarp_cache instead of Gsuper_sampled_vol.
 */
 void    build_target_lattice_using_super_sampled_def(
                                      float px[], float py[], float pz[],
@@ -668,6 +870,11 @@ void    build_target_lattice_using_super_sampled_def(
   long 
     index[VIO_MAX_DIMENSIONS];
 
+  if (Gwarp_cache != NULL) {
+    warp_cache_map_points(Gwarp_cache, px,py,pz, tx,ty,tz, len);
+    return;
+  }
+
   get_volume_sizes(Gsuper_sampled_vol,sizes);
   get_volume_XYZV_indices(Gsuper_sampled_vol,xyzv);
 
@@ -222,94 +222,6 @@ void create_super_sampled_data_volumes(VIO_General_transform *orig_deformation,
 
 }
  
-/*
-   This procedure will use cubic interpolation to resample the deformation
-   field stored in *orig_deformation->displacement_volume onto the voxel
-   lattice defined in *super_sampled.
-
-   The procedure essentially steps though all voxels of 
-   *super_sampled->displacement_volume, figures out the world coordinate for
-   the voxel position, and uses this info to interpolate into *orig_deformation.
-
-   see interpolate_super_sampled_data_by2() (below) for speedy code for the
-   special case when the super sampling rate is euqal to 2.
-
-
-
-         W A R N I N G : there appears to be a bug in volume_io's evaluate_volume
-                         call, so this routine should not be called.
-
-
-*/
-void interpolate_super_sampled_data(VIO_General_transform *orig_deformation,
-                                           VIO_General_transform *super_sampled)
-{
-  VIO_Volume
-    orig_vol,
-    super_vol;
-
-  int 
-    i,
-    index[VIO_MAX_DIMENSIONS],
-    orig_xyzv[VIO_MAX_DIMENSIONS],
-    xyzv[VIO_MAX_DIMENSIONS],
-    count[VIO_MAX_DIMENSIONS];
-  VIO_Real
-    def_vector[VIO_N_DIMENSIONS],
-    voxel[VIO_MAX_DIMENSIONS],
-    wx,wy,wz;
-  VIO_progress_struct
-    progress;
-
-  print ("W A R N I N G : there appears to be a bug in volume_io's evaluate_volume\ncall, so interpolate_super_sampled_data should not be called.\n");
-
-
-
-
-  orig_vol = orig_deformation->displacement_volume;
-  super_vol= super_sampled->displacement_volume;
-
-  get_volume_sizes(super_vol, count);
-  get_volume_XYZV_indices(super_vol, xyzv);
-  get_volume_XYZV_indices(orig_vol, orig_xyzv);
-  
-  initialize_progress_report( &progress, FALSE, count[ xyzv[VIO_X] ],
-                             "Super-sampling defs:" );
-  
-  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
-  
-
-  /* check here to see if special case of super sampling by 2, and if so, call the correct routine dec 02 */
-
-  for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<count[xyzv[VIO_X]]; index[xyzv[VIO_X]]++) {
-    for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<count[xyzv[VIO_Y]]; index[xyzv[VIO_Y]]++) {
-      for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<count[xyzv[VIO_Z]]; index[xyzv[VIO_Z]]++) {
-        
-        for(i=0; i<VIO_MAX_DIMENSIONS; i++) 
-          voxel[i]=(VIO_Real)index[i];
-        convert_voxel_to_world(super_vol, 
-                               voxel,
-                               &wx, &wy, &wz);
-
-        evaluate_volume_in_world(orig_vol, wx,wy,wz, 2, TRUE, 0.0,
-                                 def_vector,
-                                 NULL, NULL, NULL,
-                                 NULL, NULL, NULL, NULL, NULL, NULL);
-
-        for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<count[xyzv[VIO_Z+1]]; index[xyzv[VIO_Z+1]]++) 
-          set_volume_real_value(super_vol,
-                                index[0],index[1],index[2],index[3],index[4],
-                                def_vector[ index[ xyzv[VIO_Z+1] ] ]);
-        
-      }
-    }
-    update_progress_report( &progress, index[ xyzv[VIO_X] ]+1 );
-  }
-  terminate_progress_report( &progress );
-
-
-}
-
 /* build the volume structure and allocate the data space to store
    a super-sampled GRID_TRANSFORM.
 
@@ -22,10 +22,43 @@
 #include "vox_space.h"
 #include "local_macros.h"
 
+/* ----------------------------- MNI Header -----------------------------------
+   evaluation context:
+
+   a linear fit evaluates its objective function thousands of times,
+   with the same two volumes and only the transformation changing.
+   init_voxel_space_context() builds, once per fit, the two halves of
+   the voxel-to-voxel transform that do not depend on the
+   transformation:
+
+      pre  = v1 voxel (xyz order) -> world
+      post = world -> v2 voxel (xyz order)
+
+   and keeps one Voxel_space_struct that new_voxel_space_struct() hands
+   out instead of allocating a new one.  get_into_voxel_space() then
+   only has to compute  post * transformation * pre.  Only the forward
+   matrix of voxel_to_voxel_space is kept up to date on this path; the
+   objective functions do not use its inverse.
+---------------------------------------------------------------------------- */
+
+static struct {
+   VIO_BOOL              active;
+   VIO_BOOL              in_use;
+   VIO_Volume            v1, v2;
+   VIO_Transform         pre, post;
+   VIO_General_transform voxel_to_voxel_space;
+   Voxel_space_struct    vox;
+} context = { FALSE, FALSE };
+
 Voxel_space_struct* new_voxel_space_struct(void) {
 
    Voxel_space_struct *vox_space;
 
+   if (context.active && !context.in_use) {
+      context.in_use = TRUE;
+      return(&context.vox);
+   }
+
    ALLOC(vox_space, 1);
    
    ALLOC(vox_space->voxel_to_voxel_space, 1);
@@ -37,6 +70,11 @@ Voxel_space_struct* new_voxel_space_struct(void) {
 
 void delete_voxel_space_struct( Voxel_space_struct *vox_space) {
 
+   if (vox_space == &context.vox) {
+      context.in_use = FALSE;
+      return;
+   }
+
    delete_general_transform(vox_space->voxel_to_voxel_space);
    FREE(vox_space->voxel_to_voxel_space);
 
@@ -100,25 +138,15 @@ void build_reorder_matrix_xyz2vox(VIO_General_transform *trans, VIO_Volume volum
    
 }
 
-void get_into_voxel_space(Arg_Data *globals,
-                                 Voxel_space_struct *vox,
-                                 VIO_Volume v1, VIO_Volume v2) {
-   VIO_Transform 
-      *lin;
-   VIO_General_transform 
-      *reorder,
-      *w2v;
+/* the part of get_into_voxel_space() that does not depend on the
+   transformation */
+
+static void get_lattice_in_voxel_space(Arg_Data *globals,
+                                       Voxel_space_struct *vox,
+                                       VIO_Volume v1) {
    VIO_Real 
      sign,
-     tx,ty,tz;
-   PointR pnt,tmp_pt;
-   VIO_Real 
-      voxel_vector[VIO_MAX_DIMENSIONS],
-      s_voxel_xyz[VIO_MAX_DIMENSIONS],
-      s_voxel[VIO_MAX_DIMENSIONS],
-      s_world[VIO_N_DIMENSIONS],
-      t_voxel[VIO_MAX_DIMENSIONS],
-      t_world[VIO_N_DIMENSIONS];
+     voxel_vector[VIO_MAX_DIMENSIONS];
    int i;
                                 /* take care of the starting coordinate */
    convert_3D_world_to_voxel(v1,
@@ -144,6 +172,83 @@ void get_into_voxel_space(Arg_Data *globals,
                                    voxel_vector);
      
      fill_Vector(vox->directions[i], voxel_vector[0],voxel_vector[1],voxel_vector[2]);
+   }
+}
+
+void init_voxel_space_context(VIO_Volume v1, VIO_Volume v2) {
+
+   VIO_General_transform 
+      reorder,
+      w2v,
+      half;
+
+   clear_voxel_space_context();
+                                /* same construction as the general
+                                   path of get_into_voxel_space() */
+   create_linear_transform(&reorder, (VIO_Transform *)NULL);
+   build_reorder_matrix_vox2xyz(&reorder, v1);
+   concat_general_transforms(&reorder, get_voxel_to_world_transform( v1 ), &half);
+   copy_transform(&context.pre, get_linear_transform_ptr(&half));
+   delete_general_transform(&half);
+   delete_general_transform(&reorder);
+
+   create_linear_transform(&reorder, (VIO_Transform *)NULL);
+   build_reorder_matrix_xyz2vox(&reorder, v2);
+   create_inverse_general_transform(get_voxel_to_world_transform( v2 ), &w2v);
+   concat_general_transforms(&w2v, &reorder, &half);
+   copy_transform(&context.post, get_linear_transform_ptr(&half));
+   delete_general_transform(&half);
+   delete_general_transform(&w2v);
+   delete_general_transform(&reorder);
+
+   create_linear_transform(&context.voxel_to_voxel_space, (VIO_Transform *)NULL);
+   context.vox.voxel_to_voxel_space = &context.voxel_to_voxel_space;
+
+   context.v1     = v1;
+   context.v2     = v2;
+   context.in_use = FALSE;
+   context.active = TRUE;
+}
+
+void clear_voxel_space_context(void) {
+
+   if (context.active)
+      delete_general_transform(&context.voxel_to_voxel_space);
+   context.active = FALSE;
+   context.in_use = FALSE;
+}
+
+void get_into_voxel_space(Arg_Data *globals,
+                                 Voxel_space_struct *vox,
+                                 VIO_Volume v1, VIO_Volume v2) {
+   VIO_Transform 
+      *lin,
+      tmp;
+   VIO_General_transform 
+      *reorder,
+      *w2v;
+   VIO_Real 
+     tx,ty,tz;
+   PointR pnt,tmp_pt;
+   VIO_Real 
+      s_voxel_xyz[VIO_MAX_DIMENSIONS],
+      s_voxel[VIO_MAX_DIMENSIONS],
+      s_world[VIO_N_DIMENSIONS],
+      t_voxel[VIO_MAX_DIMENSIONS],
+      t_world[VIO_N_DIMENSIONS];
+   int i;
+
+   get_lattice_in_voxel_space(globals, vox, v1);
+
+                                /* with the evaluation context, only the
+                                   transformation has to be multiplied in */
+   if (vox == &context.vox && v1 == context.v1 && v2 == context.v2 &&
+       get_transform_type(globals->trans_info.transformation) == LINEAR) {
+      concat_transforms(&tmp, &context.pre, 
+                        get_linear_transform_ptr(globals->trans_info.transformation));
+      concat_transforms(get_linear_transform_ptr(vox->voxel_to_voxel_space),
+                        &tmp, &context.post);
+      return;
    }
 
                                 /* take care of the
@@ -298,3 +403,203 @@ void get_into_voxel_space(Arg_Data *globals,
         *z_trans /= w_trans;
     }
 }
+
+
+/* ----------------------------- MNI Header -----------------------------------
+   lattice clipping:
+
+   every linear objective function ignores a lattice node when the node,
+   mapped into the second volume, falls outside of that volume or of its
+   mask (and, for some objective functions, below threshold[1]).  The
+   box of voxels in the second volume that can contribute is found once
+   per fit by init_lattice_clip(); for each row of the lattice, 
+   get_lattice_clip_range() then returns the range of columns that the
+   current voxel-to-voxel transform maps into that box, so that the
+   objective functions do not visit nodes that cannot contribute.
+---------------------------------------------------------------------------- */
+
+static VIO_BOOL clip_active = FALSE;
+static VIO_Real clip_lo[3], clip_hi[3];
+
+/* box (in voxels) around all voxels of vol above thresh; FALSE if none */
+static VIO_BOOL get_voxel_bounding_box(VIO_Volume vol, VIO_Real thresh, 
+                                       VIO_Real lo[], VIO_Real hi[])
+{
+   int i,j,k, sizes[VIO_MAX_DIMENSIONS], min[3], max[3];
+
+   get_volume_sizes(vol, sizes);
+
+   for(i=0; i<3; i++) {
+      min[i] = sizes[i];
+      max[i] = -1;
+   }
+
+   for(i=0; i<sizes[0]; i++)
+      for(j=0; j<sizes[1]; j++)
+         for(k=0; k<sizes[2]; k++) 
+            if (get_volume_real_value(vol, i,j,k,0,0) > thresh) {
+               if (i < min[0]) min[0] = i;
+               if (i > max[0]) max[0] = i;
+               if (j < min[1]) min[1] = j;
+               if (j > max[1]) max[1] = j;
+               if (k < min[2]) min[2] = k;
+               if (k > max[2]) max[2] = k;
+            }
+
+   if (max[0] < 0)
+      return(FALSE);
+
+   for(i=0; i<3; i++) {
+      lo[i] = (VIO_Real)min[i];
+      hi[i] = (VIO_Real)max[i];
+   }
+   return(TRUE);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : init_lattice_clip
+@INPUT      : d2, m2 - second volume and its mask (or NULL)
+              threshold - threshold[1] of the objective function
+              use_threshold - TRUE if nodes for which the interpolated
+                 value of d2 is not above threshold do not contribute.
+                 This is only valid for interpolants that do not 
+                 overshoot (nearest neighbour, trilinear, partial volume).
+@OUTPUT     : 
+@RETURNS    : 
+@DESCRIPTION: find the box (in voxel coordinates of d2) out of which 
+              lattice nodes cannot contribute to the objective function.
+              NN lookups reach 0.5 voxel past a voxel center, trilinear
+              ones a full voxel, hence the margins.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void init_lattice_clip(VIO_Volume d2, VIO_Volume m2, 
+                       VIO_Real threshold, VIO_BOOL use_threshold)
+{
+   int i, sizes[VIO_MAX_DIMENSIONS];
+   VIO_Real lo[3], hi[3];
+
+   get_volume_sizes(d2, sizes);
+   for(i=0; i<3; i++) {
+      clip_lo[i] = -0.5;
+      clip_hi[i] = sizes[i] - 0.5;
+   }
+
+   if (m2 != (VIO_Volume)NULL) {
+      if (get_voxel_bounding_box(m2, 0.0, lo, hi)) {
+         for(i=0; i<3; i++) {
+            clip_lo[i] = MAX(clip_lo[i], lo[i] - 0.5);
+            clip_hi[i] = MIN(clip_hi[i], hi[i] + 0.5);
+         }
+      }
+      else                      /* nothing in the mask */
+         for(i=0; i<3; i++) {
+            clip_lo[i] = 1.0;
+            clip_hi[i] = 0.0;
+         }
+   }
+
+   if (use_threshold) {
+      if (get_voxel_bounding_box(d2, threshold, lo, hi)) {
+         for(i=0; i<3; i++) {
+            clip_lo[i] = MAX(clip_lo[i], lo[i] - 1.0);
+            clip_hi[i] = MIN(clip_hi[i], hi[i] + 1.0);
+         }
+      }
+      else
+         for(i=0; i<3; i++) {
+            clip_lo[i] = 1.0;
+            clip_hi[i] = 0.0;
+         }
+   }
+
+   clip_active = TRUE;
+}
+
+void clear_lattice_clip(void)
+{
+   clip_active = FALSE;
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_lattice_clip_range
+@INPUT      : trans - voxel-to-voxel transform of the objective function
+              row   - voxel position (in volume 1) of the first node of a row
+              col_step - voxel step between nodes of the row
+              count - number of nodes in the row
+@OUTPUT     : first, last - range of nodes (inclusive) that may map into
+                 the clip box.  first > last if none can.
+@RETURNS    : 
+@DESCRIPTION: a row maps to a straight line in volume 2, so the range is
+              found by intersecting, for each axis, the interval of node
+              indices that falls between clip_lo and clip_hi.  The box is
+              grown by half a source voxel mapped through trans, to allow
+              for objective functions that round the node to the nearest
+              source voxel before mapping it.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void get_lattice_clip_range(VIO_Transform *trans, 
+                            PointR *row, VectorR *col_step, int count,
+                            int *first, int *last)
+{
+   int k;
+   VIO_Real q0[3], dq[3], margin, lo, hi, t0, t1, c_min, c_max;
+
+   *first = 0;
+   *last  = count-1;
+
+   if (!clip_active)
+      return;
+
+   c_min = 0.0;
+   c_max = (VIO_Real)(count-1);
+
+   for(k=0; k<3; k++) {
+      q0[k] = Transform_elem(*trans,k,0) * Point_x(*row) +
+              Transform_elem(*trans,k,1) * Point_y(*row) +
+              Transform_elem(*trans,k,2) * Point_z(*row) +
+              Transform_elem(*trans,k,3);
+      dq[k] = Transform_elem(*trans,k,0) * Point_x(*col_step) +
+              Transform_elem(*trans,k,1) * Point_y(*col_step) +
+              Transform_elem(*trans,k,2) * Point_z(*col_step);
+      margin = 0.5 * (fabs(Transform_elem(*trans,k,0)) +
+                      fabs(Transform_elem(*trans,k,1)) +
+                      fabs(Transform_elem(*trans,k,2))) + 1.0e-6;
+
+      lo = clip_lo[k] - margin;
+      hi = clip_hi[k] + margin;
+
+      if (fabs(dq[k]) < 1.0e-12) {
+         if (q0[k] < lo || q0[k] > hi) {
+            *first = 0;
+            *last  = -1;
+            return;
+         }
+      }
+      else {
+         t0 = (lo - q0[k]) / dq[k];
+         t1 = (hi - q0[k]) / dq[k];
+         if (t0 > t1) { VIO_Real tmp = t0; t0 = t1; t1 = tmp; }
+         if (t0 > c_min) c_min = t0;
+         if (t1 < c_max) c_max = t1;
+      }
+   }
+
+   if (c_min > c_max) {
+      *first = 0;
+      *last  = -1;
+   }
+   else {
+      *first = (int)floor(c_min);
+      *last  = (int)ceil(c_max);
+      if (*first < 0)       *first = 0;
+      if (*last  > count-1) *last  = count-1;
+   }
+}
@@ -0,0 +1,474 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : warp_cache.c
+@DESCRIPTION: a packed, incrementally updated evaluator for the
+              super-sampled deformation field used when building the
+              target sub-lattice in do_nonlinear.c.
+
+  these include:
+     init_warp_cache() -       set up geometry, interpolation taps and the
+                               (optional) affine form of the linear part
+     update_warp_cache() -     re-sample only the tiles of the super-sampled
+                               field whose coarse nodes have changed
+     warp_cache_map_points() - map a list of source sub-lattice points
+                               through linear part + cached warp
+     delete_warp_cache() -     free everything
+
+  The super-sampled field has a node at every half coarse step, so
+  that super node 2c coincides with coarse node c along each axis.
+  Odd super nodes are interpolated with the same 4-point cubic
+  (-1,9,9,-1)/16 used by interpolate_super_sampled_data_by2(), falling
+  back to a linear average on the first and last interval.  Here the
+  1D filter is applied separably (tensor product) which lets us
+  recompute any super node on its own, and so regenerate only the
+  tiles touched by a changed coarse node: coarse node c feeds super
+  nodes 2c-3 .. 2c+3 along each axis.
+
+  The displacements are stored as floats, xyz interleaved, with x
+  varying fastest, so that a lookup touches a single cache line per
+  corner instead of going through GET_VALUE_4D for each component.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "minctracc_point_vector.h"
+#include "warp_cache.h"
+
+                                /* prototypes called: */
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+
+/* build the 1D interpolation taps for super node s along an axis
+   with n coarse nodes */
+
+static void set_taps(int s, int n, int *first, int *n_taps, float w[])
+{
+  int c;
+
+  w[0] = w[1] = w[2] = w[3] = 0.0;
+
+  if (n == 1 || (s % 2) == 0) {    /* coincides with a coarse node */
+    *first  = s/2;
+    *n_taps = 1;
+    w[0]    = 1.0;
+    return;
+  }
+
+  c = (s-1)/2;                       /* between coarse nodes c and c+1 */
+
+  if (c-1 >= 0 && c+2 <= n-1) {
+    *first  = c-1;
+    *n_taps = 4;
+    w[0] = -1.0/16.0; w[1] = 9.0/16.0; w[2] = 9.0/16.0; w[3] = -1.0/16.0;
+  }
+  else {                             /* linear interp at the ends */
+    *first  = c;
+    *n_taps = 2;
+    w[0] = 0.5; w[1] = 0.5;
+  }
+}
+
+/* get the affine map that takes world coordinates to super-sampled
+   voxel coordinates (in XYZ order) by probing convert_world_to_voxel()
+   on the coarse volume: super voxel = 2 * coarse voxel */
+
+static void get_world_to_super_voxel(Warp_Cache *cache)
+{
+  int      i,j;
+  VIO_Real v0[VIO_MAX_DIMENSIONS], v[VIO_MAX_DIMENSIONS];
+  VIO_Real w[3];
+
+  convert_world_to_voxel(cache->coarse_vol, 0.0, 0.0, 0.0, v0);
+
+  for(i=0; i<3; i++) {
+    cache->world_to_voxel[i][3] = (cache->coarse_count[i] > 1) ?
+      2.0 * v0[ cache->coarse_xyzv[i] ] : v0[ cache->coarse_xyzv[i] ];
+  }
+
+  for(j=0; j<3; j++) {
+    w[0] = w[1] = w[2] = 0.0;
+    w[j] = 1.0;
+    convert_world_to_voxel(cache->coarse_vol, w[0], w[1], w[2], v);
+    for(i=0; i<3; i++) {
+      cache->world_to_voxel[i][j] = v[ cache->coarse_xyzv[i] ] - v0[ cache->coarse_xyzv[i] ];
+      if (cache->coarse_count[i] > 1)
+        cache->world_to_voxel[i][j] *= 2.0;
+    }
+  }
+}
+
+/* if the linear part is made only of LINEAR transforms, store it as a
+   3x4 matrix so that it need not be re-evaluated through
+   general_transform_point() for every sub-lattice node */
+
+static void get_affine_linear_part(Warp_Cache *cache)
+{
+  int      i,j,n;
+  VIO_Real x0,y0,z0, x,y,z;
+  VIO_General_transform *lin;
+
+  lin = cache->linear_transform;
+  cache->linear_is_affine = FALSE;
+
+  if (get_transform_type(lin) == LINEAR)
+    cache->linear_is_affine = TRUE;
+  else if (get_transform_type(lin) == CONCATENATED_TRANSFORM) {
+    cache->linear_is_affine = TRUE;
+    n = get_n_concated_transforms(lin);
+    for(i=0; i<n; i++)
+      if (get_transform_type(get_nth_general_transform(lin,i)) != LINEAR)
+        cache->linear_is_affine = FALSE;
+  }
+
+  if (!cache->linear_is_affine)
+    return;
+
+  general_transform_point(lin, 0.0, 0.0, 0.0, &x0, &y0, &z0);
+  cache->linear[0][3] = x0;
+  cache->linear[1][3] = y0;
+  cache->linear[2][3] = z0;
+
+  for(j=0; j<3; j++) {
+    general_transform_point(lin,
+                            (j==0) ? 1.0 : 0.0,
+                            (j==1) ? 1.0 : 0.0,
+                            (j==2) ? 1.0 : 0.0,
+                            &x, &y, &z);
+    cache->linear[0][j] = x - x0;
+    cache->linear[1][j] = y - y0;
+    cache->linear[2][j] = z - z0;
+  }
+}
+
+VIO_BOOL init_warp_cache(Warp_Cache *cache,
+                         VIO_General_transform *warp,
+                         VIO_General_transform *linear_part,
+                         int interpolation)
+{
+  int  i,s,sizes[VIO_MAX_DIMENSIONS];
+  long n_super, n_coarse;
+
+  if (warp->type != GRID_TRANSFORM) {
+    print_error_and_line_num("init_warp_cache not called with GRID_TRANSFORM",
+                             __FILE__, __LINE__);
+    return(FALSE);
+  }
+
+  cache->coarse_vol       = warp->displacement_volume;
+  cache->linear_transform = linear_part;
+  cache->interpolation    = interpolation;
+  cache->initialized      = FALSE;
+  cache->tiles_updated    = 0;
+
+  get_volume_sizes(       cache->coarse_vol, sizes);
+  get_volume_XYZV_indices(cache->coarse_vol, cache->coarse_xyzv);
+
+  cache->total_tiles = 1;
+  for(i=0; i<3; i++) {
+    cache->coarse_count[i] = sizes[ cache->coarse_xyzv[i] ];
+    cache->count[i] = (cache->coarse_count[i] > 1) ? 2*cache->coarse_count[i]-1 : 1;
+    cache->tile_count[i] = (cache->count[i] + WARP_CACHE_TILE_SIZE - 1) / WARP_CACHE_TILE_SIZE;
+    cache->total_tiles *= cache->tile_count[i];
+  }
+
+  n_coarse = (long)cache->coarse_count[0] * cache->coarse_count[1] * cache->coarse_count[2];
+  n_super  = (long)cache->count[0] * cache->count[1] * cache->count[2];
+
+  ALLOC(cache->coarse, 3*n_coarse);
+  ALLOC(cache->disp,   3*n_super);
+  ALLOC(cache->dirty,  cache->total_tiles);
+
+  for(i=0; i<3; i++) {
+    ALLOC(cache->first_tap[i],   cache->count[i]);
+    ALLOC(cache->n_taps[i],      cache->count[i]);
+    ALLOC(cache->tap_weights[i], 4*cache->count[i]);
+    for(s=0; s<cache->count[i]; s++)
+      set_taps(s, cache->coarse_count[i],
+               &cache->first_tap[i][s], &cache->n_taps[i][s],
+               &cache->tap_weights[i][4*s]);
+  }
+
+  get_world_to_super_voxel(cache);
+  get_affine_linear_part(cache);
+
+  return(TRUE);
+}
+
+/* read the coarse warp into the packed snapshot, and flag every tile
+   that depends on a node that has moved by more than
+   WARP_CACHE_TOLERANCE since it was last stored */
+
+static void mark_dirty_tiles(Warp_Cache *cache)
+{
+  int
+    i,k,t,
+    c[3], lo[3], hi[3], tile[3],
+    index[VIO_MAX_DIMENSIONS];
+  float
+    *p;
+  VIO_Real
+    value[3];
+  VIO_BOOL
+    changed;
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i] = 0;
+
+  for(c[2]=0; c[2]<cache->coarse_count[2]; c[2]++) {
+    for(c[1]=0; c[1]<cache->coarse_count[1]; c[1]++) {
+      for(c[0]=0; c[0]<cache->coarse_count[0]; c[0]++) {
+
+        for(i=0; i<3; i++)
+          index[ cache->coarse_xyzv[i] ] = c[i];
+
+        for(k=0; k<3; k++) {
+          index[ cache->coarse_xyzv[VIO_Z+1] ] = k;
+          GET_VALUE_4D(value[k], cache->coarse_vol,
+                       index[0], index[1], index[2], index[3]);
+        }
+
+        p = &cache->coarse[ 3*(((long)c[2]*cache->coarse_count[1] + c[1])*cache->coarse_count[0] + c[0]) ];
+
+        changed = !cache->initialized;
+        for(k=0; k<3; k++)
+          if (fabs(value[k] - p[k]) > WARP_CACHE_TOLERANCE)
+            changed = TRUE;
+
+        if (!changed)
+          continue;
+
+        for(k=0; k<3; k++)
+          p[k] = (float)value[k];
+
+        for(i=0; i<3; i++) {         /* super nodes fed by this coarse node */
+          lo[i] = MAX(0, 2*c[i]-3);
+          hi[i] = MIN(cache->count[i]-1, 2*c[i]+3);
+          lo[i] /= WARP_CACHE_TILE_SIZE;
+          hi[i] /= WARP_CACHE_TILE_SIZE;
+        }
+
+        for(tile[2]=lo[2]; tile[2]<=hi[2]; tile[2]++)
+          for(tile[1]=lo[1]; tile[1]<=hi[1]; tile[1]++)
+            for(tile[0]=lo[0]; tile[0]<=hi[0]; tile[0]++) {
+              t = (tile[2]*cache->tile_count[1] + tile[1])*cache->tile_count[0] + tile[0];
+              cache->dirty[t] = TRUE;
+            }
+      }
+    }
+  }
+}
+
+/* recompute all super-sampled nodes within one tile */
+
+static void regenerate_tile(Warp_Cache *cache, int tx, int ty, int tz)
+{
+  int
+    s[3], s_lo[3], s_hi[3],
+    a,b,c, cx,cy,cz;
+  float
+    wz,wyz,w, sum[3],
+    *p, *d;
+  long
+    nx, nxy;
+
+  s_lo[0] = tx*WARP_CACHE_TILE_SIZE;
+  s_lo[1] = ty*WARP_CACHE_TILE_SIZE;
+  s_lo[2] = tz*WARP_CACHE_TILE_SIZE;
+  for(a=0; a<3; a++)
+    s_hi[a] = MIN(cache->count[a], s_lo[a] + WARP_CACHE_TILE_SIZE);
+
+  nx  = cache->coarse_count[0];
+  nxy = nx * cache->coarse_count[1];
+
+  for(s[2]=s_lo[2]; s[2]<s_hi[2]; s[2]++) {
+    for(s[1]=s_lo[1]; s[1]<s_hi[1]; s[1]++) {
+      for(s[0]=s_lo[0]; s[0]<s_hi[0]; s[0]++) {
+
+        sum[0] = sum[1] = sum[2] = 0.0;
+
+        for(c=0; c<cache->n_taps[2][s[2]]; c++) {
+          cz = cache->first_tap[2][s[2]] + c;
+          wz = cache->tap_weights[2][4*s[2]+c];
+
+          for(b=0; b<cache->n_taps[1][s[1]]; b++) {
+            cy  = cache->first_tap[1][s[1]] + b;
+            wyz = wz * cache->tap_weights[1][4*s[1]+b];
+
+            for(a=0; a<cache->n_taps[0][s[0]]; a++) {
+              cx = cache->first_tap[0][s[0]] + a;
+              w  = wyz * cache->tap_weights[0][4*s[0]+a];
+              p  = &cache->coarse[ 3*(cz*nxy + cy*nx + cx) ];
+              sum[0] += w*p[0];
+              sum[1] += w*p[1];
+              sum[2] += w*p[2];
+            }
+          }
+        }
+
+        d = &cache->disp[ 3*(((long)s[2]*cache->count[1] + s[1])*cache->count[0] + s[0]) ];
+        d[0] = sum[0];
+        d[1] = sum[1];
+        d[2] = sum[2];
+      }
+    }
+  }
+}
+
+/* bring the packed super-sampled field up to date with the coarse
+   warp.  Returns the number of tiles that were regenerated. */
+
+long update_warp_cache(Warp_Cache *cache)
+{
+  int  tx,ty,tz;
+  long t;
+
+  for(t=0; t<cache->total_tiles; t++)
+    cache->dirty[t] = FALSE;
+
+  mark_dirty_tiles(cache);
+
+  cache->tiles_updated = 0;
+  t = 0;
+  for(tz=0; tz<cache->tile_count[2]; tz++)
+    for(ty=0; ty<cache->tile_count[1]; ty++)
+      for(tx=0; tx<cache->tile_count[0]; tx++, t++)
+        if (cache->dirty[t]) {
+          regenerate_tile(cache, tx, ty, tz);
+          cache->tiles_updated++;
+        }
+
+  cache->initialized = TRUE;
+
+  return(cache->tiles_updated);
+}
+
+/* get the base index and fraction along one axis of the super-sampled
+   field.  Returns FALSE if v is outside [-0.5, count-0.5), i.e. the
+   region covered by the nearest neighbour lookup of
+   build_target_lattice_using_super_sampled_def(). */
+
+static VIO_BOOL axis_position(VIO_Real v, int count, int *i0, float *f)
+{
+  if (v < -0.5 || v >= count-0.5)
+    return(FALSE);
+
+  if (count == 1) {
+    *i0 = 0; *f = 0.0;
+  }
+  else if (v <= 0.0) {
+    *i0 = 0; *f = 0.0;
+  }
+  else if (v >= count-1) {
+    *i0 = count-2; *f = 1.0;
+  }
+  else {
+    *i0 = (int)v;
+    *f  = (float)(v - *i0);
+  }
+  return(TRUE);
+}
+
+/* map the source sub-lattice points (px,py,pz)[1..len] through the
+   linear part and the cached warp, returning the target points in
+   (tx,ty,tz)[1..len].  All coordinates are world coordinates. */
+
+void warp_cache_map_points(Warp_Cache *cache,
+                           float px[], float py[], float pz[],
+                           float tx[], float ty[], float tz[],
+                           int len)
+{
+  int
+    i,k, idx[3];
+  VIO_Real
+    x,y,z, v[3];
+  float
+    f[3], *d, *d0, *d1;
+  long
+    off, sx, sy, sz, dx, dy, dz;
+
+  sx = 3;
+  sy = 3L * cache->count[0];
+  sz = sy * cache->count[1];
+
+  for(i=1; i<=len; i++) {
+
+                                /* apply linear part of the transformation */
+    if (cache->linear_is_affine) {
+      x = cache->linear[0][0]*px[i] + cache->linear[0][1]*py[i] + cache->linear[0][2]*pz[i] + cache->linear[0][3];
+      y = cache->linear[1][0]*px[i] + cache->linear[1][1]*py[i] + cache->linear[1][2]*pz[i] + cache->linear[1][3];
+      z = cache->linear[2][0]*px[i] + cache->linear[2][1]*py[i] + cache->linear[2][2]*pz[i] + cache->linear[2][3];
+    }
+    else
+      general_transform_point(cache->linear_transform,
+                              (VIO_Real)px[i], (VIO_Real)py[i], (VIO_Real)pz[i],
+                              &x, &y, &z);
+
+    for(k=0; k<3; k++)
+      v[k] = cache->world_to_voxel[k][0]*x + cache->world_to_voxel[k][1]*y +
+             cache->world_to_voxel[k][2]*z + cache->world_to_voxel[k][3];
+
+    if (cache->interpolation == WARP_CACHE_TRILINEAR) {
+
+      if (axis_position(v[0], cache->count[0], &idx[0], &f[0]) &&
+          axis_position(v[1], cache->count[1], &idx[1], &f[1]) &&
+          axis_position(v[2], cache->count[2], &idx[2], &f[2])) {
+
+        off = idx[2]*sz + idx[1]*sy + idx[0]*sx;
+        dx  = (cache->count[0] > 1) ? sx : 0;
+        dy  = (cache->count[1] > 1) ? sy : 0;
+        dz  = (cache->count[2] > 1) ? sz : 0;
+
+        for(k=0; k<3; k++) {
+          d0 = &cache->disp[off + k];
+          d1 = d0 + dz;
+          v[k] =
+            (1-f[2])*( (1-f[1])*((1-f[0])*d0[0]  + f[0]*d0[dx]) +
+                          f[1] *((1-f[0])*d0[dy] + f[0]*d0[dy+dx]) ) +
+               f[2] *( (1-f[1])*((1-f[0])*d1[0]  + f[0]*d1[dx]) +
+                          f[1] *((1-f[0])*d1[dy] + f[0]*d1[dy+dx]) );
+        }
+
+        x += v[0];
+        y += v[1];
+        z += v[2];
+      }
+    }
+    else {
+                                /* nearest neighbour */
+      if (v[0] >= -0.5 && v[0] < cache->count[0]-0.5 &&
+          v[1] >= -0.5 && v[1] < cache->count[1]-0.5 &&
+          v[2] >= -0.5 && v[2] < cache->count[2]-0.5) {
+
+        for(k=0; k<3; k++) idx[k] = (int)(v[k]+0.5);
+
+        d = &cache->disp[ idx[2]*sz + idx[1]*sy + idx[0]*sx ];
+        x += d[0];
+        y += d[1];
+        z += d[2];
+      }
+    }
+
+    tx[i] = (float)x;
+    ty[i] = (float)y;
+    tz[i] = (float)z;
+  }
+}
+
+void delete_warp_cache(Warp_Cache *cache)
+{
+  int i;
+
+  for(i=0; i<3; i++) {
+    FREE(cache->first_tap[i]);
+    FREE(cache->n_taps[i]);
+    FREE(cache->tap_weights[i]);
+  }
+  FREE(cache->coarse);
+  FREE(cache->disp);
+  FREE(cache->dirty);
+}
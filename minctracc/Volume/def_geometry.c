@@ -0,0 +1,524 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : def_geometry.c
+@DESCRIPTION: local geometry of a deformation field, for def_to_mag and
+              def_to_scale.
+
+  these include:
+     init_def_geometry() -    pack the displacement volume of the
+                              GRID_TRANSFORM of a transformation into
+                              float arrays, and collect the linear
+                              transformations concatenated around it
+     compute_def_geometry() - fill any of the DEF_MAP_* maps, visiting
+                              every node once, in a pool of worker
+                              processes
+     delete_def_geometry() -  free the packed field
+
+  For a transformation  T = post o G o pre,  where G(p) = p + d(p) is
+  the grid transform, the values at grid node p are those of T at the
+  point  x = pre^-1(p), so that
+
+     magnitude  = | post(p + d(p)) - x |
+     Jacobian   = post * (I + grad d(p)) * pre   (linear parts only)
+
+  grad d is estimated with central differences on the nodes (one-sided
+  on the border of the grid).  The principal strains are the
+  eigenvalues of the Green-Lagrange strain  E = (F'F - I)/2  of the
+  Jacobian F above.  The local scale is the mean, over the 6
+  neighbours of a node, of the ratio of their distance after and
+  before the transformation.
+
+  Every node only reads the packed field, so the slices along X are
+  independent: with n_jobs > 1, worker w computes the slices w,
+  w+n_jobs, ... and sends the part of each map that covers a slice
+  back through a pipe as soon as it is done.  Slices whose worker could
+  not be started, or failed, are computed by the parent.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "def_geometry.h"
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_TYPES_H)
+#define  DEF_GEOMETRY_CAN_FORK
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+
+/* c = a o b, for 3x4 affine matrices */
+
+static void compose_affine(VIO_Real a[][4], VIO_Real b[][4], VIO_Real c[][4])
+{
+  VIO_Real
+    t[VIO_N_DIMENSIONS][4];
+  int
+    i,j;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    for(j=0; j<4; j++)
+      t[i][j] = a[i][0]*b[0][j] + a[i][1]*b[1][j] + a[i][2]*b[2][j];
+    t[i][3] += a[i][3];
+  }
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    for(j=0; j<4; j++)
+      c[i][j] = t[i][j];
+}
+
+static void identity_affine(VIO_Real a[][4])
+{
+  int i,j;
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    for(j=0; j<4; j++)
+      a[i][j] = (i==j) ? 1.0 : 0.0;
+}
+
+static void transform_to_affine(VIO_Transform *t, VIO_Real a[][4])
+{
+  int i,j;
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    for(j=0; j<4; j++)
+      a[i][j] = Transform_elem(*t, i, j);
+}
+
+static void apply_affine(VIO_Real a[][4], VIO_Real p[], VIO_Real q[])
+{
+  int i;
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    q[i] = a[i][0]*p[0] + a[i][1]*p[1] + a[i][2]*p[2] + a[i][3];
+}
+
+/* linear part only, for vectors */
+
+static void apply_linear(VIO_Real a[][4], VIO_Real p[], VIO_Real q[])
+{
+  int i;
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    q[i] = a[i][0]*p[0] + a[i][1]*p[1] + a[i][2]*p[2];
+}
+
+/* eigenvalues of the symmetric matrix m, largest first */
+
+static void symmetric_eigenvalues(VIO_Real m[][VIO_N_DIMENSIONS], VIO_Real ev[])
+{
+  VIO_Real
+    p1, p2, p, q, r, phi, t,
+    b[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS];
+  int
+    i,j;
+
+  p1 = m[0][1]*m[0][1] + m[0][2]*m[0][2] + m[1][2]*m[1][2];
+  if (p1 == 0.0) {
+    for(i=0; i<VIO_N_DIMENSIONS; i++) ev[i] = m[i][i];
+  }
+  else {
+    q  = (m[0][0] + m[1][1] + m[2][2]) / 3.0;
+    p2 = (m[0][0]-q)*(m[0][0]-q) + (m[1][1]-q)*(m[1][1]-q) +
+         (m[2][2]-q)*(m[2][2]-q) + 2.0*p1;
+    p  = sqrt(p2 / 6.0);
+    for(i=0; i<VIO_N_DIMENSIONS; i++)
+      for(j=0; j<VIO_N_DIMENSIONS; j++)
+        b[i][j] = (m[i][j] - ((i==j) ? q : 0.0)) / p;
+    r = ( b[0][0]*(b[1][1]*b[2][2] - b[1][2]*b[2][1])
+        - b[0][1]*(b[1][0]*b[2][2] - b[1][2]*b[2][0])
+        + b[0][2]*(b[1][0]*b[2][1] - b[1][1]*b[2][0]) ) / 2.0;
+    if (r < -1.0) r = -1.0;
+    if (r >  1.0) r =  1.0;
+    phi = acos(r) / 3.0;
+    ev[0] = q + 2.0*p*cos(phi);
+    ev[2] = q + 2.0*p*cos(phi + 2.0*VIO_PI/3.0);
+    ev[1] = 3.0*q - ev[0] - ev[2];
+  }
+                                /* sort, largest first */
+  for(i=0; i<VIO_N_DIMENSIONS-1; i++)
+    for(j=i+1; j<VIO_N_DIMENSIONS; j++)
+      if (ev[j] > ev[i]) { t = ev[i]; ev[i] = ev[j]; ev[j] = t; }
+}
+
+
+VIO_BOOL init_def_geometry(VIO_General_transform *trans,
+                           VIO_BOOL include_linear,
+                           Def_Geometry *geom)
+{
+  VIO_General_transform
+    *t, *grid;
+  VIO_Volume
+    volume;
+  VIO_Real
+    m[VIO_N_DIMENSIONS][4],
+    voxel0[VIO_MAX_DIMENSIONS],
+    voxel[VIO_MAX_DIMENSIONS],
+    world[VIO_N_DIMENSIONS];
+  int
+    i,j,c,
+    xyzv[VIO_MAX_DIMENSIONS],
+    sizes[VIO_MAX_DIMENSIONS],
+    index[VIO_MAX_DIMENSIONS];
+  long
+    n;
+
+  identity_affine(geom->pre);
+  identity_affine(geom->pre_inverse);
+  identity_affine(geom->post);
+  geom->n_folded = 0;
+  for(c=0; c<VIO_N_DIMENSIONS; c++)
+    geom->d[c] = NULL;
+
+  grid = (VIO_General_transform *)NULL;
+  for(i=0; i<get_n_concated_transforms(trans); i++) {
+    t = get_nth_general_transform(trans, i);
+
+    switch (get_transform_type(t)) {
+    case GRID_TRANSFORM:
+      if (grid != (VIO_General_transform *)NULL) {
+        print_error_and_line_num("only one GRID_TRANSFORM is supported", __FILE__, __LINE__);
+        return(FALSE);
+      }
+      if (t->inverse_flag) {
+        print_error_and_line_num("cannot use an inverted GRID_TRANSFORM", __FILE__, __LINE__);
+        return(FALSE);
+      }
+      grid = t;
+      break;
+    case LINEAR:
+      if (!include_linear)
+        break;
+                                /* get_linear_transform_ptr() already
+                                   accounts for the inverse flag */
+      transform_to_affine(get_linear_transform_ptr(t), m);
+      if (grid == (VIO_General_transform *)NULL) {
+        compose_affine(m, geom->pre, geom->pre);
+        transform_to_affine(get_inverse_linear_transform_ptr(t), m);
+        compose_affine(geom->pre_inverse, m, geom->pre_inverse);
+      }
+      else
+        compose_affine(m, geom->post, geom->post);
+      break;
+    default:
+      print_error_and_line_num("only LINEAR and GRID_TRANSFORMs are supported", __FILE__, __LINE__);
+      return(FALSE);
+    }
+  }
+
+  if (grid == (VIO_General_transform *)NULL) {
+    print_error_and_line_num("transformation has no GRID_TRANSFORM", __FILE__, __LINE__);
+    return(FALSE);
+  }
+
+  volume = grid->displacement_volume;
+  get_volume_XYZV_indices(volume, xyzv);
+  get_volume_sizes(volume, sizes);
+
+  if (get_volume_n_dimensions(volume) != 4 || xyzv[VIO_Z+1] < 0) {
+    print_error_and_line_num("displacement volume is not 3D", __FILE__, __LINE__);
+    return(FALSE);
+  }
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    if (xyzv[i] < 0 || sizes[xyzv[i]] < 1) {
+      print_error_and_line_num("displacement volume is not 3D", __FILE__, __LINE__);
+      return(FALSE);
+    }
+    geom->n[i] = sizes[xyzv[i]];
+  }
+
+                                /* node positions: voxel_to_world is
+                                   affine, world_to_voxel only needed
+                                   for gradients, so no offset */
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel0[i] = 0.0;
+  convert_voxel_to_world(volume, voxel0, &world[VIO_X], &world[VIO_Y], &world[VIO_Z]);
+  for(i=VIO_X; i<=VIO_Z; i++)
+    geom->voxel_to_world[i][3] = world[i];
+  for(j=VIO_X; j<=VIO_Z; j++) {
+    for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i] = 0.0;
+    voxel[xyzv[j]] = 1.0;
+    convert_voxel_to_world(volume, voxel, &world[VIO_X], &world[VIO_Y], &world[VIO_Z]);
+    for(i=VIO_X; i<=VIO_Z; i++)
+      geom->voxel_to_world[i][j] = world[i] - geom->voxel_to_world[i][3];
+  }
+
+  convert_world_to_voxel(volume, 0.0, 0.0, 0.0, voxel0);
+  for(j=VIO_X; j<=VIO_Z; j++) {
+    for(i=VIO_X; i<=VIO_Z; i++) world[i] = (i==j) ? 1.0 : 0.0;
+    convert_world_to_voxel(volume, world[VIO_X], world[VIO_Y], world[VIO_Z], voxel);
+    for(i=VIO_X; i<=VIO_Z; i++)
+      geom->world_to_voxel[i][j] = voxel[xyzv[i]] - voxel0[xyzv[i]];
+  }
+
+                                /* pack the displacements */
+  n = (long)geom->n[VIO_X] * geom->n[VIO_Y] * geom->n[VIO_Z];
+  for(c=VIO_X; c<=VIO_Z; c++)
+    ALLOC(geom->d[c], n);
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i] = 0;
+  for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<geom->n[VIO_X]; index[xyzv[VIO_X]]++)
+    for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<geom->n[VIO_Y]; index[xyzv[VIO_Y]]++)
+      for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<geom->n[VIO_Z]; index[xyzv[VIO_Z]]++) {
+        n = DEF_GEOMETRY_INDEX(geom, index[xyzv[VIO_X]], index[xyzv[VIO_Y]], index[xyzv[VIO_Z]]);
+        for(c=VIO_X; c<=VIO_Z; c++) {
+          index[xyzv[VIO_Z+1]] = c;
+          geom->d[c][n] = (float)get_volume_real_value(volume,
+                                     index[0],index[1],index[2],index[3],index[4]);
+        }
+        index[xyzv[VIO_Z+1]] = 0;
+      }
+
+  return(TRUE);
+}
+
+
+/* fill the maps at the nodes of the given slice along X; returns the
+   number of those nodes where the transformation folds */
+
+static long compute_def_geometry_slice(Def_Geometry *geom, float *maps[], int slice)
+{
+  VIO_Real
+    grad[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS],  /* d d_c / d voxel_a  */
+    g[VIO_N_DIMENSIONS][4],                    /* I + grad d, world  */
+    f[VIO_N_DIMENSIONS][4],                    /* full Jacobian      */
+    e[VIO_N_DIMENSIONS][VIO_N_DIMENSIONS],
+    ev[VIO_N_DIMENSIONS],
+    p[VIO_N_DIMENSIONS], q[VIO_N_DIMENSIONS], x[VIO_N_DIMENSIONS],
+    dp[VIO_N_DIMENSIONS], before[VIO_N_DIMENSIONS], after[VIO_N_DIMENSIONS],
+    det, h, len, sum;
+  int
+    i,j,a,c,
+    node[VIO_N_DIMENSIONS],
+    lo, hi, count;
+  long
+    n, n_lo, n_hi, n_folded,
+    stride[VIO_N_DIMENSIONS];
+  VIO_BOOL
+    need_jacobian, need_strain;
+
+  need_strain   = (maps[DEF_MAP_STRAIN_MAX] != NULL ||
+                   maps[DEF_MAP_STRAIN_MID] != NULL ||
+                   maps[DEF_MAP_STRAIN_MIN] != NULL);
+  need_jacobian = (need_strain ||
+                   maps[DEF_MAP_JACOBIAN] != NULL ||
+                   maps[DEF_MAP_LOG_JACOBIAN] != NULL);
+
+  stride[VIO_X] = (long)geom->n[VIO_Y] * geom->n[VIO_Z];
+  stride[VIO_Y] = geom->n[VIO_Z];
+  stride[VIO_Z] = 1;
+
+  n_folded = 0;
+
+  node[VIO_X] = slice;
+  for(node[VIO_Y]=0; node[VIO_Y]<geom->n[VIO_Y]; node[VIO_Y]++)
+    for(node[VIO_Z]=0; node[VIO_Z]<geom->n[VIO_Z]; node[VIO_Z]++) {
+
+      n = DEF_GEOMETRY_INDEX(geom, node[VIO_X], node[VIO_Y], node[VIO_Z]);
+
+      if (maps[DEF_MAP_MAGNITUDE] != NULL) {
+        for(i=0; i<VIO_N_DIMENSIONS; i++) x[i] = (VIO_Real)node[i];
+        apply_affine(geom->voxel_to_world, x, p);
+        for(i=0; i<VIO_N_DIMENSIONS; i++) x[i] = p[i] + geom->d[i][n];
+        apply_affine(geom->post, x, q);
+        apply_affine(geom->pre_inverse, p, x);
+        maps[DEF_MAP_MAGNITUDE][n] = (float)sqrt((q[0]-x[0])*(q[0]-x[0]) +
+                                                 (q[1]-x[1])*(q[1]-x[1]) +
+                                                 (q[2]-x[2])*(q[2]-x[2]));
+      }
+
+      if (need_jacobian) {
+                                /* central differences, one-sided on
+                                   the border, zero along a flat axis */
+        for(a=0; a<VIO_N_DIMENSIONS; a++) {
+          lo = (node[a] > 0)               ? node[a]-1 : node[a];
+          hi = (node[a] < geom->n[a]-1)    ? node[a]+1 : node[a];
+          n_lo = n + (lo - node[a]) * stride[a];
+          n_hi = n + (hi - node[a]) * stride[a];
+          h = (VIO_Real)(hi - lo);
+          for(c=0; c<VIO_N_DIMENSIONS; c++)
+            grad[c][a] = (h > 0.0) ? (geom->d[c][n_hi] - geom->d[c][n_lo]) / h : 0.0;
+        }
+        for(c=0; c<VIO_N_DIMENSIONS; c++) {
+          for(j=0; j<VIO_N_DIMENSIONS; j++)
+            g[c][j] = ((c==j) ? 1.0 : 0.0) +
+              grad[c][0]*geom->world_to_voxel[0][j] +
+              grad[c][1]*geom->world_to_voxel[1][j] +
+              grad[c][2]*geom->world_to_voxel[2][j];
+          g[c][3] = 0.0;
+        }
+        compose_affine(g, geom->pre, f);
+        compose_affine(geom->post, f, f);
+
+        det = f[0][0]*(f[1][1]*f[2][2] - f[1][2]*f[2][1])
+            - f[0][1]*(f[1][0]*f[2][2] - f[1][2]*f[2][0])
+            + f[0][2]*(f[1][0]*f[2][1] - f[1][1]*f[2][0]);
+        if (det <= 0.0)
+          n_folded++;
+
+        if (maps[DEF_MAP_JACOBIAN] != NULL)
+          maps[DEF_MAP_JACOBIAN][n] = (float)det;
+        if (maps[DEF_MAP_LOG_JACOBIAN] != NULL)
+          maps[DEF_MAP_LOG_JACOBIAN][n] =
+            (float)log( (det > DEF_GEOMETRY_MIN_JACOBIAN) ? det : DEF_GEOMETRY_MIN_JACOBIAN );
+
+        if (need_strain) {
+          for(i=0; i<VIO_N_DIMENSIONS; i++)
+            for(j=0; j<VIO_N_DIMENSIONS; j++)
+              e[i][j] = 0.5 * ( f[0][i]*f[0][j] + f[1][i]*f[1][j] + f[2][i]*f[2][j]
+                                - ((i==j) ? 1.0 : 0.0) );
+          symmetric_eigenvalues(e, ev);
+          if (maps[DEF_MAP_STRAIN_MAX] != NULL) maps[DEF_MAP_STRAIN_MAX][n] = (float)ev[0];
+          if (maps[DEF_MAP_STRAIN_MID] != NULL) maps[DEF_MAP_STRAIN_MID][n] = (float)ev[1];
+          if (maps[DEF_MAP_STRAIN_MIN] != NULL) maps[DEF_MAP_STRAIN_MIN][n] = (float)ev[2];
+        }
+      }
+
+      if (maps[DEF_MAP_SCALE] != NULL) {
+        sum = 0.0;
+        count = 0;
+        for(a=0; a<VIO_N_DIMENSIONS; a++)
+          for(lo=-1; lo<=1; lo+=2) {
+            if (node[a]+lo < 0 || node[a]+lo >= geom->n[a])
+              continue;
+            n_lo = n + lo * stride[a];
+            for(i=0; i<VIO_N_DIMENSIONS; i++)
+              dp[i] = lo * geom->voxel_to_world[i][a];
+            apply_linear(geom->pre_inverse, dp, before);
+            for(i=0; i<VIO_N_DIMENSIONS; i++)
+              x[i] = dp[i] + geom->d[i][n_lo] - geom->d[i][n];
+            apply_linear(geom->post, x, after);
+            len = sqrt(before[0]*before[0] + before[1]*before[1] + before[2]*before[2]);
+            if (len > 0.0) {
+              sum += sqrt(after[0]*after[0] + after[1]*after[1] + after[2]*after[2]) / len;
+              count++;
+            }
+          }
+        maps[DEF_MAP_SCALE][n] = (count > 0) ? (float)(sum / count) : 1.0f;
+      }
+    }
+
+  return(n_folded);
+}
+
+
+#ifdef DEF_GEOMETRY_CAN_FORK
+
+/* send (or receive) the slice x of every map that is computed, after
+   the number of folded nodes in it */
+
+static VIO_BOOL transfer_slice(int fd, float *maps[], long slice_size, int x,
+                               long *n_folded, VIO_BOOL writing)
+{
+  int m;
+
+  if (!transfer_all(fd, (char *)n_folded, sizeof(*n_folded), writing))
+    return(FALSE);
+  for(m=0; m<DEF_MAP_TYPES; m++)
+    if (maps[m] != NULL &&
+        !transfer_all(fd, (char *)&maps[m][x*slice_size],
+                      slice_size*sizeof(float), writing))
+      return(FALSE);
+  return(TRUE);
+}
+
+#endif
+
+
+VIO_BOOL compute_def_geometry(Def_Geometry *geom, float *maps[], int n_jobs)
+{
+  long
+    slice_size, n_folded;
+  int
+    x;
+  VIO_BOOL
+    done;
+#ifdef DEF_GEOMETRY_CAN_FORK
+  int
+    w, *fd, fds[2];
+  pid_t
+    *pid;
+#endif
+
+  slice_size = (long)geom->n[VIO_Y] * geom->n[VIO_Z];
+  geom->n_folded = 0;
+  done = FALSE;
+
+#ifdef DEF_GEOMETRY_CAN_FORK
+  n_jobs = MIN(n_jobs, geom->n[VIO_X]);
+
+  if (n_jobs > 1) {
+    ALLOC(pid, n_jobs);
+    ALLOC(fd,  n_jobs);
+
+    (void) fflush( stdout );    /* or the workers print it again */
+    (void) fflush( stderr );
+
+    for(w=0; w<n_jobs; w++) {
+      pid[w] = -1;
+      fd[w]  = -1;
+      if (pipe(fds) != 0)
+        continue;
+
+      pid[w] = fork();
+      if (pid[w] == 0) {
+        (void) close( fds[0] );
+        for(x=w; x<geom->n[VIO_X]; x+=n_jobs) {
+          n_folded = compute_def_geometry_slice(geom, maps, x);
+          if (!transfer_slice(fds[1], maps, slice_size, x, &n_folded, TRUE))
+            _exit(1);
+        }
+        _exit(0);
+      }
+
+      (void) close( fds[1] );
+      if (pid[w] < 0)
+        (void) close( fds[0] );
+      else
+        fd[w] = fds[0];
+    }
+
+                                /* take the slices in order, each from
+                                   its worker while it is still running */
+    for(x=0; x<geom->n[VIO_X]; x++) {
+      w = x % n_jobs;
+      if (fd[w] >= 0 &&
+          !transfer_slice(fd[w], maps, slice_size, x, &n_folded, FALSE)) {
+        (void) close( fd[w] );
+        fd[w] = -1;
+      }
+      if (fd[w] < 0)
+        n_folded = compute_def_geometry_slice(geom, maps, x);
+      geom->n_folded += n_folded;
+    }
+
+    for(w=0; w<n_jobs; w++) {
+      if (fd[w] >= 0)
+        (void) close( fd[w] );
+      if (pid[w] > 0)
+        (void) waitpid( pid[w], NULL, 0 );
+    }
+
+    FREE(pid);
+    FREE(fd);
+    done = TRUE;
+  }
+#endif
+
+  if (!done)
+    for(x=0; x<geom->n[VIO_X]; x++)
+      geom->n_folded += compute_def_geometry_slice(geom, maps, x);
+
+  return(TRUE);
+}
+
+
+void delete_def_geometry(Def_Geometry *geom)
+{
+  int c;
+  for(c=0; c<VIO_N_DIMENSIONS; c++)
+    if (geom->d[c] != NULL) {
+      FREE(geom->d[c]);
+      geom->d[c] = NULL;
+    }
+}
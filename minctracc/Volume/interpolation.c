@@ -71,6 +71,7 @@ static char rcsid[]="$Header: /static-cvsroot/registration/mni_autoreg/minctracc
 #endif
 
 #include <volume_io.h>
+#include <math.h>
 #include "minctracc_point_vector.h"
 
 #define VOL_NDIMS 3
@@ -219,6 +220,99 @@ int trilinear_interpolant(VIO_Volume volume,
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : trilinear_interpolant_gradient
+@INPUT      : volume - pointer to volume data
+              coord - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated TRUE value.
+              deriv  - derivative of the interpolated value with respect
+                 to each voxel coordinate (in volume index order).
+@RETURNS    : TRUE if coord is within the volume, FALSE otherwise.
+@DESCRIPTION: same as trilinear_interpolant, but also returns the spatial
+              gradient of the trilinear patch at coord.  Outside of the
+              region where the 8 neighbours exist, the nearest neighbour
+              value is returned with a zero gradient.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int trilinear_interpolant_gradient(VIO_Volume volume, 
+                                   PointR *coord, double *result,
+                                   double deriv[])
+{
+  long ind0, ind1, ind2;
+  int sizes[3];
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double v000, v001, v010, v011, v100, v101, v110, v111;
+  double a00, a01, a10, a11;
+  
+  deriv[0] = deriv[1] = deriv[2] = 0.0;
+
+  get_volume_sizes(volume, sizes);
+  
+  if ((Point_x( *coord ) < 0) || (Point_x( *coord ) >= sizes[0]-1) ||
+      (Point_y( *coord ) < 0) || (Point_y( *coord ) >= sizes[1]-1) ||
+      (Point_z( *coord ) < 0) || (Point_z( *coord ) >= sizes[2]-1)) {
+    
+    return( nearest_neighbour_interpolant(volume, coord, result) );
+  }
+    
+  ind0 = (long) floor(Point_x( *coord ));
+  ind1 = (long) floor(Point_y( *coord ));
+  ind2 = (long) floor(Point_z( *coord ));
+  
+  GET_VALUE_3D( v000 ,  volume, ind0  , ind1  , ind2   ); 
+  GET_VALUE_3D( v001 ,  volume, ind0  , ind1  , ind2+1 ); 
+  GET_VALUE_3D( v010 ,  volume, ind0  , ind1+1, ind2   ); 
+  GET_VALUE_3D( v011 ,  volume, ind0  , ind1+1, ind2+1 ); 
+  GET_VALUE_3D( v100 ,  volume, ind0+1, ind1  , ind2   ); 
+  GET_VALUE_3D( v101 ,  volume, ind0+1, ind1  , ind2+1 ); 
+  GET_VALUE_3D( v110 ,  volume, ind0+1, ind1+1, ind2   ); 
+  GET_VALUE_3D( v111 ,  volume, ind0+1, ind1+1, ind2+1 ); 
+
+  f0 = Point_x( *coord ) - ind0;
+  f1 = Point_y( *coord ) - ind1;
+  f2 = Point_z( *coord ) - ind2;
+  r0 = 1.0 - f0;
+  r1 = 1.0 - f1;
+  r2 = 1.0 - f2;
+  
+  r1r2 = r1 * r2;
+  r1f2 = r1 * f2;
+  f1r2 = f1 * r2;
+  f1f2 = f1 * f2;
+  
+  *result =
+    r0 *  (r1r2 * v000 +
+           r1f2 * v001 +
+           f1r2 * v010 +
+           f1f2 * v011);
+  *result +=
+    f0 *  (r1r2 * v100 +
+           r1f2 * v101 +
+           f1r2 * v110 +
+           f1f2 * v111);
+
+                                /* bilinear patches in the (1,2) plane,
+                                   interpolated along axis 0 */
+  a00 = r0 * v000 + f0 * v100;
+  a01 = r0 * v001 + f0 * v101;
+  a10 = r0 * v010 + f0 * v110;
+  a11 = r0 * v011 + f0 * v111;
+
+  deriv[0] = r1r2 * (v100 - v000) + r1f2 * (v101 - v001) +
+             f1r2 * (v110 - v010) + f1f2 * (v111 - v011);
+  deriv[1] = r2 * (a10 - a00) + f2 * (a11 - a01);
+  deriv[2] = r1 * (a01 - a00) + f1 * (a11 - a10);
+
+  return TRUE;
+  
+}
+
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : do_Ncubic_interpolation
 @INPUT      : volume - pointer to volume data
@@ -367,6 +461,303 @@ int tricubic_interpolant(VIO_Volume volume,
 
 }
 
+/* ----------------------------- MNI Header -----------------------------------
+   cubic B-spline interpolation:
+
+   the volume is first turned into a volume of B-spline coefficients
+   by a recursive prefilter along each axis (mirror boundaries), so
+   that the spline goes through the voxel values.  An interpolated
+   value is then a weighted sum of 4x4x4 coefficients, with weights
+   that only depend on the fractional part of the coordinate, and the
+   gradient comes from the same coefficients with the derivative
+   weights.  The result is C2 continuous, where the tricubic
+   interpolant above is only C1.
+
+   The coefficients of a volume are computed on its first use, and
+   kept (as floats) until delete_bspline_coefficients() is called.
+   Those of at most BSPLINE_MAX_VOLUMES volumes are kept at once; a
+   further volume takes the place of the one computed first.
+---------------------------------------------------------------------------- */
+
+#define BSPLINE_MAX_VOLUMES  4
+#define BSPLINE_POLE         -0.267949192431122706  /* sqrt(3) - 2 */
+#define BSPLINE_TOLERANCE    1.0e-9
+
+static struct {
+   VIO_Volume volume;
+   int        sizes[VOL_NDIMS];
+   float      *coeff;
+} bspline_store[BSPLINE_MAX_VOLUMES];
+
+static int bspline_n_stored = 0;
+static int bspline_oldest   = 0;     /* next to go, once the store is full */
+
+/* in-place prefilter of one line of n values (also used by
+   warp_resample.c) */
+void bspline_prefilter_line(double c[], int n)
+{
+   double z, zn, z2n, iz, sum;
+   int k, horizon;
+
+   if (n < 2) return;
+
+   z = BSPLINE_POLE;
+
+   for(k=0; k<n; k++)
+      c[k] *= (1.0 - z) * (1.0 - 1.0/z);
+
+                                /* causal initialization, mirror boundary */
+   horizon = (int)ceil(log(BSPLINE_TOLERANCE) / log(fabs(z)));
+   if (horizon < n) {
+      zn  = z;
+      sum = c[0];
+      for(k=1; k<horizon; k++) {
+         sum += zn * c[k];
+         zn  *= z;
+      }
+   }
+   else {
+      zn  = z;
+      iz  = 1.0 / z;
+      z2n = pow(z, (double)(n-1));
+      sum = c[0] + z2n * c[n-1];
+      z2n *= z2n * iz;
+      for(k=1; k<=n-2; k++) {
+         sum += (zn + z2n) * c[k];
+         zn  *= z;
+         z2n *= iz;
+      }
+      sum /= (1.0 - zn * zn);
+   }
+   c[0] = sum;
+
+   for(k=1; k<n; k++)
+      c[k] += z * c[k-1];
+                                /* anti-causal */
+   c[n-1] = (z / (z * z - 1.0)) * (z * c[n-2] + c[n-1]);
+   for(k=n-2; k>=0; k--)
+      c[k] = z * (c[k+1] - c[k]);
+}
+
+static float *get_bspline_coefficients(VIO_Volume volume, int sizes[])
+{
+   int i, j, k, axis, len, slot;
+   long n, stride[VOL_NDIMS], base;
+   float *coeff;
+   double *line, value;
+
+   for(slot=0; slot<bspline_n_stored; slot++)
+      if (bspline_store[slot].volume == volume &&
+          bspline_store[slot].sizes[0] == sizes[0] &&
+          bspline_store[slot].sizes[1] == sizes[1] &&
+          bspline_store[slot].sizes[2] == sizes[2])
+         return(bspline_store[slot].coeff);
+
+   if (bspline_n_stored == BSPLINE_MAX_VOLUMES) {
+      slot = bspline_oldest;
+      FREE(bspline_store[slot].coeff);
+      bspline_oldest = (slot + 1) % BSPLINE_MAX_VOLUMES;
+   }
+   else
+      slot = bspline_n_stored++;
+
+   n = (long)sizes[0] * sizes[1] * sizes[2];
+   ALLOC(coeff, n);
+
+   for(i=0; i<sizes[0]; i++)
+      for(j=0; j<sizes[1]; j++)
+         for(k=0; k<sizes[2]; k++) {
+            GET_VALUE_3D( value, volume, i, j, k );
+            coeff[ ((long)i*sizes[1] + j)*sizes[2] + k ] = (float)value;
+         }
+
+   stride[0] = (long)sizes[1] * sizes[2];
+   stride[1] = sizes[2];
+   stride[2] = 1;
+
+   len = MAX( sizes[0], MAX( sizes[1], sizes[2] ) );
+   ALLOC(line, len);
+
+   for(axis=0; axis<VOL_NDIMS; axis++) {
+      if (sizes[axis] < 2) continue;
+                                /* every line along this axis starts at
+                                   a voxel whose index on the axis is 0 */
+      for(base=0; base<n; base++) {
+         if ((base / stride[axis]) % sizes[axis] != 0) continue;
+         for(i=0; i<sizes[axis]; i++)
+            line[i] = coeff[ base + i*stride[axis] ];
+         bspline_prefilter_line(line, sizes[axis]);
+         for(i=0; i<sizes[axis]; i++)
+            coeff[ base + i*stride[axis] ] = (float)line[i];
+      }
+   }
+
+   FREE(line);
+
+   bspline_store[slot].volume = volume;
+   for(i=0; i<VOL_NDIMS; i++)
+      bspline_store[slot].sizes[i] = sizes[i];
+   bspline_store[slot].coeff = coeff;
+
+   return(coeff);
+}
+
+void delete_bspline_coefficients(void)
+{
+   int slot;
+
+   for(slot=0; slot<bspline_n_stored; slot++)
+      FREE(bspline_store[slot].coeff);
+   bspline_n_stored = 0;
+   bspline_oldest   = 0;
+}
+
+/* weights (and their derivatives) of the 4 coefficients around a
+   coordinate along one axis, with the mirrored offsets of those
+   coefficients */
+static void bspline_weights(double x, int size, long stride,
+                            double w[], double d[], long offset[])
+{
+   long i, j, m;
+   double t, r;
+
+   i = (long)floor(x);
+   t = x - i;
+   r = 1.0 - t;
+
+   w[0] = r * r * r / 6.0;
+   w[1] = (3.0*t*t*t - 6.0*t*t + 4.0) / 6.0;
+   w[2] = (-3.0*t*t*t + 3.0*t*t + 3.0*t + 1.0) / 6.0;
+   w[3] = t * t * t / 6.0;
+
+   d[0] = -0.5 * r * r;
+   d[1] =  1.5 * t * t - 2.0 * t;
+   d[2] = -1.5 * t * t + t + 0.5;
+   d[3] =  0.5 * t * t;
+
+   for(j=0; j<4; j++) {
+      m = i - 1 + j;
+      if (size < 2)
+         m = 0;
+      else {
+         if (m < 0)      m = -m;
+         if (m >= size)  m = 2*(size-1) - m;
+                                /* a single mirror is not enough when
+                                   size is smaller than the support */
+         if (m < 0)      m = 0;
+         if (m >= size)  m = size-1;
+      }
+      offset[j] = m * stride;
+   }
+}
+
+static int bspline_evaluate(VIO_Volume volume, PointR *coord, double *result,
+                            double deriv[])
+{
+   int sizes[3], a, b, c;
+   float *coeff;
+   long o0[4], o1[4], o2[4];
+   double
+      w0[4], w1[4], w2[4],
+      d0[4], d1[4], d2[4],
+      v, s, s2, t, t1, t2, u, u0, u1, u2;
+
+   get_volume_sizes(volume, sizes);
+
+   if ((Point_x( *coord ) < 0) || (Point_x( *coord ) > sizes[0]-1) ||
+       (Point_y( *coord ) < 0) || (Point_y( *coord ) > sizes[1]-1) ||
+       (Point_z( *coord ) < 0) || (Point_z( *coord ) > sizes[2]-1)) {
+
+      if (deriv != NULL) deriv[0] = deriv[1] = deriv[2] = 0.0;
+      return( nearest_neighbour_interpolant(volume, coord, result) );
+   }
+
+   coeff = get_bspline_coefficients(volume, sizes);
+
+   bspline_weights(Point_x( *coord ), sizes[0], (long)sizes[1]*sizes[2], w0, d0, o0);
+   bspline_weights(Point_y( *coord ), sizes[1], (long)sizes[2],          w1, d1, o1);
+   bspline_weights(Point_z( *coord ), sizes[2], 1L,                      w2, d2, o2);
+
+   u = u0 = u1 = u2 = 0.0;
+   for(a=0; a<4; a++) {
+      t = t1 = t2 = 0.0;
+      for(b=0; b<4; b++) {
+         s = s2 = 0.0;
+         for(c=0; c<4; c++) {
+            v   = coeff[ o0[a] + o1[b] + o2[c] ];
+            s  += w2[c] * v;
+            s2 += d2[c] * v;
+         }
+         t  += w1[b] * s;
+         t1 += d1[b] * s;
+         t2 += w1[b] * s2;
+      }
+      u  += w0[a] * t;
+      u0 += d0[a] * t;
+      u1 += w0[a] * t1;
+      u2 += w0[a] * t2;
+   }
+
+   *result = u;
+   if (deriv != NULL) {
+      deriv[0] = u0;
+      deriv[1] = u1;
+      deriv[2] = u2;
+   }
+
+   return TRUE;
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : bspline_interpolant
+@INPUT      : volume - pointer to volume data
+              coord - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated value.
+@RETURNS    : TRUE if coord is within the volume, FALSE otherwise.
+@DESCRIPTION: Routine to interpolate a volume at a point with cubic
+              B-spline interpolation.  Outside of the voxel centres, the
+              nearest neighbour value is returned.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int bspline_interpolant(VIO_Volume volume, 
+                        PointR *coord, double *result)
+{
+   return( bspline_evaluate(volume, coord, result, (double *)NULL) );
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : bspline_interpolant_gradient
+@INPUT      : volume - pointer to volume data
+              coord - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated value.
+              deriv  - derivative of the interpolated value with respect
+                 to each voxel coordinate (in volume index order).
+@RETURNS    : TRUE if coord is within the volume, FALSE otherwise.
+@DESCRIPTION: same as bspline_interpolant, but also returns the exact
+              spatial gradient of the spline.  Where the nearest
+              neighbour value is used, the gradient is zero.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int bspline_interpolant_gradient(VIO_Volume volume, 
+                                 PointR *coord, double *result,
+                                 double deriv[])
+{
+   return( bspline_evaluate(volume, coord, result, deriv) );
+}
+
+
 
 /* A point is not masked if it is a point we should consider.
    If the mask volume is NULL, we consider all points.
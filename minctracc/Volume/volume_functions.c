@@ -125,8 +125,23 @@ void  set_feature_value_threshold(VIO_Volume d1,
 #define MIN_ZRANGE -5.0
 #define MAX_ZRANGE  5.0
 
-void make_zscore_volume(VIO_Volume d1, VIO_Volume m1, 
-                               VIO_Real *threshold)
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : get_zscore_stats
+@INPUT      : d1        - volume
+              m1        - its mask, or NULL
+              threshold - only voxels above it are used
+@OUTPUT     : mean, std - of the unmasked voxels above the threshold
+@RETURNS    : 
+@DESCRIPTION: the statistics used by make_zscore_volume() to rescale d1;
+              measure_lattice() uses them to compute z-scores on the fly.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void get_zscore_stats(VIO_Volume d1, VIO_Volume m1, VIO_Real threshold,
+                      VIO_Real *mean, VIO_Real *std)
 {
   unsigned long
     count;
@@ -138,27 +153,16 @@ void make_zscore_volume(VIO_Volume d1, VIO_Volume m1,
     wx,wy,wz,
     valid_min_dvoxel, valid_max_dvoxel,
     min,max,
-    sum, sum2, mean, var, std,
-    data_vox,data_val,
-    thick[VIO_MAX_DIMENSIONS];
+    sum, sum2, var,
+    data_vox,data_val;
 
   PointR 
     voxel;
 
-  VIO_Volume 
-    vol;
-
   VIO_progress_struct
     progress;
 
-  /* get default information from data and mask */
-
-  /* build temporary working volume */
- 
-  vol = copy_volume_definition(d1, NC_UNSPECIFIED, FALSE, 0.0, 0.0);
-  set_volume_real_range(vol, MIN_ZRANGE, MAX_ZRANGE);
   get_volume_sizes(d1, sizes);
-  get_volume_separations(d1, thick);
   get_volume_voxel_range(d1, &valid_min_dvoxel, &valid_max_dvoxel);
 
   /* initialize counters and sums */
@@ -197,7 +201,7 @@ void make_zscore_volume(VIO_Volume d1, VIO_Volume m1,
 
             data_val = CONVERT_VOXEL_TO_VALUE(d1, data_vox);
             
-            if (data_val > *threshold) {
+            if (data_val > threshold) {
               sum  += data_val;
               sum2 += data_val*data_val;
               
@@ -216,15 +220,46 @@ void make_zscore_volume(VIO_Volume d1, VIO_Volume m1,
   }
   terminate_progress_report( &progress );
 
+                                /* calc mean and std */
+  *mean = sum / (float)count;
+  var  = ((float)count*sum2 - sum*sum) / ((float)count*((float)count-1));
+  *std  = sqrt(var);
+}
+
+void make_zscore_volume(VIO_Volume d1, VIO_Volume m1, 
+                               VIO_Real *threshold)
+{
+  int 
+    stat_count,
+    sizes[VIO_MAX_DIMENSIONS],
+    s,r,c;
+  VIO_Real
+    valid_min_dvoxel, valid_max_dvoxel,
+    min,max,
+    mean, std,
+    data_vox,data_val;
+
+  VIO_Volume 
+    vol;
+
+  VIO_progress_struct
+    progress;
+
+  /* get default information from data and mask */
+
+  /* build temporary working volume */
+ 
+  vol = copy_volume_definition(d1, NC_UNSPECIFIED, FALSE, 0.0, 0.0);
+  set_volume_real_range(vol, MIN_ZRANGE, MAX_ZRANGE);
+  get_volume_sizes(d1, sizes);
+  get_volume_voxel_range(d1, &valid_min_dvoxel, &valid_max_dvoxel);
+
+  get_zscore_stats(d1, m1, *threshold, &mean, &std);
+
   stat_count = 0;
   initialize_progress_report(&progress, FALSE, sizes[0]*sizes[1]*sizes[2] + 1,
                              "Zscore convert" );
 
-                                /* calc mean and std */
-  mean = sum / (float)count;
-  var  = ((float)count*sum2 - sum*sum) / ((float)count*((float)count-1));
-  std  = sqrt(var);
-
   min = 1e38;
   max = -1e38;
 
@@ -0,0 +1,432 @@
+/*
+------------------------------ MNI Header ----------------------------------
+@NAME       : warp_resample.c
+@DESCRIPTION: resampling of a deformation field onto another grid.
+
+  these include:
+     resample_warp_volume() - fill the displacement volume of one
+                              GRID_TRANSFORM with the displacements of
+                              another, interpolated at its nodes
+
+  resample_the_deformation_field() in default_def.c used to call
+  grid_transform_point() (and so evaluate_volume_in_world()) for every
+  node of the new field, and set_volume_real_value()-like macros for
+  every component.  Here the old field is copied once into a float
+  array, x fastest with the xyz displacements interleaved, and the
+  nodes of the new field are mapped to voxels of the old one by an
+  affine transform built from both volume definitions, so that any
+  direction cosines are taken into account.
+
+  When that transform does not mix the axes (the usual case: the new
+  grid is set up from the old one with set_up_lattice()), the
+  interpolation is done separably, one axis after the other, with the
+  1D taps of each new node computed once per axis: going from a 4mm to
+  a 2mm field costs a few multiply-adds per node and component.
+  Otherwise, each new node is interpolated from the full tensor product
+  of taps.
+
+  Kernels:
+     WARP_RESAMPLE_LINEAR   2 taps
+     WARP_RESAMPLE_CUBIC    4 taps, interpolating (Catmull-Rom), as the
+                            cubic interpolation of volume_io; the edge
+                            nodes are repeated, where volume_io lowers
+                            the degree of the interpolation instead
+     WARP_RESAMPLE_BSPLINE  4 taps on the coefficients of a cubic
+                            B-spline through the nodes (mirror edges,
+                            as the -bspline interpolant)
+
+  As in evaluate_volume_in_world() with an outside value of 0, a node
+  more than half a step outside the old field gets no displacement.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "warp_resample.h"
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+void bspline_prefilter_line(double c[], int n);
+
+#define WARP_INDEX(n,x,y,z) ( 3*(((long)(z)*(n)[1] + (y))*(n)[0] + (x)) )
+
+
+/* copy the displacements of a 4D vector volume into a float array,
+   x fastest and xyz interleaved; n[] gets the node counts (XYZ) */
+
+static float *pack_warp(VIO_Volume volume, int n[])
+{
+  int
+    i, k, c[3],
+    sizes[VIO_MAX_DIMENSIONS],
+    xyzv[VIO_MAX_DIMENSIONS],
+    index[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    value;
+  float
+    *disp;
+
+  get_volume_sizes(volume, sizes);
+  get_volume_XYZV_indices(volume, xyzv);
+
+  for(i=0; i<3; i++)
+    n[i] = sizes[ xyzv[i] ];
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++)
+    index[i] = 0;
+
+  ALLOC(disp, 3L*n[0]*n[1]*n[2]);
+
+  for(c[2]=0; c[2]<n[2]; c[2]++)
+    for(c[1]=0; c[1]<n[1]; c[1]++)
+      for(c[0]=0; c[0]<n[0]; c[0]++) {
+        for(i=0; i<3; i++)
+          index[ xyzv[i] ] = c[i];
+        for(k=0; k<3; k++) {
+          index[ xyzv[VIO_Z+1] ] = k;
+          GET_VALUE_4D(value, volume, index[0], index[1], index[2], index[3]);
+          disp[ WARP_INDEX(n, c[0], c[1], c[2]) + k ] = (float)value;
+        }
+      }
+
+  return(disp);
+}
+
+static void unpack_warp(VIO_Volume volume, int n[], float *disp)
+{
+  int
+    i, k, c[3],
+    xyzv[VIO_MAX_DIMENSIONS],
+    index[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    value;
+
+  get_volume_XYZV_indices(volume, xyzv);
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++)
+    index[i] = 0;
+
+  for(c[2]=0; c[2]<n[2]; c[2]++)
+    for(c[1]=0; c[1]<n[1]; c[1]++)
+      for(c[0]=0; c[0]<n[0]; c[0]++) {
+        for(i=0; i<3; i++)
+          index[ xyzv[i] ] = c[i];
+        for(k=0; k<3; k++) {
+          index[ xyzv[VIO_Z+1] ] = k;
+          value = disp[ WARP_INDEX(n, c[0], c[1], c[2]) + k ];
+          SET_VOXEL_4D(volume, index[0], index[1], index[2], index[3],
+                       CONVERT_VALUE_TO_VOXEL(volume, value));
+        }
+      }
+}
+
+/* the affine map from the voxels of 'to' to those of 'from', both in
+   XYZ order: from = M * to */
+
+static void get_voxel_to_voxel(VIO_Volume from, VIO_Volume to, VIO_Real M[3][4])
+{
+  int
+    i, j,
+    from_xyzv[VIO_MAX_DIMENSIONS],
+    to_xyzv[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    voxel[VIO_MAX_DIMENSIONS],
+    v0[VIO_MAX_DIMENSIONS],
+    v[VIO_MAX_DIMENSIONS],
+    wx, wy, wz;
+
+  get_volume_XYZV_indices(from, from_xyzv);
+  get_volume_XYZV_indices(to,   to_xyzv);
+
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++)
+    voxel[i] = 0.0;
+
+  convert_voxel_to_world(to, voxel, &wx, &wy, &wz);
+  convert_world_to_voxel(from, wx, wy, wz, v0);
+  for(i=0; i<3; i++)
+    M[i][3] = v0[ from_xyzv[i] ];
+
+  for(j=0; j<3; j++) {
+    voxel[ to_xyzv[j] ] = 1.0;
+    convert_voxel_to_world(to, voxel, &wx, &wy, &wz);
+    convert_world_to_voxel(from, wx, wy, wz, v);
+    for(i=0; i<3; i++)
+      M[i][j] = v[ from_xyzv[i] ] - v0[ from_xyzv[i] ];
+    voxel[ to_xyzv[j] ] = 0.0;
+  }
+}
+
+/* the nodes, and their weights, used to interpolate at coordinate x
+   along an axis of n nodes; returns their number (0 if x is out of
+   the field) */
+
+static int get_taps(VIO_Real x, int n, int kernel, int index[], float w[])
+{
+  int
+    i, j, m;
+  VIO_Real
+    t, r;
+
+  if (x < -0.5 || x > n - 0.5)
+    return(0);
+
+  if (n == 1) {
+    index[0] = 0;
+    w[0] = 1.0;
+    return(1);
+  }
+
+  if (kernel == WARP_RESAMPLE_LINEAR) {
+    if (x < 0.0)   x = 0.0;
+    if (x > n-1)   x = n-1;
+    i = (int)floor(x);
+    if (i > n-2)   i = n-2;
+    t = x - i;
+    index[0] = i;    w[0] = 1.0 - t;
+    index[1] = i+1;  w[1] = t;
+    return(2);
+  }
+
+  i = (int)floor(x);
+  t = x - i;
+
+  if (kernel == WARP_RESAMPLE_BSPLINE) {
+    r = 1.0 - t;
+    w[0] = r * r * r / 6.0;
+    w[1] = (3.0*t*t*t - 6.0*t*t + 4.0) / 6.0;
+    w[2] = (-3.0*t*t*t + 3.0*t*t + 3.0*t + 1.0) / 6.0;
+    w[3] = t * t * t / 6.0;
+  }
+  else {
+    w[0] = 0.5 * (-t*t*t + 2.0*t*t - t);
+    w[1] = 0.5 * (3.0*t*t*t - 5.0*t*t + 2.0);
+    w[2] = 0.5 * (-3.0*t*t*t + 4.0*t*t + t);
+    w[3] = 0.5 * (t*t*t - t*t);
+  }
+
+  for(j=0; j<4; j++) {
+    m = i - 1 + j;
+    if (kernel == WARP_RESAMPLE_BSPLINE) {       /* mirror */
+      if (m < 0)   m = -m;
+      if (m >= n)  m = 2*(n-1) - m;
+      if (m < 0)   m = 0;
+    }
+    else {                                       /* repeat the edge */
+      if (m < 0)   m = 0;
+      if (m >= n)  m = n-1;
+    }
+    index[j] = m;
+  }
+
+  return(4);
+}
+
+/* replace the displacements by B-spline coefficients, axis by axis */
+
+static void prefilter_warp(float *disp, int n[])
+{
+  int
+    a, k, i, c[3], len;
+  long
+    stride, base;
+  double
+    *line;
+
+  len = MAX3(n[0], n[1], n[2]);
+  ALLOC(line, len);
+
+  for(a=0; a<3; a++) {
+    if (n[a] < 2)
+      continue;
+    stride = (a == 0) ? 3 : (a == 1) ? 3L*n[0] : 3L*n[0]*n[1];
+
+    for(c[2]=0; c[2] < (a == 2 ? 1 : n[2]); c[2]++)
+      for(c[1]=0; c[1] < (a == 1 ? 1 : n[1]); c[1]++)
+        for(c[0]=0; c[0] < (a == 0 ? 1 : n[0]); c[0]++) {
+          base = WARP_INDEX(n, c[0], c[1], c[2]);
+          for(k=0; k<3; k++) {
+            for(i=0; i<n[a]; i++)
+              line[i] = disp[ base + i*stride + k ];
+            bspline_prefilter_line(line, n[a]);
+            for(i=0; i<n[a]; i++)
+              disp[ base + i*stride + k ] = (float)line[i];
+          }
+        }
+  }
+
+  FREE(line);
+}
+
+/* interpolate along one axis: in has n[] nodes, out has the same
+   except m nodes along axis, node j of which is at in coordinate
+   scale*j + offset */
+
+static float *resample_along_axis(float *in, int n[], int axis, int m,
+                                  VIO_Real scale, VIO_Real offset, int kernel)
+{
+  int
+    i, j, k, t, o[3], c[3],
+    *n_taps, *index;
+  long
+    in_stride, base, out;
+  float
+    *w, *result;
+  VIO_Real
+    sum[3];
+
+  ALLOC(n_taps, m);
+  ALLOC(index,  4*m);
+  ALLOC(w,      4*m);
+  for(j=0; j<m; j++)
+    n_taps[j] = get_taps(scale*j + offset, n[axis], kernel, &index[4*j], &w[4*j]);
+
+  for(i=0; i<3; i++)
+    o[i] = (i == axis) ? m : n[i];
+  in_stride = (axis == 0) ? 3 : (axis == 1) ? 3L*n[0] : 3L*n[0]*n[1];
+
+  ALLOC(result, 3L*o[0]*o[1]*o[2]);
+
+  out = 0;
+  for(c[2]=0; c[2]<o[2]; c[2]++)
+    for(c[1]=0; c[1]<o[1]; c[1]++)
+      for(c[0]=0; c[0]<o[0]; c[0]++, out+=3) {
+
+        j = c[axis];
+        c[axis] = 0;
+        base = WARP_INDEX(n, c[0], c[1], c[2]);
+        c[axis] = j;
+
+        sum[0] = sum[1] = sum[2] = 0.0;
+        for(t=0; t<n_taps[j]; t++)
+          for(k=0; k<3; k++)
+            sum[k] += w[4*j+t] * in[ base + index[4*j+t]*in_stride + k ];
+
+        for(k=0; k<3; k++)
+          result[out+k] = (float)sum[k];
+      }
+
+  FREE(n_taps);
+  FREE(index);
+  FREE(w);
+
+  return(result);
+}
+
+/* interpolate each node of a grid of m[] nodes, at in coordinate
+   M * node, from the tensor product of the taps along each axis */
+
+static float *resample_general(float *in, int n[], int m[],
+                               VIO_Real M[3][4], int kernel)
+{
+  int
+    a, i, j, k, c[3], nt[3],
+    index[3][4];
+  float
+    w[3][4], *result;
+  long
+    out, p;
+  VIO_Real
+    x, wjk, sum[3];
+
+  ALLOC(result, 3L*m[0]*m[1]*m[2]);
+
+  out = 0;
+  for(c[2]=0; c[2]<m[2]; c[2]++)
+    for(c[1]=0; c[1]<m[1]; c[1]++)
+      for(c[0]=0; c[0]<m[0]; c[0]++, out+=3) {
+
+        for(a=0; a<3; a++) {
+          x = M[a][0]*c[0] + M[a][1]*c[1] + M[a][2]*c[2] + M[a][3];
+          nt[a] = get_taps(x, n[a], kernel, index[a], w[a]);
+        }
+
+        sum[0] = sum[1] = sum[2] = 0.0;
+        for(k=0; k<nt[2]; k++)
+          for(j=0; j<nt[1]; j++) {
+            wjk = w[2][k] * w[1][j];
+            for(i=0; i<nt[0]; i++) {
+              p = WARP_INDEX(n, index[0][i], index[1][j], index[2][k]);
+              sum[0] += wjk * w[0][i] * in[p];
+              sum[1] += wjk * w[0][i] * in[p+1];
+              sum[2] += wjk * w[0][i] * in[p+2];
+            }
+          }
+
+        for(a=0; a<3; a++)
+          result[out+a] = (float)sum[a];
+      }
+
+  return(result);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : resample_warp_volume
+@INPUT      : from   - displacement volume of a GRID_TRANSFORM
+              to     - displacement volume (allocated) of another, on
+                       the grid to resample onto
+              kernel - WARP_RESAMPLE_LINEAR, _CUBIC or _BSPLINE
+@OUTPUT     : to     - the displacements of from, at its nodes
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: see the top of this file
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_BOOL resample_warp_volume(VIO_Volume from, VIO_Volume to, int kernel)
+{
+  int
+    a, b, n[3], m[3], sizes[VIO_MAX_DIMENSIONS],
+    xyzv[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    M[3][4];
+  VIO_BOOL
+    separable;
+  float
+    *disp, *next;
+
+  if (get_volume_n_dimensions(from) != 4 || get_volume_n_dimensions(to) != 4)
+    return(FALSE);
+
+  if (kernel != WARP_RESAMPLE_LINEAR && kernel != WARP_RESAMPLE_BSPLINE)
+    kernel = WARP_RESAMPLE_CUBIC;
+
+  get_volume_sizes(to, sizes);
+  get_volume_XYZV_indices(to, xyzv);
+  for(a=0; a<3; a++)
+    m[a] = sizes[ xyzv[a] ];
+
+  disp = pack_warp(from, n);
+  if (kernel == WARP_RESAMPLE_BSPLINE)
+    prefilter_warp(disp, n);
+
+  get_voxel_to_voxel(from, to, M);
+
+  separable = TRUE;
+  for(a=0; a<3; a++)
+    for(b=0; b<3; b++)
+      if (a != b && fabs(M[a][b]) > 1.0e-6 * MAX(1.0, fabs(M[a][a])))
+        separable = FALSE;
+
+  if (separable) {
+    for(a=0; a<3; a++) {
+      next = resample_along_axis(disp, n, a, m[a], M[a][a], M[a][3], kernel);
+      FREE(disp);
+      disp = next;
+      n[a] = m[a];
+    }
+  }
+  else {
+    next = resample_general(disp, n, m, M, kernel);
+    FREE(disp);
+    disp = next;
+  }
+
+  unpack_warp(to, m, disp);
+  FREE(disp);
+
+  return(TRUE);
+}